@@ -0,0 +1,215 @@
+#include "Animation.h"
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <cstring>
+
+#include "CompiledScene.h"
+#include "Render.h"
+#include "Scheduler.h"
+#include "Denoise.h"
+#include "Stats.h"
+
+using namespace Eigen;
+using namespace std;
+
+//-----------------------------------------------------------
+Vector3f AnimationTrack::GetPosition(const float frame) const
+{
+	if (frame <= keys.front().frame)
+	{
+		return keys.front().position;
+	}
+	if (frame >= keys.back().frame)
+	{
+		return keys.back().position;
+	}
+
+	// The first key after frame, and the one before it
+	const auto next = upper_bound(keys.begin(), keys.end(), frame, [](const float f, const Keyframe& key) { return f < key.frame; });
+	const Keyframe& a = *(next - 1);
+	const Keyframe& b = *next;
+	const float t = (frame - a.frame) / (b.frame - a.frame);
+	return a.position + t * (b.position - a.position);
+}
+
+//-----------------------------------------------------------
+bool Animation::Load(const string& fileName)
+{
+	auto fail = [&fileName](const char* reason)
+	{
+		cout << "ERROR: could not read animation file " << fileName << ": " << reason << endl;
+		return false;
+	};
+
+	ifstream file(fileName);
+	if (!file.is_open())
+	{
+		return fail("it can't be opened");
+	}
+
+	int numTracks = 0;
+	if (!(file >> numFrames >> numTracks) || numFrames <= 0 || numTracks < 0)
+	{
+		return fail("it doesn't start with a number of frames and of tracks");
+	}
+
+	tracks.clear();
+	for (int t = 0; t < numTracks; ++t)
+	{
+		string type;
+		AnimationTrack track;
+		int numKeys = 0;
+		if (!(file >> type >> track.index >> numKeys))
+		{
+			return fail("there are fewer tracks than it says");
+		}
+		if (strcmp(type.c_str(), "SPHERE") == 0)
+		{
+			track.type = ANIMATED_SPHERE;
+		}
+		else if (strcmp(type.c_str(), "POINTLIGHT") == 0)
+		{
+			track.type = ANIMATED_LIGHT;
+		}
+		else
+		{
+			return fail("only SPHERE and POINTLIGHT can be animated");
+		}
+		if (track.index < 0 || numKeys <= 0)
+		{
+			return fail("a track has a negative index, or no keyframes");
+		}
+
+		track.keys.resize(numKeys);
+		for (Keyframe& key : track.keys)
+		{
+			if (!(file >> key.frame >> key.position[0] >> key.position[1] >> key.position[2]))
+			{
+				return fail("a track has fewer keyframes than it says");
+			}
+		}
+		stable_sort(track.keys.begin(), track.keys.end(), [](const Keyframe& a, const Keyframe& b) { return a.frame < b.frame; });
+		tracks.push_back(track);
+	}
+	return true;
+}
+
+bool Animation::Fits(const CompiledScene& scene) const
+{
+	for (const AnimationTrack& track : tracks)
+	{
+		const size_t count = track.type == ANIMATED_SPHERE ? scene.GetSpheres().size() : scene.GetLights().size();
+		if ((size_t)track.index >= count)
+		{
+			cout << "ERROR: the animation moves " << (track.type == ANIMATED_SPHERE ? "sphere " : "light ")
+				<< track.index << ", but the scene only has " << count << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Animation::MoveTo(const int frame, CompiledScene& scene) const
+{
+	for (const AnimationTrack& track : tracks)
+	{
+		const Vector3f position = track.GetPosition((float)frame);
+		if (track.type == ANIMATED_SPHERE)
+		{
+			scene.SetSphereCentre(track.index, position);
+		}
+		else
+		{
+			scene.SetLightPosition(track.index, position);
+		}
+	}
+	return scene.RefitBVH();
+}
+
+//-----------------------------------------------------------
+string GetFrameFileName(const string& fileName, const int frame)
+{
+	string number = to_string(frame);
+	if (number.size() < ANIMATION_FRAME_DIGITS)
+	{
+		number.insert(0, ANIMATION_FRAME_DIGITS - number.size(), '0');
+	}
+	return AddFileSuffix(fileName, "_" + number);
+}
+
+//-----------------------------------------------------------
+bool RenderAnimation(
+	CompiledScene& scene,
+	const Animation& animation,
+	const Params& params,
+	WorkStealingPool& pool)
+{
+	if (!animation.Fits(scene))
+	{
+		return false;
+	}
+	if (params.costMaps)
+	{
+		cout << "Cost maps aren't made for animations" << endl;
+	}
+
+	const int numFrames = animation.GetNumFrames();
+	cout << "Rendering " << numFrames << " frames on " << pool.GetNumThreads() << " threads" << endl;
+
+	// One frame renders into one of these while the one before is written from the other
+	FrameBuffer frameBuffers[2] = { FrameBuffer(params.width, params.height), FrameBuffer(params.width, params.height) };
+	vector<int> sampleCounts(params.width * params.height, 0);
+	future<bool> writing;
+	int numRebuilds = 0;
+
+	const auto start = chrono::steady_clock::now();
+	for (int frame = 0; frame < numFrames; ++frame)
+	{
+		const auto frameStart = chrono::steady_clock::now();
+		if (animation.MoveTo(frame, scene))
+		{
+			++numRebuilds;
+		}
+		const auto moved = chrono::steady_clock::now();
+
+		Params frameParams = params;
+		frameParams.outputFile = GetFrameFileName(params.outputFile, frame);
+		FrameBuffer& frameBuffer = frameBuffers[frame % 2];
+		{
+			StatTimer timer(STAT_TIME_RENDER);
+			RenderFrame(scene, frameParams, pool, frameBuffer, &sampleCounts);
+		}
+		if (params.denoise && !DenoiseFrame(scene, frameParams, pool, &sampleCounts, frameBuffer))
+		{
+			return false;
+		}
+		const auto rendered = chrono::steady_clock::now();
+
+		// The frame before this one was written from the other buffer, and
+		// has to be out of the way before the next frame renders into it
+		if (writing.valid() && !writing.get())
+		{
+			return false;
+		}
+		writing = async(launch::async, [&frameBuffer, frameParams]()
+		{
+			return WriteImageToFile(frameBuffer, frameParams, frameParams.outputFile);
+		});
+
+		cout << "Frame " << frame << ": moved in " << chrono::duration<double, milli>(moved - frameStart).count() << "ms, rendered in "
+			<< chrono::duration<double>(rendered - moved).count() << "s" << endl;
+	}
+	const bool written = !writing.valid() || writing.get();
+
+	const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cout << "Rendered " << numFrames << " frames in " << seconds << "s (" << numFrames / seconds << " frames/sec). The BVH was refitted every frame";
+	if (numRebuilds > 0)
+	{
+		cout << ", and built again " << numRebuilds << " times when that left it too slow";
+	}
+	cout << endl;
+	return written;
+}
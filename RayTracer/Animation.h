@@ -0,0 +1,101 @@
+#pragma once
+#include <eigen3/Eigen/Dense>
+#include <string>
+#include <vector>
+
+class CompiledScene;
+class WorkStealingPool;
+struct Params;
+
+// Frames are written out as out_0000.ppm, out_0001.ppm, ... with this
+// many digits at least
+#define ANIMATION_FRAME_DIGITS 4
+
+/**********************************************/
+/*############# ANIMATION CLASSES ############*/
+/**********************************************/
+
+enum AnimatedType
+{
+	ANIMATED_SPHERE,
+	ANIMATED_LIGHT
+};
+
+// Where something is at a frame. Frames can be fractions.
+struct Keyframe
+{
+	float frame;
+	Eigen::Vector3f position;
+};
+
+/*
+	How one sphere's centre or one light's position moves. Between
+	keyframes it moves in a straight line, and before the first or after
+	the last it stays where that one puts it.
+*/
+struct AnimationTrack
+{
+	AnimatedType type = ANIMATED_SPHERE;
+	// Which sphere or light, counting from 0 in the order of the scene file
+	int index = 0;
+	// In order of frame
+	std::vector<Keyframe> keys;
+
+	Eigen::Vector3f GetPosition(const float frame) const;
+};
+
+/*
+	Keyframes for a scene, read from a file laid out like the scene files:
+
+		numFrames numTracks
+		SPHERE index numKeys frame x y z frame x y z ...
+		POINTLIGHT index numKeys frame x y z ...
+
+	Spheres and lights are numbered separately, in the order the scene
+	file lists them, starting from 0. Anything without a track stays put.
+*/
+class Animation
+{
+public:
+	Animation() {};
+
+	bool Load(const std::string& fileName);
+
+	// Does every track point at a sphere or light the scene has?
+	bool Fits(const CompiledScene& scene) const;
+
+	// Move everything to where it is at frame, and refit the BVH to
+	// match. Says whether the BVH had to be built again instead.
+	bool MoveTo(const int frame, CompiledScene& scene) const;
+
+	int GetNumFrames() const { return numFrames; };
+	const std::vector<AnimationTrack>& GetTracks() const { return tracks; };
+	void SetNumFrames(const int frames) { numFrames = frames; };
+	void AddTrack(const AnimationTrack& track) { tracks.push_back(track); };
+
+private:
+	int numFrames = 0;
+	std::vector<AnimationTrack> tracks;
+};
+
+// out.ppm, frame 7 -> out_0007.ppm
+std::string GetFrameFileName(const std::string& fileName, const int frame);
+
+/*
+	Render every frame of the animation in one go, into numbered files
+	next to the output.
+
+	Everything is loaded and compiled once. Between frames the spheres
+	and lights are moved and the BVH refitted, not built again. Each
+	frame is encoded and written on a thread of its own while the next
+	one renders, so the render threads never wait on the disk, and two
+	frame buffers are enough for that.
+
+	Photon and illumination maps would need tracing again every frame,
+	so they can't be used with animation yet.
+*/
+bool RenderAnimation(
+	CompiledScene& scene,
+	const Animation& animation,
+	const Params& params,
+	WorkStealingPool& pool);
@@ -0,0 +1,31 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+
+/*
+	A read only window onto an array someone else owns: a vector, or
+	part of a memory mapped file. Just a pointer and a size, so it's
+	as cheap to index as the array itself.
+
+	The owner has to outlive the view.
+*/
+template <class T>
+class ArrayView
+{
+public:
+	ArrayView() {};
+	ArrayView(const T* data, const size_t size) : first(data), count(size) {};
+	ArrayView(const std::vector<T>& v) : first(v.data()), count(v.size()) {};
+
+	const T& operator[](const size_t i) const { return first[i]; };
+	const T* data() const { return first; };
+	size_t size() const { return count; };
+	bool empty() const { return count == 0; };
+
+	const T* begin() const { return first; };
+	const T* end() const { return first + count; };
+
+private:
+	const T* first = nullptr;
+	size_t count = 0;
+};
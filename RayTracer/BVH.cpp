@@ -0,0 +1,265 @@
+#include "BVH.h"
+#include <utility>
+
+using namespace Eigen;
+using namespace std;
+
+static void SetNodeBounds(BVHNode& node, const AABB& box)
+{
+	for (int a = 0; a < 3; ++a)
+	{
+		node.lower[a] = box.lower[a];
+		node.upper[a] = box.upper[a];
+	}
+}
+
+static AABB GetNodeBounds(const BVHNode& node)
+{
+	AABB box;
+	box.lower = Vector3f(node.lower[0], node.lower[1], node.lower[2]);
+	box.upper = Vector3f(node.upper[0], node.upper[1], node.upper[2]);
+	return box;
+}
+
+//-----------------------------------------------------------
+/*
+	Build the tree top down.
+
+	Nodes are split with a binned SAH, using an explicit work list rather
+	than recursion. Children are always allocated as a pair, so an
+	interior node only needs to store the index of its left child.
+*/
+void BVH::Build(const vector<AABB>& bounds)
+{
+	nodes.clear();
+	primitiveIndices.clear();
+	nodeView = ArrayView<BVHNode>();
+	indexView = ArrayView<int>();
+	depth = 0;
+	buildCost = 0.f;
+	if (bounds.empty())
+	{
+		return;
+	}
+
+	const int numPrimitives = (int)bounds.size();
+	primitiveIndices.resize(numPrimitives);
+	vector<Vector3f> centroids(numPrimitives);
+	AABB rootBounds;
+	for (int i = 0; i < numPrimitives; ++i)
+	{
+		primitiveIndices[i] = i;
+		centroids[i] = bounds[i].Centroid();
+		rootBounds.Grow(bounds[i]);
+	}
+
+	nodes.reserve(2 * numPrimitives);
+	BVHNode root;
+	SetNodeBounds(root, rootBounds);
+	root.first = 0;
+	root.count = numPrimitives;
+	nodes.push_back(root);
+
+	// Pairs of (node, depth of node)
+	vector<pair<int, int>> work;
+	work.push_back(make_pair(0, 1));
+	while (!work.empty())
+	{
+		const int node = work.back().first;
+		const int nodeDepth = work.back().second;
+		work.pop_back();
+		depth = max(depth, nodeDepth);
+
+		const int first = nodes[node].first;
+		const int count = nodes[node].count;
+		if (count <= BVH_MAX_LEAF_SIZE || nodeDepth >= BVH_MAX_DEPTH)
+		{
+			continue;
+		}
+
+		// Bin on the centroids rather than the boxes, so that
+		// each primitive lands in exactly one bin
+		AABB centroidBounds;
+		for (int i = first; i < first + count; ++i)
+		{
+			centroidBounds.Grow(centroids[primitiveIndices[i]]);
+		}
+
+		float bestCost = numeric_limits<float>::max();
+		int bestAxis = -1;
+		int bestSplit = 0;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			const float lo = centroidBounds.lower[axis];
+			const float extent = centroidBounds.upper[axis] - lo;
+			if (extent <= 0.f)
+			{
+				continue;
+			}
+
+			int binCounts[BVH_NUM_BINS] = {};
+			AABB binBounds[BVH_NUM_BINS];
+			const float scale = BVH_NUM_BINS / extent;
+			for (int i = first; i < first + count; ++i)
+			{
+				const int p = primitiveIndices[i];
+				const int b = min(BVH_NUM_BINS - 1, (int)((centroids[p][axis] - lo) * scale));
+				++binCounts[b];
+				binBounds[b].Grow(bounds[p]);
+			}
+
+			// Sweep from both ends to get the area and count either side of each split
+			float leftArea[BVH_NUM_BINS - 1], rightArea[BVH_NUM_BINS - 1];
+			int leftCount[BVH_NUM_BINS - 1], rightCount[BVH_NUM_BINS - 1];
+			AABB leftBox, rightBox;
+			int leftSum = 0, rightSum = 0;
+			for (int i = 0; i < BVH_NUM_BINS - 1; ++i)
+			{
+				leftSum += binCounts[i];
+				leftBox.Grow(binBounds[i]);
+				leftCount[i] = leftSum;
+				leftArea[i] = leftBox.SurfaceArea();
+
+				rightSum += binCounts[BVH_NUM_BINS - 1 - i];
+				rightBox.Grow(binBounds[BVH_NUM_BINS - 1 - i]);
+				rightCount[BVH_NUM_BINS - 2 - i] = rightSum;
+				rightArea[BVH_NUM_BINS - 2 - i] = rightBox.SurfaceArea();
+			}
+
+			for (int i = 0; i < BVH_NUM_BINS - 1; ++i)
+			{
+				const float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = i + 1;
+				}
+			}
+		}
+
+		// Splitting costs one more box test than testing every primitive here.
+		// If that doesn't pay for itself, this stays a leaf.
+		const float nodeArea = GetNodeBounds(nodes[node]).SurfaceArea();
+		const float leafCost = count * nodeArea;
+		if (bestAxis == -1 || nodeArea + bestCost >= leafCost)
+		{
+			continue;
+		}
+
+		const float lo = centroidBounds.lower[bestAxis];
+		const float scale = BVH_NUM_BINS / (centroidBounds.upper[bestAxis] - lo);
+		auto middle = partition(
+			primitiveIndices.begin() + first,
+			primitiveIndices.begin() + first + count,
+			[&](int p)
+			{
+				const int b = min(BVH_NUM_BINS - 1, (int)((centroids[p][bestAxis] - lo) * scale));
+				return b < bestSplit;
+			});
+		const int leftCount = (int)(middle - (primitiveIndices.begin() + first));
+		if (leftCount == 0 || leftCount == count)
+		{
+			continue;
+		}
+
+		BVHNode left, right;
+		left.first = first;
+		left.count = leftCount;
+		right.first = first + leftCount;
+		right.count = count - leftCount;
+
+		AABB leftBounds, rightBounds;
+		for (int i = left.first; i < left.first + left.count; ++i)
+			leftBounds.Grow(bounds[primitiveIndices[i]]);
+		for (int i = right.first; i < right.first + right.count; ++i)
+			rightBounds.Grow(bounds[primitiveIndices[i]]);
+		SetNodeBounds(left, leftBounds);
+		SetNodeBounds(right, rightBounds);
+
+		const int leftIndex = (int)nodes.size();
+		nodes.push_back(left);
+		nodes.push_back(right);
+		nodes[node].first = leftIndex;
+		nodes[node].count = 0;
+
+		work.push_back(make_pair(leftIndex, nodeDepth + 1));
+		work.push_back(make_pair(leftIndex + 1, nodeDepth + 1));
+	}
+
+	// Room was left for the worst case, which is about four times what
+	// leaves of several primitives need. Big meshes notice that.
+	nodes.shrink_to_fit();
+	nodeView = ArrayView<BVHNode>(nodes);
+	indexView = ArrayView<int>(primitiveIndices);
+	buildCost = GetCost();
+}
+
+/*
+	Children always come after their parent, so going through the nodes
+	backwards refits every child before the parent that needs its box
+*/
+void BVH::Refit(const vector<AABB>& bounds)
+{
+	if (nodes.empty() && !nodeView.empty())
+	{
+		nodes.assign(nodeView.begin(), nodeView.end());
+		primitiveIndices.assign(indexView.begin(), indexView.end());
+		nodeView = ArrayView<BVHNode>(nodes);
+		indexView = ArrayView<int>(primitiveIndices);
+	}
+
+	for (int node = (int)nodes.size() - 1; node >= 0; --node)
+	{
+		BVHNode& n = nodes[node];
+		AABB box;
+		if (n.IsLeaf())
+		{
+			for (int i = n.first; i < n.first + n.count; ++i)
+			{
+				box.Grow(bounds[primitiveIndices[i]]);
+			}
+		}
+		else
+		{
+			box.Grow(GetNodeBounds(nodes[n.first]));
+			box.Grow(GetNodeBounds(nodes[n.first + 1]));
+		}
+		SetNodeBounds(n, box);
+	}
+}
+
+float BVH::GetCost() const
+{
+	if (nodeView.empty())
+	{
+		return 0.f;
+	}
+
+	const float rootArea = GetNodeBounds(nodeView[0]).SurfaceArea();
+	if (rootArea <= 0.f)
+	{
+		return (float)nodeView.size();
+	}
+
+	float cost = 0.f;
+	for (const BVHNode& n : nodeView)
+	{
+		const float area = GetNodeBounds(n).SurfaceArea();
+		cost += (n.IsLeaf() ? (float)n.count : 1.f) * area;
+	}
+	return cost / rootArea;
+}
+
+void BVH::Borrow(
+	const ArrayView<BVHNode>& borrowedNodes,
+	const ArrayView<int>& borrowedIndices,
+	const int borrowedDepth)
+{
+	nodes.clear();
+	primitiveIndices.clear();
+	nodeView = borrowedNodes;
+	indexView = borrowedIndices;
+	depth = borrowedDepth;
+	buildCost = GetCost();
+}
@@ -0,0 +1,315 @@
+#pragma once
+#include <eigen3/Eigen/Dense>
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+#include "ArrayView.h"
+#include "Stats.h"
+
+// Leaves stop splitting once they get down to this many primitives
+#define BVH_MAX_LEAF_SIZE 4
+// Number of buckets the SAH sweeps over on each axis when choosing a split
+#define BVH_NUM_BINS 16
+// Deepest a traversal can go. A SAH tree over millions of shapes is nowhere near this
+#define BVH_MAX_DEPTH 64
+// A refitted tree is built again once its SAH cost has grown this many times over
+#define BVH_REFIT_MAX_COST_GROWTH 2.f
+
+/**********************************************/
+/*############### BVH CLASSES ################*/
+/**********************************************/
+
+// Axis aligned bounding box
+struct AABB
+{
+	Eigen::Vector3f lower = Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+	Eigen::Vector3f upper = Eigen::Vector3f::Constant(-std::numeric_limits<float>::max());
+
+	void Grow(const Eigen::Vector3f& point)
+	{
+		lower = lower.cwiseMin(point);
+		upper = upper.cwiseMax(point);
+	}
+	void Grow(const AABB& box)
+	{
+		lower = lower.cwiseMin(box.lower);
+		upper = upper.cwiseMax(box.upper);
+	}
+
+	bool IsEmpty() const { return lower[0] > upper[0]; };
+	Eigen::Vector3f Centroid() const { return 0.5f * (lower + upper); };
+	float SurfaceArea() const
+	{
+		if (IsEmpty())
+			return 0.f;
+		Eigen::Vector3f e = upper - lower;
+		return 2.f * (e[0] * e[1] + e[1] * e[2] + e[2] * e[0]);
+	}
+};
+
+// A node is either a leaf, holding count primitives starting at first,
+// or an interior node whose two children are at first and first + 1.
+// Packed into 32 bytes so two nodes share a cache line.
+struct BVHNode
+{
+	float lower[3];
+	int first;
+	float upper[3];
+	int count;
+
+	bool IsLeaf() const { return count > 0; };
+};
+
+/*
+	Bounding volume hierarchy
+
+	This only knows about boxes and primitive indices. What a primitive
+	actually is, and how to intersect it, is up to whoever owns the tree:
+	they hand Intersect a function that tests one primitive.
+
+	Splits are chosen with the surface area heuristic: the cost of a split
+	is the area of each side times the number of primitives on that side,
+	which estimates how many intersection tests a random ray will make.
+*/
+class BVH
+{
+public:
+	BVH() {};
+	~BVH() {};
+
+	// Build over primitives 0 .. bounds.size()-1
+	void Build(const std::vector<AABB>& bounds);
+
+	// Use a tree that was built earlier and stored somewhere else, like a
+	// scene file, instead of building one. The arrays have to outlive the tree.
+	void Borrow(
+		const ArrayView<BVHNode>& nodes,
+		const ArrayView<int>& primitiveIndices,
+		const int depth);
+
+	/*
+		Move the boxes to fit primitives that have moved, keeping the
+		tree as it is. bounds are the primitives' boxes now, in the
+		same order as they were built with. Much quicker than building
+		again, but the splits were chosen for where things were, so the
+		tree gets slower to trace the further they go.
+
+		A borrowed tree is copied the first time, as it can't be written to.
+	*/
+	void Refit(const std::vector<AABB>& bounds);
+
+	// What the SAH expects a ray to cost: box tests for interior nodes,
+	// primitive tests for leaves, each weighted by the chance of the
+	// ray reaching the node, its area over the root's
+	float GetCost() const;
+	// The cost when the tree was built or borrowed, before any refits
+	float GetBuildCost() const { return buildCost; };
+
+	bool IsEmpty() const { return nodeView.empty(); };
+	int GetNumNodes() const { return (int)nodeView.size(); };
+	int GetDepth() const { return depth; };
+
+	// Raw access for traversals that live elsewhere, like the packet tracer
+	ArrayView<BVHNode> GetNodes() const { return nodeView; };
+	ArrayView<int> GetPrimitiveIndices() const { return indexView; };
+
+	/*
+		Find the closest primitive along the ray, walking the tree with a
+		small stack instead of recursion.
+
+		hitPrimitive(primitive, closestDist) must test the primitive and, if it
+		is hit closer than closestDist, shrink closestDist and return true.
+		Boxes further away than closestDist are never opened, so the tree
+		gets pruned harder as closer hits are found.
+	*/
+	template <typename HitFunction>
+	bool Intersect(
+		const Eigen::Vector3f& origin,
+		const Eigen::Vector3f& direction,
+		float& closestDist,
+		HitFunction&& hitPrimitive) const
+	{
+		if (nodeView.empty())
+			return false;
+
+		const BVHNode* treeNodes = nodeView.data();
+		const int* treeIndices = indexView.data();
+		const float invDir[3] = { 1.f / direction[0], 1.f / direction[1], 1.f / direction[2] };
+		const float orig[3] = { origin[0], origin[1], origin[2] };
+
+		bool hit = false;
+		int stack[BVH_MAX_DEPTH];
+		int stackSize = 0;
+		int node = 0;
+
+		if (IntersectBox(treeNodes[0], orig, invDir, closestDist) == NO_HIT)
+			return false;
+
+		LocalStat nodesVisited(STAT_BVH_NODES);
+		while (true)
+		{
+			const BVHNode& n = treeNodes[node];
+			nodesVisited.Add();
+			if (n.IsLeaf())
+			{
+				for (int i = 0; i < n.count; ++i)
+				{
+					hit |= hitPrimitive(treeIndices[n.first + i], closestDist);
+				}
+			}
+			else
+			{
+				// Visit the nearer child first, so the far one is more likely to be culled
+				float nearDist = IntersectBox(treeNodes[n.first], orig, invDir, closestDist);
+				float farDist = IntersectBox(treeNodes[n.first + 1], orig, invDir, closestDist);
+				int nearChild = n.first;
+				int farChild = n.first + 1;
+				if (farDist < nearDist)
+				{
+					std::swap(nearDist, farDist);
+					std::swap(nearChild, farChild);
+				}
+
+				if (nearDist != NO_HIT)
+				{
+					if (farDist != NO_HIT)
+					{
+						stack[stackSize++] = farChild;
+					}
+					node = nearChild;
+					continue;
+				}
+			}
+
+			// Pop the next node that is still closer than the closest hit
+			bool found = false;
+			while (stackSize > 0)
+			{
+				node = stack[--stackSize];
+				if (IntersectBox(treeNodes[node], orig, invDir, closestDist) != NO_HIT)
+				{
+					found = true;
+					break;
+				}
+			}
+			if (!found)
+				break;
+		}
+
+		return hit;
+	}
+
+	/*
+		Is there any primitive along the ray closer than maxDist? For
+		shadow rays, where which one it is doesn't matter.
+
+		hitPrimitive(primitive) must say whether the primitive is hit no
+		further than maxDist. The walk stops at the first one that is.
+		Nothing is kept about the hits, and the search never shrinks,
+		so boxes are only ever tested once.
+	*/
+	template <typename HitFunction>
+	bool IntersectAny(
+		const Eigen::Vector3f& origin,
+		const Eigen::Vector3f& direction,
+		const float maxDist,
+		HitFunction&& hitPrimitive) const
+	{
+		if (nodeView.empty())
+			return false;
+
+		const BVHNode* treeNodes = nodeView.data();
+		const int* treeIndices = indexView.data();
+		const float invDir[3] = { 1.f / direction[0], 1.f / direction[1], 1.f / direction[2] };
+		const float orig[3] = { origin[0], origin[1], origin[2] };
+
+		if (IntersectBox(treeNodes[0], orig, invDir, maxDist) == NO_HIT)
+			return false;
+
+		// The nearer child is still opened first, since the box tests give
+		// the distances for free, and near blockers end the walk soonest
+		int stack[BVH_MAX_DEPTH];
+		int stackSize = 0;
+		int node = 0;
+		LocalStat nodesVisited(STAT_BVH_NODES);
+		while (true)
+		{
+			const BVHNode& n = treeNodes[node];
+			nodesVisited.Add();
+			if (n.IsLeaf())
+			{
+				for (int i = 0; i < n.count; ++i)
+				{
+					if (hitPrimitive(treeIndices[n.first + i]))
+						return true;
+				}
+			}
+			else
+			{
+				float nearDist = IntersectBox(treeNodes[n.first], orig, invDir, maxDist);
+				float farDist = IntersectBox(treeNodes[n.first + 1], orig, invDir, maxDist);
+				int nearChild = n.first;
+				int farChild = n.first + 1;
+				if (farDist < nearDist)
+				{
+					std::swap(nearDist, farDist);
+					std::swap(nearChild, farChild);
+				}
+
+				if (nearDist != NO_HIT)
+				{
+					if (farDist != NO_HIT)
+					{
+						stack[stackSize++] = farChild;
+					}
+					node = nearChild;
+					continue;
+				}
+			}
+
+			// Nothing shrinks maxDist, so popped boxes don't need testing again
+			if (stackSize == 0)
+				break;
+			node = stack[--stackSize];
+		}
+
+		return false;
+	}
+
+private:
+	static constexpr float NO_HIT = std::numeric_limits<float>::infinity();
+
+	// Slab test. Returns the entry distance, or NO_HIT if the ray misses
+	// the box or only reaches it past maxDist
+	static float IntersectBox(
+		const BVHNode& node,
+		const float origin[3],
+		const float invDir[3],
+		const float maxDist)
+	{
+		float tNear = 0.f;
+		float tFar = maxDist;
+		for (int a = 0; a < 3; ++a)
+		{
+			float t0 = (node.lower[a] - origin[a]) * invDir[a];
+			float t1 = (node.upper[a] - origin[a]) * invDir[a];
+			if (t0 > t1)
+				std::swap(t0, t1);
+			// Written this way round so a NaN from 0 * inf leaves the bounds alone
+			tNear = t0 > tNear ? t0 : tNear;
+			tFar = t1 < tFar ? t1 : tFar;
+		}
+		return tNear <= tFar ? tNear : NO_HIT;
+	}
+
+	// Trees built here live in these. Borrowed ones don't.
+	std::vector<BVHNode> nodes;
+	std::vector<int> primitiveIndices;
+
+	// What traversal reads from, wherever the tree lives
+	ArrayView<BVHNode> nodeView;
+	ArrayView<int> indexView;
+	int depth = 0;
+	float buildCost = 0.f;
+};
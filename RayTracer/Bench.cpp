@@ -0,0 +1,486 @@
+#include <stdlib.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstring>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <eigen3/Eigen/Dense>
+
+#include "Scene.h"
+#include "CompiledScene.h"
+#include "Render.h"
+#include "Scheduler.h"
+#include "PhotonMap.h"
+#include "Integrator.h"
+
+using namespace std;
+using namespace Eigen;
+
+#ifndef RT_SCENE_DIR
+#define RT_SCENE_DIR "."
+#endif
+
+/*
+    Benchmarks for the ray tracer.
+
+    Micro benchmarks time the per-shape intersection tests, shadow rays,
+    photon maps and CastRay on their own. Macro benchmarks render whole frames of shapes.txt and of
+    some generated scenes with lots of spheres, with each way of tracing.
+
+    Results go to stdout (and to -o <file> if given) as JSON, one entry per
+    benchmark. Progress goes to stderr, so stdout can be piped straight
+    into something else.
+
+    For frames, "rays" counts camera rays (pixels times samples), not
+    bounces, so ns_per_ray is the cost of a whole pixel sample.
+*/
+
+struct BenchResult
+{
+    string name;
+    long long rays;
+    double seconds;
+};
+
+struct BenchSettings
+{
+    bool quick = false;
+    int numThreads = 0;
+    string outputFile;
+    vector<string> extraScenes;
+};
+
+typedef chrono::steady_clock BenchClock;
+
+static double SecondsSince(const BenchClock::time_point& start)
+{
+    return chrono::duration<double>(BenchClock::now() - start).count();
+}
+
+// Keeps the compiler from throwing away work whose result is never used
+static volatile float benchSink = 0.f;
+
+/*
+    Run body, which traces raysPerCall rays, over and over until at
+    least minSeconds have gone by
+*/
+template <class Body>
+static BenchResult TimeRepeated(
+    const string& name,
+    const long long raysPerCall,
+    const double minSeconds,
+    Body body)
+{
+    // One untimed run, to warm the caches
+    body();
+
+    BenchResult result = { name, 0, 0.0 };
+    const auto start = BenchClock::now();
+    do
+    {
+        body();
+        result.rays += raysPerCall;
+        result.seconds = SecondsSince(start);
+    } while (result.seconds < minSeconds);
+    return result;
+}
+
+/*
+    Unit directions spread over a cone around +z, like camera rays
+*/
+static vector<Vector3f> MakeRays(const int count, const float spread, const unsigned seed)
+{
+    mt19937 generator(seed);
+    uniform_real_distribution<float> offset(-spread, spread);
+    vector<Vector3f> rays(count);
+    for (auto& ray : rays)
+    {
+        ray = Vector3f(offset(generator), offset(generator), 1.f).normalized();
+    }
+    return rays;
+}
+
+/*
+    A field of random spheres over a floor, lit by two lights.
+    The same count always gives the same scene.
+*/
+static void GenerateSphereScene(const int numSpheres, Scene& scene)
+{
+    mt19937 generator(numSpheres);
+    uniform_real_distribution<float> across(-20.f, 20.f);
+    uniform_real_distribution<float> up(-2.5f, 8.f);
+    uniform_real_distribution<float> away(4.f, 40.f);
+    uniform_real_distribution<float> radius(0.1f, 0.5f);
+    uniform_real_distribution<float> shade(0.f, 1.f);
+    for (int i = 0; i < numSpheres; ++i)
+    {
+        const Vector3f centre(across(generator), up(generator), away(generator));
+        const Vector3f colour(shade(generator), shade(generator), shade(generator));
+        scene.AddSphere()->SetSphere(centre, colour, radius(generator));
+    }
+
+    scene.AddPlane()->SetPlane(Vector3f(0, 1, 0), -3.f, Vector3f(0.4f, 0.4f, 0.4f));
+
+    scene.AddPointLight()->SetLight(Vector3f(-5, 10, 0), Vector3f(1, 1, 1), 0.6f);
+    scene.AddPointLight()->SetLight(Vector3f(8, 6, 20), Vector3f(1, 1, 1), 0.6f);
+}
+
+/*
+    Shape::DoesRayIntersect on one shape, for rays that mostly hit it
+*/
+static void BenchShapes(const BenchSettings& settings, vector<BenchResult>& results)
+{
+    const double minSeconds = settings.quick ? 0.02 : 0.5;
+    const vector<Vector3f> rays = MakeRays(4096, 0.3f, 1);
+
+    Sphere sphere;
+    sphere.SetSphere(Vector3f(0, 0, 5), Vector3f(1, 0, 0), 1.f);
+    results.push_back(TimeRepeated("Sphere::DoesRayIntersect", (long long)rays.size(), minSeconds, [&]()
+    {
+        LightCollision collision;
+        float total = 0.f;
+        for (const auto& ray : rays)
+        {
+            float distance = 0.f;
+            if (sphere.DoesRayIntersect(ray, distance, collision))
+            {
+                total += distance;
+            }
+        }
+        benchSink = total;
+    }));
+
+    Plane plane;
+    plane.SetPlane(Vector3f(0, 1, 0), -1.f, Vector3f(0, 1, 0));
+    const vector<Vector3f> downRays = MakeRays(4096, 1.f, 2);
+    results.push_back(TimeRepeated("Plane::DoesRayIntersect", (long long)downRays.size(), minSeconds, [&]()
+    {
+        LightCollision collision;
+        float total = 0.f;
+        for (const auto& ray : downRays)
+        {
+            float distance = 0.f;
+            if (plane.DoesRayIntersect(ray, distance, collision))
+            {
+                total += distance;
+            }
+        }
+        benchSink = total;
+    }));
+}
+
+/*
+    CastRay, on one thread, with every bounce and with just one. Each is
+    timed through the generic CastRay, which checks the bounces left and
+    loops over the lights on every ray, and through the integrator kernel
+    built for the scene, which doesn't. Both give the same colours.
+*/
+static void BenchCastRay(
+    const string& name,
+    const CompiledScene& scene,
+    const BenchSettings& settings,
+    vector<BenchResult>& results)
+{
+    const double minSeconds = settings.quick ? 0.02 : 0.5;
+    const vector<Vector3f> rays = MakeRays(4096, 1.f, 3);
+    for (const int numBounces : { MAX_NUM_BOUNCES_PER_RAY, 1 })
+    {
+        const string prefix = "CastRay/" + name + "/b" + to_string(numBounces);
+        results.push_back(TimeRepeated(prefix + "/generic", (long long)rays.size(), minSeconds, [&]()
+        {
+            float total = 0.f;
+            for (const auto& ray : rays)
+            {
+                total += CastRay(Vector3f::Zero(), ray, scene, numBounces)[0];
+            }
+            benchSink = total;
+        }));
+
+        const CastRayKernel castRay = GetIntegrator(scene, numBounces).castRay;
+        results.push_back(TimeRepeated(prefix + "/kernel", (long long)rays.size(), minSeconds, [&]()
+        {
+            float total = 0.f;
+            for (const auto& ray : rays)
+            {
+                total += castRay(Vector3f::Zero(), ray, scene)[0];
+            }
+            benchSink = total;
+        }));
+    }
+}
+
+/*
+    Shadow rays, from where camera rays first hit towards each light,
+    asked two ways: as a closest hit search cut off at the light, and
+    with the any-hit occlusion query. Both give the same answers.
+*/
+static void BenchShadowRays(
+    const string& name,
+    const CompiledScene& scene,
+    const BenchSettings& settings,
+    vector<BenchResult>& results)
+{
+    struct ShadowRay
+    {
+        Vector3f origin;
+        Vector3f direction;
+        float distance;
+    };
+    vector<ShadowRay> shadowRays;
+    for (const auto& ray : MakeRays(4096, 1.f, 4))
+    {
+        float closestDist = MAX_SCENE_DEPTH;
+        HitRecord hit;
+        if (!scene.Intersect(Vector3f::Zero(), ray, closestDist, hit))
+        {
+            continue;
+        }
+        for (const auto& light : scene.GetLights())
+        {
+            const Vector3f toLight = light.position - hit.point;
+            shadowRays.push_back({ hit.point, toLight.normalized(), toLight.norm() });
+        }
+    }
+    if (shadowRays.empty())
+    {
+        return;
+    }
+
+    const double minSeconds = settings.quick ? 0.02 : 0.5;
+    results.push_back(TimeRepeated("ShadowRay/" + name + "/closest", (long long)shadowRays.size(), minSeconds, [&]()
+    {
+        int blocked = 0;
+        for (const auto& r : shadowRays)
+        {
+            float closestDist = r.distance;
+            int closestKey = NO_PRIMITIVE_KEY;
+            blocked += scene.FindClosest(r.origin, r.direction, closestDist, closestKey);
+        }
+        benchSink = (float)blocked;
+    }));
+    results.push_back(TimeRepeated("ShadowRay/" + name + "/occluded", (long long)shadowRays.size(), minSeconds, [&]()
+    {
+        int blocked = 0;
+        for (const auto& r : shadowRays)
+        {
+            blocked += scene.IsOccluded(r.origin, r.direction, r.distance);
+        }
+        benchSink = (float)blocked;
+    }));
+}
+
+/*
+    Photon maps: tracing the photons and building the maps (where "rays"
+    counts photons shot), then lookups at the first hits of camera rays.
+    A lookup goes through the irradiance map and the caustic map, which
+    is what shading does. "estimate" is the full density estimate in the
+    global map that the irradiance map saves shading from doing.
+*/
+static void BenchPhotons(
+    const string& name,
+    const CompiledScene& scene,
+    const BenchSettings& settings,
+    WorkStealingPool& pool,
+    vector<BenchResult>& results)
+{
+    const int numPhotons = settings.quick ? 20000 : 200000;
+    const double minSeconds = settings.quick ? 0.0 : 0.5;
+    PhotonMaps maps;
+    results.push_back(TimeRepeated("Photons/" + name + "/emit", numPhotons, minSeconds, [&]()
+    {
+        maps = PhotonMaps();
+        EmitPhotons(scene, numPhotons, 0, pool, maps);
+    }));
+
+    vector<HitRecord> hits;
+    for (const auto& ray : MakeRays(4096, 1.f, 5))
+    {
+        float closestDist = MAX_SCENE_DEPTH;
+        HitRecord hit;
+        if (scene.Intersect(Vector3f::Zero(), ray, closestDist, hit))
+        {
+            hits.push_back(hit);
+        }
+    }
+    if (hits.empty())
+    {
+        return;
+    }
+
+    results.push_back(TimeRepeated("Photons/" + name + "/lookup", (long long)hits.size(), minSeconds, [&]()
+    {
+        float total = 0.f;
+        for (const auto& hit : hits)
+        {
+            total += maps.GetIndirectLighting(hit)[0];
+        }
+        benchSink = total;
+    }));
+    results.push_back(TimeRepeated("Photons/" + name + "/estimate", (long long)hits.size(), minSeconds, [&]()
+    {
+        float total = 0.f;
+        for (const auto& hit : hits)
+        {
+            total += maps.global.EstimateIrradiance(hit.point, hit.normal, maps.numNearest, maps.maxDistance)[0];
+        }
+        benchSink = total;
+    }));
+}
+
+/*
+    Whole frames, once with each way of tracing
+*/
+static void BenchFrames(
+    const string& name,
+    const CompiledScene& scene,
+    const BenchSettings& settings,
+    WorkStealingPool& pool,
+    vector<BenchResult>& results)
+{
+    Params params;
+    params.width = settings.quick ? 160 : 640;
+    params.height = settings.quick ? 120 : 480;
+    params.numThreads = settings.numThreads;
+    const double minSeconds = settings.quick ? 0.0 : 1.0;
+    const long long raysPerFrame = (long long)params.width * params.height * params.samplesPerPixel;
+    FrameBuffer frameBuffer(params.width, params.height);
+
+    const char* modes[] = { "scalar", "packets", "wavefront" };
+    for (const char* mode : modes)
+    {
+        params.usePackets = strcmp(mode, "packets") == 0;
+        params.useWavefront = strcmp(mode, "wavefront") == 0;
+        results.push_back(TimeRepeated("Frame/" + name + "/" + mode, raysPerFrame, minSeconds, [&]()
+        {
+            RenderFrame(scene, params, pool, frameBuffer);
+        }));
+        cerr << "  " << results.back().name << ": " << results.back().seconds << "s" << endl;
+    }
+}
+
+/*
+    Write the results out as JSON
+*/
+static void WriteResults(ostream& os, const vector<BenchResult>& results, const int numThreads)
+{
+    os << "{\n  \"threads\": " << numThreads << ",\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const auto& r = results[i];
+        os << "    {\"name\": \"" << r.name << "\""
+           << ", \"rays\": " << r.rays
+           << ", \"seconds\": " << r.seconds
+           << ", \"rays_per_sec\": " << r.rays / r.seconds
+           << ", \"ns_per_ray\": " << 1e9 * r.seconds / r.rays
+           << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    os << "  ]\n}\n";
+}
+
+static void FailBadArgs()
+{
+    cerr << "Usage:" << endl;
+    cerr << "raytracer_bench [-quick] [-t <int>] [-i <scene_file>] [-o <results.json>]" << endl;
+    cerr << "-quick                         : small frames and short runs, to check it all works." << endl;
+    cerr << "-t <int>                       : num render threads for frames. Defaults to all hardware threads." << endl;
+    cerr << "-i <scene_file>                : also benchmark this scene. Can be given more than once." << endl;
+    cerr << "-o <results.json>              : also write the results to this file." << endl;
+}
+
+static bool ParseArgs(const int argc, char** argv, BenchSettings& settings)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const bool hasValue = i + 1 < argc;
+        if (strcmp("-quick", argv[i]) == 0)
+        {
+            settings.quick = true;
+        }
+        else if (strcmp("-t", argv[i]) == 0 && hasValue)
+        {
+            settings.numThreads = stoi(argv[++i]);
+        }
+        else if (strcmp("-i", argv[i]) == 0 && hasValue)
+        {
+            settings.extraScenes.push_back(argv[++i]);
+        }
+        else if (strcmp("-o", argv[i]) == 0 && hasValue)
+        {
+            settings.outputFile = argv[++i];
+        }
+        else
+        {
+            cerr << "Bad argument: " << argv[i] << endl;
+            FailBadArgs();
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    BenchSettings settings;
+    if (!ParseArgs(argc, argv, settings))
+    {
+        return -1;
+    }
+
+    vector<BenchResult> results;
+    WorkStealingPool pool(settings.numThreads);
+
+    cerr << "Shapes" << endl;
+    BenchShapes(settings, results);
+
+    // shapes.txt, anything asked for with -i, then generated scenes of growing size
+    vector<pair<string, string>> sceneFiles = { { "shapes.txt", string(RT_SCENE_DIR) + "/shapes.txt" } };
+    for (const auto& file : settings.extraScenes)
+    {
+        sceneFiles.push_back({ file, file });
+    }
+    for (const auto& file : sceneFiles)
+    {
+        Scene scene;
+        if (!ReadScene(file.second, scene, settings.numThreads))
+        {
+            cerr << "Couldn't read scene " << file.second << endl;
+            return -1;
+        }
+        const CompiledScene compiled(scene);
+        cerr << file.first << endl;
+        BenchCastRay(file.first, compiled, settings, results);
+        BenchShadowRays(file.first, compiled, settings, results);
+        BenchPhotons(file.first, compiled, settings, pool, results);
+        BenchFrames(file.first, compiled, settings, pool, results);
+    }
+
+    const int sphereCounts[] = { 1000, 20000 };
+    for (const int count : sphereCounts)
+    {
+        Scene scene;
+        GenerateSphereScene(settings.quick ? count / 10 : count, scene);
+        const CompiledScene compiled(scene);
+        const string name = "spheres" + to_string(compiled.GetSpheres().size());
+        cerr << name << endl;
+        BenchCastRay(name, compiled, settings, results);
+        BenchShadowRays(name, compiled, settings, results);
+        BenchPhotons(name, compiled, settings, pool, results);
+        BenchFrames(name, compiled, settings, pool, results);
+    }
+
+    WriteResults(cout, results, pool.GetNumThreads());
+    if (!settings.outputFile.empty())
+    {
+        ofstream ofs(settings.outputFile);
+        if (!ofs.is_open())
+        {
+            cerr << "Couldn't write results to " << settings.outputFile << endl;
+            return -1;
+        }
+        WriteResults(ofs, results, pool.GetNumThreads());
+    }
+    return 0;
+}
@@ -0,0 +1,244 @@
+#include "Checkpoint.h"
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+
+#include "CompiledScene.h"
+#include "Render.h"
+
+using namespace Eigen;
+using namespace std;
+
+//-----------------------------------------------------------
+Checkpoint::Checkpoint(
+	const CompiledScene& scene,
+	const Params& params,
+	FrameBuffer& frameBuffer,
+	vector<int>& sampleCounts)
+	: width(params.width), height(params.height), frameBuffer(frameBuffer), sampleCounts(sampleCounts)
+{
+	tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	numTiles = tilesX * ((height + TILE_SIZE - 1) / TILE_SIZE);
+	tilesDone.reset(new atomic<uint8_t>[numTiles]);
+	for (int tile = 0; tile < numTiles; ++tile)
+	{
+		tilesDone[tile] = 0;
+	}
+
+	// The background isn't in the scene's hash, but it's in every pixel that misses
+	uint64_t sceneHash = scene.GetHash();
+	const Vector3f& background = scene.GetBackground();
+	const unsigned char* bytes = (const unsigned char*)background.data();
+	for (size_t i = 0; i < sizeof(float) * 3; ++i)
+	{
+		sceneHash = (sceneHash ^ bytes[i]) * 1099511628211ull;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CHECKPOINT_FILE_MAGIC, sizeof(header.magic));
+	header.version = CHECKPOINT_FILE_VERSION;
+	header.endianCheck = CHECKPOINT_FILE_ENDIAN_CHECK;
+	header.width = params.width;
+	header.height = params.height;
+	header.fov = params.fov;
+	header.tileSize = TILE_SIZE;
+	header.samplesPerPixel = params.samplesPerPixel;
+	header.adaptive = params.adaptive;
+	header.minSamples = params.minSamples;
+	header.maxSamples = params.maxSamples;
+	header.noiseThreshold = params.noiseThreshold;
+	header.samplerType = params.samplerType;
+	header.seed = params.seed;
+	header.numBouncesPerRay = params.numBouncesPerRay;
+	header.numPhotons = params.numPhotons;
+	header.photonNearest = params.photonNearest;
+	header.photonRadius = params.photonRadius;
+	header.illuminationPhotons = params.illuminationPhotons;
+	header.illuminationResolution = params.illuminationResolution;
+	header.usePackets = params.usePackets;
+	header.sceneHash = sceneHash;
+	header.numTiles = numTiles;
+}
+
+Checkpoint::~Checkpoint()
+{
+	StopWriting();
+}
+
+int Checkpoint::GetNumTilesDone() const
+{
+	int count = 0;
+	for (int tile = 0; tile < numTiles; ++tile)
+	{
+		count += IsTileDone(tile) ? 1 : 0;
+	}
+	return count;
+}
+
+//-----------------------------------------------------------
+bool Checkpoint::Load(const string& fileName)
+{
+	ifstream file(fileName, ifstream::in | ifstream::binary);
+	if (!file.good())
+	{
+		cout << "ERROR: could not open checkpoint file " << fileName << endl;
+		return false;
+	}
+
+	auto fail = [&fileName](const char* reason)
+	{
+		cout << "ERROR: " << fileName << " is not a usable checkpoint file: " << reason << endl;
+		return false;
+	};
+
+	CheckpointFileHeader loaded;
+	file.read((char*)&loaded, sizeof(loaded));
+	if (!file.good())
+	{
+		return fail("too short");
+	}
+	if (memcmp(loaded.magic, CHECKPOINT_FILE_MAGIC, sizeof(loaded.magic)) != 0)
+	{
+		return fail("not a checkpoint file");
+	}
+	if (loaded.version != CHECKPOINT_FILE_VERSION)
+	{
+		return fail("written by a different version");
+	}
+	if (loaded.endianCheck != CHECKPOINT_FILE_ENDIAN_CHECK)
+	{
+		return fail("written on a machine with the other byte order");
+	}
+	if (loaded.numTilesDone > (uint32_t)numTiles)
+	{
+		return fail("more tiles done than there are");
+	}
+	CheckpointFileHeader expected = header;
+	expected.numTilesDone = loaded.numTilesDone;
+	if (memcmp(&loaded, &expected, sizeof(expected)) != 0)
+	{
+		return fail("made for a different scene, or with different settings");
+	}
+
+	vector<uint32_t> tiles(loaded.numTilesDone);
+	file.read((char*)tiles.data(), tiles.size() * sizeof(uint32_t));
+	vector<float> pixel(4);
+	for (const uint32_t tile : tiles)
+	{
+		if (!file.good() || tile >= (uint32_t)numTiles)
+		{
+			return fail("a tile that isn't in the image");
+		}
+		const int startW = (tile % tilesX) * TILE_SIZE;
+		const int startH = (tile / tilesX) * TILE_SIZE;
+		for (int h = startH; h < min(startH + TILE_SIZE, height); ++h)
+		{
+			for (int w = startW; w < min(startW + TILE_SIZE, width); ++w)
+			{
+				Vector3f colour;
+				int32_t count = 0;
+				file.read((char*)colour.data(), sizeof(float) * 3);
+				file.read((char*)&count, sizeof(count));
+				frameBuffer.Set(w + h * width, colour);
+				sampleCounts[w + h * width] = count;
+			}
+		}
+		TileDone(tile);
+	}
+	if (!file.good())
+	{
+		return fail("too short");
+	}
+	cout << "Resuming from " << fileName << ", with " << loaded.numTilesDone << " of " << numTiles << " tiles done" << endl;
+	return true;
+}
+
+bool Checkpoint::Write(const string& fileName) const
+{
+	// Only tiles already done are read, and nothing writes to those again
+	vector<uint32_t> tiles;
+	for (int tile = 0; tile < numTiles; ++tile)
+	{
+		if (IsTileDone(tile))
+		{
+			tiles.push_back(tile);
+		}
+	}
+	vector<char> pixels;
+	pixels.reserve(tiles.size() * TILE_SIZE * TILE_SIZE * (sizeof(float) * 3 + sizeof(int32_t)));
+	for (const uint32_t tile : tiles)
+	{
+		const int startW = (tile % tilesX) * TILE_SIZE;
+		const int startH = (tile / tilesX) * TILE_SIZE;
+		for (int h = startH; h < min(startH + TILE_SIZE, height); ++h)
+		{
+			for (int w = startW; w < min(startW + TILE_SIZE, width); ++w)
+			{
+				const Vector3f colour = frameBuffer.Get(w + h * width);
+				const int32_t count = sampleCounts[w + h * width];
+				pixels.insert(pixels.end(), (const char*)colour.data(), (const char*)colour.data() + sizeof(float) * 3);
+				pixels.insert(pixels.end(), (const char*)&count, (const char*)&count + sizeof(count));
+			}
+		}
+	}
+
+	CheckpointFileHeader written = header;
+	written.numTilesDone = (uint32_t)tiles.size();
+
+	// Written beside the last one, and only moved over it once it's whole
+	const string tempName = fileName + ".tmp";
+	ofstream file(tempName, ofstream::out | ofstream::binary | ofstream::trunc);
+	file.write((const char*)&written, sizeof(written));
+	file.write((const char*)tiles.data(), tiles.size() * sizeof(uint32_t));
+	file.write(pixels.data(), pixels.size());
+	file.close();
+	if (!file.good())
+	{
+		cout << "ERROR: checkpoint could not be written to " << tempName << endl;
+		return false;
+	}
+#ifdef _WIN32
+	// Windows won't rename over a file that's there
+	remove(fileName.c_str());
+#endif
+	if (rename(tempName.c_str(), fileName.c_str()) != 0)
+	{
+		cout << "ERROR: checkpoint could not be moved to " << fileName << endl;
+		return false;
+	}
+	return true;
+}
+
+//-----------------------------------------------------------
+void Checkpoint::StartWriting(const string& fileName, const chrono::milliseconds interval)
+{
+	StopWriting();
+	stopping = false;
+	writer = thread([this, fileName, interval]()
+	{
+		unique_lock<mutex> locked(lock);
+		while (!wake.wait_for(locked, interval, [this]() { return stopping; }))
+		{
+			locked.unlock();
+			const bool written = Write(fileName);
+			locked.lock();
+			writeFailed = writeFailed || !written;
+		}
+	});
+}
+
+bool Checkpoint::StopWriting()
+{
+	if (writer.joinable())
+	{
+		{
+			lock_guard<mutex> locked(lock);
+			stopping = true;
+		}
+		wake.notify_all();
+		writer.join();
+	}
+	return !writeFailed;
+}
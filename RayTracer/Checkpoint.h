@@ -0,0 +1,130 @@
+#pragma once
+#include <eigen3/Eigen/Dense>
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+
+#include "FrameBuffer.h"
+
+class CompiledScene;
+struct Params;
+
+// First 8 bytes of every checkpoint file
+#define CHECKPOINT_FILE_MAGIC "RTCHKPT"
+// Bump this whenever the layout of anything in the file changes
+#define CHECKPOINT_FILE_VERSION 1
+#define CHECKPOINT_FILE_ENDIAN_CHECK 0x01020304u
+// Seconds between checkpoints, unless asked otherwise
+#define CHECKPOINT_DEFAULT_INTERVAL 60
+
+/**********************************************/
+/*############ CHECKPOINT CLASSES ############*/
+/**********************************************/
+
+/*
+	Checkpoint files start with this. Everything but numTilesDone has to
+	match the render for it to carry on from the file.
+
+	After it come the numbers of the tiles that are done, then each of
+	those tiles' pixels, row by row: three floats of colour and the int
+	number of samples that went into it.
+*/
+struct CheckpointFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t endianCheck;
+
+	// Everything that changes what a pixel comes out as
+	int32_t width;
+	int32_t height;
+	int32_t fov;
+	int32_t tileSize;
+	int32_t samplesPerPixel;
+	int32_t adaptive;
+	int32_t minSamples;
+	int32_t maxSamples;
+	float noiseThreshold;
+	int32_t samplerType;
+	uint32_t seed;
+	int32_t numBouncesPerRay;
+	int32_t numPhotons;
+	int32_t photonNearest;
+	float photonRadius;
+	int32_t illuminationPhotons;
+	int32_t illuminationResolution;
+	uint32_t usePackets;
+	uint64_t sceneHash;
+
+	uint32_t numTiles;
+	uint32_t numTilesDone;
+};
+
+static_assert(sizeof(CheckpointFileHeader) == 104, "The checkpoint file header is part of the file format");
+
+/*
+	The tiles of a render that are finished, saved now and again so a
+	render that gets killed can be picked up from where it got to.
+
+	Samples are placed by the seed, the pixel and the sample's number,
+	so the sampler has nothing else to save: a tile rendered after a
+	resume comes out exactly as it would have the first time, and the
+	image is the same as if the render had never stopped. Only the
+	tiles that were part done when it stopped are lost.
+
+	A thread of its own writes the checkpoints, so the render threads
+	never wait on the disk. It only reads tiles after they're marked
+	done, and they aren't written to again after that, so it needs no
+	lock on the frame buffer. Each checkpoint is written to a temporary
+	file first and then moved over the last, so a kill part way through
+	leaves the last one whole.
+*/
+class Checkpoint
+{
+public:
+	// Keeps track of tiles of these buffers, which have to outlive it
+	Checkpoint(
+		const CompiledScene& scene,
+		const Params& params,
+		FrameBuffer& frameBuffer,
+		std::vector<int>& sampleCounts);
+	~Checkpoint();
+
+	// Fill the buffers with the tiles in a checkpoint of this same render
+	bool Load(const std::string& fileName);
+	bool Write(const std::string& fileName) const;
+
+	bool IsTileDone(const int tile) const { return tilesDone[tile].load(std::memory_order_acquire) != 0; };
+	// Call once a tile's pixels are all in the buffers
+	void TileDone(const int tile) { tilesDone[tile].store(1, std::memory_order_release); };
+	int GetNumTilesDone() const;
+	int GetNumTiles() const { return numTiles; };
+
+	// Write a checkpoint to fileName every interval, on a thread of its own
+	void StartWriting(const std::string& fileName, const std::chrono::milliseconds interval);
+	// Stop that thread, and say whether every checkpoint it wrote worked
+	bool StopWriting();
+
+private:
+	int width;
+	int height;
+	int tilesX;
+	int numTiles;
+	// What every checkpoint of this render starts with, but numTilesDone
+	CheckpointFileHeader header;
+	FrameBuffer& frameBuffer;
+	std::vector<int>& sampleCounts;
+	std::unique_ptr<std::atomic<uint8_t>[]> tilesDone;
+
+	std::thread writer;
+	std::mutex lock;
+	std::condition_variable wake;
+	bool stopping = false;
+	bool writeFailed = false;
+};
@@ -0,0 +1,417 @@
+#include "CompiledScene.h"
+#include "Stats.h"
+#include <iostream>
+
+using namespace Eigen;
+using namespace std;
+
+//-----------------------------------------------------------
+/*
+	The compiled scene
+
+	Each shape and light writes its own flattened copy in, then
+	the BVH gets built over the spheres. The built in types go a pool
+	at a time, so every call is to a known type; shapes of any other
+	type compile themselves through Shape.
+*/
+CompiledScene::CompiledScene(Scene& scene)
+{
+	Compile(scene);
+}
+
+void CompiledScene::Compile(Scene& scene)
+{
+	ownedSpheres.clear();
+	ownedPlanes.clear();
+	ownedLights.clear();
+	ownedVertices.clear();
+	ownedTriangles.clear();
+	ownedMeshes.clear();
+	borrowedFrom.reset();
+	UpdateViews();
+
+	scene.GetSpheres().ForEach([this](Sphere& s) { s.Compile(*this); });
+	scene.GetPlanes().ForEach([this](Plane& p) { p.Compile(*this); });
+	scene.GetMeshes().ForEach([this](TriangleMesh& m) { m.Compile(*this); });
+	for (const auto& s : scene.GetOtherShapes())
+	{
+		s->Compile(*this);
+	}
+
+	const auto addLight = [this](auto& l)
+	{
+		LightData light;
+		light.position = l.GetPosition();
+		light.intensity = l.GetIntensity();
+		AddLight(light);
+	};
+	scene.GetPointLights().ForEach(addLight);
+	for (const auto& l : scene.GetOtherLights())
+	{
+		addLight(*l);
+	}
+	background = scene.GetBackground();
+
+	Finalise();
+}
+
+void CompiledScene::Finalise()
+{
+	vector<AABB> bounds;
+	GetSphereBounds(bounds);
+	bvh.Build(bounds);
+
+	// Boxes that fit a triangle exactly can miss it by a rounding error,
+	// which would undo the watertight test, so they get a little slack
+	vector<AABB> triangleBounds(triangles.size());
+	for (size_t i = 0; i < triangles.size(); ++i)
+	{
+		AABB& box = triangleBounds[i];
+		for (int k = 0; k < 3; ++k)
+		{
+			box.Grow(vertices[triangles[i].v[k]]);
+		}
+		const float size = max(box.lower.cwiseAbs().maxCoeff(), box.upper.cwiseAbs().maxCoeff());
+		const Vector3f slack = Vector3f::Constant(size * 1e-6f + 1e-6f);
+		box.lower -= slack;
+		box.upper += slack;
+	}
+	triangleBVH.Build(triangleBounds);
+}
+
+// Rays that pass within EPSILON of a sphere count as tangent hits,
+// so the boxes have to be that much bigger than the spheres
+void CompiledScene::GetSphereBounds(vector<AABB>& bounds) const
+{
+	bounds.resize(spheres.size());
+	for (size_t i = 0; i < spheres.size(); ++i)
+	{
+		const Vector3f extent = Vector3f::Constant(spheres[i].radius + (float)EPSILON);
+		bounds[i].lower = spheres[i].centre - extent;
+		bounds[i].upper = spheres[i].centre + extent;
+	}
+}
+
+void CompiledScene::SetSphereCentre(const int sphere, const Vector3f& centre)
+{
+	if (ownedSpheres.size() != spheres.size())
+	{
+		ownedSpheres.assign(spheres.begin(), spheres.end());
+		spheres = ArrayView<SphereData>(ownedSpheres);
+	}
+	ownedSpheres[sphere].centre = centre;
+}
+
+void CompiledScene::SetLightPosition(const int light, const Vector3f& position)
+{
+	if (ownedLights.size() != lights.size())
+	{
+		ownedLights.assign(lights.begin(), lights.end());
+		lights = ArrayView<LightData>(ownedLights);
+	}
+	ownedLights[light].position = position;
+}
+
+bool CompiledScene::RefitBVH()
+{
+	vector<AABB> bounds;
+	GetSphereBounds(bounds);
+	bvh.Refit(bounds);
+	if (bvh.GetCost() > BVH_REFIT_MAX_COST_GROWTH * bvh.GetBuildCost())
+	{
+		bvh.Build(bounds);
+		return true;
+	}
+	return false;
+}
+
+/*
+	The mesh's vertices go on the end of the shared array, so its
+	indices are shifted along by however many were there already
+*/
+void CompiledScene::AddMesh(
+	const vector<Vector3f>& meshVertices,
+	const vector<uint32_t>& meshIndices,
+	const MeshData& mesh)
+{
+	const size_t numTriangles = meshIndices.size() / 3;
+	if (ownedTriangles.size() + numTriangles >= (size_t)MAX_PRIMITIVES_PER_TYPE ||
+		ownedVertices.size() + meshVertices.size() > (size_t)UINT32_MAX)
+	{
+		cout << "ERROR: too many triangles in the scene, a mesh has been left out" << endl;
+		return;
+	}
+
+	const uint32_t base = (uint32_t)ownedVertices.size();
+	const uint32_t meshIndex = (uint32_t)ownedMeshes.size();
+	ownedMeshes.push_back(mesh);
+	ownedVertices.insert(ownedVertices.end(), meshVertices.begin(), meshVertices.end());
+	ownedTriangles.reserve(ownedTriangles.size() + numTriangles);
+	for (size_t i = 0; i < numTriangles; ++i)
+	{
+		TriangleData t;
+		for (int k = 0; k < 3; ++k)
+		{
+			t.v[k] = base + meshIndices[3 * i + k];
+		}
+		t.mesh = meshIndex;
+		ownedTriangles.push_back(t);
+	}
+	UpdateViews();
+}
+
+void CompiledScene::Borrow(
+	const ArrayView<SphereData>& borrowedSpheres,
+	const ArrayView<PlaneData>& borrowedPlanes,
+	const ArrayView<LightData>& borrowedLights,
+	const ArrayView<BVHNode>& bvhNodes,
+	const ArrayView<int>& bvhIndices,
+	const int bvhDepth,
+	const shared_ptr<const void>& owner)
+{
+	ownedSpheres.clear();
+	ownedPlanes.clear();
+	ownedLights.clear();
+	ownedVertices.clear();
+	ownedTriangles.clear();
+	ownedMeshes.clear();
+	borrowedFrom = owner;
+
+	spheres = borrowedSpheres;
+	planes = borrowedPlanes;
+	lights = borrowedLights;
+	bvh.Borrow(bvhNodes, bvhIndices, bvhDepth);
+	vertices = ArrayView<Vector3f>();
+	triangles = ArrayView<TriangleData>();
+	meshes = ArrayView<MeshData>();
+	triangleBVH.Borrow(ArrayView<BVHNode>(), ArrayView<int>(), 0);
+}
+
+void CompiledScene::BorrowTriangles(
+	const ArrayView<Vector3f>& borrowedVertices,
+	const ArrayView<TriangleData>& borrowedTriangles,
+	const ArrayView<MeshData>& borrowedMeshes,
+	const ArrayView<BVHNode>& bvhNodes,
+	const ArrayView<int>& bvhIndices,
+	const int bvhDepth)
+{
+	vertices = borrowedVertices;
+	triangles = borrowedTriangles;
+	meshes = borrowedMeshes;
+	triangleBVH.Borrow(bvhNodes, bvhIndices, bvhDepth);
+}
+
+// FNV-1a, over the bytes of an array
+template <typename T>
+static void HashArray(const ArrayView<T>& array, uint64_t& hash)
+{
+	const unsigned char* bytes = (const unsigned char*)array.data();
+	for (size_t i = 0; i < array.size() * sizeof(T); ++i)
+	{
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+}
+
+uint64_t CompiledScene::GetHash() const
+{
+	uint64_t hash = 14695981039346656037ull;
+	HashArray(spheres, hash);
+	HashArray(planes, hash);
+	HashArray(lights, hash);
+	HashArray(vertices, hash);
+	HashArray(triangles, hash);
+	HashArray(meshes, hash);
+	return hash;
+}
+
+void CompiledScene::UpdateViews()
+{
+	spheres = ArrayView<SphereData>(ownedSpheres);
+	planes = ArrayView<PlaneData>(ownedPlanes);
+	lights = ArrayView<LightData>(ownedLights);
+	vertices = ArrayView<Vector3f>(ownedVertices);
+	triangles = ArrayView<TriangleData>(ownedTriangles);
+	meshes = ArrayView<MeshData>(ownedMeshes);
+}
+
+/*
+	Closest hit over the whole scene.
+
+	Planes go first; a close plane hit lets the BVH cull more boxes.
+	Only the key and distance of the best candidate are tracked
+	while searching. Normals and colours are worked out at the end.
+*/
+bool CompiledScene::Intersect(
+	const Vector3f& origin,
+	const Vector3f& direction,
+	float& closestDist,
+	HitRecord& hit) const
+{
+	int closestKey = NO_PRIMITIVE_KEY;
+	if (!FindClosest(origin, direction, closestDist, closestKey))
+	{
+		return false;
+	}
+
+	hit.type = KeyType(closestKey);
+	hit.index = KeyIndex(closestKey);
+	hit.distance = closestDist;
+	CompleteHit(origin, direction, hit);
+	return true;
+}
+
+bool CompiledScene::FindClosest(
+	const Vector3f& origin,
+	const Vector3f& direction,
+	float& closestDist,
+	int& closestKey) const
+{
+	STAT_ADD(STAT_PLANE_TESTS, planes.size());
+	LocalStat sphereTests(STAT_SPHERE_TESTS);
+	float distance = 0.f;
+	for (int i = 0; i < (int)planes.size(); ++i)
+	{
+		const int key = PrimitiveKey(PRIMITIVE_PLANE, i);
+		if (IntersectPlane(planes[i], origin, direction, closestDist, distance) &&
+			IsCloserHit(distance, key, closestDist, closestKey))
+		{
+			closestDist = distance;
+			closestKey = key;
+		}
+	}
+
+	bvh.Intersect(origin, direction, closestDist, [&](int i, float& closest)
+	{
+		sphereTests.Add();
+		const int key = PrimitiveKey(PRIMITIVE_SPHERE, i);
+		if (IntersectSphere(spheres[i], origin, direction, closest, distance) &&
+			IsCloserHit(distance, key, closest, closestKey))
+		{
+			closest = distance;
+			closestKey = key;
+			return true;
+		}
+		return false;
+	});
+
+	FindClosestTriangle(origin, direction, closestDist, closestKey);
+	const bool hit = closestKey != NO_PRIMITIVE_KEY;
+	STAT_ADD(STAT_CLOSEST_HIT_QUERIES, 1);
+	STAT_ADD(hit ? STAT_CLOSEST_HITS : STAT_CLOSEST_MISSES, 1);
+	return hit;
+}
+
+/*
+	Planes are cheapest, so go first. Then spheres and triangles,
+	each through their own BVH's any-hit walk.
+*/
+bool CompiledScene::IsOccluded(
+	const Vector3f& origin,
+	const Vector3f& direction,
+	const float maxDist) const
+{
+	STAT_ADD(STAT_SHADOW_RAYS, 1);
+	LocalStat planeTests(STAT_PLANE_TESTS);
+	LocalStat sphereTests(STAT_SPHERE_TESTS);
+	LocalStat triangleTests(STAT_TRIANGLE_TESTS);
+	float distance = 0.f;
+	for (const PlaneData& plane : planes)
+	{
+		planeTests.Add();
+		if (IntersectPlane(plane, origin, direction, maxDist, distance))
+		{
+			STAT_ADD(STAT_SHADOW_OCCLUDED, 1);
+			return true;
+		}
+	}
+
+	if (bvh.IntersectAny(origin, direction, maxDist, [&](int i)
+		{
+			sphereTests.Add();
+			return IntersectSphere(spheres[i], origin, direction, maxDist, distance);
+		}))
+	{
+		STAT_ADD(STAT_SHADOW_OCCLUDED, 1);
+		return true;
+	}
+
+	if (triangleBVH.IsEmpty())
+	{
+		return false;
+	}
+	const TriangleRay ray = MakeTriangleRay(origin, direction);
+	const bool occluded = triangleBVH.IntersectAny(origin, direction, maxDist, [&](int i)
+	{
+		triangleTests.Add();
+		const TriangleData& t = triangles[i];
+		return IntersectTriangle(ray, vertices[t.v[0]], vertices[t.v[1]], vertices[t.v[2]], maxDist, distance);
+	});
+	STAT_ADD(STAT_SHADOW_OCCLUDED, occluded ? 1 : 0);
+	return occluded;
+}
+
+bool CompiledScene::FindClosestTriangle(
+	const Vector3f& origin,
+	const Vector3f& direction,
+	float& closestDist,
+	int& closestKey) const
+{
+	if (triangleBVH.IsEmpty())
+	{
+		return false;
+	}
+
+	const TriangleRay ray = MakeTriangleRay(origin, direction);
+	LocalStat triangleTests(STAT_TRIANGLE_TESTS);
+	float distance = 0.f;
+	return triangleBVH.Intersect(origin, direction, closestDist, [&](int i, float& closest)
+	{
+		triangleTests.Add();
+		const int key = PrimitiveKey(PRIMITIVE_TRIANGLE, i);
+		const TriangleData& t = triangles[i];
+		if (IntersectTriangle(ray, vertices[t.v[0]], vertices[t.v[1]], vertices[t.v[2]], closest, distance) &&
+			IsCloserHit(distance, key, closest, closestKey))
+		{
+			closest = distance;
+			closestKey = key;
+			return true;
+		}
+		return false;
+	});
+}
+
+void CompiledScene::CompleteHit(
+	const Vector3f& origin,
+	const Vector3f& direction,
+	HitRecord& hit) const
+{
+	hit.point = origin + hit.distance * direction;
+	if (hit.type == PRIMITIVE_SPHERE)
+	{
+		const SphereData& s = spheres[hit.index];
+		hit.normal = (hit.point - s.centre).normalized();
+		hit.colour = s.colour;
+		hit.diffusionFactor = s.diffusionFactor;
+	}
+	else if (hit.type == PRIMITIVE_TRIANGLE)
+	{
+		// Triangles have two sides, so the normal faces whichever one was hit
+		const TriangleData& t = triangles[hit.index];
+		const Vector3f& v0 = vertices[t.v[0]];
+		hit.normal = (vertices[t.v[1]] - v0).cross(vertices[t.v[2]] - v0).normalized();
+		if (hit.normal.dot(direction) > 0.f)
+		{
+			hit.normal = -hit.normal;
+		}
+		const MeshData& m = meshes[t.mesh];
+		hit.colour = m.colour;
+		hit.diffusionFactor = m.diffusionFactor;
+	}
+	else
+	{
+		const PlaneData& p = planes[hit.index];
+		hit.normal = p.normal;
+		hit.colour = p.colour;
+		hit.diffusionFactor = p.diffusionFactor;
+	}
+}
@@ -0,0 +1,454 @@
+#pragma once
+#include <eigen3/Eigen/Dense>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <climits>
+#include <memory>
+#include <cstdint>
+
+#include "Scene.h"
+#include "BVH.h"
+#include "ArrayView.h"
+
+struct PhotonMaps;
+class IlluminationMaps;
+
+/**********************************************/
+/*######## COMPILED SCENE STRUCTURES #########*/
+/**********************************************/
+
+// Plain copies of each primitive, holding only what rendering needs.
+// Each is padded out to 32 bytes, so two sit in a cache line and
+// none straddle one.
+struct alignas(32) SphereData
+{
+	Eigen::Vector3f centre;
+	float radius;
+	Eigen::Vector3f colour;
+	float diffusionFactor;
+};
+
+// Planes are stored with a unit normal, and the offset scaled to match,
+// so that dot(normal, x) = offset still holds
+struct alignas(32) PlaneData
+{
+	Eigen::Vector3f normal;
+	float offset;
+	Eigen::Vector3f colour;
+	float diffusionFactor;
+};
+
+// A triangle is three indices into the scene's shared vertex array,
+// plus the mesh it came from, which holds its material
+struct TriangleData
+{
+	uint32_t v[3];
+	uint32_t mesh;
+};
+
+struct alignas(16) MeshData
+{
+	Eigen::Vector3f colour;
+	float diffusionFactor;
+};
+
+struct alignas(16) LightData
+{
+	Eigen::Vector3f position;
+	float intensity;
+};
+
+enum PrimitiveType
+{
+	PRIMITIVE_NONE,
+	PRIMITIVE_SPHERE,
+	PRIMITIVE_PLANE,
+	PRIMITIVE_TRIANGLE
+};
+
+// The closest hit along a ray. Only filled in once the closest
+// primitive is known, so the shading data is computed once per ray
+// rather than once per candidate.
+struct HitRecord
+{
+	float distance;
+	PrimitiveType type = PRIMITIVE_NONE;
+	int index = -1;
+
+	Eigen::Vector3f point;
+	Eigen::Vector3f normal;
+	Eigen::Vector3f colour;
+	float diffusionFactor;
+};
+
+/*
+	Every primitive has a key made of its type and index. When two hits
+	are at exactly the same distance, the lower key wins. That way the
+	closest hit doesn't depend on the order the primitives were visited
+	in, so different traversals (like the packet tracer) agree exactly.
+*/
+#define NO_PRIMITIVE_KEY INT_MAX
+// The index takes the low 28 bits of a key, so this many of each type at most
+#define MAX_PRIMITIVES_PER_TYPE (1 << 28)
+
+inline int PrimitiveKey(const PrimitiveType type, const int index)
+{
+	return ((int)type << 28) | index;
+}
+
+inline PrimitiveType KeyType(const int key)
+{
+	return key == NO_PRIMITIVE_KEY ? PRIMITIVE_NONE : (PrimitiveType)(key >> 28);
+}
+
+inline int KeyIndex(const int key)
+{
+	return key == NO_PRIMITIVE_KEY ? -1 : (key & ((1 << 28) - 1));
+}
+
+// Given a hit no further than closestDist, does it beat the current closest?
+inline bool IsCloserHit(const float distance, const int key, const float closestDist, const int closestKey)
+{
+	return distance < closestDist || key < closestKey;
+}
+
+/*
+	Ray - primitive intersection kernels.
+
+	The direction must be unit length. On a hit no further than closestDist
+	and further than EPSILON, distance is set and true is returned.
+	Nothing else is computed; normals and colours come later, for the
+	closest hit only.
+
+	The arithmetic is written out in a fixed order, without Eigen, because
+	the packet kernels repeat it lane by lane and must round the same way.
+*/
+inline bool IntersectSphere(
+	const SphereData& sphere,
+	const Eigen::Vector3f& origin,
+	const Eigen::Vector3f& direction,
+	const float closestDist,
+	float& distance)
+{
+	// Project the centre onto the ray, then check how far the ray passes from it.
+	// Rays passing within EPSILON of the surface count as tangent hits.
+	const float ocx = sphere.centre[0] - origin[0];
+	const float ocy = sphere.centre[1] - origin[1];
+	const float ocz = sphere.centre[2] - origin[2];
+	const float proj = ocx * direction[0] + ocy * direction[1] + ocz * direction[2];
+	const float px = ocx - proj * direction[0];
+	const float py = ocy - proj * direction[1];
+	const float pz = ocz - proj * direction[2];
+	const float distSq = px * px + py * py + pz * pz;
+
+	const float outer = sphere.radius + (float)EPSILON;
+	if (!(distSq < outer * outer))
+	{
+		return false;
+	}
+
+	const float inner = std::max(sphere.radius - (float)EPSILON, 0.f);
+	float t = proj;
+	if (!(distSq > inner * inner))
+	{
+		t = proj - std::sqrt(sphere.radius * sphere.radius - distSq);
+	}
+
+	// Rays starting inside the sphere are ignored, as are hits behind the origin
+	if (t > (float)EPSILON && t <= closestDist)
+	{
+		distance = t;
+		return true;
+	}
+	return false;
+}
+
+inline bool IntersectPlane(
+	const PlaneData& plane,
+	const Eigen::Vector3f& origin,
+	const Eigen::Vector3f& direction,
+	const float closestDist,
+	float& distance)
+{
+	const float dot = plane.normal[0] * direction[0] + plane.normal[1] * direction[1] + plane.normal[2] * direction[2];
+	if (dot == 0.f)
+	{
+		// Parallel: either in the plane or never touching it
+		return false;
+	}
+
+	const float height = plane.offset - (plane.normal[0] * origin[0] + plane.normal[1] * origin[1] + plane.normal[2] * origin[2]);
+	const float t = height / dot;
+	if (t > (float)EPSILON && t <= closestDist)
+	{
+		distance = t;
+		return true;
+	}
+	return false;
+}
+
+/*
+	Watertight ray - triangle intersection, from Woop, Benthin and Wald,
+	"Watertight Ray/Triangle Intersection" (JCGT 2013).
+
+	The vertices are moved into a space where the ray starts at the
+	origin and runs down the z axis, and the hit test becomes a 2D
+	edge test at the origin. An edge shared by two triangles gives
+	exactly the same value in both, just with the sign flipped, so a
+	ray can't slip through the gap between them however it lands.
+	Edge values of exactly zero are worked out again in double, so
+	that holds right on the edges and vertices too.
+
+	The shear only depends on the ray, so it's worked out once, here.
+*/
+struct TriangleRay
+{
+	int kx, ky, kz;
+	float sx, sy, sz;
+	float origin[3];
+};
+
+inline TriangleRay MakeTriangleRay(const Eigen::Vector3f& origin, const Eigen::Vector3f& direction)
+{
+	TriangleRay ray;
+	// z is whichever axis the ray moves along most
+	const float ax = std::fabs(direction[0]);
+	const float ay = std::fabs(direction[1]);
+	const float az = std::fabs(direction[2]);
+	ray.kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+	ray.kx = ray.kz == 2 ? 0 : ray.kz + 1;
+	ray.ky = ray.kx == 2 ? 0 : ray.kx + 1;
+	// Keep the winding the same when looking down the negative axis
+	if (direction[ray.kz] < 0.f)
+	{
+		std::swap(ray.kx, ray.ky);
+	}
+
+	ray.sx = direction[ray.kx] / direction[ray.kz];
+	ray.sy = direction[ray.ky] / direction[ray.kz];
+	ray.sz = 1.f / direction[ray.kz];
+	for (int a = 0; a < 3; ++a)
+	{
+		ray.origin[a] = origin[a];
+	}
+	return ray;
+}
+
+inline bool IntersectTriangle(
+	const TriangleRay& ray,
+	const Eigen::Vector3f& v0,
+	const Eigen::Vector3f& v1,
+	const Eigen::Vector3f& v2,
+	const float closestDist,
+	float& distance)
+{
+	const int kx = ray.kx, ky = ray.ky, kz = ray.kz;
+	const float az = v0[kz] - ray.origin[kz];
+	const float bz = v1[kz] - ray.origin[kz];
+	const float cz = v2[kz] - ray.origin[kz];
+	const float ax = (v0[kx] - ray.origin[kx]) - ray.sx * az;
+	const float ay = (v0[ky] - ray.origin[ky]) - ray.sy * az;
+	const float bx = (v1[kx] - ray.origin[kx]) - ray.sx * bz;
+	const float by = (v1[ky] - ray.origin[ky]) - ray.sy * bz;
+	const float cx = (v2[kx] - ray.origin[kx]) - ray.sx * cz;
+	const float cy = (v2[ky] - ray.origin[ky]) - ray.sy * cz;
+
+	float u = cx * by - cy * bx;
+	float v = ax * cy - ay * cx;
+	float w = bx * ay - by * ax;
+	if (u == 0.f || v == 0.f || w == 0.f)
+	{
+		u = (float)((double)cx * (double)by - (double)cy * (double)bx);
+		v = (float)((double)ax * (double)cy - (double)ay * (double)cx);
+		w = (float)((double)bx * (double)ay - (double)by * (double)ax);
+	}
+
+	// Outside if the edges don't all agree. Either sign will do,
+	// so triangles can be hit from both sides.
+	if ((u < 0.f || v < 0.f || w < 0.f) && (u > 0.f || v > 0.f || w > 0.f))
+	{
+		return false;
+	}
+	const float det = u + v + w;
+	if (det == 0.f)
+	{
+		return false;
+	}
+
+	const float t = (u * (ray.sz * az) + v * (ray.sz * bz) + w * (ray.sz * cz)) / det;
+	if (t > (float)EPSILON && t <= closestDist)
+	{
+		distance = t;
+		return true;
+	}
+	return false;
+}
+
+/*
+	A read only snapshot of a Scene, built once after the scene is read in.
+
+	Shapes are flattened into one contiguous array per type, so the hot
+	loop walks plain structs instead of chasing Shape pointers through
+	virtual calls. Spheres go in a BVH; planes are infinite, so they're
+	kept outside it and tested on every ray.
+
+	Triangles from every mesh share one vertex array, and get a BVH of
+	their own. Keeping them apart from the spheres means neither type
+	needs a branch in the middle of its traversal loop.
+
+	Everything that renders borrows this by const reference. Nothing in
+	it allocates once it is built, so tracing a ray costs no heap traffic.
+
+	The arrays are either built here, from a Scene, or borrowed from
+	somewhere else, like a memory mapped scene file (see SceneFile.h).
+	Either way, rendering reads them through the same views.
+*/
+class CompiledScene
+{
+public:
+	CompiledScene() {};
+	CompiledScene(Scene& scene);
+	~CompiledScene() {};
+
+	// The views point into this object, so it can't be copied
+	CompiledScene(const CompiledScene&) = delete;
+	CompiledScene& operator=(const CompiledScene&) = delete;
+
+	// Flatten scene into this, replacing whatever was here
+	void Compile(Scene& scene);
+
+	// Shapes and lights add themselves through these when compiled
+	void AddSphere(const SphereData& sphere) { ownedSpheres.push_back(sphere); UpdateViews(); };
+	void AddPlane(const PlaneData& plane) { ownedPlanes.push_back(plane); UpdateViews(); };
+	void AddLight(const LightData& light) { ownedLights.push_back(light); UpdateViews(); };
+	// indices holds three per triangle, into vertices
+	void AddMesh(
+		const std::vector<Eigen::Vector3f>& vertices,
+		const std::vector<uint32_t>& indices,
+		const MeshData& mesh);
+	void SetBackground(const Eigen::Vector3f& colour) { background = colour; };
+
+	// Build the acceleration structure. Call once all primitives are added.
+	void Finalise();
+
+	// Move a sphere or a light, for animation. Borrowed arrays are
+	// copied the first time, since they can't be written to. Once
+	// everything has moved, call RefitBVH before tracing any more rays.
+	void SetSphereCentre(const int sphere, const Eigen::Vector3f& centre);
+	void SetLightPosition(const int light, const Eigen::Vector3f& position);
+
+	// Fit the spheres' BVH to where they are now. The tree is only built
+	// again if refitting has left it BVH_REFIT_MAX_COST_GROWTH times as
+	// costly as when it was built. Says whether it was.
+	bool RefitBVH();
+
+	// Use arrays, and a BVH over the spheres, that live somewhere else.
+	// owner is kept alive for as long as this scene is.
+	void Borrow(
+		const ArrayView<SphereData>& spheres,
+		const ArrayView<PlaneData>& planes,
+		const ArrayView<LightData>& lights,
+		const ArrayView<BVHNode>& bvhNodes,
+		const ArrayView<int>& bvhIndices,
+		const int bvhDepth,
+		const std::shared_ptr<const void>& owner);
+
+	// The same for triangles. Call after Borrow, whose owner keeps these alive too.
+	void BorrowTriangles(
+		const ArrayView<Eigen::Vector3f>& vertices,
+		const ArrayView<TriangleData>& triangles,
+		const ArrayView<MeshData>& meshes,
+		const ArrayView<BVHNode>& bvhNodes,
+		const ArrayView<int>& bvhIndices,
+		const int bvhDepth);
+
+	// Find the closest primitive hit that is nearer than closestDist.
+	// On a hit, closestDist and hit are filled in.
+	bool Intersect(
+		const Eigen::Vector3f& origin,
+		const Eigen::Vector3f& direction,
+		float& closestDist,
+		HitRecord& hit) const;
+
+	// The same search, but only giving back the key of the closest
+	// primitive, for callers that fill in the hit later or not at all.
+	// closestKey must start as NO_PRIMITIVE_KEY.
+	bool FindClosest(
+		const Eigen::Vector3f& origin,
+		const Eigen::Vector3f& direction,
+		float& closestDist,
+		int& closestKey) const;
+
+	// Is anything in the way along the ray, closer than maxDist?
+	// Stops at the first thing found, so it's much cheaper than
+	// FindClosest. For shadow rays.
+	bool IsOccluded(
+		const Eigen::Vector3f& origin,
+		const Eigen::Vector3f& direction,
+		const float maxDist) const;
+
+	// Just the triangles part of FindClosest
+	bool FindClosestTriangle(
+		const Eigen::Vector3f& origin,
+		const Eigen::Vector3f& direction,
+		float& closestDist,
+		int& closestKey) const;
+
+	ArrayView<SphereData> GetSpheres() const { return spheres; };
+	ArrayView<PlaneData> GetPlanes() const { return planes; };
+	ArrayView<LightData> GetLights() const { return lights; };
+	const Eigen::Vector3f& GetBackground() const { return background; };
+	const BVH& GetBVH() const { return bvh; };
+	ArrayView<Eigen::Vector3f> GetVertices() const { return vertices; };
+	ArrayView<TriangleData> GetTriangles() const { return triangles; };
+	ArrayView<MeshData> GetMeshes() const { return meshes; };
+	const BVH& GetTriangleBVH() const { return triangleBVH; };
+
+	// FNV-1a over every primitive and light, for telling whether a file
+	// made from a scene was made from this one
+	uint64_t GetHash() const;
+
+	// Photon maps for indirect light, if any were made. They aren't owned
+	// here, and have to outlive the scene or be taken away first.
+	void SetPhotonMaps(const PhotonMaps* maps) { photonMaps = maps; };
+	const PhotonMaps* GetPhotonMaps() const { return photonMaps; };
+
+	// Illumination maps for indirect light, on the same terms. Photon
+	// maps take over from these if there are both.
+	void SetIlluminationMaps(const IlluminationMaps* maps) { illuminationMaps = maps; };
+	const IlluminationMaps* GetIlluminationMaps() const { return illuminationMaps; };
+
+	// Fill in the shading data for a hit whose type, index and distance are known
+	void CompleteHit(
+		const Eigen::Vector3f& origin,
+		const Eigen::Vector3f& direction,
+		HitRecord& hit) const;
+
+private:
+	void UpdateViews();
+	// Every sphere's box, for building or refitting the BVH
+	void GetSphereBounds(std::vector<AABB>& bounds) const;
+
+	std::vector<SphereData> ownedSpheres;
+	std::vector<PlaneData> ownedPlanes;
+	std::vector<LightData> ownedLights;
+	std::vector<Eigen::Vector3f> ownedVertices;
+	std::vector<TriangleData> ownedTriangles;
+	std::vector<MeshData> ownedMeshes;
+	std::shared_ptr<const void> borrowedFrom;
+
+	ArrayView<SphereData> spheres;
+	ArrayView<PlaneData> planes;
+	ArrayView<LightData> lights;
+	ArrayView<Eigen::Vector3f> vertices;
+	ArrayView<TriangleData> triangles;
+	ArrayView<MeshData> meshes;
+	Eigen::Vector3f background = Eigen::Vector3f(0.1f, 0.1f, 0.1f);
+
+	BVH bvh;
+	BVH triangleBVH;
+
+	const PhotonMaps* photonMaps = nullptr;
+	const IlluminationMaps* illuminationMaps = nullptr;
+};
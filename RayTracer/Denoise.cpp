@@ -0,0 +1,439 @@
+#include "Denoise.h"
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <memory>
+
+#include "CompiledScene.h"
+#include "Render.h"
+#include "Sampler.h"
+#include "Scheduler.h"
+#include "Stats.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RT_SSE2 1
+#include <emmintrin.h>
+#else
+#define RT_SSE2 0
+#endif
+
+using namespace Eigen;
+using namespace std;
+
+// The B3 spline, one tap each side of the middle and then two
+static const float filterKernel[5] = { 1.f / 16.f, 1.f / 4.f, 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+
+// Depths are never taken to be nearer than this, to keep 1 / depth finite
+#define DENOISE_MIN_DEPTH 1e-3f
+
+//-----------------------------------------------------------
+void RenderAOVs(
+	const CompiledScene& scene,
+	const Params& params,
+	WorkStealingPool& pool,
+	const vector<int>* sampleCounts,
+	AOVBuffers& aovs)
+{
+	const unique_ptr<Sampler> sampler = MakeSampler(params.samplerType, params.seed);
+	const PlaneFormat format = params.halfAOVs ? PLANE_HALF : PLANE_FLOAT;
+	aovs.albedo.Resize(params.width, params.height, 3, format);
+	aovs.normal.Resize(params.width, params.height, 3, format);
+	aovs.depth.Resize(params.width, params.height, 1, format);
+
+	const int numBands = (params.height + DENOISE_ROWS - 1) / DENOISE_ROWS;
+	pool.Run(numBands, [&](int band, [[maybe_unused]] int thread)
+	{
+		const int endRow = min((band + 1) * DENOISE_ROWS, params.height);
+		for (int h = band * DENOISE_ROWS; h < endRow; ++h)
+		{
+			for (int w = 0; w < params.width; ++w)
+			{
+				const int i = w + h * params.width;
+				const int wanted = sampleCounts ? (*sampleCounts)[i] : params.samplesPerPixel;
+				const int numSamples = max(1, min(wanted, DENOISE_MAX_GUIDE_SAMPLES));
+
+				Vector3f albedo = Vector3f::Zero();
+				Vector3f normal = Vector3f::Zero();
+				float depth = 0.f;
+				for (int sample = 0; sample < numSamples; ++sample)
+				{
+					// The camera sits at the origin
+					const Vector3f ray = GetPrimaryRay(params, *sampler, w, h, sample);
+					float closestDist = MAX_SCENE_DEPTH;
+					HitRecord hit;
+					if (scene.Intersect(Vector3f::Zero(), ray, closestDist, hit))
+					{
+						albedo += hit.colour;
+						normal += hit.normal;
+						depth += hit.distance;
+					}
+					else
+					{
+						albedo += scene.GetBackground();
+						depth += MAX_SCENE_DEPTH;
+					}
+				}
+
+				aovs.albedo.Set(i, albedo / (float)numSamples);
+				aovs.normal.Set(i, normal / (float)numSamples);
+				aovs.depth.SetValue(i, 0, depth / (float)numSamples);
+			}
+		}
+	});
+}
+
+//-----------------------------------------------------------
+/*
+	e^x, for x <= 0, to about 1e-7 relative, and exactly 1 at 0.
+
+	Worked out as 2^i * 2^f, with i a whole number going into the
+	exponent bits and a polynomial for 2^f. Anything below 2^-126 comes
+	out as 2^-126, which is as good as nothing for a filter weight.
+*/
+#define FAST_EXP_LOG2E 1.44269504f
+#define FAST_EXP_C1 0.69315308f
+#define FAST_EXP_C2 0.24015361f
+#define FAST_EXP_C3 0.05582632f
+#define FAST_EXP_C4 0.00898934f
+#define FAST_EXP_C5 0.00187757f
+
+static inline float FastExp(const float x)
+{
+	const float t = max(x * FAST_EXP_LOG2E, -126.f);
+	// Round towards minus infinity: truncate, then step down where that went up
+	int i = (int)t;
+	if ((float)i > t)
+	{
+		--i;
+	}
+	const float f = t - (float)i;
+
+	float p = FAST_EXP_C5;
+	p = p * f + FAST_EXP_C4;
+	p = p * f + FAST_EXP_C3;
+	p = p * f + FAST_EXP_C2;
+	p = p * f + FAST_EXP_C1;
+	p = p * f + 1.f;
+
+	const uint32_t bits = (uint32_t)(i + 127) << 23;
+	float scale;
+	memcpy(&scale, &bits, sizeof(scale));
+	return p * scale;
+}
+
+#if RT_SSE2
+// The same as FastExp, four at a time
+static inline __m128 FastExp4(const __m128 x)
+{
+	const __m128 t = _mm_max_ps(_mm_mul_ps(x, _mm_set1_ps(FAST_EXP_LOG2E)), _mm_set1_ps(-126.f));
+	__m128i i = _mm_cvttps_epi32(t);
+	i = _mm_add_epi32(i, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(i), t)));
+	const __m128 f = _mm_sub_ps(t, _mm_cvtepi32_ps(i));
+
+	__m128 p = _mm_set1_ps(FAST_EXP_C5);
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(FAST_EXP_C4));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(FAST_EXP_C3));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(FAST_EXP_C2));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(FAST_EXP_C1));
+	p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.f));
+
+	const __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(i, _mm_set1_epi32(127)), 23));
+	return _mm_mul_ps(p, scale);
+}
+#endif
+
+//-----------------------------------------------------------
+/*
+	One row of what a pass of the filter reads, as rows of floats, one
+	per channel, starting from the row's first pixel. inverseDepth is
+	only there for the row being filtered.
+*/
+struct FilterPlanes
+{
+	const float* colour[3];
+	const float* albedo[3];
+	const float* normal[3];
+	const float* depth;
+	const float* inverseDepth;
+};
+
+// One over each sigma squared, for the pass being run
+struct FilterSigmas
+{
+	float colour;
+	float albedo;
+	float normal;
+	float depth;
+};
+
+// The sum of the squared differences of three planes between p in a and q in b
+static inline float SquaredDistance(const float* const a[3], const int p, const float* const b[3], const int q)
+{
+	const float d0 = a[0][p] - b[0][q];
+	const float d1 = a[1][p] - b[1][q];
+	const float d2 = a[2][p] - b[2][q];
+	return d0 * d0 + d1 * d1 + d2 * d2;
+}
+
+/*
+	Add pixel q of a neighbouring row into the sums for pixel p of the
+	row being filtered. This is the version everything else has to
+	match, sum for sum.
+*/
+static inline void FilterTap(
+	const FilterPlanes& centre,
+	const FilterPlanes& neighbour,
+	const FilterSigmas& sigmas,
+	const float weight,
+	const int p,
+	const int q,
+	float* const sums[4])
+{
+	const float dz = (centre.depth[p] - neighbour.depth[q]) * centre.inverseDepth[p];
+	const float distance = SquaredDistance(centre.colour, p, neighbour.colour, q) * sigmas.colour
+		+ SquaredDistance(centre.albedo, p, neighbour.albedo, q) * sigmas.albedo
+		+ SquaredDistance(centre.normal, p, neighbour.normal, q) * sigmas.normal
+		+ dz * dz * sigmas.depth;
+	const float w = weight * FastExp(-distance);
+
+	sums[0][p] += w * neighbour.colour[0][q];
+	sums[1][p] += w * neighbour.colour[1][q];
+	sums[2][p] += w * neighbour.colour[2][q];
+	sums[3][p] += w;
+}
+
+#if RT_SSE2
+static inline __m128 SquaredDistance4(const float* const a[3], const int p, const float* const b[3], const int q)
+{
+	const __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a[0] + p), _mm_loadu_ps(b[0] + q));
+	const __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a[1] + p), _mm_loadu_ps(b[1] + q));
+	const __m128 d2 = _mm_sub_ps(_mm_loadu_ps(a[2] + p), _mm_loadu_ps(b[2] + q));
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(d0, d0), _mm_mul_ps(d1, d1)), _mm_mul_ps(d2, d2));
+}
+
+// FilterTap for pixels p to p + 3
+static inline void FilterTap4(
+	const FilterPlanes& centre,
+	const FilterPlanes& neighbour,
+	const FilterSigmas& sigmas,
+	const float weight,
+	const int p,
+	const int q,
+	float* const sums[4])
+{
+	const __m128 dz = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(centre.depth + p), _mm_loadu_ps(neighbour.depth + q)), _mm_loadu_ps(centre.inverseDepth + p));
+	__m128 distance = _mm_mul_ps(SquaredDistance4(centre.colour, p, neighbour.colour, q), _mm_set1_ps(sigmas.colour));
+	distance = _mm_add_ps(distance, _mm_mul_ps(SquaredDistance4(centre.albedo, p, neighbour.albedo, q), _mm_set1_ps(sigmas.albedo)));
+	distance = _mm_add_ps(distance, _mm_mul_ps(SquaredDistance4(centre.normal, p, neighbour.normal, q), _mm_set1_ps(sigmas.normal)));
+	distance = _mm_add_ps(distance, _mm_mul_ps(_mm_mul_ps(dz, dz), _mm_set1_ps(sigmas.depth)));
+	const __m128 w = _mm_mul_ps(_mm_set1_ps(weight), FastExp4(_mm_sub_ps(_mm_setzero_ps(), distance)));
+
+	for (int c = 0; c < 3; ++c)
+	{
+		const __m128 sum = _mm_add_ps(_mm_loadu_ps(sums[c] + p), _mm_mul_ps(w, _mm_loadu_ps(neighbour.colour[c] + q)));
+		_mm_storeu_ps(sums[c] + p, sum);
+	}
+	_mm_storeu_ps(sums[3] + p, _mm_add_ps(_mm_loadu_ps(sums[3] + p), w));
+}
+#endif
+
+// Floats of scratch FilterRow needs per pixel of a row: the sums, the
+// inverse depths, and the guides of the five rows the taps are on
+#define DENOISE_SCRATCH_PER_PIXEL (4 + 1 + 5 * 7)
+
+/*
+	Filter row y of colour into out. The taps go round the outside, one
+	at a time, across the whole row, so the SIMD version can take
+	neighbouring pixels together. Taps that land off the image are left
+	out, and the weights that are left are normalised as usual.
+
+	Float guides are read where they are. Half ones are widened a row
+	at a time into scratch, so they never take more than the few rows
+	the taps are on as floats.
+*/
+static void FilterRow(
+	const FrameBuffer& colour,
+	const AOVBuffers& aovs,
+	const FilterSigmas& sigmas,
+	const int y,
+	const int step,
+	float* scratch,
+	FrameBuffer& out)
+{
+	const int width = colour.GetWidth();
+	const int height = colour.GetHeight();
+	float* const sums[4] = { scratch, scratch + width, scratch + 2 * width, scratch + 3 * width };
+	for (int c = 0; c < 4; ++c)
+	{
+		fill(sums[c], sums[c] + width, 0.f);
+	}
+	float* const inverseDepth = scratch + 4 * width;
+	float* guides = scratch + 5 * width;
+
+	FilterPlanes rows[5];
+	for (int ty = 0; ty < 5; ++ty)
+	{
+		const int yy = y + (ty - 2) * step;
+		if (yy < 0 || yy >= height)
+		{
+			continue;
+		}
+		for (int c = 0; c < 3; ++c)
+		{
+			rows[ty].colour[c] = colour.GetPlane(c) + (size_t)yy * width;
+			rows[ty].albedo[c] = aovs.albedo.GetRow(c, yy, guides + c * width);
+			rows[ty].normal[c] = aovs.normal.GetRow(c, yy, guides + (3 + c) * width);
+		}
+		rows[ty].depth = aovs.depth.GetRow(0, yy, guides + 6 * width);
+		guides += 7 * width;
+	}
+
+	FilterPlanes& centre = rows[2];
+	for (int x = 0; x < width; ++x)
+	{
+		inverseDepth[x] = 1.f / max(centre.depth[x], DENOISE_MIN_DEPTH);
+	}
+	centre.inverseDepth = inverseDepth;
+
+	for (int ty = 0; ty < 5; ++ty)
+	{
+		const int yy = y + (ty - 2) * step;
+		if (yy < 0 || yy >= height)
+		{
+			continue;
+		}
+
+		for (int tx = 0; tx < 5; ++tx)
+		{
+			const int offset = (tx - 2) * step;
+			const int startX = max(0, -offset);
+			const int endX = min(width, width - offset);
+			const float weight = filterKernel[ty] * filterKernel[tx];
+
+			int x = startX;
+#if RT_SSE2
+			for (; x + 4 <= endX; x += 4)
+			{
+				FilterTap4(centre, rows[ty], sigmas, weight, x, x + offset, sums);
+			}
+#endif
+			for (; x < endX; ++x)
+			{
+				FilterTap(centre, rows[ty], sigmas, weight, x, x + offset, sums);
+			}
+		}
+	}
+
+	// The middle tap always counts fully, so there's never nothing to divide by
+	for (int c = 0; c < 3; ++c)
+	{
+		float* outRow = out.GetPlane(c) + (size_t)y * width;
+		for (int x = 0; x < width; ++x)
+		{
+			outRow[x] = sums[c][x] / sums[3][x];
+		}
+	}
+}
+
+//-----------------------------------------------------------
+void DenoiseImage(
+	const AOVBuffers& aovs,
+	WorkStealingPool& pool,
+	FrameBuffer& image)
+{
+	// The passes go back and forth between the image and one more like it
+	const int width = image.GetWidth();
+	const int height = image.GetHeight();
+	FrameBuffer other(width, height);
+	FrameBuffer* source = &image;
+	FrameBuffer* target = &other;
+
+	// Each thread keeps its own scratch for the row it's on
+	vector<vector<float>> threadScratch(pool.GetNumThreads(), vector<float>(DENOISE_SCRATCH_PER_PIXEL * (size_t)width));
+	const int numBands = (height + DENOISE_ROWS - 1) / DENOISE_ROWS;
+
+	for (int pass = 0; pass < DENOISE_PASSES; ++pass)
+	{
+		const int step = 1 << pass;
+
+		// The colour sigma halves every pass, so later, wider passes only
+		// blur together what the earlier ones have already made alike
+		const float colourSigma = DENOISE_SIGMA_COLOUR / (float)step;
+		const float depthSigma = DENOISE_SIGMA_DEPTH * (float)step;
+		FilterSigmas sigmas;
+		sigmas.colour = 1.f / (colourSigma * colourSigma);
+		sigmas.albedo = 1.f / (DENOISE_SIGMA_ALBEDO * DENOISE_SIGMA_ALBEDO);
+		sigmas.normal = 1.f / (DENOISE_SIGMA_NORMAL * DENOISE_SIGMA_NORMAL);
+		sigmas.depth = 1.f / (depthSigma * depthSigma);
+
+		pool.Run(numBands, [&](int band, int thread)
+		{
+			const int endRow = min((band + 1) * DENOISE_ROWS, height);
+			for (int y = band * DENOISE_ROWS; y < endRow; ++y)
+			{
+				FilterRow(*source, aovs, sigmas, y, step, threadScratch[thread].data(), *target);
+			}
+		});
+		swap(source, target);
+	}
+
+	if (source != &image)
+	{
+		swap(image, other);
+	}
+}
+
+//-----------------------------------------------------------
+bool DenoiseFrame(
+	const CompiledScene& scene,
+	const Params& params,
+	WorkStealingPool& pool,
+	const vector<int>* sampleCounts,
+	FrameBuffer& frameBuffer)
+{
+	AOVBuffers aovs;
+	{
+		StatTimer timer(STAT_TIME_DENOISE);
+		const auto start = chrono::steady_clock::now();
+		RenderAOVs(scene, params, pool, sampleCounts, aovs);
+		const auto guided = chrono::steady_clock::now();
+		DenoiseImage(aovs, pool, frameBuffer);
+		const auto end = chrono::steady_clock::now();
+		cout << "Denoised in " << chrono::duration<double>(end - start).count() << "s ("
+			<< chrono::duration<double>(guided - start).count() << "s of that tracing guides)" << endl;
+	}
+
+	if (params.writeAOVs)
+	{
+		return WriteAOVs(aovs, params);
+	}
+	return true;
+}
+
+//-----------------------------------------------------------
+bool WriteAOVs(
+	const AOVBuffers& aovs,
+	const Params& params)
+{
+	// Normals go from [-1, 1] to [0, 1], and depths from nothing at the
+	// camera to white at MAX_SCENE_DEPTH
+	FrameBuffer image(aovs.normal.GetWidth(), aovs.normal.GetHeight());
+	for (size_t i = 0; i < image.GetNumPixels(); ++i)
+	{
+		image.Set(i, aovs.normal.Get(i) * 0.5f + Vector3f::Constant(0.5f));
+	}
+	if (!WriteImageToFile(aovs.albedo, params, AddFileSuffix(params.outputFile, "_albedo"))
+		|| !WriteImageToFile(image, params, AddFileSuffix(params.outputFile, "_normal")))
+	{
+		return false;
+	}
+
+	FrameBuffer depth(image.GetWidth(), image.GetHeight(), 1);
+	for (size_t i = 0; i < depth.GetNumPixels(); ++i)
+	{
+		depth.SetValue(i, 0, aovs.depth.GetValue(i, 0) / (float)MAX_SCENE_DEPTH);
+	}
+	return WriteImageToFile(depth, params, AddFileSuffix(params.outputFile, "_depth"));
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include <eigen3/Eigen/Dense>
+#include <vector>
+
+#include "FrameBuffer.h"
+
+class CompiledScene;
+class WorkStealingPool;
+struct Params;
+
+// Passes of the a-trous filter. Each reaches twice as far as the one
+// before, so five of them blur up to 2 * (1 + 2 + 4 + 8 + 16) = 62
+// pixels either side.
+#define DENOISE_PASSES 5
+// Rows of the image handed out per job
+#define DENOISE_ROWS 16
+// Most first hits averaged into a pixel's guides
+#define DENOISE_MAX_GUIDE_SAMPLES 16
+
+// How far apart two pixels' values can be before they stop being
+// blurred together: colours, in the units written out, albedos, the
+// length between unit normals, and depths as a fraction of the pixel's
+// depth per pixel apart. The colour one halves every pass.
+#define DENOISE_SIGMA_COLOUR 0.8f
+#define DENOISE_SIGMA_ALBEDO 0.1f
+#define DENOISE_SIGMA_NORMAL 0.3f
+#define DENOISE_SIGMA_DEPTH 0.02f
+
+/**********************************************/
+/*############## DENOISE CLASSES #############*/
+/**********************************************/
+
+/*
+	What the camera saw first through each pixel: the colour of the
+	surface, its normal and how far away it was, averaged over the
+	pixel's samples. Pixels that see nothing get the background colour,
+	a zero normal and a depth of MAX_SCENE_DEPTH.
+
+	None of it is noisy, so it shows the denoiser where the edges are
+	that it mustn't blur across. None of it needs much precision either,
+	so with halfAOVs it's kept as half floats.
+*/
+struct AOVBuffers
+{
+	FrameBuffer albedo;
+	FrameBuffer normal;
+	// One channel
+	FrameBuffer depth;
+};
+
+/*
+	Trace the first hits for every pixel, with the same sample positions
+	the render used. sampleCounts says how many samples each pixel took,
+	up to DENOISE_MAX_GUIDE_SAMPLES of which are used. Without it, each
+	pixel uses samplesPerPixel.
+*/
+void RenderAOVs(
+	const CompiledScene& scene,
+	const Params& params,
+	WorkStealingPool& pool,
+	const std::vector<int>* sampleCounts,
+	AOVBuffers& aovs);
+
+/*
+	Edge avoiding a-trous wavelet filter, after Dammertz et al., "Edge-
+	Avoiding A-Trous Wavelet Transform for fast Global Illumination
+	Filtering" (HPG 2010).
+
+	Each pass blurs with a 5x5 B3 spline kernel whose taps are spread
+	2^pass pixels apart, so a wide blur only takes 25 taps a pixel. Every
+	tap is weighted down by how different its colour, albedo, normal and
+	depth are from the pixel's, so blurring stops at edges in the guides
+	and in the colour.
+
+	The image is already planes of floats, so it's filtered where it is,
+	into one more image and back, and on x86 four pixels go through each
+	tap at once with SSE2. The leftovers go through a scalar version
+	doing exactly the same sums, so every pixel comes out the same
+	whichever path it took, and whatever the number of threads.
+*/
+void DenoiseImage(
+	const AOVBuffers& aovs,
+	WorkStealingPool& pool,
+	FrameBuffer& image);
+
+// Guides, then the filter, and the guides written out if they're asked
+// for. Run before the image is written.
+bool DenoiseFrame(
+	const CompiledScene& scene,
+	const Params& params,
+	WorkStealingPool& pool,
+	const std::vector<int>* sampleCounts,
+	FrameBuffer& frameBuffer);
+
+// Write the guides next to the output, as out_albedo, out_normal and out_depth
+bool WriteAOVs(
+	const AOVBuffers& aovs,
+	const Params& params);
@@ -0,0 +1,493 @@
+#include "Distributed.h"
+#include <iostream>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+#include "CompiledScene.h"
+#include "Render.h"
+#include "Sampler.h"
+#include "Scheduler.h"
+#include "Denoise.h"
+#include "Stats.h"
+
+using namespace Eigen;
+using namespace std;
+
+static int GetNumBands(const Params& params)
+{
+	return (params.height + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+#ifdef _WIN32
+
+bool StartWorkers(const Params&, const int, char**, vector<WorkerLink>&)
+{
+	cout << "ERROR: worker processes aren't supported on Windows yet" << endl;
+	return false;
+}
+
+void StopWorkers(vector<WorkerLink>&) {}
+
+bool RenderBands(const Params&, vector<WorkerLink>&, FrameBuffer&, vector<int>&)
+{
+	return false;
+}
+
+bool RunWorker(const CompiledScene&, const Params&, WorkStealingPool&, const int, const int)
+{
+	cout << "ERROR: worker processes aren't supported on Windows yet" << endl;
+	return false;
+}
+
+#else
+
+// Read or write all of it, or fail if the other end has gone
+static bool ReadAll(const int fd, void* data, size_t bytes)
+{
+	char* next = (char*)data;
+	while (bytes > 0)
+	{
+		const ssize_t n = read(fd, next, bytes);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			return false;
+		}
+		next += n;
+		bytes -= (size_t)n;
+	}
+	return true;
+}
+
+static bool WriteAll(const int fd, const void* data, size_t bytes)
+{
+	const char* next = (const char*)data;
+	while (bytes > 0)
+	{
+		const ssize_t n = write(fd, next, bytes);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			return false;
+		}
+		next += n;
+		bytes -= (size_t)n;
+	}
+	return true;
+}
+
+//-----------------------------------------------------------
+static void CloseLink(WorkerLink& worker)
+{
+	if (worker.toWorker >= 0)
+	{
+		close(worker.toWorker);
+	}
+	if (worker.fromWorker >= 0)
+	{
+		close(worker.fromWorker);
+	}
+	worker.toWorker = -1;
+	worker.fromWorker = -1;
+}
+
+// Run command with its stdin and stdout piped back here
+static bool SpawnWorker(const vector<string>& command, WorkerLink& worker)
+{
+	// Made before forking. The render threads may be running, so the child
+	// mustn't allocate: another thread could have held the heap's lock
+	// when it was forked, and it never lets go in the child.
+	vector<char*> argv;
+	for (const string& arg : command)
+	{
+		argv.push_back(const_cast<char*>(arg.c_str()));
+	}
+	argv.push_back(nullptr);
+
+	int toWorker[2];
+	int fromWorker[2];
+	if (pipe(toWorker) != 0)
+	{
+		return false;
+	}
+	if (pipe(fromWorker) != 0)
+	{
+		close(toWorker[0]);
+		close(toWorker[1]);
+		return false;
+	}
+	// Workers started after this one mustn't hold its pipes open, or it
+	// would never be seen to die
+	for (const int fd : { toWorker[0], toWorker[1], fromWorker[0], fromWorker[1] })
+	{
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	}
+
+	const pid_t pid = fork();
+	if (pid == 0)
+	{
+		dup2(toWorker[0], 0);
+		dup2(fromWorker[1], 1);
+		execvp(argv[0], argv.data());
+		_exit(127);
+	}
+
+	close(toWorker[0]);
+	close(fromWorker[1]);
+	worker.toWorker = toWorker[1];
+	worker.fromWorker = fromWorker[0];
+	if (pid < 0)
+	{
+		CloseLink(worker);
+		return false;
+	}
+	worker.pid = (int)pid;
+	return true;
+}
+
+bool StartWorkers(
+	const Params& params,
+	const int argc,
+	char** argv,
+	vector<WorkerLink>& workers)
+{
+	// Workers render with everything the coordinator was given, apart from
+	// what makes it the coordinator, and the stats file it writes
+	vector<string> args;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-workers") == 0 || strcmp(argv[i], "-worker-cmd") == 0 || strcmp(argv[i], "-stats") == 0)
+		{
+			++i;
+			continue;
+		}
+		args.push_back(argv[i]);
+	}
+	args.push_back("-worker");
+
+	// A dead worker's pipe gives an error to write to, rather than a signal
+	signal(SIGPIPE, SIG_IGN);
+
+	const int hardwareThreads = max(1, (int)thread::hardware_concurrency());
+	const int localThreads = params.numThreads > 0 ? params.numThreads : max(1, hardwareThreads / max(1, params.numWorkers));
+	for (int w = 0; w < params.numWorkers; ++w)
+	{
+		vector<string> command = { argv[0] };
+		command.insert(command.end(), args.begin(), args.end());
+		command.push_back("-t");
+		command.push_back(to_string(localThreads));
+
+		WorkerLink worker;
+		worker.name = "local worker " + to_string(w);
+		if (!SpawnWorker(command, worker))
+		{
+			cout << "ERROR: could not start " << worker.name << ": " << strerror(errno) << endl;
+			StopWorkers(workers);
+			return false;
+		}
+		workers.push_back(worker);
+	}
+
+	for (const string& workerCommand : params.workerCommands)
+	{
+		// Quoted for the shell, which may be a shell on another machine
+		string line = workerCommand;
+		for (const string& arg : args)
+		{
+			string quoted = "'";
+			for (const char c : arg)
+			{
+				quoted += c == '\'' ? string("'\\''") : string(1, c);
+			}
+			line += " " + quoted + "'";
+		}
+
+		WorkerLink worker;
+		worker.name = "\"" + workerCommand + "\"";
+		if (!SpawnWorker({ "/bin/sh", "-c", line }, worker))
+		{
+			cout << "ERROR: could not start " << worker.name << ": " << strerror(errno) << endl;
+			StopWorkers(workers);
+			return false;
+		}
+		workers.push_back(worker);
+	}
+	return true;
+}
+
+void StopWorkers(vector<WorkerLink>& workers)
+{
+	const int32_t quit = DISTRIBUTED_QUIT;
+	for (WorkerLink& worker : workers)
+	{
+		if (worker.toWorker >= 0)
+		{
+			WriteAll(worker.toWorker, &quit, sizeof(quit));
+		}
+		CloseLink(worker);
+	}
+	for (WorkerLink& worker : workers)
+	{
+		if (worker.pid > 0)
+		{
+			waitpid(worker.pid, nullptr, 0);
+			worker.pid = -1;
+		}
+	}
+}
+
+//-----------------------------------------------------------
+bool RenderBands(
+	const Params& params,
+	vector<WorkerLink>& workers,
+	FrameBuffer& frameBuffer,
+	vector<int>& sampleCounts)
+{
+	signal(SIGPIPE, SIG_IGN);
+
+	const int numBands = GetNumBands(params);
+	deque<int> queued;
+	for (int band = 0; band < numBands; ++band)
+	{
+		queued.push_back(band);
+	}
+	// Bands sent to each worker and not back yet, in the order they were sent
+	vector<deque<int>> inFlight(workers.size());
+
+	// A dead worker's bands go to the front, so they're not left till last
+	auto fail = [&](const size_t w, const char* reason)
+	{
+		WorkerLink& worker = workers[w];
+		cout << worker.name << " " << reason << ", handing its " << inFlight[w].size() << " bands to the others" << endl;
+		queued.insert(queued.begin(), inFlight[w].begin(), inFlight[w].end());
+		inFlight[w].clear();
+		worker.died = true;
+		CloseLink(worker);
+	};
+
+	int bandsLeft = numBands;
+	while (bandsLeft > 0)
+	{
+		// Keep every worker that's still going topped up
+		for (size_t w = 0; w < workers.size(); ++w)
+		{
+			while (!workers[w].died && inFlight[w].size() < DISTRIBUTED_BANDS_IN_FLIGHT && !queued.empty())
+			{
+				const int32_t band = queued.front();
+				queued.pop_front();
+				inFlight[w].push_back(band);
+				if (!WriteAll(workers[w].toWorker, &band, sizeof(band)))
+				{
+					fail(w, "has stopped reading");
+				}
+			}
+		}
+
+		vector<pollfd> polls;
+		vector<size_t> polled;
+		for (size_t w = 0; w < workers.size(); ++w)
+		{
+			if (!workers[w].died && !inFlight[w].empty())
+			{
+				polls.push_back({ workers[w].fromWorker, POLLIN, 0 });
+				polled.push_back(w);
+			}
+		}
+		if (polls.empty())
+		{
+			cout << "ERROR: every worker has died, with " << bandsLeft << " bands still to render" << endl;
+			return false;
+		}
+		if (poll(polls.data(), polls.size(), -1) < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			cout << "ERROR: could not wait for the workers: " << strerror(errno) << endl;
+			return false;
+		}
+
+		for (size_t p = 0; p < polls.size(); ++p)
+		{
+			if (polls[p].revents == 0)
+			{
+				continue;
+			}
+			const size_t w = polled[p];
+			DistributedBandHeader header;
+			if (!ReadAll(workers[w].fromWorker, &header, sizeof(header)))
+			{
+				fail(w, "has died");
+				continue;
+			}
+			const int expectedRows = min(TILE_SIZE, params.height - inFlight[w].front() * TILE_SIZE);
+			if (header.magic != DISTRIBUTED_MAGIC || header.band != inFlight[w].front() || header.width != params.width
+				|| header.startRow != header.band * TILE_SIZE || header.numRows != expectedRows)
+			{
+				fail(w, "sent back a band it wasn't asked for");
+				continue;
+			}
+
+			// The band's rows are contiguous in each plane, so they're read straight in
+			const size_t numPixels = (size_t)header.width * header.numRows;
+			const size_t first = (size_t)header.startRow * params.width;
+			if (!ReadAll(workers[w].fromWorker, frameBuffer.GetPlane(0) + first, numPixels * sizeof(float))
+				|| !ReadAll(workers[w].fromWorker, frameBuffer.GetPlane(1) + first, numPixels * sizeof(float))
+				|| !ReadAll(workers[w].fromWorker, frameBuffer.GetPlane(2) + first, numPixels * sizeof(float))
+				|| !ReadAll(workers[w].fromWorker, sampleCounts.data() + first, numPixels * sizeof(int32_t)))
+			{
+				fail(w, "died part way through a band");
+				continue;
+			}
+			inFlight[w].pop_front();
+			++workers[w].bandsRendered;
+			--bandsLeft;
+		}
+	}
+	return true;
+}
+
+//-----------------------------------------------------------
+bool RunWorker(
+	const CompiledScene& scene,
+	const Params& params,
+	WorkStealingPool& pool,
+	const int input,
+	const int output)
+{
+	const unique_ptr<Sampler> sampler = MakeSampler(params.samplerType, params.seed);
+	const int tilesX = (params.width + TILE_SIZE - 1) / TILE_SIZE;
+	const int numBands = GetNumBands(params);
+
+	// The tiles write into a whole image, but only a band of it is used at a time
+	FrameBuffer frameBuffer(params.width, params.height);
+	vector<int> sampleCounts(params.width * params.height, 0);
+
+	int32_t band = DISTRIBUTED_QUIT;
+	while (ReadAll(input, &band, sizeof(band)) && band != DISTRIBUTED_QUIT)
+	{
+		if (band < 0 || band >= numBands)
+		{
+			cerr << "ERROR: worker was asked for band " << band << ", but there are only " << numBands << endl;
+			return false;
+		}
+
+		{
+			StatTimer timer(STAT_TIME_RENDER);
+			pool.Run(tilesX, [&](int job, [[maybe_unused]] int thread)
+			{
+				const int tile = band * tilesX + job;
+				if (params.usePackets)
+				{
+					RenderTilePackets(scene, params, *sampler, tile, frameBuffer, &sampleCounts);
+				}
+				else
+				{
+					RenderTile(scene, params, *sampler, tile, frameBuffer, &sampleCounts);
+				}
+			});
+		}
+
+		DistributedBandHeader header;
+		header.magic = DISTRIBUTED_MAGIC;
+		header.band = band;
+		header.startRow = band * TILE_SIZE;
+		header.numRows = min(TILE_SIZE, params.height - header.startRow);
+		header.width = params.width;
+
+		const size_t numPixels = (size_t)header.width * header.numRows;
+		const size_t first = (size_t)header.startRow * params.width;
+		if (!WriteAll(output, &header, sizeof(header))
+			|| !WriteAll(output, frameBuffer.GetPlane(0) + first, numPixels * sizeof(float))
+			|| !WriteAll(output, frameBuffer.GetPlane(1) + first, numPixels * sizeof(float))
+			|| !WriteAll(output, frameBuffer.GetPlane(2) + first, numPixels * sizeof(float))
+			|| !WriteAll(output, sampleCounts.data() + first, numPixels * sizeof(int32_t)))
+		{
+			// The coordinator has gone, so there's nothing left to do
+			return false;
+		}
+	}
+	return true;
+}
+
+#endif
+
+//-----------------------------------------------------------
+bool RenderDistributed(
+	const CompiledScene& scene,
+	const Params& params,
+	WorkStealingPool& pool,
+	const int argc,
+	char** argv)
+{
+	if (params.sppmPasses > 0 || !params.animationFile.empty())
+	{
+		cout << "ERROR: SPPM and animations can't be rendered on workers yet" << endl;
+		return false;
+	}
+	if (params.useWavefront || params.costMaps || params.streamOutput)
+	{
+		cout << "Workers render tiles a pixel at a time and the image is written at the end, so -wavefront, -cost and -stream are ignored" << endl;
+	}
+	if (!params.checkpointFile.empty())
+	{
+		cout << "Renders on workers aren't checkpointed" << endl;
+	}
+
+	vector<WorkerLink> workers;
+	if (!StartWorkers(params, argc, argv, workers))
+	{
+		return false;
+	}
+	cout << "Rendering " << GetNumBands(params) << " bands on " << workers.size() << " workers" << endl;
+
+	FrameBuffer frameBuffer(params.width, params.height);
+	vector<int> sampleCounts(params.width * params.height, 0);
+	const auto start = chrono::steady_clock::now();
+	bool rendered = false;
+	{
+		StatTimer timer(STAT_TIME_RENDER);
+		rendered = RenderBands(params, workers, frameBuffer, sampleCounts);
+	}
+	StopWorkers(workers);
+	if (!rendered)
+	{
+		return false;
+	}
+
+	const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	cout << "Rendered in " << seconds << "s" << endl;
+	for (const WorkerLink& worker : workers)
+	{
+		cout << "  " << worker.name << ": " << worker.bandsRendered << " bands" << (worker.died ? " (died)" : "") << endl;
+	}
+
+	if (params.denoise && !DenoiseFrame(scene, params, pool, &sampleCounts, frameBuffer))
+	{
+		return false;
+	}
+	if (!WriteImageToFile(frameBuffer, params, params.outputFile))
+	{
+		return false;
+	}
+	return !params.adaptive || WriteSampleCountMap(sampleCounts, params);
+}
@@ -0,0 +1,120 @@
+#pragma once
+#include <eigen3/Eigen/Dense>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "FrameBuffer.h"
+
+class CompiledScene;
+class WorkStealingPool;
+struct Params;
+
+// Bands each worker is sent before it has finished the first, so it
+// never sits idle waiting for the next one
+#define DISTRIBUTED_BANDS_IN_FLIGHT 2
+// Starts every band a worker sends back, so a confused pipe is caught.
+// Changes whenever what follows it does, so mismatched workers are too.
+#define DISTRIBUTED_MAGIC 0x324e4252
+
+/**********************************************/
+/*############ DISTRIBUTED CLASSES ###########*/
+/**********************************************/
+
+/*
+	Rendering across worker processes.
+
+	The coordinator cuts the image into bands, each a row of tiles, and
+	hands them out to workers a few at a time. Each worker is another
+	raytracer, started with -worker and the same arguments, so it loads
+	the scene and traces any photon maps itself. It reads band numbers
+	from stdin and writes back the float colours and sample counts of
+	each band it renders, which the coordinator copies into the frame
+	buffer. Each pixel's samples don't depend on who renders it, so the
+	image comes out the same as rendering it in one process.
+
+	Workers only talk over their stdin and stdout, so a worker on another
+	machine is just a command that runs one there, such as through ssh.
+	Floats and ints go over as they are in memory, so every machine has
+	to be the same endianness.
+
+	If a worker dies, or sends back something that doesn't make sense,
+	its bands go back on the queue for the others.
+*/
+
+// Sent to a worker: the band to render next, or this to stop
+#define DISTRIBUTED_QUIT -1
+
+// Sent back ahead of each band: the band's rows of the frame buffer's
+// red plane as width * numRows floats, then its green and blue ones,
+// then width * numRows int sample counts
+struct DistributedBandHeader
+{
+	uint32_t magic;
+	int32_t band;
+	int32_t startRow;
+	int32_t numRows;
+	int32_t width;
+};
+
+// The coordinator's ends of the pipes to one worker
+struct WorkerLink
+{
+	int toWorker = -1;
+	int fromWorker = -1;
+	// -1 for a worker that isn't a process of its own
+	int pid = -1;
+	std::string name;
+
+	// Filled in by RenderBands
+	int bandsRendered = 0;
+	bool died = false;
+};
+
+/*
+	Start params.numWorkers copies of this program as workers, and one
+	more for each of params.workerCommands, run through the shell. They
+	get argv, less the coordinator's own arguments. Local workers share
+	out the hardware threads between them unless -t is given.
+*/
+bool StartWorkers(
+	const Params& params,
+	const int argc,
+	char** argv,
+	std::vector<WorkerLink>& workers);
+
+// Tell the workers that are still going to stop, and wait for them
+void StopWorkers(std::vector<WorkerLink>& workers);
+
+/*
+	Hand out every band of the image to the workers until they're all
+	back, and merge them into frameBuffer and sampleCounts. Only fails
+	when every worker has died with bands still to do.
+*/
+bool RenderBands(
+	const Params& params,
+	std::vector<WorkerLink>& workers,
+	FrameBuffer& frameBuffer,
+	std::vector<int>& sampleCounts);
+
+/*
+	Be a worker: render the bands read from input on the pool, and write
+	them to output, until told to quit or input is closed.
+*/
+bool RunWorker(
+	const CompiledScene& scene,
+	const Params& params,
+	WorkStealingPool& pool,
+	const int input,
+	const int output);
+
+/*
+	Render the scene on workers, then denoise it here if asked, and write
+	it out. The scene is only used here for the denoiser's guides.
+*/
+bool RenderDistributed(
+	const CompiledScene& scene,
+	const Params& params,
+	WorkStealingPool& pool,
+	const int argc,
+	char** argv);
@@ -0,0 +1,251 @@
+#include "FrameBuffer.h"
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <assert.h>
+
+using namespace Eigen;
+using namespace std;
+
+//-----------------------------------------------------------
+static atomic<size_t> imageMemoryUsed(0);
+static atomic<size_t> peakImageMemoryUsed(0);
+
+size_t GetImageMemoryUsed()
+{
+	return imageMemoryUsed.load();
+}
+
+size_t GetPeakImageMemoryUsed()
+{
+	return peakImageMemoryUsed.load();
+}
+
+void ResetPeakImageMemoryUsed()
+{
+	peakImageMemoryUsed = imageMemoryUsed.load();
+}
+
+void AddImageMemoryUsed(const ptrdiff_t bytes)
+{
+	const size_t used = imageMemoryUsed.fetch_add((size_t)bytes) + (size_t)bytes;
+	size_t peak = peakImageMemoryUsed.load();
+	while (used > peak && !peakImageMemoryUsed.compare_exchange_weak(peak, used))
+	{
+	}
+}
+
+//-----------------------------------------------------------
+uint16_t FloatToHalf(const float value)
+{
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	const uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+	const uint32_t magnitude = bits & 0x7fffffff;
+
+	// Infinity stays infinity, and NaN stays NaN
+	if (magnitude >= 0x7f800000)
+	{
+		return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+	}
+	// 65520 and up round past the biggest half, 65504
+	if (magnitude >= 0x477ff000)
+	{
+		return sign | 0x7c00;
+	}
+
+	// Below 2^-14 halves lose their implicit one, and go in steps of 2^-24.
+	// Half of 2^-24 or less rounds to nothing.
+	if (magnitude < 0x38800000)
+	{
+		if (magnitude <= 0x33000000)
+		{
+			return sign;
+		}
+		const uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+		const uint32_t shift = 126 - (magnitude >> 23);
+		uint32_t half = mantissa >> shift;
+		const uint32_t rest = mantissa & ((1u << shift) - 1);
+		const uint32_t halfway = 1u << (shift - 1);
+		if (rest > halfway || (rest == halfway && (half & 1)))
+		{
+			++half;
+		}
+		return sign | (uint16_t)half;
+	}
+
+	// Move the exponent's bias from 127 to 15, and drop 13 bits of mantissa.
+	// Rounding up can carry into the exponent, which is still right.
+	uint32_t half = (magnitude - 0x38000000) >> 13;
+	const uint32_t rest = magnitude & 0x1fff;
+	if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+	{
+		++half;
+	}
+	return sign | (uint16_t)half;
+}
+
+float HalfToFloat(const uint16_t half)
+{
+	const uint32_t sign = (uint32_t)(half & 0x8000) << 16;
+	const uint32_t exponent = (half >> 10) & 0x1f;
+	uint32_t mantissa = half & 0x3ff;
+
+	uint32_t bits;
+	if (exponent == 0x1f)
+	{
+		bits = sign | 0x7f800000 | (mantissa << 13);
+	}
+	else if (exponent != 0)
+	{
+		bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+	}
+	else if (mantissa == 0)
+	{
+		bits = sign;
+	}
+	else
+	{
+		// Shift the first one up to where the implicit one goes
+		uint32_t floatExponent = 113;
+		while ((mantissa & 0x400) == 0)
+		{
+			mantissa <<= 1;
+			--floatExponent;
+		}
+		bits = sign | (floatExponent << 23) | ((mantissa & 0x3ff) << 13);
+	}
+
+	float value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+void HalvesToFloats(const uint16_t* in, const int count, float* out)
+{
+	static const vector<float> table = []()
+	{
+		vector<float> values(65536);
+		for (size_t i = 0; i < values.size(); ++i)
+		{
+			values[i] = HalfToFloat((uint16_t)i);
+		}
+		return values;
+	}();
+
+	for (int i = 0; i < count; ++i)
+	{
+		out[i] = table[in[i]];
+	}
+}
+
+//-----------------------------------------------------------
+FrameBuffer::FrameBuffer(const int width, const int height, const int numChannels, const PlaneFormat format)
+{
+	Resize(width, height, numChannels, format);
+}
+
+void FrameBuffer::Resize(const int width, const int height, const int numChannels, const PlaneFormat format)
+{
+	this->width = width;
+	this->height = height;
+	this->numChannels = numChannels;
+	this->format = format;
+
+	const size_t bytesPerValue = format == PLANE_HALF ? sizeof(uint16_t) : sizeof(float);
+	const size_t valuesPerLine = FRAMEBUFFER_ALIGNMENT / bytesPerValue;
+	planeSize = (GetNumPixels() + valuesPerLine - 1) / valuesPerLine * valuesPerLine;
+
+	// Swapped out rather than cleared, so the memory really goes
+	decltype(floats)().swap(floats);
+	decltype(halves)().swap(halves);
+	if (format == PLANE_HALF)
+	{
+		halves.assign(planeSize * numChannels, 0);
+	}
+	else
+	{
+		floats.assign(planeSize * numChannels, 0.f);
+	}
+}
+
+void FrameBuffer::Clear()
+{
+	fill(floats.begin(), floats.end(), 0.f);
+	fill(halves.begin(), halves.end(), (uint16_t)0);
+}
+
+size_t FrameBuffer::GetMemoryUsed() const
+{
+	return floats.size() * sizeof(float) + halves.size() * sizeof(uint16_t);
+}
+
+Vector3f FrameBuffer::Get(const size_t pixel) const
+{
+	if (numChannels == 1)
+	{
+		return Vector3f::Constant(GetValue(pixel, 0));
+	}
+	return Vector3f(GetValue(pixel, 0), GetValue(pixel, 1), GetValue(pixel, 2));
+}
+
+void FrameBuffer::Set(const size_t pixel, const Vector3f& colour)
+{
+	for (int c = 0; c < numChannels; ++c)
+	{
+		SetValue(pixel, c, colour[c]);
+	}
+}
+
+float FrameBuffer::GetValue(const size_t pixel, const int channel) const
+{
+	const size_t i = channel * planeSize + pixel;
+	return format == PLANE_HALF ? HalfToFloat(halves[i]) : floats[i];
+}
+
+void FrameBuffer::SetValue(const size_t pixel, const int channel, const float value)
+{
+	const size_t i = channel * planeSize + pixel;
+	if (format == PLANE_HALF)
+	{
+		halves[i] = FloatToHalf(value);
+	}
+	else
+	{
+		floats[i] = value;
+	}
+}
+
+const float* FrameBuffer::GetRow(const int channel, const int y, float* scratch) const
+{
+	const size_t start = min(channel, numChannels - 1) * planeSize + (size_t)y * width;
+	if (format == PLANE_FLOAT)
+	{
+		return floats.data() + start;
+	}
+	HalvesToFloats(halves.data() + start, width, scratch);
+	return scratch;
+}
+
+void FrameBuffer::WriteBlock(
+	const int x,
+	const int y,
+	const int blockWidth,
+	const int blockHeight,
+	const float* const planes[3])
+{
+	assert(format == PLANE_FLOAT && numChannels == 3);
+	for (int c = 0; c < 3; ++c)
+	{
+		for (int row = 0; row < blockHeight; ++row)
+		{
+			memcpy(GetPlane(c) + (size_t)(y + row) * width + x, planes[c] + row * blockWidth, blockWidth * sizeof(float));
+		}
+	}
+}
+
+bool FrameBuffer::operator==(const FrameBuffer& other) const
+{
+	return width == other.width && height == other.height && numChannels == other.numChannels
+		&& format == other.format && floats == other.floats && halves == other.halves;
+}
@@ -0,0 +1,135 @@
+#pragma once
+#include <eigen3/Eigen/Dense>
+#include <vector>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+
+// Every plane starts on a boundary this many bytes apart: a cache line,
+// and the widest SIMD load there is
+#define FRAMEBUFFER_ALIGNMENT 64
+
+/**********************************************/
+/*########### FRAME BUFFER CLASSES ###########*/
+/**********************************************/
+
+enum PlaneFormat
+{
+	PLANE_FLOAT,	// 32 bit floats
+	PLANE_HALF		// IEEE 754 half floats: 11 bits of precision, up to 65504
+};
+
+// How many bytes of image buffers there are now, and the most there
+// have been at once. Everything allocated with AlignedAllocator counts.
+size_t GetImageMemoryUsed();
+size_t GetPeakImageMemoryUsed();
+void ResetPeakImageMemoryUsed();
+
+void AddImageMemoryUsed(const ptrdiff_t bytes);
+
+// For std::vector, so its storage starts on FRAMEBUFFER_ALIGNMENT
+template <typename T>
+struct AlignedAllocator
+{
+	typedef T value_type;
+
+	AlignedAllocator() {};
+	template <typename U>
+	AlignedAllocator(const AlignedAllocator<U>&) {};
+
+	T* allocate(const size_t n)
+	{
+		AddImageMemoryUsed((ptrdiff_t)(n * sizeof(T)));
+		return (T*)::operator new(n * sizeof(T), std::align_val_t(FRAMEBUFFER_ALIGNMENT));
+	};
+	void deallocate(T* p, const size_t n)
+	{
+		AddImageMemoryUsed(-(ptrdiff_t)(n * sizeof(T)));
+		::operator delete(p, std::align_val_t(FRAMEBUFFER_ALIGNMENT));
+	};
+
+	template <typename U>
+	bool operator==(const AlignedAllocator<U>&) const { return true; };
+	template <typename U>
+	bool operator!=(const AlignedAllocator<U>&) const { return false; };
+};
+
+// Round to nearest even, as the hardware does. Too big goes to infinity.
+uint16_t FloatToHalf(const float value);
+float HalfToFloat(const uint16_t half);
+// Through a table, so a run of them is a load each
+void HalvesToFloats(const uint16_t* in, const int count, float* out);
+
+/*
+	An image, kept as one plane per channel rather than a colour per
+	pixel, so a row of any channel is contiguous and SIMD can load it
+	straight in. Every plane is aligned to FRAMEBUFFER_ALIGNMENT, and
+	the padding after each one stays zero.
+
+	Images that only guide something else, like the denoiser's albedos
+	and normals, can be kept as half floats, which halves their memory.
+	Their planes are read a row at a time through GetRow, which widens
+	them back to floats. The rendered image itself is always floats.
+
+	A one channel image reads back as grey, the same value in all three
+	channels of Get.
+*/
+class FrameBuffer
+{
+public:
+	FrameBuffer() {};
+	FrameBuffer(const int width, const int height, const int numChannels = 3, const PlaneFormat format = PLANE_FLOAT);
+
+	// Every pixel goes back to zero
+	void Resize(const int width, const int height, const int numChannels = 3, const PlaneFormat format = PLANE_FLOAT);
+	void Clear();
+
+	int GetWidth() const { return width; };
+	int GetHeight() const { return height; };
+	int GetNumChannels() const { return numChannels; };
+	PlaneFormat GetFormat() const { return format; };
+	size_t GetNumPixels() const { return (size_t)width * height; };
+	size_t GetMemoryUsed() const;
+
+	Eigen::Vector3f Get(const size_t pixel) const;
+	void Set(const size_t pixel, const Eigen::Vector3f& colour);
+	float GetValue(const size_t pixel, const int channel) const;
+	void SetValue(const size_t pixel, const int channel, const float value);
+
+	// A channel's plane, for float images only
+	float* GetPlane(const int channel) { return floats.data() + channel * planeSize; };
+	const float* GetPlane(const int channel) const { return floats.data() + channel * planeSize; };
+
+	/*
+		Row y of a channel as floats. Float images give their own plane;
+		half ones are widened into scratch, which needs room for a row.
+		Channels past the last give the last one, so one channel images
+		read as grey.
+	*/
+	const float* GetRow(const int channel, const int y, float* scratch) const;
+
+	/*
+		Copy a block in, from a plane per channel of blockWidth floats a
+		row, with its top left corner at x, y
+	*/
+	void WriteBlock(
+		const int x,
+		const int y,
+		const int blockWidth,
+		const int blockHeight,
+		const float* const planes[3]);
+
+	bool operator==(const FrameBuffer& other) const;
+	bool operator!=(const FrameBuffer& other) const { return !(*this == other); };
+
+private:
+	int width = 0;
+	int height = 0;
+	int numChannels = 0;
+	PlaneFormat format = PLANE_FLOAT;
+	// Pixels from the start of one plane to the next, so each stays aligned
+	size_t planeSize = 0;
+
+	std::vector<float, AlignedAllocator<float>> floats;
+	std::vector<uint16_t, AlignedAllocator<uint16_t>> halves;
+};
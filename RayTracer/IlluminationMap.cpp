@@ -0,0 +1,404 @@
+#include "IlluminationMap.h"
+#include "PhotonMap.h"
+#include "Render.h"
+#include "Sampler.h"
+#include "Scheduler.h"
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <cmath>
+
+using namespace Eigen;
+using namespace std;
+
+#define PI_F 3.14159265f
+
+/*
+	An illumination map file is this header, then the texels of every
+	map as three floats each, spheres first and then planes, in the
+	order the scene has them.
+*/
+struct IlluminationFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t endianCheck;
+	uint32_t resolution;
+	uint32_t numSpheres;
+	uint32_t numPlanes;
+	uint32_t reserved;
+	uint64_t numPhotons;
+	// Of everything in the scene photons can land on or come from
+	uint64_t sceneHash;
+};
+
+static_assert(sizeof(IlluminationFileHeader) == 48, "The illumination map file header is part of the file format");
+
+//-----------------------------------------------------------
+IlluminationChart MakeSphereChart(const SphereData& sphere)
+{
+	IlluminationChart chart;
+	chart.type = PRIMITIVE_SPHERE;
+	chart.origin = sphere.centre;
+	chart.axes[0] = Vector3f(1.f, 0.f, 0.f);
+	chart.axes[1] = Vector3f(0.f, 1.f, 0.f);
+	chart.axes[2] = Vector3f(0.f, 0.f, 1.f);
+	chart.size = sphere.radius;
+	return chart;
+}
+
+IlluminationChart MakePlaneChart(const PlaneData& plane)
+{
+	IlluminationChart chart;
+	chart.type = PRIMITIVE_PLANE;
+	chart.origin = plane.offset * plane.normal;
+	const Vector3f helper = fabs(plane.normal[0]) > 0.9f ? Vector3f(0.f, 1.f, 0.f) : Vector3f(1.f, 0.f, 0.f);
+	chart.axes[0] = plane.normal.cross(helper).normalized();
+	chart.axes[1] = plane.normal.cross(chart.axes[0]);
+	chart.axes[2] = plane.normal;
+	chart.size = MAX_SCENE_DEPTH;
+	return chart;
+}
+
+bool IlluminationChart::ToMap(const Vector3f& point, Vector2f& uv) const
+{
+	const Vector3f d = point - origin;
+	if (type == PRIMITIVE_SPHERE)
+	{
+		const float length = d.norm();
+		if (length == 0.f)
+		{
+			return false;
+		}
+		uv[0] = atan2(d[2], d[0]) / (2.f * PI_F) + 0.5f;
+		uv[1] = acos(min(max(d[1] / length, -1.f), 1.f)) / PI_F;
+		return true;
+	}
+	if (type == PRIMITIVE_PLANE)
+	{
+		uv[0] = 0.5f * (d.dot(axes[0]) / size + 1.f);
+		uv[1] = 0.5f * (d.dot(axes[1]) / size + 1.f);
+		return uv[0] >= 0.f && uv[0] <= 1.f && uv[1] >= 0.f && uv[1] <= 1.f;
+	}
+	return false;
+}
+
+/*
+	A sphere's texel covers a band of latitude, by 1 / resolution of the
+	way round. Its area is the slice of the band between those two
+	lines of longitude: r^2 dphi (cos theta0 - cos theta1), from Arvo.
+	Texels on the poles only reach half way to the next row.
+
+	A plane's texels are squares, halved along the edges of the map.
+*/
+float IlluminationChart::GetTexelArea(const int i, const int j, const int resolution) const
+{
+	const float last = (float)(resolution - 1);
+	if (type == PRIMITIVE_SPHERE)
+	{
+		const float theta0 = PI_F * max(j - 0.5f, 0.f) / last;
+		const float theta1 = PI_F * min(j + 0.5f, last) / last;
+		return size * size * (2.f * PI_F / resolution) * (cos(theta0) - cos(theta1));
+	}
+	const float step = 2.f * size / last;
+	const float width = (i == 0 || i == resolution - 1) ? 0.5f * step : step;
+	const float height = (j == 0 || j == resolution - 1) ? 0.5f * step : step;
+	return width * height;
+}
+
+// The outward normal of a chart's surface at a point on it
+static Vector3f GetChartNormal(const IlluminationChart& chart, const Vector3f& point)
+{
+	return chart.type == PRIMITIVE_SPHERE ? Vector3f((point - chart.origin).normalized()) : chart.axes[2];
+}
+
+//-----------------------------------------------------------
+// The four texels around a point on a map, and how much each counts for
+struct TexelWeights
+{
+	int texel[4];
+	float weight[4];
+};
+
+/*
+	Find the texels either side of uv, in each direction. Points off the
+	edge of the map are clamped onto it when clamp is set, and turned
+	away otherwise.
+*/
+static bool GetTexelWeights(
+	const IlluminationChart& chart,
+	const Vector3f& point,
+	const int resolution,
+	const bool clamp,
+	TexelWeights& weights)
+{
+	Vector2f uv;
+	if (!chart.ToMap(point, uv) && !clamp)
+	{
+		return false;
+	}
+	uv = uv.cwiseMax(0.f).cwiseMin(1.f);
+
+	int i0, i1;
+	float fx;
+	if (chart.WrapsU())
+	{
+		const float x = uv[0] * resolution;
+		const float cell = floor(x);
+		fx = x - cell;
+		i0 = (int)cell % resolution;
+		i1 = (i0 + 1) % resolution;
+	}
+	else
+	{
+		const float x = uv[0] * (resolution - 1);
+		i0 = min((int)x, resolution - 2);
+		fx = x - i0;
+		i1 = i0 + 1;
+	}
+	const float y = uv[1] * (resolution - 1);
+	const int j0 = min((int)y, resolution - 2);
+	const float fy = y - j0;
+	const int j1 = j0 + 1;
+
+	weights.texel[0] = j0 * resolution + i0;
+	weights.texel[1] = j0 * resolution + i1;
+	weights.texel[2] = j1 * resolution + i0;
+	weights.texel[3] = j1 * resolution + i1;
+	weights.weight[0] = (1.f - fx) * (1.f - fy);
+	weights.weight[1] = fx * (1.f - fy);
+	weights.weight[2] = (1.f - fx) * fy;
+	weights.weight[3] = fx * fy;
+	return true;
+}
+
+//-----------------------------------------------------------
+void IlluminationMaps::MakeCharts(const CompiledScene& scene)
+{
+	const ArrayView<SphereData> spheres = scene.GetSpheres();
+	const ArrayView<PlaneData> planes = scene.GetPlanes();
+	numSpheres = (int)spheres.size();
+	charts.clear();
+	charts.reserve(spheres.size() + planes.size());
+	for (const SphereData& sphere : spheres)
+	{
+		charts.push_back(MakeSphereChart(sphere));
+	}
+	for (const PlaneData& plane : planes)
+	{
+		charts.push_back(MakePlaneChart(plane));
+	}
+}
+
+int IlluminationMaps::GetChartIndex(const PrimitiveType type, const int index) const
+{
+	if (type == PRIMITIVE_SPHERE)
+	{
+		return index;
+	}
+	if (type == PRIMITIVE_PLANE)
+	{
+		return numSpheres + index;
+	}
+	return -1;
+}
+
+/*
+	Splat every photon into the map of whatever it landed on, then turn
+	the energy in each texel into irradiance.
+*/
+void IlluminationMaps::Build(
+	const CompiledScene& scene,
+	const int numPhotons,
+	const uint32_t seed,
+	const int resolution,
+	WorkStealingPool& pool)
+{
+	this->resolution = max(resolution, 2);
+	this->numPhotons = numPhotons;
+	MakeCharts(scene);
+
+	const size_t texelsPerMap = (size_t)this->resolution * this->resolution;
+	vector<atomic<uint64_t>> energy(charts.size() * texelsPerMap * 3);
+
+	const vector<PhotonJob> jobs = PlanPhotonJobs(scene, numPhotons, 0);
+	const SobolSampler sampler(seed);
+	pool.Run((int)jobs.size(), [&](int j, int)
+	{
+		const function<void(const PhotonHit&)> store = [&](const PhotonHit& photon)
+		{
+			const int c = GetChartIndex(photon.type, photon.index);
+			if (c < 0 || photon.direction.dot(GetChartNormal(charts[c], photon.position)) >= 0.f)
+			{
+				return;
+			}
+			TexelWeights weights;
+			if (!GetTexelWeights(charts[c], photon.position, this->resolution, false, weights))
+			{
+				return;
+			}
+			atomic<uint64_t>* map = &energy[c * texelsPerMap * 3];
+			for (int k = 0; k < 4; ++k)
+			{
+				for (int channel = 0; channel < 3; ++channel)
+				{
+					const double amount = (double)photon.power[channel] * weights.weight[k] * ILLUMINATION_MAP_FIXED_POINT;
+					map[weights.texel[k] * 3 + channel].fetch_add((uint64_t)(amount + 0.5), memory_order_relaxed);
+				}
+			}
+		};
+		for (int p = 0; p < jobs[j].count; ++p)
+		{
+			TracePhoton(scene, sampler, jobs[j], jobs[j].first + p, store);
+		}
+	});
+
+	// Every photon is in by now, so the totals are final
+	texels.assign(charts.size() * texelsPerMap, Vector3f::Zero());
+	pool.Run((int)charts.size(), [&](int c, int)
+	{
+		for (int j = 0; j < this->resolution; ++j)
+		{
+			for (int i = 0; i < this->resolution; ++i)
+			{
+				const size_t texel = c * texelsPerMap + j * this->resolution + i;
+				const float area = charts[c].GetTexelArea(i, j, this->resolution);
+				for (int channel = 0; channel < 3; ++channel)
+				{
+					const double total = (double)energy[texel * 3 + channel].load(memory_order_relaxed) / ILLUMINATION_MAP_FIXED_POINT;
+					texels[texel][channel] = area > 0.f ? (float)(total / area) : 0.f;
+				}
+			}
+		}
+	});
+}
+
+Vector3f IlluminationMaps::GetIrradiance(const HitRecord& hit) const
+{
+	const int c = GetChartIndex(hit.type, hit.index);
+	TexelWeights weights;
+	if (c < 0 || c >= (int)charts.size() || !GetTexelWeights(charts[c], hit.point, resolution, true, weights))
+	{
+		return Vector3f::Zero();
+	}
+	const Vector3f* map = &texels[(size_t)c * resolution * resolution];
+	Vector3f irradiance = Vector3f::Zero();
+	for (int k = 0; k < 4; ++k)
+	{
+		irradiance += weights.weight[k] * map[weights.texel[k]];
+	}
+	return irradiance;
+}
+
+Vector3f IlluminationMaps::GetIndirectLighting(const HitRecord& hit) const
+{
+	return hit.diffusionFactor * hit.colour.cwiseProduct(GetIrradiance(hit));
+}
+
+//-----------------------------------------------------------
+bool IsIlluminationMapFile(const string& fileName)
+{
+	ifstream file(fileName, ifstream::in | ifstream::binary);
+	char magic[8] = {};
+	file.read(magic, sizeof(magic));
+	return file.good() && memcmp(magic, ILLUMINATION_FILE_MAGIC, sizeof(magic)) == 0;
+}
+
+bool IlluminationMaps::Write(const string& fileName, const CompiledScene& scene) const
+{
+	IlluminationFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, ILLUMINATION_FILE_MAGIC, sizeof(header.magic));
+	header.version = ILLUMINATION_FILE_VERSION;
+	header.endianCheck = ILLUMINATION_FILE_ENDIAN_CHECK;
+	header.resolution = resolution;
+	header.numSpheres = numSpheres;
+	header.numPlanes = (uint32_t)(charts.size() - numSpheres);
+	header.numPhotons = numPhotons;
+	header.sceneHash = scene.GetHash();
+
+	vector<float> values(texels.size() * 3);
+	for (size_t i = 0; i < texels.size(); ++i)
+	{
+		for (int c = 0; c < 3; ++c)
+		{
+			values[i * 3 + c] = texels[i][c];
+		}
+	}
+
+	ofstream file(fileName, ofstream::out | ofstream::binary | ofstream::trunc);
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)values.data(), values.size() * sizeof(float));
+	file.close();
+	if (!file.good())
+	{
+		cout << "ERROR: illumination maps could not be written to " << fileName << endl;
+		return false;
+	}
+	return true;
+}
+
+bool IlluminationMaps::Load(const string& fileName, const CompiledScene& scene)
+{
+	ifstream file(fileName, ifstream::in | ifstream::binary);
+	if (!file.good())
+	{
+		cout << "ERROR: could not open illumination map file " << fileName << endl;
+		return false;
+	}
+
+	auto fail = [&fileName](const char* reason)
+	{
+		cout << "ERROR: " << fileName << " is not a usable illumination map file: " << reason << endl;
+		return false;
+	};
+
+	IlluminationFileHeader header;
+	file.read((char*)&header, sizeof(header));
+	if (!file.good())
+	{
+		return fail("too short");
+	}
+	if (memcmp(header.magic, ILLUMINATION_FILE_MAGIC, sizeof(header.magic)) != 0)
+	{
+		return fail("not an illumination map file");
+	}
+	if (header.version != ILLUMINATION_FILE_VERSION)
+	{
+		return fail("written by a different version");
+	}
+	if (header.endianCheck != ILLUMINATION_FILE_ENDIAN_CHECK)
+	{
+		return fail("written on a machine with the other byte order");
+	}
+	if (header.resolution < 2 || header.resolution > 65536)
+	{
+		return fail("a bad resolution");
+	}
+	if (header.numSpheres != scene.GetSpheres().size() ||
+		header.numPlanes != scene.GetPlanes().size() ||
+		header.sceneHash != scene.GetHash())
+	{
+		return fail("made for a different scene");
+	}
+
+	const size_t numTexels = ((size_t)header.numSpheres + header.numPlanes) * header.resolution * header.resolution;
+	vector<float> values(numTexels * 3);
+	file.read((char*)values.data(), values.size() * sizeof(float));
+	if (!file.good())
+	{
+		return fail("too short");
+	}
+
+	resolution = (int)header.resolution;
+	numPhotons = (long long)header.numPhotons;
+	MakeCharts(scene);
+	texels.resize(numTexels);
+	for (size_t i = 0; i < numTexels; ++i)
+	{
+		texels[i] = Vector3f(values[i * 3], values[i * 3 + 1], values[i * 3 + 2]);
+	}
+	return true;
+}
@@ -0,0 +1,140 @@
+#pragma once
+#include <eigen3/Eigen/Dense>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+#include "CompiledScene.h"
+
+class WorkStealingPool;
+
+// Texels along each side of a shape's map, unless asked otherwise
+#define ILLUMINATION_MAP_DEFAULT_RESOLUTION 64
+// Energy is added up in fixed point, in steps of one over this
+#define ILLUMINATION_MAP_FIXED_POINT 4294967296.0
+
+// First 8 bytes of every illumination map file
+#define ILLUMINATION_FILE_MAGIC "RTILLUM"
+// Bump this whenever the layout of anything in the file changes
+#define ILLUMINATION_FILE_VERSION 1
+#define ILLUMINATION_FILE_ENDIAN_CHECK 0x01020304u
+
+/**********************************************/
+/*########## ILLUMINATION MAP CLASSES ########*/
+/**********************************************/
+
+/*
+	How a primitive's surface is laid out over the unit square of its
+	illumination map. There's one kind for each type of primitive that
+	gets a map:
+
+		sphere: polar coordinates, u round the equator from +x, and
+		v from the pole at +y down to the one at -y. u wraps round.
+		plane: a square of the plane, 2 * MAX_SCENE_DEPTH a side,
+		centred on the point nearest the world origin. That covers
+		everywhere a camera ray can reach on it. Only the side the
+		normal points to is mapped, as the photon maps do.
+
+	Triangles don't get maps: there's no one chart for a whole mesh
+	that wouldn't need unwrapping first, and a map per triangle would
+	run to gigabytes on the meshes the renderer is meant for.
+
+	Texels sit on the corners of a grid over the square, so the map
+	can be sampled bilinearly right up to its edges.
+*/
+struct IlluminationChart
+{
+	PrimitiveType type = PRIMITIVE_NONE;
+	// A sphere's centre, or the middle of a plane's square
+	Eigen::Vector3f origin;
+	// A plane's u and v axes, and its normal
+	Eigen::Vector3f axes[3];
+	// A sphere's radius, or half the side of a plane's square
+	float size = 0.f;
+
+	// Where a point on the surface lands on the map, if it does at all
+	bool ToMap(const Eigen::Vector3f& point, Eigen::Vector2f& uv) const;
+
+	// Area of the surface that texel (i, j) stands for: everything
+	// nearer it than any other texel
+	float GetTexelArea(const int i, const int j, const int resolution) const;
+
+	// Does u wrap round from 1 back to 0?
+	bool WrapsU() const { return type == PRIMITIVE_SPHERE; };
+};
+
+IlluminationChart MakeSphereChart(const SphereData& sphere);
+IlluminationChart MakePlaneChart(const PlaneData& plane);
+
+/*
+	Illumination maps, after Arvo, "Backward Ray Tracing" (SIGGRAPH 1986
+	course notes).
+
+	Light is shot out of the lights as photons, and every time one
+	lands on a diffuse sphere or plane after its first bounce, its power
+	is shared bilinearly between the four texels around where it landed.
+	Once they're all in, each texel is divided by the area of surface it
+	stands for, which leaves irradiance. A camera ray hitting the shape
+	then just reads it back bilinearly, which makes it much cheaper to
+	look up than a photon map, though only as sharp as the texels.
+
+	Photons come from the same tracer as the photon maps, in parallel
+	jobs. Texels are added to with atomic adds and no locks. Adding
+	floats in whatever order threads get there would change the last
+	bits from run to run, so energy is kept in 64 bit fixed point while
+	it's being added up, which comes to the same total in any order.
+
+	The lighting only depends on the scene, not the camera, so the maps
+	can be written to a file and read back for every later render of
+	the same scene. The file records a hash of the scene's spheres,
+	planes and lights, so maps are never used with a scene that has
+	changed since.
+*/
+class IlluminationMaps
+{
+public:
+	IlluminationMaps() {};
+
+	// Trace numPhotons photons through scene and build a map for each
+	// of its spheres and planes, replacing whatever was here
+	void Build(
+		const CompiledScene& scene,
+		const int numPhotons,
+		const uint32_t seed,
+		const int resolution,
+		WorkStealingPool& pool);
+
+	// Irradiance at a hit, or zero for primitives without maps
+	Eigen::Vector3f GetIrradiance(const HitRecord& hit) const;
+
+	// Light reflected back along the ray from the maps at hit
+	Eigen::Vector3f GetIndirectLighting(const HitRecord& hit) const;
+
+	// Save the maps, for the scene they were built for
+	bool Write(const std::string& fileName, const CompiledScene& scene) const;
+
+	// Read maps back in. They're rejected, and this left alone, if they
+	// don't belong to scene.
+	bool Load(const std::string& fileName, const CompiledScene& scene);
+
+	int GetResolution() const { return resolution; };
+	long long GetNumPhotons() const { return numPhotons; };
+	// The texels of every map, one map after another: spheres, then planes
+	const std::vector<Eigen::Vector3f>& GetTexels() const { return texels; };
+	size_t GetMemoryUsed() const { return texels.capacity() * sizeof(Eigen::Vector3f) + charts.capacity() * sizeof(IlluminationChart); };
+
+private:
+	void MakeCharts(const CompiledScene& scene);
+	// Which chart a hit's primitive uses, or -1
+	int GetChartIndex(const PrimitiveType type, const int index) const;
+
+	int resolution = 0;
+	long long numPhotons = 0;
+	int numSpheres = 0;
+	std::vector<IlluminationChart> charts;
+	std::vector<Eigen::Vector3f> texels;
+};
+
+// Does the file start like an illumination map file?
+bool IsIlluminationMapFile(const std::string& fileName);
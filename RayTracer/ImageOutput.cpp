@@ -0,0 +1,411 @@
+#include "ImageOutput.h"
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RT_SSE2 1
+#include <emmintrin.h>
+#else
+#define RT_SSE2 0
+#endif
+
+using namespace Eigen;
+using namespace std;
+
+//-----------------------------------------------------------
+ImageFormat GetImageFormat(const string& fileName)
+{
+	const size_t dot = fileName.find_last_of('.');
+	if (dot == string::npos)
+	{
+		return IMAGE_PPM;
+	}
+
+	string extension = fileName.substr(dot + 1);
+	transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return (char)tolower(c); });
+	if (extension == "pfm")
+	{
+		return IMAGE_PFM;
+	}
+	if (extension == "exr")
+	{
+		return IMAGE_EXR;
+	}
+	return IMAGE_PPM;
+}
+
+//-----------------------------------------------------------
+Quantizer::Quantizer(const float gamma)
+	: gamma(gamma)
+{
+	if (gamma != 1.f)
+	{
+		table.resize(GAMMA_TABLE_SIZE);
+		for (int i = 0; i < GAMMA_TABLE_SIZE; ++i)
+		{
+			const double linear = (double)i / (GAMMA_TABLE_SIZE - 1);
+			table[i] = (uint8_t)(255.0 * pow(linear, 1.0 / gamma) + 0.5);
+		}
+	}
+}
+
+/*
+	The scalar version, for the odd values left over at the end, and
+	for CPUs without SSE2. The clamp is written so a NaN comes out
+	white, the same as the SIMD version.
+*/
+static inline uint8_t QuantizeOne(const float value, const vector<uint8_t>& table)
+{
+	const float clamped = max(0.f, min(1.f, value));
+	if (table.empty())
+	{
+		return (uint8_t)(255 * clamped);
+	}
+	return table[(int)(clamped * (GAMMA_TABLE_SIZE - 1) + 0.5f)];
+}
+
+void Quantizer::Quantize(const float* in, const int count, uint8_t* out) const
+{
+	int i = 0;
+#if RT_SSE2
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.f);
+	const __m128 scale = _mm_set1_ps(table.empty() ? 255.f : (float)(GAMMA_TABLE_SIZE - 1));
+	const __m128 offset = _mm_set1_ps(table.empty() ? 0.f : 0.5f);
+	for (; i + 16 <= count; i += 16)
+	{
+		__m128i quads[4];
+		for (int k = 0; k < 4; ++k)
+		{
+			// min(x, 1) gives the second operand for a NaN, so NaNs clamp to 1
+			__m128 v = _mm_loadu_ps(in + i + 4 * k);
+			v = _mm_max_ps(_mm_min_ps(v, one), zero);
+			quads[k] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, scale), offset));
+		}
+
+		if (table.empty())
+		{
+			const __m128i low = _mm_packs_epi32(quads[0], quads[1]);
+			const __m128i high = _mm_packs_epi32(quads[2], quads[3]);
+			_mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(low, high));
+		}
+		else
+		{
+			alignas(16) int32_t indices[16];
+			for (int k = 0; k < 4; ++k)
+			{
+				_mm_store_si128((__m128i*)(indices + 4 * k), quads[k]);
+			}
+			for (int k = 0; k < 16; ++k)
+			{
+				out[i + k] = table[indices[k]];
+			}
+		}
+	}
+#endif
+	for (; i < count; ++i)
+	{
+		out[i] = QuantizeOne(in[i], table);
+	}
+}
+
+//-----------------------------------------------------------
+/*
+	File layouts.
+
+	Every format here is a header followed by rows of a fixed size,
+	which is what lets ImageWriter put rows straight into place.
+	Multi-byte values are written in the machine's own order, which
+	is little endian everywhere this runs, as PFM (with a negative
+	scale) and EXR both expect.
+*/
+template <class T>
+static void Append(string& bytes, const T& value)
+{
+	bytes.append((const char*)&value, sizeof(T));
+}
+
+static void AppendAttribute(string& header, const char* name, const char* type, const string& value)
+{
+	header.append(name, strlen(name) + 1);
+	header.append(type, strlen(type) + 1);
+	Append(header, (int32_t)value.size());
+	header += value;
+}
+
+static size_t RowSize(const ImageFormat format, const int width)
+{
+	switch (format)
+	{
+	case IMAGE_PFM:
+		return (size_t)width * 3 * sizeof(float);
+	case IMAGE_EXR:
+		// Each scanline is a block of its own: y, size, then the data
+		return 2 * sizeof(int32_t) + (size_t)width * 3 * sizeof(float);
+	case IMAGE_PPM:
+	default:
+		return (size_t)width * 3;
+	}
+}
+
+/*
+	An uncompressed single part scanline OpenEXR header, with B, G and R
+	float channels (EXR wants them in alphabetical order), and then the
+	table of where each scanline starts.
+*/
+static string MakeExrHeader(const int width, const int height)
+{
+	string header;
+	Append(header, (int32_t)20000630);	// magic number
+	Append(header, (int32_t)2);			// version 2, single part scanline
+
+	string channels;
+	for (const char* name : { "B", "G", "R" })
+	{
+		channels.append(name, 2);
+		Append(channels, (int32_t)2);	// FLOAT
+		Append(channels, (int32_t)0);	// pLinear, then 3 reserved bytes
+		Append(channels, (int32_t)1);	// x sampling
+		Append(channels, (int32_t)1);	// y sampling
+	}
+	channels.push_back('\0');
+	AppendAttribute(header, "channels", "chlist", channels);
+	AppendAttribute(header, "compression", "compression", string(1, '\0'));
+
+	string window;
+	const int32_t box[4] = { 0, 0, width - 1, height - 1 };
+	window.append((const char*)box, sizeof(box));
+	AppendAttribute(header, "dataWindow", "box2i", window);
+	AppendAttribute(header, "displayWindow", "box2i", window);
+	AppendAttribute(header, "lineOrder", "lineOrder", string(1, '\0'));
+
+	string value;
+	Append(value, 1.f);
+	AppendAttribute(header, "pixelAspectRatio", "float", value);
+	AppendAttribute(header, "screenWindowWidth", "float", value);
+	value.clear();
+	Append(value, 0.f);
+	Append(value, 0.f);
+	AppendAttribute(header, "screenWindowCenter", "v2f", value);
+	header.push_back('\0');
+
+	const uint64_t firstRow = header.size() + (size_t)height * sizeof(uint64_t);
+	for (int y = 0; y < height; ++y)
+	{
+		Append(header, (uint64_t)(firstRow + y * RowSize(IMAGE_EXR, width)));
+	}
+	return header;
+}
+
+static string MakeHeader(const ImageFormat format, const int width, const int height)
+{
+	switch (format)
+	{
+	case IMAGE_PFM:
+		return "PF\n" + to_string(width) + " " + to_string(height) + "\n-1.0\n";
+	case IMAGE_EXR:
+		return MakeExrHeader(width, height);
+	case IMAGE_PPM:
+	default:
+		return "P6\n" + to_string(width) + " " + to_string(height) + "\n255\n";
+	}
+}
+
+// Where row y starts, counting from just after the header.
+// PFM files start from the bottom row.
+static size_t RowOffset(const ImageFormat format, const int width, const int height, const int y)
+{
+	const int fileRow = format == IMAGE_PFM ? height - 1 - y : y;
+	return (size_t)fileRow * RowSize(format, width);
+}
+
+// Room for EncodeRow to widen and quantize a row's planes in
+struct RowScratch
+{
+	RowScratch(const int width) : floats((size_t)width * 3), bytes((size_t)width * 3) {};
+
+	vector<float> floats;
+	vector<uint8_t> bytes;
+};
+
+/*
+	The image is a plane per channel, and the files want pixels, so
+	each channel's row is worked on whole and then interleaved. EXR
+	keeps its channels apart too, so its rows are straight copies.
+*/
+static void EncodeRow(
+	const ImageFormat format,
+	const Quantizer& quantizer,
+	const FrameBuffer& image,
+	const int y,
+	RowScratch& scratch,
+	char* out)
+{
+	const int width = image.GetWidth();
+	const float* planes[3];
+	for (int c = 0; c < 3; ++c)
+	{
+		planes[c] = image.GetRow(c, y, scratch.floats.data() + (size_t)c * width);
+	}
+
+	switch (format)
+	{
+	case IMAGE_PFM:
+		for (int x = 0; x < width; ++x)
+		{
+			for (int c = 0; c < 3; ++c)
+			{
+				memcpy(out + (3 * x + c) * sizeof(float), planes[c] + x, sizeof(float));
+			}
+		}
+		break;
+	case IMAGE_EXR:
+	{
+		const int32_t block[2] = { y, (int32_t)(width * 3 * sizeof(float)) };
+		memcpy(out, block, sizeof(block));
+		char* channels = out + sizeof(block);
+		for (int c = 0; c < 3; ++c)
+		{
+			// B, G, R
+			memcpy(channels + (size_t)c * width * sizeof(float), planes[2 - c], width * sizeof(float));
+		}
+		break;
+	}
+	case IMAGE_PPM:
+	default:
+	{
+		uint8_t* bytes = scratch.bytes.data();
+		for (int c = 0; c < 3; ++c)
+		{
+			quantizer.Quantize(planes[c], width, bytes + (size_t)c * width);
+		}
+		for (int x = 0; x < width; ++x)
+		{
+			out[3 * x] = (char)bytes[x];
+			out[3 * x + 1] = (char)bytes[width + x];
+			out[3 * x + 2] = (char)bytes[2 * width + x];
+		}
+		break;
+	}
+	}
+}
+
+void EncodeImage(
+	const FrameBuffer& image,
+	const ImageFormat format,
+	const float gamma,
+	vector<char>& encoded)
+{
+	const int width = image.GetWidth();
+	const int height = image.GetHeight();
+	const Quantizer quantizer(gamma);
+	RowScratch scratch(width);
+	const string header = MakeHeader(format, width, height);
+	encoded.resize(header.size() + (size_t)height * RowSize(format, width));
+	memcpy(encoded.data(), header.data(), header.size());
+	for (int y = 0; y < height; ++y)
+	{
+		char* out = encoded.data() + header.size() + RowOffset(format, width, height, y);
+		EncodeRow(format, quantizer, image, y, scratch, out);
+	}
+}
+
+//-----------------------------------------------------------
+Vector3f FalseColour(const float value)
+{
+	static const Vector3f stops[] =
+	{
+		Vector3f(0.f, 0.f, 0.5f),
+		Vector3f(0.f, 0.8f, 1.f),
+		Vector3f(0.f, 0.9f, 0.f),
+		Vector3f(1.f, 0.9f, 0.f),
+		Vector3f(1.f, 0.f, 0.f)
+	};
+	const int numSteps = (int)(sizeof(stops) / sizeof(stops[0])) - 1;
+
+	// NaN goes to 0 along with everything else below it
+	const float t = value > 0.f ? min(value, 1.f) * numSteps : 0.f;
+	const int step = min((int)t, numSteps - 1);
+	const float f = t - (float)step;
+	return stops[step] * (1.f - f) + stops[step + 1] * f;
+}
+
+//-----------------------------------------------------------
+ImageWriter::ImageWriter(
+	const string& fileName,
+	const int width,
+	const int height,
+	const float gamma)
+	: fileName(fileName),
+	format(GetImageFormat(fileName)),
+	width(width),
+	height(height),
+	quantizer(gamma)
+{
+	file.open(fileName, ofstream::out | ofstream::binary | ofstream::trunc);
+	if (file.is_open())
+	{
+		const string header = MakeHeader(format, width, height);
+		headerSize = header.size();
+		file.write(header.data(), header.size());
+	}
+}
+
+ImageWriter::~ImageWriter()
+{
+	if (file.is_open())
+	{
+		Close();
+	}
+}
+
+/*
+	The rows are encoded before taking the lock, so threads only wait
+	on each other for the write itself
+*/
+bool ImageWriter::WriteRows(
+	const FrameBuffer& frameBuffer,
+	const int startRow,
+	const int endRow)
+{
+	const size_t rowSize = RowSize(format, width);
+	vector<char> rows((endRow - startRow) * rowSize);
+	RowScratch scratch(width);
+	for (int y = startRow; y < endRow; ++y)
+	{
+		EncodeRow(format, quantizer, frameBuffer, y, scratch, rows.data() + (y - startRow) * rowSize);
+	}
+
+	lock_guard<mutex> lock(fileMutex);
+	if (format == IMAGE_PFM)
+	{
+		// Bottom row first, so these go in backwards, one at a time
+		for (int y = startRow; y < endRow; ++y)
+		{
+			file.seekp(headerSize + RowOffset(format, width, height, y));
+			file.write(rows.data() + (y - startRow) * rowSize, rowSize);
+		}
+	}
+	else
+	{
+		file.seekp(headerSize + RowOffset(format, width, height, startRow));
+		file.write(rows.data(), rows.size());
+	}
+	failed = failed || !file.good();
+	return file.good();
+}
+
+bool ImageWriter::Close()
+{
+	lock_guard<mutex> lock(fileMutex);
+	file.close();
+	if (failed)
+	{
+		cout << "ERROR: image could not be written to " << fileName << endl;
+		return false;
+	}
+	cout << "Written image to file " << fileName << endl;
+	return true;
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <eigen3/Eigen/Dense>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <mutex>
+#include <cstdint>
+
+#include "FrameBuffer.h"
+
+// Entries in the gamma lookup table. 16 bits of input is enough that
+// neighbouring entries never differ by more than one output level
+// outside of the very darkest values.
+#define GAMMA_TABLE_SIZE 65536
+
+/**********************************************/
+/*########### IMAGE OUTPUT CLASSES ###########*/
+/**********************************************/
+
+enum ImageFormat
+{
+	IMAGE_PPM,	// 8 bit binary RGB, clamped and gamma corrected
+	IMAGE_PFM,	// 32 bit float RGB, linear, bottom row first
+	IMAGE_EXR	// OpenEXR, uncompressed 32 bit float scanlines, linear
+};
+
+// Picked from the file's extension. Anything unknown is PPM.
+ImageFormat GetImageFormat(const std::string& fileName);
+
+/*
+	Turn linear floats into bytes: clamp to [0, 1], apply gamma, and
+	scale to [0, 255].
+
+	A gamma of 1 keeps the old truncating conversion exactly. Anything
+	else goes through a lookup table, built once per gamma.
+	On x86 this runs 16 values at a time with SSE2.
+*/
+class Quantizer
+{
+public:
+	Quantizer(const float gamma);
+
+	void Quantize(const float* in, const int count, uint8_t* out) const;
+
+private:
+	float gamma;
+	std::vector<uint8_t> table;
+};
+
+/*
+	Writes an image to a file a few rows at a time, in any order, from
+	any thread. The header goes out when the file is opened, and every
+	row's place in the file is fixed, so rows go straight to where they
+	belong as soon as they're finished.
+
+	Used for streaming output while rendering carries on.
+*/
+class ImageWriter
+{
+public:
+	ImageWriter(
+		const std::string& fileName,
+		const int width,
+		const int height,
+		const float gamma);
+	~ImageWriter();
+
+	bool IsOpen() const { return file.is_open(); };
+
+	// Write rows [startRow, endRow) of an image the size of the whole frame
+	bool WriteRows(
+		const FrameBuffer& frameBuffer,
+		const int startRow,
+		const int endRow);
+
+	bool Close();
+
+private:
+	std::string fileName;
+	ImageFormat format;
+	int width;
+	int height;
+	size_t headerSize = 0;
+	Quantizer quantizer;
+
+	std::ofstream file;
+	std::mutex fileMutex;
+	bool failed = false;
+};
+
+// The whole image, header and all, in memory, ready for one write
+void EncodeImage(
+	const FrameBuffer& image,
+	const ImageFormat format,
+	const float gamma,
+	std::vector<char>& encoded);
+
+/*
+	A number from 0 to 1 as a colour, for images of numbers rather than
+	of the scene: dark blue for 0, through cyan, green and yellow, to
+	red for 1. Anything outside [0, 1] gets the colour at the nearest end.
+*/
+Eigen::Vector3f FalseColour(const float value);
@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <utility>
+
+#include "Integrator.h"
+#include "Render.h"
+#include "PhotonMap.h"
+#include "IlluminationMap.h"
+#include "Stats.h"
+
+using namespace Eigen;
+using namespace std;
+
+/*
+	DirectLighting, for a known number of lights. The sums are done in
+	the same order, so the colour comes out exactly the same.
+*/
+template <LightCount Lights>
+static Vector3f DirectLightingWith(
+	const HitRecord& hit,
+	const CompiledScene& scene)
+{
+	if constexpr (Lights == LIGHTS_NONE)
+	{
+		return Vector3f::Zero();
+	}
+	else
+	{
+		const ArrayView<LightData> lights = scene.GetLights();
+		const size_t numLights = Lights == LIGHTS_ONE ? 1 : lights.size();
+		float diffuseIntensity = 0;
+		for (size_t i = 0; i < numLights; ++i)
+		{
+			const LightData& l = lights[i];
+			Vector3f lightDir = l.position - hit.point;
+			const float lightDist = lightDir.norm();
+			lightDir /= lightDist;
+			const float facing = lightDir.dot(hit.normal);
+			if (facing <= 0.f || scene.IsOccluded(hit.point, lightDir, lightDist))
+			{
+				continue;
+			}
+			diffuseIntensity += l.intensity * facing;
+		}
+		return hit.diffusionFactor * diffuseIntensity * hit.colour;
+	}
+}
+
+// IndirectLighting, knowing which maps are there
+template <IndirectSource Indirect>
+static Vector3f IndirectLightingWith(
+	const HitRecord& hit,
+	const CompiledScene& scene)
+{
+	if constexpr (Indirect == INDIRECT_PHOTONS)
+	{
+		return scene.GetPhotonMaps()->GetIndirectLighting(hit);
+	}
+	else if constexpr (Indirect == INDIRECT_ILLUMINATION)
+	{
+		return scene.GetIlluminationMaps()->GetIndirectLighting(hit);
+	}
+	else
+	{
+		return Vector3f::Zero();
+	}
+}
+
+template <int Bounces, LightCount Lights, IndirectSource Indirect>
+static Vector3f CastRayWith(
+	const Vector3f& origin,
+	const Vector3f& ray,
+	const CompiledScene& scene);
+
+/*
+	ShadeHit with Bounces left. The bounce calls the kernel for one fewer,
+	down to 0, where the chain stops.
+*/
+template <int Bounces, LightCount Lights, IndirectSource Indirect>
+static Vector3f ShadeHitWith(
+	const Vector3f& ray,
+	const HitRecord& hit,
+	const CompiledScene& scene)
+{
+	Vector3f colour = DirectLightingWith<Lights>(hit, scene) + IndirectLightingWith<Indirect>(hit, scene);
+
+	if constexpr (Bounces > 0)
+	{
+		STAT_ADD(STAT_REFLECTION_RAYS, 1);
+		colour += REFLECTANCE * CastRayWith<Bounces - 1, Lights, Indirect>(hit.point, ReflectRay(ray, hit.normal), scene);
+	}
+	else
+	{
+		STAT_ADD(STAT_BOUNCE_LIMIT_REACHED, 1);
+		STAT_SAMPLE(STAT_HIST_BOUNCES_LEFT, 0);
+	}
+
+	return colour;
+}
+
+template <int Bounces, LightCount Lights, IndirectSource Indirect>
+static Vector3f CastRayWith(
+	const Vector3f& origin,
+	const Vector3f& ray,
+	const CompiledScene& scene)
+{
+	float closestDist = MAX_SCENE_DEPTH;
+	HitRecord hit;
+	if (scene.Intersect(origin, ray, closestDist, hit))
+	{
+		return ShadeHitWith<Bounces, Lights, Indirect>(ray, hit, scene);
+	}
+
+	STAT_SAMPLE(STAT_HIST_BOUNCES_LEFT, Bounces);
+	return scene.GetBackground();
+}
+
+/*
+	Every kernel, indexed by features. Filled in once, the first time
+	one is asked for.
+*/
+struct IntegratorTable
+{
+	Integrator kernels[NUM_LIGHT_COUNTS][NUM_INDIRECT_SOURCES][MAX_NUM_BOUNCES_PER_RAY + 1];
+
+	IntegratorTable()
+	{
+		FillLights<LIGHTS_NONE>();
+		FillLights<LIGHTS_ONE>();
+		FillLights<LIGHTS_MANY>();
+	}
+
+	template <LightCount Lights>
+	void FillLights()
+	{
+		typedef make_integer_sequence<int, MAX_NUM_BOUNCES_PER_RAY + 1> AllBounces;
+		FillBounces<Lights, INDIRECT_NONE>(AllBounces());
+		FillBounces<Lights, INDIRECT_PHOTONS>(AllBounces());
+		FillBounces<Lights, INDIRECT_ILLUMINATION>(AllBounces());
+	}
+
+	template <LightCount Lights, IndirectSource Indirect, int... Bounces>
+	void FillBounces(integer_sequence<int, Bounces...>)
+	{
+		((kernels[Lights][Indirect][Bounces] = Integrator{
+			CastRayWith<Bounces, Lights, Indirect>,
+			ShadeHitWith<Bounces, Lights, Indirect> }), ...);
+	}
+};
+
+IntegratorFeatures GetIntegratorFeatures(
+	const CompiledScene& scene,
+	const int numBounces)
+{
+	IntegratorFeatures features;
+	features.numBounces = min(max(numBounces, 0), MAX_NUM_BOUNCES_PER_RAY);
+
+	const size_t numLights = scene.GetLights().size();
+	features.lights = numLights == 0 ? LIGHTS_NONE : (numLights == 1 ? LIGHTS_ONE : LIGHTS_MANY);
+
+	if (scene.GetPhotonMaps())
+	{
+		features.indirect = INDIRECT_PHOTONS;
+	}
+	else if (scene.GetIlluminationMaps())
+	{
+		features.indirect = INDIRECT_ILLUMINATION;
+	}
+	else
+	{
+		features.indirect = INDIRECT_NONE;
+	}
+	return features;
+}
+
+Integrator GetIntegrator(const IntegratorFeatures& features)
+{
+	static const IntegratorTable table;
+	const int numBounces = min(max(features.numBounces, 0), MAX_NUM_BOUNCES_PER_RAY);
+	return table.kernels[features.lights][features.indirect][numBounces];
+}
+
+Integrator GetIntegrator(
+	const CompiledScene& scene,
+	const int numBounces)
+{
+	return GetIntegrator(GetIntegratorFeatures(scene, numBounces));
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include <eigen3/Eigen/Dense>
+
+#include "CompiledScene.h"
+
+/**********************************************/
+/*############ INTEGRATOR KERNELS ############*/
+/**********************************************/
+
+// How many lights a kernel loops over. With none there's no direct light
+// at all, and with one there's no loop.
+enum LightCount
+{
+	LIGHTS_NONE,
+	LIGHTS_ONE,
+	LIGHTS_MANY,
+	NUM_LIGHT_COUNTS
+};
+
+// Where a kernel gets indirect light from at each hit, if anywhere.
+// Photon maps win when a scene has both, as in IndirectLighting.
+enum IndirectSource
+{
+	INDIRECT_NONE,
+	INDIRECT_PHOTONS,
+	INDIRECT_ILLUMINATION,
+	NUM_INDIRECT_SOURCES
+};
+
+// Everything about a render that CastRay would otherwise check for
+// on every ray
+struct IntegratorFeatures
+{
+	int numBounces = MAX_NUM_BOUNCES_PER_RAY;
+	LightCount lights = LIGHTS_MANY;
+	IndirectSource indirect = INDIRECT_NONE;
+};
+
+// Every kernel looks like one of these, and gives the same colour,
+// bit for bit, as CastRay and ShadeHit with the same number of bounces
+typedef Eigen::Vector3f (*CastRayKernel)(
+	const Eigen::Vector3f& origin,
+	const Eigen::Vector3f& ray,
+	const CompiledScene& scene);
+
+typedef Eigen::Vector3f (*ShadeHitKernel)(
+	const Eigen::Vector3f& ray,
+	const HitRecord& hit,
+	const CompiledScene& scene);
+
+struct Integrator
+{
+	CastRayKernel castRay;
+	ShadeHitKernel shadeHit;
+};
+
+// What a scene, with whatever photon or illumination maps it has
+// attached, rendered with this many bounces, needs
+IntegratorFeatures GetIntegratorFeatures(
+	const CompiledScene& scene,
+	const int numBounces);
+
+/*
+	The kernels built for exactly these features. Every combination of
+	0 to MAX_NUM_BOUNCES_PER_RAY bounces, light count and indirect source
+	is instantiated ahead of time, so this is a table lookup.
+
+	Each kernel is CastRay with the features as template arguments: the
+	bounce recursion is a chain of separate functions, one per bounce
+	left, with no count to check, and the light loop and indirect light
+	lookups are compiled out when they can't do anything.
+*/
+Integrator GetIntegrator(const IntegratorFeatures& features);
+
+// The kernels for rendering this scene with this many bounces
+Integrator GetIntegrator(
+	const CompiledScene& scene,
+	const int numBounces);
@@ -0,0 +1,31 @@
+#pragma once
+#include <string>
+#include <cstddef>
+
+/*
+	A whole file mapped read only into memory. The mapping lasts as
+	long as this does.
+*/
+class MappedFile
+{
+public:
+	MappedFile() {};
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool Open(const std::string& fileName);
+	void Close();
+
+	const char* GetData() const { return data; };
+	size_t GetSize() const { return size; };
+
+private:
+	const char* data = nullptr;
+	size_t size = 0;
+#ifdef _WIN32
+	void* fileHandle = nullptr;
+	void* mappingHandle = nullptr;
+#endif
+};
@@ -0,0 +1,270 @@
+#include "ObjLoader.h"
+#include "MappedFile.h"
+#include "Scheduler.h"
+#include <iostream>
+#include <charconv>
+#include <cstring>
+#include <climits>
+
+using namespace Eigen;
+using namespace std;
+
+// What one chunk of the file turned into
+struct ObjChunk
+{
+	const char* begin = nullptr;
+	const char* end = nullptr;
+
+	vector<Vector3f> vertices;
+	vector<uint32_t> indices;
+
+	// Places in indices holding a relative index. These are stored
+	// counting from this chunk's first vertex, and can be negative.
+	vector<size_t> relative;
+
+	const char* error = nullptr;
+};
+
+//-----------------------------------------------------------
+static inline bool IsSpace(const char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char* SkipSpaces(const char* p, const char* end)
+{
+	while (p < end && IsSpace(*p))
+	{
+		++p;
+	}
+	return p;
+}
+
+// Just past the end of this line
+static inline const char* SkipLine(const char* p, const char* end)
+{
+	const char* newline = (const char*)memchr(p, '\n', end - p);
+	return newline ? newline + 1 : end;
+}
+
+static inline const char* ParseFloat(const char* p, const char* end, float& value)
+{
+	// from_chars won't take a leading +
+	if (p < end && *p == '+')
+	{
+		++p;
+	}
+	const from_chars_result result = from_chars(p, end, value);
+	return result.ec == errc() ? result.ptr : nullptr;
+}
+
+static inline const char* ParseIndex(const char* p, const char* end, int64_t& value)
+{
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+	{
+		negative = *p == '-';
+		++p;
+	}
+	const char* start = p;
+	value = 0;
+	while (p < end && *p >= '0' && *p <= '9' && value <= UINT32_MAX)
+	{
+		value = value * 10 + (*p - '0');
+		++p;
+	}
+	if (p == start)
+	{
+		return nullptr;
+	}
+	value = negative ? -value : value;
+	return p;
+}
+
+//-----------------------------------------------------------
+/*
+	Parse one chunk, a line at a time. Lines that aren't "v" or "f"
+	are skipped without looking at them any further.
+*/
+static void ParseChunk(ObjChunk& chunk)
+{
+	// One entry per corner of the current face: the index, and whether it's relative
+	vector<pair<int64_t, bool>> corners;
+
+	// A guess, so the arrays don't have to grow much
+	const size_t size = chunk.end - chunk.begin;
+	chunk.vertices.reserve(size / 40);
+	chunk.indices.reserve(size / 10);
+
+	const char* p = chunk.begin;
+	const char* end = chunk.end;
+	while (p < end)
+	{
+		p = SkipSpaces(p, end);
+		if (end - p >= 2 && p[0] == 'v' && IsSpace(p[1]))
+		{
+			Vector3f v;
+			p += 2;
+			for (int k = 0; k < 3 && p; ++k)
+			{
+				p = ParseFloat(SkipSpaces(p, end), end, v[k]);
+			}
+			if (!p)
+			{
+				chunk.error = "a vertex couldn't be read";
+				return;
+			}
+			chunk.vertices.push_back(v);
+		}
+		else if (end - p >= 2 && p[0] == 'f' && IsSpace(p[1]))
+		{
+			corners.clear();
+			p += 2;
+			for (;;)
+			{
+				p = SkipSpaces(p, end);
+				if (p >= end || *p == '\n' || *p == '#')
+				{
+					break;
+				}
+
+				int64_t index = 0;
+				p = ParseIndex(p, end, index);
+				if (!p || index == 0 || index > UINT32_MAX)
+				{
+					chunk.error = "a face has a bad index";
+					return;
+				}
+				// Skip over any texture coordinate and normal indices
+				while (p < end && !IsSpace(*p) && *p != '\n')
+				{
+					++p;
+				}
+
+				if (index > 0)
+				{
+					corners.push_back(make_pair(index - 1, false));
+				}
+				else
+				{
+					const int64_t local = (int64_t)chunk.vertices.size() + index;
+					if (local < INT32_MIN)
+					{
+						chunk.error = "a face has a bad index";
+						return;
+					}
+					corners.push_back(make_pair(local, true));
+				}
+			}
+
+			if (corners.size() < 3)
+			{
+				chunk.error = "a face has fewer than three corners";
+				return;
+			}
+			for (size_t i = 1; i + 1 < corners.size(); ++i)
+			{
+				for (const size_t c : { (size_t)0, i, i + 1 })
+				{
+					if (corners[c].second)
+					{
+						chunk.relative.push_back(chunk.indices.size());
+					}
+					chunk.indices.push_back((uint32_t)corners[c].first);
+				}
+			}
+		}
+
+		if (p < end)
+		{
+			p = SkipLine(p, end);
+		}
+	}
+}
+
+bool LoadObj(
+	const string& fileName,
+	vector<Vector3f>& vertices,
+	vector<uint32_t>& indices,
+	const int numThreads,
+	const size_t chunkSize)
+{
+	MappedFile file;
+	if (!file.Open(fileName))
+	{
+		cout << "ERROR: could not open mesh file " << fileName << endl;
+		return false;
+	}
+
+	// Cut at the first line break after each multiple of chunkSize
+	const char* data = file.GetData();
+	const char* fileEnd = data + file.GetSize();
+	vector<ObjChunk> chunks;
+	for (const char* p = data; p < fileEnd;)
+	{
+		ObjChunk chunk;
+		chunk.begin = p;
+		chunk.end = (size_t)(fileEnd - p) <= chunkSize ? fileEnd : SkipLine(p + chunkSize, fileEnd);
+		p = chunk.end;
+		chunks.push_back(move(chunk));
+	}
+
+	WorkStealingPool pool(numThreads);
+	pool.Run((int)chunks.size(), [&](int c, int)
+	{
+		ParseChunk(chunks[c]);
+	});
+
+	// Where each chunk's vertices and indices go in the final arrays
+	vector<size_t> firstVertex(chunks.size() + 1, 0);
+	vector<size_t> firstIndex(chunks.size() + 1, 0);
+	for (size_t c = 0; c < chunks.size(); ++c)
+	{
+		if (chunks[c].error)
+		{
+			cout << "ERROR: could not read mesh file " << fileName << ": " << chunks[c].error << endl;
+			return false;
+		}
+		firstVertex[c + 1] = firstVertex[c] + chunks[c].vertices.size();
+		firstIndex[c + 1] = firstIndex[c] + chunks[c].indices.size();
+	}
+
+	const size_t numVertices = firstVertex.back();
+	if (numVertices > UINT32_MAX)
+	{
+		cout << "ERROR: too many vertices in mesh file " << fileName << endl;
+		return false;
+	}
+	vertices.resize(numVertices);
+	indices.resize(firstIndex.back());
+
+	// Copy each chunk into place, and let it go as soon as it's done with
+	vector<char> badIndex(chunks.size(), 0);
+	pool.Run((int)chunks.size(), [&](int c, int)
+	{
+		ObjChunk& chunk = chunks[c];
+		for (const size_t i : chunk.relative)
+		{
+			chunk.indices[i] = (uint32_t)((int64_t)firstVertex[c] + (int32_t)chunk.indices[i]);
+		}
+		for (const uint32_t index : chunk.indices)
+		{
+			badIndex[c] |= index >= numVertices;
+		}
+		copy(chunk.vertices.begin(), chunk.vertices.end(), vertices.begin() + firstVertex[c]);
+		copy(chunk.indices.begin(), chunk.indices.end(), indices.begin() + firstIndex[c]);
+		chunk = ObjChunk();
+	});
+
+	for (const char bad : badIndex)
+	{
+		if (bad)
+		{
+			cout << "ERROR: could not read mesh file " << fileName << ": a face refers to a vertex that isn't there" << endl;
+			vertices.clear();
+			indices.clear();
+			return false;
+		}
+	}
+	return true;
+}
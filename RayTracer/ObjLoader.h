@@ -0,0 +1,33 @@
+#pragma once
+#include <eigen3/Eigen/Dense>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Files are cut into pieces about this big, and the pieces parsed in parallel
+#define OBJ_CHUNK_SIZE (1 << 22)
+
+/*
+	Read the triangles out of a Wavefront OBJ file.
+
+	Only geometry is read: "v" lines give vertices, and "f" lines give
+	faces, with three indices per triangle going into indices. Faces
+	with more corners are split into a fan of triangles. Texture
+	coordinates, normals, groups and materials are skipped over.
+
+	The file is mapped rather than read, and cut into chunks at line
+	breaks. The chunks are parsed in parallel, straight out of the
+	mapping, with no strings made along the way, and then copied into
+	place. Negative (relative) indices can point back into an earlier
+	chunk, so those are fixed up once every chunk's vertex count is known.
+
+	numThreads < 1 means use every hardware thread. chunkSize is only
+	there so tests can make lots of chunks out of a small file.
+*/
+bool LoadObj(
+	const std::string& fileName,
+	std::vector<Eigen::Vector3f>& vertices,
+	std::vector<uint32_t>& indices,
+	const int numThreads = 0,
+	const size_t chunkSize = OBJ_CHUNK_SIZE);
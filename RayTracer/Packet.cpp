@@ -0,0 +1,136 @@
+#include "Packet.h"
+
+#if RT_X86_SIMD && defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+using namespace Eigen;
+using namespace std;
+
+//-----------------------------------------------------------
+/*
+	Work out what the CPU can run.
+
+	GCC and Clang have a builtin for this. On MSVC we ask cpuid
+	directly, and also check the OS saves the wide registers on
+	a context switch, since without that the instructions fault.
+*/
+static int DetectPacketWidth()
+{
+#if !RT_X86_SIMD
+	return 1;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	const int maxLeaf = info[0];
+
+	__cpuid(info, 1);
+	const bool osxsave = (info[2] & (1 << 27)) != 0;
+	const bool avx = (info[2] & (1 << 28)) != 0;
+	const bool sse2 = (info[3] & (1 << 26)) != 0;
+	if (!sse2)
+	{
+		return 1;
+	}
+	if (!osxsave || !avx || maxLeaf < 7)
+	{
+		return 4;
+	}
+
+	const unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+	const bool avx2 = (info[1] & (1 << 5)) != 0;
+	const bool avx512f = (info[1] & (1 << 16)) != 0;
+	if (avx512f && (xcr0 & 0xE6) == 0xE6)
+	{
+		return 16;
+	}
+	if (avx2 && (xcr0 & 0x6) == 0x6)
+	{
+		return 8;
+	}
+	return 4;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+	{
+		return 16;
+	}
+	if (__builtin_cpu_supports("avx2"))
+	{
+		return 8;
+	}
+	if (__builtin_cpu_supports("sse2"))
+	{
+		return 4;
+	}
+	return 1;
+#endif
+}
+
+int GetNativePacketWidth()
+{
+	static const int width = DetectPacketWidth();
+	return width;
+}
+
+PacketKernel GetPacketKernel(int width)
+{
+	width = min(width, GetNativePacketWidth());
+#if RT_X86_SIMD
+	if (width >= 16)
+	{
+		return TracePacketAVX512;
+	}
+	if (width >= 8)
+	{
+		return TracePacketAVX2;
+	}
+	if (width >= 4)
+	{
+		return TracePacketSSE;
+	}
+#endif
+	return TracePacketScalar;
+}
+
+void TracePacket(
+	const CompiledScene& scene,
+	const RayPacket& packet,
+	const float closestDist,
+	PacketHits& hits)
+{
+	static const PacketKernel kernel = GetPacketKernel(GetNativePacketWidth());
+	kernel(scene, packet, closestDist, hits);
+}
+
+/*
+	The reference version. The SIMD kernels have to agree with this exactly.
+*/
+void TracePacketScalar(
+	const CompiledScene& scene,
+	const RayPacket& packet,
+	const float closestDist,
+	PacketHits& hits)
+{
+	const Vector3f origin(packet.origin[0], packet.origin[1], packet.origin[2]);
+	for (int i = 0; i < packet.count; ++i)
+	{
+		const Vector3f direction(packet.dx[i], packet.dy[i], packet.dz[i]);
+		float distance = closestDist;
+		HitRecord hit;
+		if (scene.Intersect(origin, direction, distance, hit))
+		{
+			hits.distance[i] = distance;
+			hits.type[i] = hit.type;
+			hits.index[i] = hit.index;
+		}
+		else
+		{
+			hits.distance[i] = closestDist;
+			hits.type[i] = PRIMITIVE_NONE;
+			hits.index[i] = -1;
+		}
+	}
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <eigen3/Eigen/Dense>
+
+#include "CompiledScene.h"
+
+// Rays per packet. This is also the widest kernel, so an AVX-512
+// kernel covers a packet in one go, AVX2 in two steps and SSE in four.
+#define PACKET_SIZE 16
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define RT_X86_SIMD 1
+#else
+#define RT_X86_SIMD 0
+#endif
+
+/**********************************************/
+/*############# PACKET STRUCTURES ############*/
+/**********************************************/
+
+// Up to PACKET_SIZE rays that share an origin, like primary rays
+// from the camera. Directions are stored one component per array,
+// so a kernel can load the same component of several rays at once.
+// Directions must be unit length.
+struct alignas(64) RayPacket
+{
+	float dx[PACKET_SIZE];
+	float dy[PACKET_SIZE];
+	float dz[PACKET_SIZE];
+	float origin[3];
+
+	// Lanes [0, count) hold rays. The rest are ignored.
+	int count = 0;
+};
+
+// The closest hit for each lane of a packet. Lanes that hit
+// nothing have type PRIMITIVE_NONE. These match what
+// CompiledScene::Intersect gives for the same ray, bit for bit.
+struct alignas(64) PacketHits
+{
+	float distance[PACKET_SIZE];
+	int type[PACKET_SIZE];
+	int index[PACKET_SIZE];
+};
+
+// Every kernel looks like this. closestDist is the furthest a hit may be,
+// as with CompiledScene::Intersect.
+typedef void (*PacketKernel)(
+	const CompiledScene& scene,
+	const RayPacket& packet,
+	const float closestDist,
+	PacketHits& hits);
+
+// The instruction set specific kernels. Each is built in its own file
+// with that instruction set turned on, and must only be called on
+// a CPU that has it.
+#if RT_X86_SIMD
+void TracePacketSSE(const CompiledScene& scene, const RayPacket& packet, const float closestDist, PacketHits& hits);
+void TracePacketAVX2(const CompiledScene& scene, const RayPacket& packet, const float closestDist, PacketHits& hits);
+void TracePacketAVX512(const CompiledScene& scene, const RayPacket& packet, const float closestDist, PacketHits& hits);
+#endif
+
+// One ray at a time through CompiledScene::Intersect. Used where there's no SIMD.
+void TracePacketScalar(const CompiledScene& scene, const RayPacket& packet, const float closestDist, PacketHits& hits);
+
+// The widest kernel this CPU can run: 16, 8, 4, or 1 for scalar
+int GetNativePacketWidth();
+
+// Kernel for a given width. Widths the CPU can't run fall back to
+// the widest one it can.
+PacketKernel GetPacketKernel(int width);
+
+// Trace a packet with the widest kernel the CPU supports
+void TracePacket(
+	const CompiledScene& scene,
+	const RayPacket& packet,
+	const float closestDist,
+	PacketHits& hits);
@@ -0,0 +1,80 @@
+#include "Packet.h"
+
+#if RT_X86_SIMD
+
+// Everything from here down is built for AVX2, including the kernels in PacketKernels.inl
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx2"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+// Fusing a multiply and add into one FMA rounds differently to the scalar kernels
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#include <immintrin.h>
+
+namespace
+{
+
+// Eight lanes in AVX registers
+struct Lanes
+{
+	static const int WIDTH = 8;
+	typedef __m256 Float;
+	typedef __m256i Int;
+	typedef __m256 Mask;
+
+	static Float Load(const float* p) { return _mm256_load_ps(p); }
+	static void Store(float* p, Float v) { _mm256_store_ps(p, v); }
+	static Float Set1(float v) { return _mm256_set1_ps(v); }
+	static Int LoadI(const int* p) { return _mm256_load_si256((const __m256i*)p); }
+	static void StoreI(int* p, Int v) { _mm256_store_si256((__m256i*)p, v); }
+	static Int Set1I(int v) { return _mm256_set1_epi32(v); }
+
+	static Float Add(Float a, Float b) { return _mm256_add_ps(a, b); }
+	static Float Sub(Float a, Float b) { return _mm256_sub_ps(a, b); }
+	static Float Mul(Float a, Float b) { return _mm256_mul_ps(a, b); }
+	static Float Div(Float a, Float b) { return _mm256_div_ps(a, b); }
+	static Float Sqrt(Float a) { return _mm256_sqrt_ps(a); }
+
+	static Mask Lt(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	static Mask Le(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+	static Mask Gt(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+	static Mask Eq(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+	static Mask Neq(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_OQ); }
+	static Mask LtI(Int a, Int b) { return _mm256_castsi256_ps(_mm256_cmpgt_epi32(b, a)); }
+
+	static Mask And(Mask a, Mask b) { return _mm256_and_ps(a, b); }
+	static Mask Or(Mask a, Mask b) { return _mm256_or_ps(a, b); }
+	static Float Select(Mask m, Float a, Float b) { return _mm256_blendv_ps(b, a, m); }
+	static Int SelectI(Mask m, Int a, Int b)
+	{
+		return _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(b), _mm256_castsi256_ps(a), m));
+	}
+
+	static unsigned Bits(Mask m) { return (unsigned)_mm256_movemask_ps(m); }
+	static Mask FromBits(unsigned bits)
+	{
+		const __m256i laneBits = _mm256_set_epi32(128, 64, 32, 16, 8, 4, 2, 1);
+		const __m256i set = _mm256_and_si256(_mm256_set1_epi32((int)bits), laneBits);
+		return _mm256_castsi256_ps(_mm256_cmpeq_epi32(set, laneBits));
+	}
+};
+
+} // namespace
+
+#include "PacketKernels.inl"
+
+void TracePacketAVX2(const CompiledScene& scene, const RayPacket& packet, const float closestDist, PacketHits& hits)
+{
+	TracePacketLanes<Lanes>(scene, packet, closestDist, hits);
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#endif
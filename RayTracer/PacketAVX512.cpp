@@ -0,0 +1,73 @@
+#include "Packet.h"
+
+#if RT_X86_SIMD
+
+// Everything from here down is built for AVX-512, including the kernels in PacketKernels.inl
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("avx512f"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+// Fusing a multiply and add into one FMA rounds differently to the scalar kernels
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#include <immintrin.h>
+
+namespace
+{
+
+// Sixteen lanes, a whole packet, in AVX-512 registers.
+// Comparisons give mask registers directly.
+struct Lanes
+{
+	static const int WIDTH = 16;
+	typedef __m512 Float;
+	typedef __m512i Int;
+	typedef __mmask16 Mask;
+
+	static Float Load(const float* p) { return _mm512_load_ps(p); }
+	static void Store(float* p, Float v) { _mm512_store_ps(p, v); }
+	static Float Set1(float v) { return _mm512_set1_ps(v); }
+	static Int LoadI(const int* p) { return _mm512_load_si512((const void*)p); }
+	static void StoreI(int* p, Int v) { _mm512_store_si512((void*)p, v); }
+	static Int Set1I(int v) { return _mm512_set1_epi32(v); }
+
+	static Float Add(Float a, Float b) { return _mm512_add_ps(a, b); }
+	static Float Sub(Float a, Float b) { return _mm512_sub_ps(a, b); }
+	static Float Mul(Float a, Float b) { return _mm512_mul_ps(a, b); }
+	static Float Div(Float a, Float b) { return _mm512_div_ps(a, b); }
+	static Float Sqrt(Float a) { return _mm512_sqrt_ps(a); }
+
+	static Mask Lt(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+	static Mask Le(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+	static Mask Gt(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_GT_OQ); }
+	static Mask Eq(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ); }
+	static Mask Neq(Float a, Float b) { return _mm512_cmp_ps_mask(a, b, _CMP_NEQ_OQ); }
+	static Mask LtI(Int a, Int b) { return _mm512_cmplt_epi32_mask(a, b); }
+
+	static Mask And(Mask a, Mask b) { return (Mask)(a & b); }
+	static Mask Or(Mask a, Mask b) { return (Mask)(a | b); }
+	static Float Select(Mask m, Float a, Float b) { return _mm512_mask_blend_ps(m, b, a); }
+	static Int SelectI(Mask m, Int a, Int b) { return _mm512_mask_blend_epi32(m, b, a); }
+
+	static unsigned Bits(Mask m) { return (unsigned)m; }
+	static Mask FromBits(unsigned bits) { return (Mask)bits; }
+};
+
+} // namespace
+
+#include "PacketKernels.inl"
+
+void TracePacketAVX512(const CompiledScene& scene, const RayPacket& packet, const float closestDist, PacketHits& hits)
+{
+	TracePacketLanes<Lanes>(scene, packet, closestDist, hits);
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#endif
@@ -0,0 +1,300 @@
+// The packet tracer, written once against a Lanes type.
+//
+// This gets included by each of PacketSSE.cpp, PacketAVX2.cpp and
+// PacketAVX512.cpp, after they define Lanes and switch on their
+// instruction set, so each gets its own copy built for that instruction set.
+//
+// Lanes has to provide, for WIDTH lanes at a time:
+//   Float, Int, Mask                  vector and mask types
+//   Load, Store, Set1                 float loads/stores/broadcast
+//   LoadI, StoreI, Set1I              the same for ints
+//   Add, Sub, Mul, Div, Sqrt          IEEE arithmetic, rounded like scalar code
+//   Lt, Le, Gt, Eq, Neq, LtI          comparisons; false when either side is NaN
+//   And, Or                           mask logic
+//   Select, SelectI                   mask ? a : b per lane
+//   Bits, FromBits                    mask to and from an int, one bit per lane
+//
+// The arithmetic copies IntersectSphere and IntersectPlane operation for
+// operation, so each lane gets the same answer as the scalar kernels.
+// Triangles use the scalar kernel itself.
+
+namespace
+{
+
+template <class L>
+inline unsigned LaneBits(const unsigned packetMask, const int base)
+{
+	return (packetMask >> base) & ((1u << L::WIDTH) - 1);
+}
+
+template <class L>
+inline void IntersectSpherePacket(
+	const SphereData& sphere,
+	const int key,
+	const RayPacket& packet,
+	const unsigned packetMask,
+	float* closestDist,
+	int* closestKey)
+{
+	typedef typename L::Float Float;
+	typedef typename L::Int Int;
+	typedef typename L::Mask Mask;
+
+	const float radius = sphere.radius;
+	const float outer = radius + (float)EPSILON;
+	const float inner = std::max(radius - (float)EPSILON, 0.f);
+	const Float ocx = L::Set1(sphere.centre[0] - packet.origin[0]);
+	const Float ocy = L::Set1(sphere.centre[1] - packet.origin[1]);
+	const Float ocz = L::Set1(sphere.centre[2] - packet.origin[2]);
+	const Float outerSq = L::Set1(outer * outer);
+	const Float innerSq = L::Set1(inner * inner);
+	const Float radiusSq = L::Set1(radius * radius);
+	const Float epsilon = L::Set1((float)EPSILON);
+	const Int keys = L::Set1I(key);
+
+	for (int base = 0; base < PACKET_SIZE; base += L::WIDTH)
+	{
+		const unsigned lanes = LaneBits<L>(packetMask, base);
+		if (lanes == 0)
+		{
+			continue;
+		}
+
+		const Float dx = L::Load(packet.dx + base);
+		const Float dy = L::Load(packet.dy + base);
+		const Float dz = L::Load(packet.dz + base);
+
+		const Float proj = L::Add(L::Add(L::Mul(ocx, dx), L::Mul(ocy, dy)), L::Mul(ocz, dz));
+		const Float px = L::Sub(ocx, L::Mul(proj, dx));
+		const Float py = L::Sub(ocy, L::Mul(proj, dy));
+		const Float pz = L::Sub(ocz, L::Mul(proj, dz));
+		const Float distSq = L::Add(L::Add(L::Mul(px, px), L::Mul(py, py)), L::Mul(pz, pz));
+
+		const Mask inside = L::And(L::Lt(distSq, outerSq), L::FromBits(lanes));
+		if (L::Bits(inside) == 0)
+		{
+			continue;
+		}
+
+		// Lanes that take the tangent branch get a NaN root here, but it's thrown away
+		const Float root = L::Sqrt(L::Sub(radiusSq, distSq));
+		const Float t = L::Select(L::Gt(distSq, innerSq), proj, L::Sub(proj, root));
+
+		const Float best = L::Load(closestDist + base);
+		const Int bestKey = L::LoadI(closestKey + base);
+		const Mask closer = L::Or(L::Lt(t, best), L::And(L::Eq(t, best), L::LtI(keys, bestKey)));
+		const Mask hit = L::And(L::And(inside, L::Gt(t, epsilon)), closer);
+
+		L::Store(closestDist + base, L::Select(hit, t, best));
+		L::StoreI(closestKey + base, L::SelectI(hit, keys, bestKey));
+	}
+}
+
+template <class L>
+inline void IntersectPlanePacket(
+	const PlaneData& plane,
+	const int key,
+	const RayPacket& packet,
+	const unsigned packetMask,
+	float* closestDist,
+	int* closestKey)
+{
+	typedef typename L::Float Float;
+	typedef typename L::Int Int;
+	typedef typename L::Mask Mask;
+
+	const Float nx = L::Set1(plane.normal[0]);
+	const Float ny = L::Set1(plane.normal[1]);
+	const Float nz = L::Set1(plane.normal[2]);
+	const float height = plane.offset - (plane.normal[0] * packet.origin[0] + plane.normal[1] * packet.origin[1] + plane.normal[2] * packet.origin[2]);
+	const Float heights = L::Set1(height);
+	const Float zero = L::Set1(0.f);
+	const Float epsilon = L::Set1((float)EPSILON);
+	const Int keys = L::Set1I(key);
+
+	for (int base = 0; base < PACKET_SIZE; base += L::WIDTH)
+	{
+		const unsigned lanes = LaneBits<L>(packetMask, base);
+		if (lanes == 0)
+		{
+			continue;
+		}
+
+		const Float dx = L::Load(packet.dx + base);
+		const Float dy = L::Load(packet.dy + base);
+		const Float dz = L::Load(packet.dz + base);
+
+		const Float dot = L::Add(L::Add(L::Mul(nx, dx), L::Mul(ny, dy)), L::Mul(nz, dz));
+		const Float t = L::Div(heights, dot);
+
+		const Float best = L::Load(closestDist + base);
+		const Int bestKey = L::LoadI(closestKey + base);
+		const Mask closer = L::Or(L::Lt(t, best), L::And(L::Eq(t, best), L::LtI(keys, bestKey)));
+		const Mask valid = L::And(L::Neq(dot, zero), L::FromBits(lanes));
+		const Mask hit = L::And(L::And(valid, L::Gt(t, epsilon)), closer);
+
+		L::Store(closestDist + base, L::Select(hit, t, best));
+		L::StoreI(closestKey + base, L::SelectI(hit, keys, bestKey));
+	}
+}
+
+/*
+	Which lanes reach this box before their closest hit so far.
+	Same slab test as the scalar BVH traversal.
+*/
+template <class L>
+inline unsigned IntersectBoxPacket(
+	const BVHNode& node,
+	const RayPacket& packet,
+	const float* invDx,
+	const float* invDy,
+	const float* invDz,
+	const unsigned packetMask,
+	const float* closestDist)
+{
+	typedef typename L::Float Float;
+	typedef typename L::Mask Mask;
+
+	const float* invDir[3] = { invDx, invDy, invDz };
+	unsigned result = 0;
+	for (int base = 0; base < PACKET_SIZE; base += L::WIDTH)
+	{
+		const unsigned lanes = LaneBits<L>(packetMask, base);
+		if (lanes == 0)
+		{
+			continue;
+		}
+
+		Float tNear = L::Set1(0.f);
+		Float tFar = L::Load(closestDist + base);
+		for (int a = 0; a < 3; ++a)
+		{
+			const Float inv = L::Load(invDir[a] + base);
+			Float t0 = L::Mul(L::Set1(node.lower[a] - packet.origin[a]), inv);
+			Float t1 = L::Mul(L::Set1(node.upper[a] - packet.origin[a]), inv);
+			const Mask swap = L::Gt(t0, t1);
+			const Float lo = L::Select(swap, t1, t0);
+			const Float hi = L::Select(swap, t0, t1);
+			tNear = L::Select(L::Gt(lo, tNear), lo, tNear);
+			tFar = L::Select(L::Lt(hi, tFar), hi, tFar);
+		}
+
+		result |= (L::Bits(L::Le(tNear, tFar)) & lanes) << base;
+	}
+	return result;
+}
+
+/*
+	Trace a whole packet.
+
+	The packet goes down the BVH together. A node is opened if any lane
+	still reaches it, and only those lanes are tested against what's inside.
+	Children are pushed so that the one nearer along the first live ray
+	is opened first.
+*/
+template <class L>
+void TracePacketLanes(
+	const CompiledScene& scene,
+	const RayPacket& packet,
+	const float maxDist,
+	PacketHits& hits)
+{
+	alignas(64) float closestDist[PACKET_SIZE];
+	alignas(64) int closestKey[PACKET_SIZE];
+	alignas(64) float invDx[PACKET_SIZE];
+	alignas(64) float invDy[PACKET_SIZE];
+	alignas(64) float invDz[PACKET_SIZE];
+	for (int i = 0; i < PACKET_SIZE; ++i)
+	{
+		closestDist[i] = maxDist;
+		closestKey[i] = NO_PRIMITIVE_KEY;
+		invDx[i] = i < packet.count ? 1.f / packet.dx[i] : 0.f;
+		invDy[i] = i < packet.count ? 1.f / packet.dy[i] : 0.f;
+		invDz[i] = i < packet.count ? 1.f / packet.dz[i] : 0.f;
+	}
+
+	const unsigned packetMask = packet.count >= PACKET_SIZE ? (1u << PACKET_SIZE) - 1 : (1u << packet.count) - 1;
+
+	const auto& planes = scene.GetPlanes();
+	for (int i = 0; i < (int)planes.size(); ++i)
+	{
+		IntersectPlanePacket<L>(planes[i], PrimitiveKey(PRIMITIVE_PLANE, i), packet, packetMask, closestDist, closestKey);
+	}
+
+	const auto& nodes = scene.GetBVH().GetNodes();
+	const auto& indices = scene.GetBVH().GetPrimitiveIndices();
+	const auto& spheres = scene.GetSpheres();
+	if (!nodes.empty() && packetMask != 0)
+	{
+		int firstLane = 0;
+		while (!(packetMask & (1u << firstLane)))
+		{
+			++firstLane;
+		}
+		const float leadDir[3] = { packet.dx[firstLane], packet.dy[firstLane], packet.dz[firstLane] };
+
+		// Every pop pushes at most two, so this is never deeper than the tree plus one
+		int stack[BVH_MAX_DEPTH + 2];
+		int stackSize = 0;
+		stack[stackSize++] = 0;
+		while (stackSize > 0)
+		{
+			const BVHNode& node = nodes[stack[--stackSize]];
+			const unsigned nodeMask = IntersectBoxPacket<L>(node, packet, invDx, invDy, invDz, packetMask, closestDist);
+			if (nodeMask == 0)
+			{
+				continue;
+			}
+
+			if (node.IsLeaf())
+			{
+				for (int i = node.first; i < node.first + node.count; ++i)
+				{
+					const int p = indices[i];
+					IntersectSpherePacket<L>(spheres[p], PrimitiveKey(PRIMITIVE_SPHERE, p), packet, nodeMask, closestDist, closestKey);
+				}
+				continue;
+			}
+
+			const BVHNode& left = nodes[node.first];
+			const BVHNode& right = nodes[node.first + 1];
+			float leftDist = 0.f, rightDist = 0.f;
+			for (int a = 0; a < 3; ++a)
+			{
+				leftDist += (left.lower[a] + left.upper[a] - 2.f * packet.origin[a]) * leadDir[a];
+				rightDist += (right.lower[a] + right.upper[a] - 2.f * packet.origin[a]) * leadDir[a];
+			}
+			if (leftDist < rightDist)
+			{
+				stack[stackSize++] = node.first + 1;
+				stack[stackSize++] = node.first;
+			}
+			else
+			{
+				stack[stackSize++] = node.first;
+				stack[stackSize++] = node.first + 1;
+			}
+		}
+	}
+
+	// The watertight test picks its axes ray by ray, which doesn't suit
+	// lanes, so triangles go through the scalar test one lane at a time
+	if (!scene.GetTriangleBVH().IsEmpty())
+	{
+		const Eigen::Vector3f origin(packet.origin[0], packet.origin[1], packet.origin[2]);
+		for (int i = 0; i < packet.count; ++i)
+		{
+			const Eigen::Vector3f direction(packet.dx[i], packet.dy[i], packet.dz[i]);
+			scene.FindClosestTriangle(origin, direction, closestDist[i], closestKey[i]);
+		}
+	}
+
+	for (int i = 0; i < packet.count; ++i)
+	{
+		hits.distance[i] = closestDist[i];
+		hits.type[i] = KeyType(closestKey[i]);
+		hits.index[i] = KeyIndex(closestKey[i]);
+	}
+}
+
+} // namespace
@@ -0,0 +1,83 @@
+#include "Packet.h"
+
+#if RT_X86_SIMD
+
+// Everything from here down is built for SSE2, including the kernels in PacketKernels.inl
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("sse2"))), apply_to = function)
+#elif defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("sse2")
+// Fusing a multiply and add into one FMA rounds differently to the scalar kernels
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+#include <emmintrin.h>
+
+namespace
+{
+
+// Four lanes in SSE registers. SSE2 has no blend instruction,
+// so selects are done with and/andnot/or.
+struct Lanes
+{
+	static const int WIDTH = 4;
+	typedef __m128 Float;
+	typedef __m128i Int;
+	typedef __m128 Mask;
+
+	static Float Load(const float* p) { return _mm_load_ps(p); }
+	static void Store(float* p, Float v) { _mm_store_ps(p, v); }
+	static Float Set1(float v) { return _mm_set1_ps(v); }
+	static Int LoadI(const int* p) { return _mm_load_si128((const __m128i*)p); }
+	static void StoreI(int* p, Int v) { _mm_store_si128((__m128i*)p, v); }
+	static Int Set1I(int v) { return _mm_set1_epi32(v); }
+
+	static Float Add(Float a, Float b) { return _mm_add_ps(a, b); }
+	static Float Sub(Float a, Float b) { return _mm_sub_ps(a, b); }
+	static Float Mul(Float a, Float b) { return _mm_mul_ps(a, b); }
+	static Float Div(Float a, Float b) { return _mm_div_ps(a, b); }
+	static Float Sqrt(Float a) { return _mm_sqrt_ps(a); }
+
+	static Mask Lt(Float a, Float b) { return _mm_cmplt_ps(a, b); }
+	static Mask Le(Float a, Float b) { return _mm_cmple_ps(a, b); }
+	static Mask Gt(Float a, Float b) { return _mm_cmpgt_ps(a, b); }
+	static Mask Eq(Float a, Float b) { return _mm_cmpeq_ps(a, b); }
+	// cmpneq is true for NaN, so check both sides are ordered as well
+	static Mask Neq(Float a, Float b) { return _mm_and_ps(_mm_cmpneq_ps(a, b), _mm_cmpord_ps(a, b)); }
+	static Mask LtI(Int a, Int b) { return _mm_castsi128_ps(_mm_cmplt_epi32(a, b)); }
+
+	static Mask And(Mask a, Mask b) { return _mm_and_ps(a, b); }
+	static Mask Or(Mask a, Mask b) { return _mm_or_ps(a, b); }
+	static Float Select(Mask m, Float a, Float b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+	static Int SelectI(Mask m, Int a, Int b)
+	{
+		const __m128i mi = _mm_castps_si128(m);
+		return _mm_or_si128(_mm_and_si128(mi, a), _mm_andnot_si128(mi, b));
+	}
+
+	static unsigned Bits(Mask m) { return (unsigned)_mm_movemask_ps(m); }
+	static Mask FromBits(unsigned bits)
+	{
+		const __m128i laneBits = _mm_set_epi32(8, 4, 2, 1);
+		const __m128i set = _mm_and_si128(_mm_set1_epi32((int)bits), laneBits);
+		return _mm_castsi128_ps(_mm_cmpeq_epi32(set, laneBits));
+	}
+};
+
+} // namespace
+
+#include "PacketKernels.inl"
+
+void TracePacketSSE(const CompiledScene& scene, const RayPacket& packet, const float closestDist, PacketHits& hits)
+{
+	TracePacketLanes<Lanes>(scene, packet, closestDist, hits);
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#elif defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+
+#endif
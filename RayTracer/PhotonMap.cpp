@@ -0,0 +1,613 @@
+#include "PhotonMap.h"
+#include "Render.h"
+#include "Sampler.h"
+#include "Scheduler.h"
+#include "Stats.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace Eigen;
+using namespace std;
+
+#define PI_F 3.14159265f
+
+//-----------------------------------------------------------
+/*
+	Ward's RGBE: the largest channel sets a shared exponent, and each
+	channel keeps 8 bits of mantissa under it. Good to about 1% of the
+	largest channel, over a huge range, in 4 bytes.
+*/
+void Photon::SetPower(const Vector3f& power)
+{
+	const float largest = power.maxCoeff();
+	if (!(largest > 1e-32f))
+	{
+		this->power[0] = this->power[1] = this->power[2] = this->power[3] = 0;
+		return;
+	}
+	int exponent = 0;
+	const float scale = frexp(largest, &exponent) * 256.f / largest;
+	for (int c = 0; c < 3; ++c)
+	{
+		this->power[c] = (uint8_t)min(max(power[c] * scale, 0.f), 255.f);
+	}
+	this->power[3] = (uint8_t)(exponent + 128);
+}
+
+Vector3f Photon::GetPower() const
+{
+	if (power[3] == 0)
+	{
+		return Vector3f::Zero();
+	}
+	const float scale = ldexp(1.f, (int)power[3] - (128 + 8));
+	return Vector3f(power[0] + 0.5f, power[1] + 0.5f, power[2] + 0.5f) * scale;
+}
+
+// Sines and cosines at the middle of each of the 256 steps
+// the angles are cut into, so directions decode with no trig
+struct DirectionTable
+{
+	float cosTheta[256], sinTheta[256];
+	float cosPhi[256], sinPhi[256];
+
+	DirectionTable()
+	{
+		for (int i = 0; i < 256; ++i)
+		{
+			const float theta = (i + 0.5f) * (PI_F / 256.f);
+			const float phi = (i + 0.5f) * (2.f * PI_F / 256.f);
+			cosTheta[i] = cos(theta);
+			sinTheta[i] = sin(theta);
+			cosPhi[i] = cos(phi);
+			sinPhi[i] = sin(phi);
+		}
+	}
+};
+
+static const DirectionTable& GetDirectionTable()
+{
+	static const DirectionTable table;
+	return table;
+}
+
+void Photon::SetDirection(const Vector3f& direction)
+{
+	const float t = acos(min(max(direction[2], -1.f), 1.f)) * (256.f / PI_F);
+	float p = atan2(direction[1], direction[0]) * (256.f / (2.f * PI_F));
+	if (p < 0.f)
+	{
+		p += 256.f;
+	}
+	theta = (uint8_t)min((int)t, 255);
+	phi = (uint8_t)min((int)p, 255);
+}
+
+Vector3f Photon::GetDirection() const
+{
+	const DirectionTable& table = GetDirectionTable();
+	return Vector3f(
+		table.sinTheta[theta] * table.cosPhi[phi],
+		table.sinTheta[theta] * table.sinPhi[phi],
+		table.cosTheta[theta]);
+}
+
+//-----------------------------------------------------------
+/*
+	How many of n nodes go to the left of the root, when the tree
+	has to be complete. h full levels take 2^h - 1 of them, and what's
+	left goes on the last level, filling the left half first.
+*/
+static size_t LeftBalancedSize(const size_t n)
+{
+	int h = 0;
+	while (((size_t)2 << h) <= n)
+	{
+		++h;
+	}
+	const size_t lastLevel = n - (((size_t)1 << h) - 1);
+	const size_t halfLast = (size_t)1 << (h - 1);
+	return (halfLast - 1) + min(lastLevel, halfLast);
+}
+
+// The axis the photons in [first, last) spread furthest along
+static int WidestAxis(const Photon* first, const Photon* last)
+{
+	Vector3f lower = Vector3f::Constant(INFINITY);
+	Vector3f upper = Vector3f::Constant(-INFINITY);
+	for (const Photon* p = first; p != last; ++p)
+	{
+		const Vector3f position(p->position[0], p->position[1], p->position[2]);
+		lower = lower.cwiseMin(position);
+		upper = upper.cwiseMax(position);
+	}
+	int axis = 0;
+	(upper - lower).maxCoeff(&axis);
+	return axis;
+}
+
+// Split photons [first, last) at the left balanced median into node of
+// tree, which is then split no further. Gives back where the median went.
+static Photon* SplitAtMedian(Photon* first, Photon* last, vector<Photon>& tree, const size_t node)
+{
+	const int axis = WidestAxis(first, last);
+	Photon* median = first + LeftBalancedSize(last - first);
+	nth_element(first, median, last, [axis](const Photon& a, const Photon& b)
+	{
+		return a.position[axis] < b.position[axis];
+	});
+	tree[node] = *median;
+	tree[node].plane = (uint16_t)axis;
+	return median;
+}
+
+static void Balance(Photon* first, Photon* last, vector<Photon>& tree, const size_t node)
+{
+	if (first == last)
+	{
+		return;
+	}
+	if (last - first == 1)
+	{
+		tree[node] = *first;
+		tree[node].plane = 0;
+		return;
+	}
+	Photon* median = SplitAtMedian(first, last, tree, node);
+	Balance(first, median, tree, 2 * node + 1);
+	Balance(median + 1, last, tree, 2 * node + 2);
+}
+
+void PhotonMap::Build(vector<Photon>& photons, WorkStealingPool& pool)
+{
+	tree.assign(photons.size(), Photon());
+	tree.shrink_to_fit();
+
+	// Split breadth first until there are a few subtrees per thread,
+	// so the stealing can even out subtrees of different depths
+	struct Subtree
+	{
+		Photon* first;
+		Photon* last;
+		size_t node;
+	};
+	vector<Subtree> subtrees = { { photons.data(), photons.data() + photons.size(), 0 } };
+	const size_t wanted = 4 * (size_t)pool.GetNumThreads();
+	while (subtrees.size() < wanted)
+	{
+		vector<Subtree> next;
+		for (const Subtree& s : subtrees)
+		{
+			if (s.last - s.first <= PHOTON_BATCH_SIZE)
+			{
+				next.push_back(s);
+				continue;
+			}
+			Photon* median = SplitAtMedian(s.first, s.last, tree, s.node);
+			next.push_back({ s.first, median, 2 * s.node + 1 });
+			next.push_back({ median + 1, s.last, 2 * s.node + 2 });
+		}
+		if (next.size() == subtrees.size())
+		{
+			break;
+		}
+		subtrees.swap(next);
+	}
+
+	pool.Run((int)subtrees.size(), [&](int job, int)
+	{
+		Balance(subtrees[job].first, subtrees[job].last, tree, subtrees[job].node);
+	});
+}
+
+//-----------------------------------------------------------
+/*
+	The k nearest photons found so far. Until there are k of them,
+	they're just added to the end. After that they're kept as a max
+	heap on distance, so the furthest is always on top to be replaced.
+	It lives on the stack, so a search never allocates.
+*/
+struct NearestPhotons
+{
+	Vector3f point;
+	int k;
+	float maxDistSq;
+	int found = 0;
+	float distSq[MAX_NEAREST_PHOTONS];
+	const Photon* photons[MAX_NEAREST_PHOTONS];
+
+	void Add(const Photon* photon, const float d)
+	{
+		if (found < k)
+		{
+			distSq[found] = d;
+			photons[found] = photon;
+			if (++found == k)
+			{
+				for (int i = k / 2 - 1; i >= 0; --i)
+				{
+					SiftDown(i, distSq[i], photons[i]);
+				}
+				// With k in hand, nothing further than the furthest of them matters
+				maxDistSq = distSq[0];
+			}
+			return;
+		}
+		SiftDown(0, d, photon);
+		maxDistSq = distSq[0];
+	}
+
+	// Put photon at i, and move it down until it's no nearer than its children
+	void SiftDown(int i, const float d, const Photon* photon)
+	{
+		for (;;)
+		{
+			int child = 2 * i + 1;
+			if (child >= found)
+			{
+				break;
+			}
+			if (child + 1 < found && distSq[child + 1] > distSq[child])
+			{
+				++child;
+			}
+			if (distSq[child] <= d)
+			{
+				break;
+			}
+			distSq[i] = distSq[child];
+			photons[i] = photons[child];
+			i = child;
+		}
+		distSq[i] = d;
+		photons[i] = photon;
+	}
+};
+
+/*
+	Jensen's search, without the recursion: go down the side of each
+	split the point is on, leaving the other side on a stack along with
+	how far away its splitting plane is. Sides whose plane is further
+	than the furthest photon wanted by the time they come off the stack
+	are skipped.
+*/
+static void Search(const vector<Photon>& tree, NearestPhotons& nearest)
+{
+	nearest.k = min(max(nearest.k, 1), MAX_NEAREST_PHOTONS);
+
+	struct Side
+	{
+		size_t node;
+		float planeDistSq;
+	};
+	// A complete tree of any size that fits in memory is less deep than this
+	Side stack[64];
+	int stackSize = 0;
+
+	const Photon* photons = tree.data();
+	const size_t size = tree.size();
+	const float px = nearest.point[0], py = nearest.point[1], pz = nearest.point[2];
+	size_t node = 0;
+	for (;;)
+	{
+		while (node < size)
+		{
+			const Photon& photon = photons[node];
+			const float dx = photon.position[0] - px;
+			const float dy = photon.position[1] - py;
+			const float dz = photon.position[2] - pz;
+			const float distSq = dx * dx + dy * dy + dz * dz;
+			if (distSq < nearest.maxDistSq)
+			{
+				nearest.Add(&photon, distSq);
+			}
+
+			const size_t left = 2 * node + 1;
+			if (left >= size)
+			{
+				break;
+			}
+			const float delta = nearest.point[photon.plane] - photon.position[photon.plane];
+			const size_t far = delta < 0.f ? left + 1 : left;
+			if (far < size)
+			{
+				stack[stackSize++] = { far, delta * delta };
+			}
+			node = delta < 0.f ? left : left + 1;
+		}
+
+		node = size;
+		while (stackSize > 0 && node == size)
+		{
+			const Side& side = stack[--stackSize];
+			if (side.planeDistSq < nearest.maxDistSq)
+			{
+				node = side.node;
+			}
+		}
+		if (node == size)
+		{
+			return;
+		}
+	}
+}
+
+float PhotonMap::FindNearest(
+	const Vector3f& point,
+	const int k,
+	const float maxDistSq,
+	vector<const Photon*>& nearest) const
+{
+	NearestPhotons search;
+	search.point = point;
+	search.k = k;
+	search.maxDistSq = maxDistSq;
+	Search(tree, search);
+	nearest.assign(search.photons, search.photons + search.found);
+	return search.maxDistSq;
+}
+
+Vector3f PhotonMap::EstimateIrradiance(
+	const Vector3f& point,
+	const Vector3f& normal,
+	const int k,
+	const float maxDist) const
+{
+	NearestPhotons search;
+	search.point = point;
+	search.k = k;
+	search.maxDistSq = maxDist * maxDist;
+	Search(tree, search);
+
+	Vector3f power = Vector3f::Zero();
+	for (int i = 0; i < search.found; ++i)
+	{
+		const Photon& photon = *search.photons[i];
+		if (photon.GetDirection().dot(normal) < 0.f)
+		{
+			power += photon.GetPower();
+		}
+	}
+	return power / (PI_F * search.maxDistSq);
+}
+
+const Photon* PhotonMap::FindNearestFacing(
+	const Vector3f& point,
+	const Vector3f& normal,
+	const float maxDist) const
+{
+	NearestPhotons search;
+	search.point = point;
+	search.k = PHOTON_IRRADIANCE_CANDIDATES;
+	search.maxDistSq = maxDist * maxDist;
+	Search(tree, search);
+
+	const Photon* nearest = nullptr;
+	float nearestDistSq = INFINITY;
+	for (int i = 0; i < search.found; ++i)
+	{
+		if (search.distSq[i] < nearestDistSq && search.photons[i]->GetDirection().dot(normal) > 0.f)
+		{
+			nearest = search.photons[i];
+			nearestDistSq = search.distSq[i];
+		}
+	}
+	return nearest;
+}
+
+//-----------------------------------------------------------
+Vector3f PhotonMaps::GetIndirectLighting(const HitRecord& hit) const
+{
+	if (hit.diffusionFactor <= 0.f)
+	{
+		return Vector3f::Zero();
+	}
+	Vector3f incoming = caustic.EstimateIrradiance(hit.point, hit.normal, numNearest, maxDistance);
+	if (const Photon* nearest = irradiance.FindNearestFacing(hit.point, hit.normal, maxDistance))
+	{
+		incoming += nearest->GetPower();
+	}
+	return hit.diffusionFactor * hit.colour.cwiseProduct(incoming);
+}
+
+//-----------------------------------------------------------
+// A cosine weighted direction about the normal, from two numbers in [0, 1)
+static Vector3f DiffuseBounce(const Vector3f& normal, const Vector2f& u)
+{
+	// Any two directions at right angles to the normal, and each other
+	const Vector3f helper = fabs(normal[0]) > 0.9f ? Vector3f(0.f, 1.f, 0.f) : Vector3f(1.f, 0.f, 0.f);
+	const Vector3f tangent = normal.cross(helper).normalized();
+	const Vector3f bitangent = normal.cross(tangent);
+
+	const float r = sqrt(u[0]);
+	const float phi = 2.f * PI_F * u[1];
+	const float z = sqrt(max(1.f - u[0], 0.f));
+	return (r * cos(phi) * tangent + r * sin(phi) * bitangent + z * normal).normalized();
+}
+
+/*
+	Follow one photon until it's absorbed. Random numbers come two
+	dimensions to a bounce, starting at SAMPLE_DIM_PHOTON for the way
+	out of the light.
+*/
+void TracePhoton(
+	const CompiledScene& scene,
+	const Sampler& sampler,
+	const PhotonJob& job,
+	const int photon,
+	const function<void(const PhotonHit& hit)>& store)
+{
+	const Vector2f emit = sampler.Get2D(job.light, 0, photon, SAMPLE_DIM_PHOTON);
+	const float z = 1.f - 2.f * emit[0];
+	const float r = sqrt(max(1.f - z * z, 0.f));
+	const float phi = 2.f * PI_F * emit[1];
+
+	Vector3f origin = scene.GetLights()[job.light].position;
+	Vector3f direction(r * cos(phi), r * sin(phi), z);
+	Vector3f power = Vector3f::Constant(job.power);
+	bool mirrorOnly = true;
+
+	for (int bounce = 0; bounce < MAX_PHOTON_BOUNCES; ++bounce)
+	{
+		// Photons go as far as camera rays do
+		STAT_ADD(STAT_PHOTON_RAYS, 1);
+		float closestDist = MAX_SCENE_DEPTH;
+		HitRecord hit;
+		if (!scene.Intersect(origin, direction, closestDist, hit))
+		{
+			return;
+		}
+		if (bounce == 0)
+		{
+			power *= hit.distance * hit.distance;
+		}
+		const Vector3f normal = hit.normal.dot(direction) < 0.f ? hit.normal : Vector3f(-hit.normal);
+
+		if (bounce > 0 && hit.diffusionFactor > 0.f)
+		{
+			store({ hit.point, direction, normal, power, mirrorOnly, hit.type, hit.index });
+		}
+
+		// Diffuse, mirror or absorbed, with the odds the surface reflects each with
+		const Vector3f albedo = hit.diffusionFactor * hit.colour;
+		float diffuseChance = max(albedo.mean(), 0.f);
+		float mirrorChance = REFLECTANCE;
+		if (diffuseChance + mirrorChance > 1.f)
+		{
+			const float scale = 1.f / (diffuseChance + mirrorChance);
+			diffuseChance *= scale;
+			mirrorChance *= scale;
+		}
+
+		const Vector2f roulette = sampler.Get2D(job.light, 0, photon, SAMPLE_DIM_PHOTON + 1 + 2 * bounce);
+		if (roulette[0] < diffuseChance)
+		{
+			power = power.cwiseProduct(albedo) / diffuseChance;
+			direction = DiffuseBounce(normal, sampler.Get2D(job.light, 0, photon, SAMPLE_DIM_PHOTON + 2 + 2 * bounce));
+			mirrorOnly = false;
+		}
+		else if (roulette[0] < diffuseChance + mirrorChance)
+		{
+			power *= REFLECTANCE / mirrorChance;
+			direction = ReflectRay(direction, normal);
+		}
+		else
+		{
+			return;
+		}
+		origin = hit.point;
+	}
+}
+
+vector<PhotonJob> PlanPhotonJobs(
+	const CompiledScene& scene,
+	const int numPhotons,
+	const int pass)
+{
+	// Share the photons out between the lights by intensity
+	const ArrayView<LightData> lights = scene.GetLights();
+	float totalIntensity = 0.f;
+	for (const LightData& light : lights)
+	{
+		totalIntensity += light.intensity;
+	}
+
+	vector<PhotonJob> jobs;
+	for (int l = 0; l < (int)lights.size() && totalIntensity > 0.f; ++l)
+	{
+		const int count = (int)ceil((double)numPhotons * lights[l].intensity / totalIntensity);
+		// Spread over the whole sphere, a photon carries 4 pi I / count
+		const float power = 4.f * PI_F * lights[l].intensity / (float)max(count, 1);
+		// Each pass carries on along the light's sequence, wrapping round after 2^32 photons
+		const uint32_t passStart = (uint32_t)pass * (uint32_t)count;
+		for (int first = 0; first < count; first += PHOTON_BATCH_SIZE)
+		{
+			PhotonJob job;
+			job.light = l;
+			job.first = (int)(passStart + (uint32_t)first);
+			job.count = min(PHOTON_BATCH_SIZE, count - first);
+			job.power = power;
+			jobs.push_back(job);
+		}
+	}
+	return jobs;
+}
+
+void EmitPhotons(
+	const CompiledScene& scene,
+	const int numPhotons,
+	const uint32_t seed,
+	WorkStealingPool& pool,
+	PhotonMaps& maps)
+{
+	// Where each job's photons went. Irradiance points are a copy of
+	// some of the global photons, with the surface normal in place of the direction.
+	const vector<PhotonJob> jobs = PlanPhotonJobs(scene, numPhotons, 0);
+	vector<vector<Photon>> globalParts(jobs.size());
+	vector<vector<Photon>> causticParts(jobs.size());
+	vector<vector<Photon>> irradianceParts(jobs.size());
+
+	const SobolSampler sampler(seed);
+	pool.Run((int)jobs.size(), [&](int j, int)
+	{
+		vector<Photon>& global = globalParts[j];
+		vector<Photon>& caustic = causticParts[j];
+		vector<Photon>& irradiance = irradianceParts[j];
+		const function<void(const PhotonHit&)> store = [&](const PhotonHit& hit)
+		{
+			Photon stored;
+			for (int a = 0; a < 3; ++a)
+			{
+				stored.position[a] = hit.position[a];
+			}
+			stored.SetPower(hit.power);
+			stored.SetDirection(hit.direction);
+			stored.plane = 0;
+			if (hit.mirrorOnly)
+			{
+				caustic.push_back(stored);
+				return;
+			}
+			if (global.size() % PHOTON_IRRADIANCE_SPACING == 0)
+			{
+				irradiance.push_back(stored);
+				irradiance.back().SetDirection(hit.normal);
+			}
+			global.push_back(stored);
+		};
+		for (int i = 0; i < jobs[j].count; ++i)
+		{
+			TracePhoton(scene, sampler, jobs[j], jobs[j].first + i, store);
+		}
+	});
+
+	// Gather the jobs in order, so the thread count makes no difference
+	vector<Photon> global;
+	vector<Photon> caustic;
+	vector<Photon> irradiance;
+	for (size_t j = 0; j < jobs.size(); ++j)
+	{
+		global.insert(global.end(), globalParts[j].begin(), globalParts[j].end());
+		caustic.insert(caustic.end(), causticParts[j].begin(), causticParts[j].end());
+		irradiance.insert(irradiance.end(), irradianceParts[j].begin(), irradianceParts[j].end());
+		globalParts[j] = vector<Photon>();
+		causticParts[j] = vector<Photon>();
+		irradianceParts[j] = vector<Photon>();
+	}
+	maps.global.Build(global, pool);
+	maps.caustic.Build(caustic, pool);
+
+	// Each irradiance point only reads the global map, so they can all go at once
+	const int numJobs = (int)((irradiance.size() + PHOTON_BATCH_SIZE - 1) / PHOTON_BATCH_SIZE);
+	pool.Run(numJobs, [&](int job, int)
+	{
+		const size_t end = min(irradiance.size(), (size_t)(job + 1) * PHOTON_BATCH_SIZE);
+		for (size_t i = (size_t)job * PHOTON_BATCH_SIZE; i < end; ++i)
+		{
+			Photon& point = irradiance[i];
+			const Vector3f position(point.position[0], point.position[1], point.position[2]);
+			point.SetPower(maps.global.EstimateIrradiance(position, point.GetDirection(), maps.numNearest, maps.maxDistance));
+		}
+	});
+	maps.irradiance.Build(irradiance, pool);
+}
@@ -0,0 +1,238 @@
+#pragma once
+#include <eigen3/Eigen/Dense>
+#include <vector>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+#include "CompiledScene.h"
+
+class WorkStealingPool;
+class Sampler;
+
+// Photons are traced from the lights in jobs of this many
+#define PHOTON_BATCH_SIZE 4096
+// A photon path stops after this many bounces, whatever roulette says
+#define MAX_PHOTON_BOUNCES 16
+// Most photons a single density estimate can gather
+#define MAX_NEAREST_PHOTONS 256
+// Irradiance is worked out ahead of time at one global photon in this many
+#define PHOTON_IRRADIANCE_SPACING 4
+// How many of the nearest irradiance points a lookup picks from
+#define PHOTON_IRRADIANCE_CANDIDATES 8
+
+/**********************************************/
+/*############ PHOTON MAP CLASSES ############*/
+/**********************************************/
+
+/*
+	One photon, as stored: Jensen's 20 byte layout from
+	"Realistic Image Synthesis Using Photon Mapping".
+
+	The position is kept as plain floats, since the kd-tree search
+	reads it all the time. The power is packed into RGBE, a byte per
+	channel sharing one exponent, and the direction it arrived from
+	into two bytes of spherical angles. plane is the axis the kd-tree
+	splits on at this photon.
+
+	Three photons and a bit fit in a cache line.
+*/
+struct Photon
+{
+	float position[3];
+	uint8_t power[4];
+	uint8_t theta;
+	uint8_t phi;
+	uint16_t plane;
+
+	void SetPower(const Eigen::Vector3f& power);
+	Eigen::Vector3f GetPower() const;
+
+	// The direction the photon was travelling in, unit length
+	void SetDirection(const Eigen::Vector3f& direction);
+	Eigen::Vector3f GetDirection() const;
+};
+
+static_assert(sizeof(Photon) == 20, "Photons are meant to be 20 bytes");
+
+/*
+	A store of photons, arranged as a left balanced kd-tree.
+
+	Left balanced means the tree is complete: every level full but the
+	last, which fills from the left. Then it can sit in one array with
+	no pointers at all, the children of photon i being photons 2i + 1
+	and 2i + 2, and the search walks down it like a heap.
+
+	The top few levels are split on one thread, until there's a subtree
+	for every job, then the subtrees are balanced in parallel. Each one
+	writes to its own part of the array, so they never touch.
+*/
+class PhotonMap
+{
+public:
+	PhotonMap() {};
+
+	// Balance photons into the tree, replacing whatever was here.
+	// photons is used as scratch space and is left in no useful order.
+	void Build(std::vector<Photon>& photons, WorkStealingPool& pool);
+
+	/*
+		Find the (up to) k photons nearest point, no further than
+		sqrt(maxDistSq) away. nearest is filled with them, in no
+		particular order. Gives back the squared distance to the
+		furthest one when k were found, otherwise maxDistSq, which is
+		the radius that was searched completely.
+	*/
+	float FindNearest(
+		const Eigen::Vector3f& point,
+		const int k,
+		const float maxDistSq,
+		std::vector<const Photon*>& nearest) const;
+
+	/*
+		Irradiance at a point on a surface, estimated from the density of
+		the k nearest photons: their power over the area of the disc they
+		were found in. Photons that arrived from the back of the surface
+		are left out, so light doesn't leak through thin walls.
+
+		Doesn't allocate, so it's safe to call per ray on any thread.
+	*/
+	Eigen::Vector3f EstimateIrradiance(
+		const Eigen::Vector3f& point,
+		const Eigen::Vector3f& normal,
+		const int k,
+		const float maxDist) const;
+
+	/*
+		The nearest photon to point, within maxDist, whose direction is on
+		the same side as normal (for points stored with a surface normal
+		as their direction). Null if there isn't one among the nearest
+		PHOTON_IRRADIANCE_CANDIDATES.
+	*/
+	const Photon* FindNearestFacing(
+		const Eigen::Vector3f& point,
+		const Eigen::Vector3f& normal,
+		const float maxDist) const;
+
+	const std::vector<Photon>& GetPhotons() const { return tree; };
+	size_t size() const { return tree.size(); };
+	size_t GetMemoryUsed() const { return tree.capacity() * sizeof(Photon); };
+
+private:
+	std::vector<Photon> tree;
+};
+
+/*
+	The photon maps for a scene, and how to look things up in them.
+
+	Photons are split by the path they took, as in Jensen. The caustic
+	map holds photons that got to a surface by mirror bounces alone,
+	which make sharp patterns and want many photons close together.
+	The global map holds photons that bounced diffusely on the way.
+	Photons arriving straight from a light aren't stored at all, since
+	direct lighting already traces shadow rays for them. So between
+	them, the maps give all the indirect light at a diffuse hit.
+
+	Looking the global map up directly, with a full density estimate
+	at every diffuse hit of every camera ray, is far too slow for a
+	big image. Instead, following Christensen, "Faster Photon Map
+	Global Illumination" (JGT 1999), irradiance is estimated once, at
+	every PHOTON_IRRADIANCE_SPACING'th global photon, and kept in a map
+	of its own. Those are stored as photons whose direction is the
+	surface normal there and whose power is the irradiance, so a camera
+	ray only has to find the nearest one that faces the same way. The
+	caustic map stays as it is: caustics are sharp, and need the full
+	estimate to stay that way.
+
+	Once built, this is only ever read, so every render thread can
+	look things up in it at once.
+*/
+struct PhotonMaps
+{
+	PhotonMap global;
+	PhotonMap caustic;
+	PhotonMap irradiance;
+
+	// How many photons each density estimate uses, and how far it looks
+	int numNearest = 64;
+	float maxDistance = 0.5f;
+
+	// Light reflected back along the ray from the photons around hit
+	Eigen::Vector3f GetIndirectLighting(const HitRecord& hit) const;
+};
+
+// A photon job: photons [first, first + count) of one light, each carrying power
+struct PhotonJob
+{
+	int light;
+	int first;
+	int count;
+	float power;
+};
+
+// A photon arriving at a diffuse surface, on its way to being stored
+struct PhotonHit
+{
+	Eigen::Vector3f position;
+	Eigen::Vector3f direction;	// the way it was travelling
+	Eigen::Vector3f normal;		// of the surface, turned to face the photon
+	Eigen::Vector3f power;
+	bool mirrorOnly;			// only mirrors on the way from the light: a caustic photon
+
+	// What it landed on
+	PrimitiveType type;
+	int index;
+};
+
+/*
+	Split numPhotons between the scene's lights, in proportion to their
+	intensity, and cut each light's share into jobs of PHOTON_BATCH_SIZE.
+
+	pass picks which stretch of each light's random sequence to use, so
+	repeated passes (as SPPM makes) send out new photons each time
+	rather than the same ones again.
+*/
+std::vector<PhotonJob> PlanPhotonJobs(
+	const CompiledScene& scene,
+	const int numPhotons,
+	const int pass);
+
+/*
+	Send out photon number photon from job's light, and follow it
+	until it's absorbed, handing store every hit it makes on a diffuse
+	surface after the first. See EmitPhotons for how it's done.
+*/
+void TracePhoton(
+	const CompiledScene& scene,
+	const Sampler& sampler,
+	const PhotonJob& job,
+	const int photon,
+	const std::function<void(const PhotonHit& hit)>& store);
+
+/*
+	Shoot numPhotons photons out of the scene's lights, trace them through
+	it, and build maps out of where they land.
+
+	Each light gets a share of the photons in proportion to its intensity,
+	sent out evenly over the sphere. At each hit, Russian roulette picks
+	between a diffuse bounce, a mirror bounce, or being absorbed, with the
+	same odds the surface reflects light with, so every photon that goes
+	on keeps the same power. Any light only ever has one colour (white),
+	so the power only changes colour at diffuse bounces.
+
+	Lights in the renderer don't fall off with distance, so neither do
+	photons on the way out of them: the first hit scales the power up by
+	the distance squared, which makes photon density at a directly lit
+	point match DirectLighting exactly. After that, transport is physical.
+
+	Batches of photons are traced in parallel. The random numbers come
+	from a Sobol sampler keyed on the photon's number, and batches are
+	put together in order, so the maps are the same whatever the thread
+	count. The irradiance map is worked out last, in parallel too.
+*/
+void EmitPhotons(
+	const CompiledScene& scene,
+	const int numPhotons,
+	const uint32_t seed,
+	WorkStealingPool& pool,
+	PhotonMaps& maps);
@@ -2,16 +2,28 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <cstring>
 #include <sstream>
 #include <vector>
 #include <algorithm>
-//#include <omp.h>
 #include <limits>
 #include <cmath>
 #include <eigen3/Eigen/Dense>
 #include <random>
+#include <chrono>
+#include <stdexcept>
 
 #include "Scene.h"
+#include "CompiledScene.h"
+#include "SceneFile.h"
+#include "Render.h"
+#include "PhotonMap.h"
+#include "IlluminationMap.h"
+#include "Stats.h"
+#include "Animation.h"
+#include "Distributed.h"
+#include "Scheduler.h"
+#include "Server.h"
 #include "UnitTests.h"
 //#include "geometry.h"
 
@@ -20,9 +32,6 @@ using namespace Eigen;
 
 const Eigen::Vector3f NO_COLOUR = Vector3f(0.2, 0.2, 0.2);
 
-// TODO define this in a better spot
-#define MAX_SCENE_DEPTH 10
-
 /*
     This is an exercise in ray tracing/ray marching/path tracing/whatever. 
 
@@ -57,40 +66,8 @@ const Eigen::Vector3f NO_COLOUR = Vector3f(0.2, 0.2, 0.2);
     - refactor?
 */
 
-/* ---------- Structures ----------- */
-struct Params
-{
-    string sceneFile;
-    string outputFile;
-    int width = 640;
-    int height = 480;
-    int fov = 90;
-
-    int samplesPerPixel = 1;
-
-    int numBouncesPerRay = MAX_NUM_BOUNCES_PER_RAY;
-
-    bool runUnitTests;
-};
-
 /* ---------- Function prototypes -------------- */
 void FailBadArgs();
-bool ParseArgs(const int argc, char** argv, Params& params);
-
-bool WriteImageToFile(
-    const vector<Vector3f>& frameBuffer,
-    const Params& params);
-
-bool RenderScene(
-    Scene& scene,
-    const Params& params);
-
-Vector3f CastRay(
-    const Vector3f& ray,
-    Scene scene,
-    int numBounces);
-
-inline double random_double();
 
 /* ------ Main --------*/
 // Read in the scene to render
@@ -117,19 +94,119 @@ int main(int argc, char** argv)
     if (params.runUnitTests)
     {
         // Run the unit tests, then return. No image is rendered.
-        return RunUnitTests();
+        // Exit with 0 when they pass, so scripts and ctest can check it.
+        return RunUnitTests() ? 0 : 1;
     }
 
+    if (!params.serverAddress.empty())
+    {
+        return RunServer(params, ParseArgs) ? 0 : -1;
+    }
 
-    // right now only supported shapes are spheres but design the interface so that 
-    // arbitrary shapes defined by equations work once I figure out the math
+    // A worker's stdout is the pipe bands go back to the coordinator on,
+    // so anything it has to say goes to stderr
+    if (params.isWorker)
+    {
+        cout.rdbuf(cerr.rdbuf());
+    }
 
-    // TODO: somehow read all the inherited classes as the base class?
-    Scene scene;
-    ReadScene(params.sceneFile, scene);
+
+    // Binary scene files are already compiled, so they're mapped straight in
+    StatTimer loadTimer(STAT_TIME_LOAD);
+    CompiledScene compiledScene;
+    if (!LoadScene(params.sceneFile, compiledScene, params.numThreads))
+    {
+        return -1;
+    }
+    loadTimer.Stop();
+
+    // Triangles are where the memory goes in big scenes, so say how much
+    const size_t numTriangles = compiledScene.GetTriangles().size();
+    if (numTriangles > 0)
+    {
+        const BVH& bvh = compiledScene.GetTriangleBVH();
+        const size_t bytes =
+            compiledScene.GetVertices().size() * sizeof(Vector3f) +
+            numTriangles * sizeof(TriangleData) +
+            bvh.GetNodes().size() * sizeof(BVHNode) +
+            bvh.GetPrimitiveIndices().size() * sizeof(int);
+        cout << numTriangles << " triangles, " << (double)bytes / numTriangles << " bytes per triangle with the BVH" << endl;
+    }
+
+    if (!params.convertFile.empty())
+    {
+        if (!WriteSceneFile(params.convertFile, compiledScene))
+        {
+            return -1;
+        }
+        cout << "Written scene to file " << params.convertFile << endl;
+        return 0;
+    }
+
+    // Animations move things between frames, which would leave any
+    // maps traced from where they were out of date
+    Animation animation;
+    if (!params.animationFile.empty())
+    {
+        if (params.numPhotons > 0 || params.illuminationPhotons > 0 || !params.illuminationFile.empty() || params.sppmPasses > 0)
+        {
+            cout << "ERROR: photon maps, illumination maps and SPPM can't be used with -anim yet" << endl;
+            return -1;
+        }
+        if (!animation.Load(params.animationFile))
+        {
+            return -1;
+        }
+    }
+
+    // One pool of render threads does everything from here on
+    WorkStealingPool pool(params.numThreads);
+
+    // The workers trace the photons they need themselves
+    if (params.numWorkers > 0 || !params.workerCommands.empty())
+    {
+        return RenderDistributed(compiledScene, params, pool, argc, argv) ? 0 : -1;
+    }
+
+    PhotonMaps photonMaps;
+    IlluminationMaps illuminationMaps;
+    if (!PrepareIndirectLighting(compiledScene, params, pool, photonMaps, illuminationMaps))
+    {
+        return -1;
+    }
 
     // Use current ray tracing technique to render the scene
-    RenderScene(scene, params);
+    if (params.isWorker)
+    {
+        return RunWorker(compiledScene, params, pool, 0, 1) ? 0 : -1;
+    }
+    else if (!params.animationFile.empty())
+    {
+        if (!RenderAnimation(compiledScene, animation, params, pool))
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        if (!RenderScene(compiledScene, params, pool))
+        {
+            return -1;
+        }
+    }
+
+    if (!params.statsFile.empty())
+    {
+        if (!AreStatsEnabled())
+        {
+            cout << "Built without RAYTRACER_STATS, so there are no counts to write" << endl;
+        }
+        if (!WriteStatsFile(params.statsFile, MergeStats(), params.numBouncesPerRay, (size_t)params.width * params.height))
+        {
+            return -1;
+        }
+        cout << "Written stats to file " << params.statsFile << endl;
+    }
     return 0;
 }
 
@@ -144,9 +221,55 @@ void FailBadArgs()
     cout << "-w <int>                       : image width" << endl;
     cout << "-f <int>                       : field of view in degrees" << endl;
     cout << "-s <int>                       : samples per pixel" << endl;
+    cout << "-s-min <int>                   : adaptive sampling: fewest samples per pixel. Defaults to 4." << endl;
+    cout << "-s-max <int>                   : adaptive sampling: most samples per pixel. Defaults to 64." << endl;
+    cout << "-noise <float>                 : adaptive sampling: stop once a pixel is known to within this. Defaults to 0.01." << endl;
+    cout << "                                 Any of these turns adaptive sampling on, and -s is ignored." << endl;
+    cout << "                                 A map of samples per pixel is written next to the image." << endl;
     cout << "-b <int>                       : num bounces per ray, capped at 10." << endl;
+    cout << "-sampler <sobol|random|bluenoise> : where the per-sample jitter comes from. Defaults to sobol." << endl;
+    cout << "-seed <int>                    : seed for the sampler. The same seed always gives the same image." << endl;
+    cout << "-t <int>                       : num render threads. Defaults to all hardware threads." << endl;
+    cout << "-packets                       : trace primary rays in SIMD packets." << endl;
+    cout << "-packet-width <4|8|16>         : force the packet kernel width. Defaults to the widest the CPU has." << endl;
+    cout << "-wavefront                     : trace all paths a bounce at a time, sorted between bounces." << endl;
+    cout << "-photons <int>                 : trace this many photons from the lights first, for indirect light and caustics." << endl;
+    cout << "-photon-k <int>                : photons gathered per lookup, up to 256. Defaults to 64." << endl;
+    cout << "-photon-radius <float>         : furthest a lookup looks for photons. Defaults to 0.5." << endl;
+    cout << "-illum <int>                   : splat this many photons into an illumination map on each sphere and plane, for indirect light." << endl;
+    cout << "-illum-res <int>               : texels along each side of an illumination map. Defaults to 64." << endl;
+    cout << "-illum-file <file>             : read illumination maps from here if they were made for this scene," << endl;
+    cout << "                                 otherwise build them with -illum and save them here for next time." << endl;
+    cout << "-sppm <int>                    : render this many passes of stochastic progressive photon mapping instead." << endl;
+    cout << "                                 -photons is then photons per pass (default 100000), and -photon-radius" << endl;
+    cout << "                                 the radius to start from. Memory stays the same however many passes." << endl;
     cout << "-i <input_scene_filename>      : contains the scene to be rendered." << endl;
-    cout << "-o <output_image_filename>     : name of .ppm file to save output to." << endl;
+    cout << "-o <output_image_filename>     : file to save output to. .pfm and .exr are written as floats, anything else as .ppm." << endl;
+    cout << "-gamma <float>                 : gamma for .ppm output. Defaults to 1, so no correction." << endl;
+    cout << "-stream                        : write rows out as soon as they're finished." << endl;
+    cout << "-stats <file.json>             : write counts of rays, hits and tests, bounce depths and time per phase here." << endl;
+    cout << "-denoise                       : filter the noise out of the image before writing it, guided by the albedo," << endl;
+    cout << "                                 normal and depth at the first hit through each pixel." << endl;
+    cout << "-aovs                          : with -denoise, also write those guides next to the output." << endl;
+    cout << "-half-aovs                     : with -denoise, keep those guides as half floats, for half the memory." << endl;
+    cout << "-cost                          : also write what each pixel cost in tests, bounces and time, as false colour" << endl;
+    cout << "                                 images next to the output. Pixels are then traced one ray at a time." << endl;
+    cout << "-anim <animation_filename>     : render every frame of the keyframes in this file, as out_0000.ppm, out_0001.ppm, ..." << endl;
+    cout << "                                 Only spheres and point lights move. Each frame is written while the next renders." << endl;
+    cout << "-convert <output_scene_filename> : compile the input scene to a binary scene file, instead of rendering." << endl;
+    cout << "                                 Binary scene files can be given to -i like any other, and load much faster." << endl;
+    cout << "-checkpoint <file>             : save the tiles that are done here every minute, to -resume from if the render" << endl;
+    cout << "                                 is killed. It's removed once the image is written." << endl;
+    cout << "-checkpoint-every <int>        : seconds between checkpoints. Defaults to 60." << endl;
+    cout << "-resume <file>                 : carry on from the tiles in this checkpoint, and keep checkpointing to it." << endl;
+    cout << "                                 Everything but the output and threads has to be as it was." << endl;
+    cout << "-workers <int>                 : render on this many worker processes, sharing out the threads between them." << endl;
+    cout << "-worker-cmd <command>          : also render on a worker started by this shell command, such as" << endl;
+    cout << "                                 \"ssh node1 /path/to/raytracer\". The scene has to be at the same path there." << endl;
+    cout << "                                 Can be given more than once. A worker that dies has its work handed to the others." << endl;
+    cout << "-serve <stdio|socket_path>     : keep the render threads and compiled scenes around, and render jobs sent a line" << endl;
+    cout << "                                 at a time, like \"-i scene.txt -o out.ppm -s 16\", until \"quit\". Each gets a reply" << endl;
+    cout << "                                 of \"OK ...\" or \"ERROR ...\". Other arguments given here are the jobs' defaults." << endl;
     cout << "-u                             : runs unit tests instead of rendering image." << endl;
     cout << endl;
     cout << "Scene file format (last line is background colour):" << endl;
@@ -161,6 +284,25 @@ void FailBadArgs()
     cout << "Currently supported shapes: " << endl;
     cout << "SPHERE Cx Cy Cz Cr Cg Cb radius" << endl;
     cout << "PLANE Nx Ny Nz Cr Cg Cb offset" << endl;
+    cout << "MESH file.obj Cr Cg Cb           (relative to the scene file)" << endl;
+    cout << endl;
+    cout << "Animation file format (spheres and lights count from 0, in scene file order):" << endl;
+    cout << "numFrames numTracks" << endl;
+    cout << "SPHERE index numKeys frame Cx Cy Cz frame Cx Cy Cz ..." << endl;
+    cout << "POINTLIGHT index numKeys frame Cx Cy Cz ..." << endl;
+}
+
+/*
+    The value after the flag at argv[i], stepping i on to it. Throws
+    if the flag was the last thing given.
+*/
+static const char* NextArg(const int argc, char** argv, int& i)
+{
+    if (i + 1 >= argc)
+    {
+        throw invalid_argument(string(argv[i]) + " needs a value");
+    }
+    return argv[++i];
 }
 
 /*
@@ -170,252 +312,328 @@ bool ParseArgs(const int argc, char** argv, Params& params)
 {
     for (int i = 1; i < argc; ++i)
     {
-        if (strcmp("-i", argv[i]) == 0)
-        {
-            params.sceneFile = argv[++i];
-        }
-        else if (strcmp("-o", argv[i]) == 0)
+        const int flag = i;
+        try
         {
-            params.outputFile = argv[++i];
-        }
-        else if (strcmp("-h", argv[i]) == 0)
-        {
-            params.height = stoi(argv[++i]);
-            if (params.height < 1)
+            if (strcmp("-i", argv[i]) == 0)
             {
-                cout << "Bad argument!" << endl;
-                FailBadArgs();
-                return false;
+                params.sceneFile = NextArg(argc, argv, i);
             }
-        }
-        else if (strcmp("-w", argv[i]) == 0)
-        {
-            params.width = stoi(argv[++i]);
-            if (params.width < 1)
+            else if (strcmp("-o", argv[i]) == 0)
             {
-                cout << "Bad argument!" << endl;
-                FailBadArgs();
-                return false;
+                params.outputFile = NextArg(argc, argv, i);
             }
-        }
-        else if (strcmp("-f", argv[i]) == 0)
-        {
-            params.fov = stoi(argv[++i]);
-            if (params.fov < 1)
+            else if (strcmp("-h", argv[i]) == 0)
             {
-                cout << "Bad argument!" << endl;
-                FailBadArgs();
-                return false;
+                params.height = stoi(NextArg(argc, argv, i));
+                if (params.height < 1)
+                {
+                    cout << "Bad argument!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
             }
-        }
-        else if (strcmp("-s", argv[i]) == 0)
-        {
-            params.samplesPerPixel = stoi(argv[++i]);
-            if (params.samplesPerPixel< 1)
+            else if (strcmp("-w", argv[i]) == 0)
             {
-                cout << "Bad argument!" << endl;
-                FailBadArgs();
-                return false;
+                params.width = stoi(NextArg(argc, argv, i));
+                if (params.width < 1)
+                {
+                    cout << "Bad argument!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
             }
-        }
-        else if (strcmp("-b", argv[i]) == 0)
-        {
-            params.numBouncesPerRay = stoi(argv[++i]);
-            if (params.numBouncesPerRay > MAX_NUM_BOUNCES_PER_RAY)
+            else if (strcmp("-f", argv[i]) == 0)
+            {
+                params.fov = stoi(NextArg(argc, argv, i));
+                if (params.fov < 1)
+                {
+                    cout << "Bad argument!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
+            }
+            else if (strcmp("-s", argv[i]) == 0)
+            {
+                params.samplesPerPixel = stoi(NextArg(argc, argv, i));
+                if (params.samplesPerPixel< 1)
+                {
+                    cout << "Bad argument!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
+            }
+            else if (strcmp("-s-min", argv[i]) == 0)
+            {
+                params.adaptive = true;
+                params.minSamples = stoi(NextArg(argc, argv, i));
+                if (params.minSamples < 1)
+                {
+                    cout << "Bad argument!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
+            }
+            else if (strcmp("-s-max", argv[i]) == 0)
+            {
+                params.adaptive = true;
+                params.maxSamples = stoi(NextArg(argc, argv, i));
+                if (params.maxSamples < 1)
+                {
+                    cout << "Bad argument!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
+            }
+            else if (strcmp("-noise", argv[i]) == 0)
+            {
+                params.adaptive = true;
+                params.noiseThreshold = stof(NextArg(argc, argv, i));
+                if (params.noiseThreshold <= 0.f)
+                {
+                    cout << "Bad argument!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
+            }
+            else if (strcmp("-b", argv[i]) == 0)
+            {
+                params.numBouncesPerRay = stoi(NextArg(argc, argv, i));
+                if (params.numBouncesPerRay > MAX_NUM_BOUNCES_PER_RAY)
+                {
+                    cout << "Bad argument!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
+            }
+            else if (strcmp("-sampler", argv[i]) == 0)
+            {
+                const string name = NextArg(argc, argv, i);
+                if (name == "sobol")
+                {
+                    params.samplerType = SAMPLER_SOBOL;
+                }
+                else if (name == "random")
+                {
+                    params.samplerType = SAMPLER_RANDOM;
+                }
+                else if (name == "bluenoise")
+                {
+                    params.samplerType = SAMPLER_BLUE_NOISE;
+                }
+                else
+                {
+                    cout << "Bad argument!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
+            }
+            else if (strcmp("-seed", argv[i]) == 0)
             {
-                cout << "Bad argument!" << endl;
+                params.seed = (uint32_t)stoul(NextArg(argc, argv, i));
+            }
+            else if (strcmp("-t", argv[i]) == 0)
+            {
+                params.numThreads = stoi(NextArg(argc, argv, i));
+                if (params.numThreads < 1)
+                {
+                    cout << "Bad argument!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
+            }
+            else if (strcmp("-packets", argv[i]) == 0)
+            {
+                params.usePackets = true;
+            }
+            else if (strcmp("-packet-width", argv[i]) == 0)
+            {
+                params.usePackets = true;
+                params.packetWidth = stoi(NextArg(argc, argv, i));
+                if (params.packetWidth != 4 && params.packetWidth != 8 && params.packetWidth != 16)
+                {
+                    cout << "Bad argument!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
+            }
+            else if (strcmp("-wavefront", argv[i]) == 0)
+            {
+                params.useWavefront = true;
+            }
+            else if (strcmp("-photons", argv[i]) == 0)
+            {
+                params.numPhotons = stoi(NextArg(argc, argv, i));
+                if (params.numPhotons < 0)
+                {
+                    cout << "Bad argument!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
+            }
+            else if (strcmp("-photon-k", argv[i]) == 0)
+            {
+                params.photonNearest = stoi(NextArg(argc, argv, i));
+                if (params.photonNearest < 1 || params.photonNearest > MAX_NEAREST_PHOTONS)
+                {
+                    cout << "Bad argument!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
+            }
+            else if (strcmp("-photon-radius", argv[i]) == 0)
+            {
+                params.photonRadius = stof(NextArg(argc, argv, i));
+                if (params.photonRadius <= 0.f)
+                {
+                    cout << "Bad argument!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
+            }
+            else if (strcmp("-stats", argv[i]) == 0)
+            {
+                params.statsFile = NextArg(argc, argv, i);
+            }
+            else if (strcmp("-illum", argv[i]) == 0)
+            {
+                params.illuminationPhotons = stoi(NextArg(argc, argv, i));
+                if (params.illuminationPhotons < 0)
+                {
+                    cout << "Bad argument!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
+            }
+            else if (strcmp("-illum-res", argv[i]) == 0)
+            {
+                params.illuminationResolution = stoi(NextArg(argc, argv, i));
+                if (params.illuminationResolution < 2 || params.illuminationResolution > 4096)
+                {
+                    cout << "Bad argument!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
+            }
+            else if (strcmp("-illum-file", argv[i]) == 0)
+            {
+                params.illuminationFile = NextArg(argc, argv, i);
+            }
+            else if (strcmp("-sppm", argv[i]) == 0)
+            {
+                params.sppmPasses = stoi(NextArg(argc, argv, i));
+                if (params.sppmPasses < 1)
+                {
+                    cout << "Bad argument!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
+            }
+            else if (strcmp("-gamma", argv[i]) == 0)
+            {
+                params.gamma = stof(NextArg(argc, argv, i));
+                if (params.gamma <= 0.f)
+                {
+                    cout << "Bad argument!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
+            }
+            else if (strcmp("-stream", argv[i]) == 0)
+            {
+                params.streamOutput = true;
+            }
+            else if (strcmp("-denoise", argv[i]) == 0)
+            {
+                params.denoise = true;
+            }
+            else if (strcmp("-aovs", argv[i]) == 0)
+            {
+                params.writeAOVs = true;
+            }
+            else if (strcmp("-half-aovs", argv[i]) == 0)
+            {
+                params.halfAOVs = true;
+            }
+            else if (strcmp("-cost", argv[i]) == 0)
+            {
+                params.costMaps = true;
+            }
+            else if (strcmp("-anim", argv[i]) == 0)
+            {
+                params.animationFile = NextArg(argc, argv, i);
+            }
+            else if (strcmp("-convert", argv[i]) == 0)
+            {
+                params.convertFile = NextArg(argc, argv, i);
+            }
+            else if (strcmp("-checkpoint", argv[i]) == 0)
+            {
+                params.checkpointFile = NextArg(argc, argv, i);
+            }
+            else if (strcmp("-checkpoint-every", argv[i]) == 0)
+            {
+                params.checkpointInterval = stoi(NextArg(argc, argv, i));
+                if (params.checkpointInterval < 1)
+                {
+                    cout << "Checkpoints have to be at least a second apart!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
+            }
+            else if (strcmp("-resume", argv[i]) == 0)
+            {
+                params.checkpointFile = NextArg(argc, argv, i);
+                params.resume = true;
+            }
+            else if (strcmp("-workers", argv[i]) == 0)
+            {
+                params.numWorkers = stoi(NextArg(argc, argv, i));
+                if (params.numWorkers < 0)
+                {
+                    cout << "Can't have fewer than 0 workers!" << endl;
+                    FailBadArgs();
+                    return false;
+                }
+            }
+            else if (strcmp("-worker-cmd", argv[i]) == 0)
+            {
+                params.workerCommands.push_back(NextArg(argc, argv, i));
+            }
+            else if (strcmp("-worker", argv[i]) == 0)
+            {
+                params.isWorker = true;
+            }
+            else if (strcmp("-serve", argv[i]) == 0)
+            {
+                params.serverAddress = NextArg(argc, argv, i);
+            }
+            else if (strcmp("-u", argv[i]) == 0)
+            {
+                params.runUnitTests = true;
+            }
+            else
+            {
+                cout << "Bad argument: " << argv[i] << endl;
                 FailBadArgs();
                 return false;
             }
         }
-        else if (strcmp("-u", argv[i]) == 0)
-        {
-            params.runUnitTests = true;
-        }
-        else
+        catch (const logic_error&)
         {
-            cout << "Bad argument: " << argv[i] << endl;
+            // From NextArg when the value's missing, or stoi and friends
+            // when it isn't a number, or won't fit
+            cout << "Bad or missing value for " << argv[flag] << endl;
             FailBadArgs();
             return false;
         }
     }
-    return true;
-}
-
-inline double random_double() {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
-}
 
-/*
-    Write the image to a ppm file
-
-    This is ripped straight from
-    https://github.com/ssloy/tinyraytracer/wiki/Part-1:-understandable-raytracing
-*/
-bool WriteImageToFile(
-    const vector<Vector3f>& frameBuffer,
-    const Params& params)
-{
-    ofstream ofs; // save the framebuffer to file
-    ofs.open(params.outputFile, std::ofstream::out | std::ofstream::binary);
-    if (ofs.is_open())
-    {
-        ofs << "P6\n" << params.width << " " << params.height << "\n255\n";
-        for (int i = 0; i < params.height * params.width; ++i)
-        {
-            for (int j = 0; j < 3; ++j)
-            {
-                ofs << (char)(255 * std::max(0.f, std::min(1.f, frameBuffer[i](j))));
-            }
-        }
-        ofs.close();
-        cout << "Written image to file " << params.outputFile << endl;
-    }
-    else
+    if (params.adaptive && params.minSamples > params.maxSamples)
     {
-        cout << "ERROR: image could not be written to " << params.outputFile << endl;
+        cout << "-s-min can't be more than -s-max!" << endl;
+        FailBadArgs();
         return false;
     }
-    
     return true;
 }
-
-/*
-    Render the scene using ray tracing. 
-
-    Currently this assumes a constant hardcoded background colour
-    and a constant hardcoded light source.
-    and a hardcoded field of view
-
-    Currently this is not a function of the scene class
-    The scene class is purely for organisational purposes
-
-    We want, in future, this to probably be stochastic progressive path mapping 
-    or whatever the name is
-    Where you do BDRT for a few rays at a time, to reduce memory overhead
-    but keep quality
-*/
-bool RenderScene(
-    Scene& scene,
-    const Params& params)
-{
-    // This will be the image
-    vector<Vector3f> frameBuffer(params.width*params.height);
-    const float fov = (3.141592 / 180.f) * (float)params.fov;
-    const float width = (float)params.width;
-    const float height = (float)params.height;
-
-    float oneHorizontalPixel = (2 * (1 + 0.5) / width - 1) * tan(fov / 2.) * width / height;
-    float oneVerticalPixel = -(2 * (1 + 0.5) / height - 1) * tan(fov / 2.);
-
-    // Send rays from each pixel, checking over all shapes for collisions
-    // TODO: hold shapes in a BVH, or similar, to make this more efficient
-    //       given that we just have a small number of spheres and planes, don't worry about this for now
-    // TODO: parallelise
-    //#pragma omp parallel for
-    for (int h = 0; h < params.height; ++h)
-    {
-        for (int w = 0; w < params.width; ++w)
-        {
-            // get x and y from field of view equation
-            const float x = (2 * (w + 0.5) / width - 1) * tan(fov / 2.) * width / height;
-            const float y = -(2 * (h + 0.5) / height - 1) * tan(fov / 2.);
-            auto finalColour = Vector3f(0, 0, 0);
-            for (int n = 0; n < params.samplesPerPixel; ++n)
-            {
-                // perturb x and y by an amount not larger than a quarter pixel
-                // since pixel intensities are gaussian-distributed at the centre of the pixel
-                // [0, 0.5] + 0.25 = [0.25, 0.75]
-                double r1 = 0.5*random_double() - 0.25;
-                double r2 = 0.5*random_double() - 0.25;
-                Vector3f ray(x+r1, y+r2, 1.f);
-                ray.normalize();
-
-                // Accumulate the colour over all sampled rays
-                finalColour += CastRay(ray, scene, params.numBouncesPerRay);
-            }
-
-            // Get the average pixel colour. Values are clamped when written out.
-            finalColour /= (float)params.samplesPerPixel;
-            
-            frameBuffer[w + h * params.width] = Vector3f(finalColour[0], finalColour[1], finalColour[2]);
-        }
-    }
-
-    return WriteImageToFile(frameBuffer, params);
-}
-
-/*
-    Cast a single ray into a scene
-
-    This checks all shapes for collisions, and does lighting equations. Returns a colour
-*/
-Vector3f CastRay(
-    const Vector3f& ray,
-    Scene scene,
-    int numBounces)
-{
-    vector<Light*> lights = scene.GetLights();
-    vector<Shape*> shapes = scene.GetShapes();
-
-    Vector3f colour = scene.GetBackground();
-
-    Vector3f surfaceNormal(0, 0, 0);
-    float closestDist = MAX_SCENE_DEPTH;
-    int closestShapeIndex = -1;
-    for (int i = 0; i < shapes.size(); ++i)
-    {
-        const auto s = shapes[i];
-        float distance = MAX_SCENE_DEPTH;
-        LightCollision collision;
-        if (s->DoesRayIntersect(ray, distance, collision))
-        {
-                                        // don't use distances too close, in case reflection 
-                                        // rays got spawned beneath the surface
-            if (distance < closestDist && distance > EPSILON)
-            {
-                colour = Vector3f(collision.colour[0], collision.colour[1], collision.colour[2]);
-                closestDist = distance;
-                closestShapeIndex = i;
-                surfaceNormal = collision.surfaceNormal;
-            }
-        }
-
-        // add bounces, so adjust ray and call this recursively
-    }
-
-    if (closestShapeIndex != -1)
-    {
-        float diffuseIntensity = 0;
-        for (const auto l : lights)
-        {
-            Vector3f point = closestDist * ray;
-            Vector3f lightDir = l->GetPosition() - point;
-            lightDir /= lightDir.norm();
-            surfaceNormal /= surfaceNormal.norm();
-            diffuseIntensity += l->GetIntensity() * max(0.f, lightDir.dot(surfaceNormal));
-        }
-
-        // How much light this reflects back toward the ray origin vs absorbs
-        // Maybe should call this absorption factor
-        float diffusionFactor = shapes[closestShapeIndex]->GetDiffusionFactor();
-        colour = diffusionFactor * diffuseIntensity * colour;
-
-        if (numBounces > 0)
-        {
-            // Compute reflection ray
-            // reflected ray = R - 2 (dot(R, N)) * N
-            // where R = ray, N = normal
-            auto reflectedRay = ray - 2 * ray.dot(surfaceNormal) * surfaceNormal;
-            // add a smidge of random to this vector for diffuse reflection
-
-            // This 0.5 is the reflectance factor
-            // final colour should contain some surface colour and some reflected colour
-            colour += 0.5 * CastRay(reflectedRay, scene, numBounces-1);
-        }
-    }
-    
-    return colour;
-}
\ No newline at end of file
@@ -0,0 +1,888 @@
+#include <stdlib.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <eigen3/Eigen/Dense>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <chrono>
+
+#include "Render.h"
+#include "Packet.h"
+#include "Scheduler.h"
+#include "Wavefront.h"
+#include "ImageOutput.h"
+#include "PhotonMap.h"
+#include "SPPM.h"
+#include "IlluminationMap.h"
+#include "Stats.h"
+#include "Denoise.h"
+#include "Checkpoint.h"
+#include "Integrator.h"
+
+using namespace std;
+using namespace Eigen;
+
+/*
+    Write the image to a file, in the format its extension asks for:
+    .pfm or .exr for floats, anything else as an 8 bit ppm.
+
+    The whole file is encoded into memory first, then written in one go.
+    The ppm writer started out from
+    https://github.com/ssloy/tinyraytracer/wiki/Part-1:-understandable-raytracing
+*/
+bool WriteImageToFile(
+    const FrameBuffer& frameBuffer,
+    const Params& params,
+    const string& fileName)
+{
+    StatTimer timer(STAT_TIME_WRITE_IMAGE);
+    vector<char> encoded;
+    EncodeImage(frameBuffer, GetImageFormat(fileName), params.gamma, encoded);
+
+    ofstream ofs; // save the framebuffer to file
+    ofs.open(fileName, std::ofstream::out | std::ofstream::binary);
+    if (ofs.is_open())
+    {
+        ofs.write(encoded.data(), encoded.size());
+        ofs.close();
+    }
+    if (!ofs.good())
+    {
+        cout << "ERROR: image could not be written to " << fileName << endl;
+        return false;
+    }
+
+    cout << "Written image to file " << fileName << endl;
+    return true;
+}
+
+/*
+    out.ppm + "_samples" -> out_samples.ppm
+*/
+string AddFileSuffix(
+    const string& fileName,
+    const string& suffix)
+{
+    const size_t dot = fileName.find_last_of('.');
+    const size_t slash = fileName.find_last_of("/\\");
+    if (dot == string::npos || (slash != string::npos && dot < slash))
+    {
+        return fileName + suffix;
+    }
+    return fileName.substr(0, dot) + suffix + fileName.substr(dot);
+}
+
+/*
+    Trace the photon maps and illumination maps params asks for, and
+    hand them to the scene. They have to outlive every render of it.
+*/
+bool PrepareIndirectLighting(
+    CompiledScene& scene,
+    const Params& params,
+    WorkStealingPool& pool,
+    PhotonMaps& photonMaps,
+    IlluminationMaps& illuminationMaps)
+{
+    // Photons are all traced before any pixels are, and the maps
+    // are only read from then on. SPPM traces its own, a pass at a time.
+    if (params.numPhotons > 0 && params.sppmPasses == 0)
+    {
+        StatTimer timer(STAT_TIME_PHOTONS);
+        const auto start = chrono::steady_clock::now();
+        photonMaps.numNearest = params.photonNearest;
+        photonMaps.maxDistance = params.photonRadius;
+        EmitPhotons(scene, params.numPhotons, params.seed, pool, photonMaps);
+        const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        const size_t bytes = photonMaps.global.GetMemoryUsed() + photonMaps.caustic.GetMemoryUsed()
+            + photonMaps.irradiance.GetMemoryUsed();
+        cout << "Traced " << params.numPhotons << " photons in " << seconds << "s ("
+            << params.numPhotons / seconds << " photons/sec): stored " << photonMaps.global.size() << " global, "
+            << photonMaps.caustic.size() << " caustic and " << photonMaps.irradiance.size() << " irradiance, "
+            << bytes / (1024. * 1024.) << " MB" << endl;
+        scene.SetPhotonMaps(&photonMaps);
+    }
+
+    // Illumination maps only depend on the scene, so they're read from
+    // a file if there's one for this scene, and only built if not
+    if ((params.illuminationPhotons > 0 || !params.illuminationFile.empty()) && params.sppmPasses == 0)
+    {
+        const bool haveFile = !params.illuminationFile.empty() && IsIlluminationMapFile(params.illuminationFile);
+        if (haveFile && illuminationMaps.Load(params.illuminationFile, scene))
+        {
+            cout << "Read illumination maps of " << illuminationMaps.GetNumPhotons() << " photons from " << params.illuminationFile << endl;
+        }
+        else if (params.illuminationPhotons > 0)
+        {
+            StatTimer timer(STAT_TIME_PHOTONS);
+            const auto start = chrono::steady_clock::now();
+            illuminationMaps.Build(scene, params.illuminationPhotons, params.seed, params.illuminationResolution, pool);
+            const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cout << "Splatted " << params.illuminationPhotons << " photons into illumination maps in " << seconds << "s ("
+                << params.illuminationPhotons / seconds << " photons/sec), " << illuminationMaps.GetMemoryUsed() / (1024. * 1024.) << " MB" << endl;
+            if (!params.illuminationFile.empty())
+            {
+                if (!illuminationMaps.Write(params.illuminationFile, scene))
+                {
+                    return false;
+                }
+                cout << "Written illumination maps to file " << params.illuminationFile << endl;
+            }
+        }
+        else
+        {
+            cout << "ERROR: no illumination maps for this scene in " << params.illuminationFile << ", and -illum wasn't given to make some" << endl;
+            return false;
+        }
+        scene.SetIlluminationMaps(&illuminationMaps);
+    }
+    return true;
+}
+
+/*
+    Render the scene using ray tracing. 
+
+    Currently this assumes a constant hardcoded background colour
+    and a constant hardcoded light source.
+    and a hardcoded field of view
+
+    Currently this is not a function of the scene class
+    The scene class is purely for organisational purposes
+
+    We want, in future, this to probably be stochastic progressive path mapping 
+    or whatever the name is
+    Where you do BDRT for a few rays at a time, to reduce memory overhead
+    but keep quality
+*/
+bool RenderScene(
+    const CompiledScene& scene,
+    const Params& params,
+    WorkStealingPool& pool)
+{
+    if (params.sppmPasses > 0)
+    {
+        if (params.costMaps)
+        {
+            cout << "Cost maps aren't made for progressive photon mapping" << endl;
+        }
+        return RenderSPPM(scene, params, pool);
+    }
+
+    // This will be the image
+    FrameBuffer frameBuffer(params.width, params.height);
+
+    if (params.useWavefront)
+    {
+        cout << "Tracing paths in waves, " << WAVEFRONT_ROWS << " rows at a time" << endl;
+    }
+    else if (params.usePackets)
+    {
+        const int width = params.packetWidth > 0 ? params.packetWidth : GetNativePacketWidth();
+        cout << "Tracing primary rays in packets of " << PACKET_SIZE << ", " << min(width, GetNativePacketWidth()) << " lanes at a time" << endl;
+    }
+    if (params.costMaps && (params.useWavefront || params.usePackets))
+    {
+        // Both of those work on many pixels at once, so there's no telling what each one cost
+        cout << "Cost maps need each pixel rendered on its own, so tracing one ray at a time instead" << endl;
+    }
+
+    // When streaming, rows go out to the file as soon as they're finished.
+    // Denoising needs the whole image first, so it doesn't stream.
+    unique_ptr<ImageWriter> stream;
+    function<void(int, int)> rowsDone;
+    if (params.streamOutput && params.denoise)
+    {
+        cout << "Denoising needs the whole image, so it's written at the end instead of streamed" << endl;
+    }
+    else if (params.streamOutput)
+    {
+        stream.reset(new ImageWriter(params.outputFile, params.width, params.height, params.gamma));
+        if (!stream->IsOpen())
+        {
+            cout << "ERROR: image could not be written to " << params.outputFile << endl;
+            return false;
+        }
+        rowsDone = [&](int startRow, int endRow)
+        {
+            stream->WriteRows(frameBuffer, startRow, endRow);
+        };
+    }
+
+    vector<int> sampleCounts(params.width*params.height, 0);
+    PixelCosts costs;
+    if (params.costMaps)
+    {
+        costs.Resize(params.width*params.height);
+    }
+
+    // Long renders save the tiles they've finished now and again, so they
+    // can be picked up from there if they're killed
+    unique_ptr<Checkpoint> checkpoint;
+    if (!params.checkpointFile.empty() && params.useWavefront)
+    {
+        cout << "Wavefronts don't render in tiles, so there are no checkpoints" << endl;
+    }
+    else if (!params.checkpointFile.empty())
+    {
+        checkpoint.reset(new Checkpoint(scene, params, frameBuffer, sampleCounts));
+        if (params.resume && !checkpoint->Load(params.checkpointFile))
+        {
+            return false;
+        }
+        checkpoint->StartWriting(params.checkpointFile, chrono::seconds(params.checkpointInterval));
+    }
+
+    int numJobs = 0;
+    {
+        StatTimer timer(STAT_TIME_RENDER);
+        numJobs = RenderFrame(scene, params, pool, frameBuffer, &sampleCounts, rowsDone, params.costMaps ? &costs : nullptr, checkpoint.get());
+    }
+    if (checkpoint && !checkpoint->StopWriting())
+    {
+        cout << "Some checkpoints couldn't be written, but the render finished anyway" << endl;
+    }
+
+    // Report how evenly the work was spread
+    const auto& jobCounts = pool.GetJobCounts();
+    const auto& stealCounts = pool.GetStealCounts();
+    const char* jobName = params.useWavefront ? " bands" : " tiles";
+    cout << "Rendered " << numJobs << jobName << " on " << pool.GetNumThreads() << " threads" << endl;
+    for (int t = 0; t < pool.GetNumThreads(); ++t)
+    {
+        cout << "  thread " << t << ": " << jobCounts[t] << jobName << " (" << stealCounts[t] << " stolen)" << endl;
+    }
+
+    if (params.denoise && !DenoiseFrame(scene, params, pool, &sampleCounts, frameBuffer))
+    {
+        return false;
+    }
+
+    const bool written = stream ? stream->Close() : WriteImageToFile(frameBuffer, params, params.outputFile);
+    if (!written)
+    {
+        return false;
+    }
+
+    // The image has everything the checkpoint had now
+    if (checkpoint)
+    {
+        remove(params.checkpointFile.c_str());
+    }
+
+    if (params.costMaps && !WriteCostMaps(costs, sampleCounts, params))
+    {
+        return false;
+    }
+
+    return !params.adaptive || WriteSampleCountMap(sampleCounts, params);
+}
+
+/*
+    With adaptive sampling, write out how many samples each pixel took,
+    from black for none up to white for maxSamples
+*/
+bool WriteSampleCountMap(
+    const vector<int>& sampleCounts,
+    const Params& params)
+{
+    long long totalSamples = 0;
+    FrameBuffer countImage(params.width, params.height, 1);
+    for (size_t i = 0; i < sampleCounts.size(); ++i)
+    {
+        totalSamples += sampleCounts[i];
+        countImage.SetValue(i, 0, (float)sampleCounts[i] / (float)params.maxSamples);
+    }
+    cout << "Took " << (double)totalSamples / sampleCounts.size() << " samples per pixel on average" << endl;
+    return WriteImageToFile(countImage, params, AddFileSuffix(params.outputFile, "_samples"));
+}
+
+/*
+    Write what each pixel cost next to the output file, in false colour:
+
+    out_tests: ray - primitive tests and BVH nodes, over all samples
+    out_bounces: the mean number of bounces a sample took, with red
+    for numBouncesPerRay
+    out_time: the time the pixel took
+
+    Tests and time run from nothing up to red at the 99th percentile,
+    so a few very expensive pixels don't leave everything else dark.
+    Where red is is printed out, to read the rest of the scale from.
+*/
+bool WriteCostMaps(
+    const PixelCosts& costs,
+    const vector<int>& sampleCounts,
+    const Params& params)
+{
+    const size_t numPixels = sampleCounts.size();
+    FrameBuffer image(params.width, params.height);
+
+    const auto getPercentile = [&](const vector<uint64_t>& values)
+    {
+        vector<uint64_t> sorted = values;
+        const size_t rank = (sorted.size() * 99) / 100;
+        nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        return max(sorted[rank], (uint64_t)1);
+    };
+    const auto writeMap = [&](const vector<uint64_t>& values, const double scale, const string& suffix)
+    {
+        for (size_t i = 0; i < numPixels; ++i)
+        {
+            image.Set(i, FalseColour((float)((double)values[i] / scale)));
+        }
+        return WriteImageToFile(image, params, AddFileSuffix(params.outputFile, suffix));
+    };
+
+    const uint64_t timeScale = getPercentile(costs.nanoseconds);
+    cout << "Pixel time map goes up to " << (double)timeScale / 1000.0 << " us" << endl;
+    if (!writeMap(costs.nanoseconds, (double)timeScale, "_time"))
+    {
+        return false;
+    }
+
+    if (!AreStatsEnabled())
+    {
+        cout << "Built without RAYTRACER_STATS, so there are no test or bounce maps" << endl;
+        return true;
+    }
+
+    const uint64_t testScale = getPercentile(costs.tests);
+    cout << "Pixel test map goes up to " << testScale << " tests" << endl;
+    if (!writeMap(costs.tests, (double)testScale, "_tests"))
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < numPixels; ++i)
+    {
+        const float bounces = (float)costs.bounces[i] / (float)max(sampleCounts[i], 1);
+        image.Set(i, FalseColour(bounces / (float)max(params.numBouncesPerRay, 1)));
+    }
+    return WriteImageToFile(image, params, AddFileSuffix(params.outputFile, "_bounces"));
+}
+
+/*
+    Render one whole frame into the frame buffer on the given pool,
+    without writing anything out. Gives back the number of jobs it
+    was cut into. If sampleCounts is given, it gets how many samples
+    each pixel took. If rowsDone is given, it's called from the render
+    threads each time a run of rows is finished and won't change again.
+    If costs is given, it gets what each pixel cost, and every pixel is
+    rendered on its own, without packets or wavefronts. If checkpoint is
+    given, tiles it has are skipped, and it's told about each one that
+    gets finished. Wavefronts don't go in tiles, so they ignore it.
+*/
+int RenderFrame(
+    const CompiledScene& scene,
+    const Params& params,
+    WorkStealingPool& pool,
+    FrameBuffer& frameBuffer,
+    vector<int>* sampleCounts,
+    const function<void(int startRow, int endRow)>& rowsDone,
+    PixelCosts* costs,
+    Checkpoint* checkpoint)
+{
+    const unique_ptr<Sampler> sampler = MakeSampler(params.samplerType, params.seed);
+
+    if (params.useWavefront && !costs)
+    {
+        // Wavefront jobs are bands of whole rows, so each batch has plenty of
+        // paths to sort. Each thread keeps its own integrator and its buffers.
+        const int numBands = (params.height + WAVEFRONT_ROWS - 1) / WAVEFRONT_ROWS;
+        vector<unique_ptr<WavefrontIntegrator>> integrators(pool.GetNumThreads());
+        pool.Run(numBands, [&](int band, int thread)
+        {
+            if (!integrators[thread])
+            {
+                integrators[thread].reset(new WavefrontIntegrator(scene, params, *sampler));
+            }
+            const int startRow = band * WAVEFRONT_ROWS;
+            const int endRow = min(startRow + WAVEFRONT_ROWS, params.height);
+            integrators[thread]->RenderRows(startRow, endRow, frameBuffer, sampleCounts);
+            if (rowsDone)
+            {
+                rowsDone(startRow, endRow);
+            }
+        });
+        return numBands;
+    }
+
+    // Send rays from each pixel, checking for collisions against the compiled scene.
+    // The image is cut into tiles, and the tiles are shared out over a pool of threads.
+    // Tiles with lots of reflective shapes in them take much longer than tiles of background,
+    // so threads that finish early steal tiles from the ones that are still busy.
+    const int tilesX = (params.width + TILE_SIZE - 1) / TILE_SIZE;
+    const int tilesY = (params.height + TILE_SIZE - 1) / TILE_SIZE;
+
+    // A row of tiles is finished when its last tile is, whichever thread that's on
+    unique_ptr<atomic<int>[]> tilesLeft(new atomic<int>[tilesY]);
+    for (int y = 0; y < tilesY; ++y)
+    {
+        tilesLeft[y] = tilesX;
+    }
+
+    pool.Run(tilesX * tilesY, [&](int tile, [[maybe_unused]] int thread)
+    {
+        // Tiles a checkpoint already has are left as it put them
+        if (!checkpoint || !checkpoint->IsTileDone(tile))
+        {
+            if (params.usePackets && !costs)
+            {
+                RenderTilePackets(scene, params, *sampler, tile, frameBuffer, sampleCounts);
+            }
+            else
+            {
+                RenderTile(scene, params, *sampler, tile, frameBuffer, sampleCounts, costs);
+            }
+            if (checkpoint)
+            {
+                checkpoint->TileDone(tile);
+            }
+        }
+
+        const int tileRow = tile / tilesX;
+        if (--tilesLeft[tileRow] == 0 && rowsDone)
+        {
+            rowsDone(tileRow * TILE_SIZE, min((tileRow + 1) * TILE_SIZE, params.height));
+        }
+    });
+    return tilesX * tilesY;
+}
+
+/*
+    Render a single tile of the image into the frame buffer.
+
+    Tiles are numbered row-major across the image. Tiles on the right
+    and bottom edges may be smaller than TILE_SIZE.
+    Each pixel belongs to exactly one tile, and the tile is built up
+    in a TileBuffer of its own, so threads never write to the same
+    part of the frame buffer.
+
+    Each pixel keeps taking samples until PixelStats says it's done:
+    a fixed number of them, or with adaptive sampling, until it stops
+    being noisy.
+
+    If costs is given, the thread's counts and the clock are read
+    before and after each pixel, and the difference is what it cost.
+
+    Rays go through the integrator kernel built for this scene and
+    bounce count, which gives the same colours as CastRay.
+*/
+void RenderTile(
+    const CompiledScene& scene,
+    const Params& params,
+    const Sampler& sampler,
+    const int tile,
+    FrameBuffer& frameBuffer,
+    vector<int>* sampleCounts,
+    PixelCosts* costs)
+{
+    const Integrator integrator = GetIntegrator(scene, params.numBouncesPerRay);
+
+    TileBuffer pixels(params, tile);
+    const int startW = pixels.startW;
+    const int startH = pixels.startH;
+    const int endW = startW + pixels.tileW;
+    const int endH = startH + pixels.tileH;
+
+    for (int h = startH; h < endH; ++h)
+    {
+        for (int w = startW; w < endW; ++w)
+        {
+            uint64_t startTests = 0;
+            uint64_t startBounces = 0;
+            chrono::steady_clock::time_point start;
+            if (costs)
+            {
+                ReadPixelCounters(startTests, startBounces);
+                start = chrono::steady_clock::now();
+            }
+
+            PixelStats stats;
+            while (!stats.IsDone(params))
+            {
+                const Vector3f ray = GetPrimaryRay(params, sampler, w, h, stats.count);
+
+                // Accumulate the colour over all sampled rays.
+                // The camera sits at the origin.
+                stats.Add(integrator.castRay(Vector3f::Zero(), ray, scene));
+            }
+
+            // Keep the average pixel colour. Values are clamped when written out.
+            pixels.Set((w - startW) + (h - startH) * pixels.tileW, stats);
+
+            if (costs)
+            {
+                const auto end = chrono::steady_clock::now();
+                uint64_t endTests = 0;
+                uint64_t endBounces = 0;
+                ReadPixelCounters(endTests, endBounces);
+                costs->tests[w + h * params.width] = endTests - startTests;
+                costs->bounces[w + h * params.width] = endBounces - startBounces;
+                costs->nanoseconds[w + h * params.width] = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+            }
+        }
+    }
+    pixels.Flush(frameBuffer, sampleCounts);
+}
+
+/*
+    Render a tile, tracing the primary rays in packets.
+
+    Primary rays all start at the camera and point in nearly the same
+    direction, so the tile is traced a sample at a time, with the pixels
+    that still want samples packed into packets for the SIMD kernels.
+    Once the packet knows what each ray hit, shading and bounces carry
+    on one ray at a time, through the same integrator kernel as RenderTile.
+*/
+void RenderTilePackets(
+    const CompiledScene& scene,
+    const Params& params,
+    const Sampler& sampler,
+    const int tile,
+    FrameBuffer& frameBuffer,
+    vector<int>* sampleCounts)
+{
+    const PacketKernel kernel = GetPacketKernel(params.packetWidth > 0 ? params.packetWidth : GetNativePacketWidth());
+    const Integrator integrator = GetIntegrator(scene, params.numBouncesPerRay);
+
+    TileBuffer pixels(params, tile);
+    const int startW = pixels.startW;
+    const int startH = pixels.startH;
+    const int tileW = pixels.tileW;
+
+    PixelStats stats[TILE_SIZE * TILE_SIZE];
+    int active[TILE_SIZE * TILE_SIZE];
+    int numActive = tileW * pixels.tileH;
+    for (int i = 0; i < numActive; ++i)
+    {
+        active[i] = i;
+    }
+
+    RayPacket packet;
+    PacketHits hits;
+    packet.origin[0] = packet.origin[1] = packet.origin[2] = 0.f;
+    while (numActive > 0)
+    {
+        for (int packetStart = 0; packetStart < numActive; packetStart += PACKET_SIZE)
+        {
+            packet.count = min(PACKET_SIZE, numActive - packetStart);
+            for (int i = 0; i < packet.count; ++i)
+            {
+                const int p = active[packetStart + i];
+                const Vector3f ray = GetPrimaryRay(params, sampler, startW + p % tileW, startH + p / tileW, stats[p].count);
+                packet.dx[i] = ray[0];
+                packet.dy[i] = ray[1];
+                packet.dz[i] = ray[2];
+            }
+
+            kernel(scene, packet, MAX_SCENE_DEPTH, hits);
+            STAT_ADD(STAT_CLOSEST_HIT_QUERIES, packet.count);
+
+            for (int i = 0; i < packet.count; ++i)
+            {
+                const Vector3f ray(packet.dx[i], packet.dy[i], packet.dz[i]);
+                Vector3f colour = scene.GetBackground();
+                if (hits.type[i] != PRIMITIVE_NONE)
+                {
+                    HitRecord hit;
+                    hit.type = (PrimitiveType)hits.type[i];
+                    hit.index = hits.index[i];
+                    hit.distance = hits.distance[i];
+                    scene.CompleteHit(Vector3f::Zero(), ray, hit);
+                    colour = integrator.shadeHit(ray, hit, scene);
+                    STAT_ADD(STAT_CLOSEST_HITS, 1);
+                }
+                else
+                {
+                    STAT_ADD(STAT_CLOSEST_MISSES, 1);
+                    STAT_SAMPLE(STAT_HIST_BOUNCES_LEFT, params.numBouncesPerRay);
+                }
+                stats[active[packetStart + i]].Add(colour);
+            }
+        }
+
+        // Drop the pixels that are done, keeping the rest in order
+        int kept = 0;
+        for (int i = 0; i < numActive; ++i)
+        {
+            if (!stats[active[i]].IsDone(params))
+            {
+                active[kept++] = active[i];
+            }
+        }
+        numActive = kept;
+    }
+
+    for (int p = 0; p < tileW * pixels.tileH; ++p)
+    {
+        pixels.Set(p, stats[p]);
+    }
+    pixels.Flush(frameBuffer, sampleCounts);
+}
+
+/*
+    The bounds of one tile, with nothing in it yet
+*/
+TileBuffer::TileBuffer(const Params& params, const int tile)
+{
+    const int tilesX = (params.width + TILE_SIZE - 1) / TILE_SIZE;
+    startW = (tile % tilesX) * TILE_SIZE;
+    startH = (tile / tilesX) * TILE_SIZE;
+    tileW = min(startW + TILE_SIZE, params.width) - startW;
+    tileH = min(startH + TILE_SIZE, params.height) - startH;
+}
+
+void TileBuffer::Set(const int p, const PixelStats& stats)
+{
+    const Vector3f pixel = stats.GetColour();
+    colour[0][p] = pixel[0];
+    colour[1][p] = pixel[1];
+    colour[2][p] = pixel[2];
+    counts[p] = stats.count;
+}
+
+/*
+    Copy the tile into its place in the frame buffer
+*/
+void TileBuffer::Flush(FrameBuffer& frameBuffer, vector<int>* sampleCounts) const
+{
+    const float* const planes[3] = { colour[0], colour[1], colour[2] };
+    frameBuffer.WriteBlock(startW, startH, tileW, tileH, planes);
+    if (sampleCounts)
+    {
+        const int width = frameBuffer.GetWidth();
+        for (int h = 0; h < tileH; ++h)
+        {
+            copy(counts + h * tileW, counts + (h + 1) * tileW, sampleCounts->begin() + (startW + (startH + h) * width));
+        }
+    }
+}
+
+/*
+    Room for every pixel, all costing nothing so far
+*/
+void PixelCosts::Resize(const int numPixels)
+{
+    tests.assign(numPixels, 0);
+    bounces.assign(numPixels, 0);
+    nanoseconds.assign(numPixels, 0);
+}
+
+/*
+    How many tests and bounces this thread has counted so far. Always
+    nothing without stats.
+*/
+void ReadPixelCounters(
+    uint64_t& tests,
+    uint64_t& bounces)
+{
+#ifdef RT_STATS
+    const ThreadStats& stats = GetThreadStats();
+    tests = stats.counters[STAT_SPHERE_TESTS] + stats.counters[STAT_PLANE_TESTS]
+        + stats.counters[STAT_TRIANGLE_TESTS] + stats.counters[STAT_BVH_NODES];
+    bounces = stats.counters[STAT_REFLECTION_RAYS];
+#else
+    tests = 0;
+    bounces = 0;
+#endif
+}
+
+/*
+    Add one sample to a pixel
+*/
+void PixelStats::Add(const Vector3f& colour)
+{
+    sum += colour;
+
+    const float luminance = 0.2126f * colour[0] + 0.7152f * colour[1] + 0.0722f * colour[2];
+    ++count;
+    const float delta = luminance - mean;
+    mean += delta / (float)count;
+    m2 += delta * (luminance - mean);
+}
+
+/*
+    Without adaptive sampling, a pixel is done after samplesPerPixel samples.
+
+    With it, a pixel is done at maxSamples, or once it has minSamples and
+    the 95% confidence interval on its mean luminance, 1.96 standard
+    errors either side, is no wider than noiseThreshold either side.
+    Luminance is in the same units as the colours written out, where 1 is white.
+*/
+bool PixelStats::IsDone(const Params& params) const
+{
+    if (!params.adaptive)
+    {
+        return count >= params.samplesPerPixel;
+    }
+    if (count >= params.maxSamples)
+    {
+        return true;
+    }
+    if (count < max(params.minSamples, 2))
+    {
+        return false;
+    }
+
+    const float variance = m2 / (float)(count - 1);
+    const float halfWidth = 1.96f * sqrt(variance / (float)count);
+    return halfWidth <= params.noiseThreshold;
+}
+
+/*
+    Cast a single ray into a scene
+
+    This finds the closest shape hit, using the scene's BVH, then shades it. Returns a colour
+
+    The scene is only ever borrowed, so a ray and all its bounces
+    don't allocate anything.
+*/
+Vector3f CastRay(
+    const Vector3f& origin,
+    const Vector3f& ray,
+    const CompiledScene& scene,
+    int numBounces)
+{
+    // Find the closest shape along the ray
+    float closestDist = MAX_SCENE_DEPTH;
+    HitRecord hit;
+    if (scene.Intersect(origin, ray, closestDist, hit))
+    {
+        return ShadeHit(ray, hit, scene, numBounces);
+    }
+
+    STAT_SAMPLE(STAT_HIST_BOUNCES_LEFT, numBounces);
+    return scene.GetBackground();
+}
+
+/*
+    Work out the colour at a hit: lighting equations, plus a bounce
+    if there are any left.
+*/
+Vector3f ShadeHit(
+    const Vector3f& ray,
+    const HitRecord& hit,
+    const CompiledScene& scene,
+    int numBounces)
+{
+    Vector3f colour = DirectLighting(hit, scene) + IndirectLighting(hit, scene);
+
+    if (numBounces > 0)
+    {
+        // This 0.5 is the reflectance factor
+        // final colour should contain some surface colour and some reflected colour
+        // The reflection starts from where this ray hit. Intersections closer
+        // than EPSILON are ignored, so it won't just hit the same surface again.
+        STAT_ADD(STAT_REFLECTION_RAYS, 1);
+        colour += REFLECTANCE * CastRay(hit.point, ReflectRay(ray, hit.normal), scene, numBounces-1);
+    }
+    else
+    {
+        STAT_ADD(STAT_BOUNCE_LIMIT_REACHED, 1);
+        STAT_SAMPLE(STAT_HIST_BOUNCES_LEFT, 0);
+    }
+
+    return colour;
+}
+
+/*
+    Light arriving directly from the lights at a hit, and
+    reflected back along the ray.
+
+    A light only counts if nothing is in the way. Which thing is in
+    the way doesn't matter, so that's an any-hit query rather than a
+    search for the closest hit. Lights behind the surface are skipped
+    before casting anything.
+*/
+Vector3f DirectLighting(
+    const HitRecord& hit,
+    const CompiledScene& scene)
+{
+    const Vector3f& surfaceNormal = hit.normal;
+    float diffuseIntensity = 0;
+    for (const auto& l : scene.GetLights())
+    {
+        Vector3f lightDir = l.position - hit.point;
+        const float lightDist = lightDir.norm();
+        lightDir /= lightDist;
+        const float facing = lightDir.dot(surfaceNormal);
+        if (facing <= 0.f || scene.IsOccluded(hit.point, lightDir, lightDist))
+        {
+            continue;
+        }
+        diffuseIntensity += l.intensity * facing;
+    }
+
+    // How much light this reflects back toward the ray origin vs absorbs
+    // Maybe should call this absorption factor
+    return hit.diffusionFactor * diffuseIntensity * hit.colour;
+}
+
+/*
+    Light arriving at a hit after bouncing off something else first,
+    estimated from the photons that landed around it. Nothing without
+    photon maps.
+*/
+Vector3f IndirectLighting(
+    const HitRecord& hit,
+    const CompiledScene& scene)
+{
+    if (const PhotonMaps* maps = scene.GetPhotonMaps())
+    {
+        return maps->GetIndirectLighting(hit);
+    }
+    const IlluminationMaps* maps = scene.GetIlluminationMaps();
+    return maps ? maps->GetIndirectLighting(hit) : Vector3f::Zero();
+}
+
+/*
+    Compute reflection ray
+    reflected ray = R - 2 (dot(R, N)) * N
+    where R = ray, N = normal
+*/
+Vector3f ReflectRay(
+    const Vector3f& ray,
+    const Vector3f& normal)
+{
+    // add a smidge of random to this vector for diffuse reflection
+    return ray - 2 * ray.dot(normal) * normal;
+}
+
+/*
+    The ray through pixel (w, h) from the camera at the origin,
+    for the given sample of that pixel.
+
+    Uses the field of view to get x and y on the view plane at z = 1,
+    from a point jittered within the pixel by the sampler.
+*/
+Vector3f GetPrimaryRay(
+    const Params& params,
+    const Sampler& sampler,
+    const int w,
+    const int h,
+    const int sample)
+{
+    STAT_ADD(STAT_CAMERA_RAYS, 1);
+    const float fov = (3.141592 / 180.f) * (float)params.fov;
+    const float width = (float)params.width;
+    const float height = (float)params.height;
+
+    // perturb the point by no more than a quarter pixel from the centre,
+    // since pixel intensities are gaussian-distributed at the centre of the pixel
+    // [0, 1) * 0.5 + 0.25 = [0.25, 0.75)
+    const Vector2f jitter = sampler.Get2D(w, h, sample, SAMPLE_DIM_PIXEL);
+    const float px = w + 0.25f + 0.5f * jitter[0];
+    const float py = h + 0.25f + 0.5f * jitter[1];
+
+    // get x and y from field of view equation
+    const float x = (2 * px / width - 1) * tan(fov / 2.) * width / height;
+    const float y = -(2 * py / height - 1) * tan(fov / 2.);
+
+    Vector3f ray(x, y, 1.f);
+    ray.normalize();
+    return ray;
+}
@@ -0,0 +1,294 @@
+#pragma once
+#include <eigen3/Eigen/Dense>
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "Scene.h"
+#include "CompiledScene.h"
+#include "Sampler.h"
+#include "IlluminationMap.h"
+#include "Checkpoint.h"
+#include "FrameBuffer.h"
+
+class WorkStealingPool;
+struct PhotonMaps;
+
+// TODO define this in a better spot
+#define MAX_SCENE_DEPTH 10
+
+// How much of the reflected ray's colour a surface passes on
+#define REFLECTANCE 0.5f
+
+// Images are split into square tiles of this many pixels a side,
+// which are the unit of work handed to the render threads
+#define TILE_SIZE 16
+
+/**********************************************/
+/*############# RENDER SETTINGS ##############*/
+/**********************************************/
+struct Params
+{
+	std::string sceneFile;
+	std::string outputFile;
+	int width = 640;
+	int height = 480;
+	int fov = 90;
+
+	int samplesPerPixel = 1;
+
+	// Adaptive sampling: each pixel takes at least minSamples and at most
+	// maxSamples, stopping once it's sure to within noiseThreshold.
+	// samplesPerPixel is ignored when this is on.
+	bool adaptive = false;
+	int minSamples = 4;
+	int maxSamples = 64;
+	float noiseThreshold = 0.01f;
+
+	// Where the jitter for each sample comes from. The same seed
+	// always gives the same image, whatever the thread count.
+	SamplerType samplerType = SAMPLER_SOBOL;
+	uint32_t seed = 0;
+
+	int numBouncesPerRay = MAX_NUM_BOUNCES_PER_RAY;
+
+	// 0 means use every hardware thread
+	int numThreads = 0;
+
+	// Trace primary rays in SIMD packets. A width of 0 means
+	// the widest the CPU supports.
+	bool usePackets = false;
+	int packetWidth = 0;
+
+	// Trace paths a bounce at a time with the WavefrontIntegrator
+	bool useWavefront = false;
+
+	// Gamma applied when writing 8 bit images. Float formats stay linear.
+	float gamma = 1.f;
+
+	// Write rows to the output file as soon as they're finished,
+	// instead of all at once at the end
+	bool streamOutput = false;
+
+	// Photon mapping: how many photons to shoot from the lights, and how
+	// many of them, from how far around, each lookup uses. 0 photons
+	// means no photon maps, and so no indirect light.
+	int numPhotons = 0;
+	int photonNearest = 64;
+	float photonRadius = 0.5f;
+
+	// Render this many passes of stochastic progressive photon mapping
+	// instead, with numPhotons photons a pass and photonRadius to start
+	// with. 0 means the usual renderer.
+	int sppmPasses = 0;
+
+	// Illumination maps: how many photons to splat into them, and how
+	// many texels a side each map has. If illuminationFile is set, maps
+	// are read from it when it holds some for this scene, and written
+	// to it when they have to be built.
+	int illuminationPhotons = 0;
+	int illuminationResolution = ILLUMINATION_MAP_DEFAULT_RESOLUTION;
+	std::string illuminationFile;
+
+	// If set, write counts of what the render did here, as JSON
+	std::string statsFile;
+
+	// Record what each pixel cost to render, and write it out next to
+	// the image as false colour maps
+	bool costMaps = false;
+
+	// Filter the noise out of the image before it's written, guided by
+	// what the camera saw first through each pixel. writeAOVs writes
+	// those guides out next to the image too. halfAOVs keeps them as
+	// half floats, for half the memory.
+	bool denoise = false;
+	bool writeAOVs = false;
+	bool halfAOVs = false;
+
+	// If set, render the animation in this file, a numbered image per frame
+	std::string animationFile;
+
+	// If set, write sceneFile out as a binary scene file here instead of rendering
+	std::string convertFile;
+
+	// If set, save the tiles that are done to this file every
+	// checkpointInterval seconds. With resume, start from the tiles
+	// already in it.
+	std::string checkpointFile;
+	int checkpointInterval = CHECKPOINT_DEFAULT_INTERVAL;
+	bool resume = false;
+
+	// Render on this many worker processes started here, and one more for
+	// each command, run through the shell. isWorker is set in the workers.
+	int numWorkers = 0;
+	std::vector<std::string> workerCommands;
+	bool isWorker = false;
+
+	// If set, render jobs from "stdio" or the unix domain socket at this
+	// path until told to quit, instead of rendering once
+	std::string serverAddress;
+
+	bool runUnitTests = false;
+};
+
+/*
+	Running totals for the samples of one pixel.
+
+	The colour is the plain mean of the samples. Alongside it, the mean
+	and variance of their luminance are kept with Welford's method, so
+	adaptive sampling can tell how sure it is of the pixel.
+*/
+struct PixelStats
+{
+	Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+	float mean = 0.f;
+	float m2 = 0.f;
+	int count = 0;
+
+	void Add(const Eigen::Vector3f& colour);
+	Eigen::Vector3f GetColour() const { return sum / (float)count; };
+
+	// Whether this pixel needs no more samples
+	bool IsDone(const Params& params) const;
+};
+
+/*
+	What each pixel cost to render, for finding the parts of a scene
+	where the time goes.
+
+	Tests are ray - primitive tests plus BVH nodes opened, and bounces
+	are reflection rays, both over all of the pixel's samples. They're
+	read off the thread's stats before and after each pixel, so they're
+	only there when stats are compiled in. Time is always there.
+*/
+struct PixelCosts
+{
+	std::vector<uint64_t> tests;
+	std::vector<uint64_t> bounces;
+	std::vector<uint64_t> nanoseconds;
+
+	void Resize(const int numPixels);
+};
+
+/*
+	One tile's pixels, kept by the thread rendering it, a plane per
+	channel, until the tile is done and they go into the frame buffer
+	in one go, a row of floats at a time. While they work, threads
+	then never write to lines of the frame buffer that the tiles next
+	to theirs share.
+*/
+struct TileBuffer
+{
+	int startW;
+	int startH;
+	int tileW;
+	int tileH;
+	alignas(FRAMEBUFFER_ALIGNMENT) float colour[3][TILE_SIZE * TILE_SIZE];
+	int counts[TILE_SIZE * TILE_SIZE];
+
+	TileBuffer(const Params& params, const int tile);
+
+	// Pixel p of the tile, counting along its rows
+	void Set(const int p, const PixelStats& stats);
+	void Flush(FrameBuffer& frameBuffer, std::vector<int>* sampleCounts) const;
+};
+
+/**********************************************/
+/*############ RENDER FUNCTIONS ##############*/
+/**********************************************/
+bool WriteImageToFile(
+	const FrameBuffer& frameBuffer,
+	const Params& params,
+	const std::string& fileName);
+
+std::string AddFileSuffix(
+	const std::string& fileName,
+	const std::string& suffix);
+
+/*
+	Trace the photon maps and illumination maps params asks for, on the
+	pool, and hand them to the scene. The maps have to outlive every
+	render of the scene. SPPM traces its own, so nothing is done for it.
+*/
+bool PrepareIndirectLighting(
+	CompiledScene& scene,
+	const Params& params,
+	WorkStealingPool& pool,
+	PhotonMaps& photonMaps,
+	IlluminationMaps& illuminationMaps);
+
+bool RenderScene(
+	const CompiledScene& scene,
+	const Params& params,
+	WorkStealingPool& pool);
+
+bool WriteSampleCountMap(
+	const std::vector<int>& sampleCounts,
+	const Params& params);
+
+bool WriteCostMaps(
+	const PixelCosts& costs,
+	const std::vector<int>& sampleCounts,
+	const Params& params);
+
+int RenderFrame(
+	const CompiledScene& scene,
+	const Params& params,
+	WorkStealingPool& pool,
+	FrameBuffer& frameBuffer,
+	std::vector<int>* sampleCounts = nullptr,
+	const std::function<void(int startRow, int endRow)>& rowsDone = nullptr,
+	PixelCosts* costs = nullptr,
+	Checkpoint* checkpoint = nullptr);
+
+void RenderTile(
+	const CompiledScene& scene,
+	const Params& params,
+	const Sampler& sampler,
+	const int tile,
+	FrameBuffer& frameBuffer,
+	std::vector<int>* sampleCounts,
+	PixelCosts* costs = nullptr);
+
+void ReadPixelCounters(
+	uint64_t& tests,
+	uint64_t& bounces);
+
+void RenderTilePackets(
+	const CompiledScene& scene,
+	const Params& params,
+	const Sampler& sampler,
+	const int tile,
+	FrameBuffer& frameBuffer,
+	std::vector<int>* sampleCounts);
+
+Eigen::Vector3f CastRay(
+	const Eigen::Vector3f& origin,
+	const Eigen::Vector3f& ray,
+	const CompiledScene& scene,
+	int numBounces);
+
+Eigen::Vector3f ShadeHit(
+	const Eigen::Vector3f& ray,
+	const HitRecord& hit,
+	const CompiledScene& scene,
+	int numBounces);
+
+Eigen::Vector3f DirectLighting(
+	const HitRecord& hit,
+	const CompiledScene& scene);
+
+Eigen::Vector3f IndirectLighting(
+	const HitRecord& hit,
+	const CompiledScene& scene);
+
+Eigen::Vector3f ReflectRay(
+	const Eigen::Vector3f& ray,
+	const Eigen::Vector3f& normal);
+
+Eigen::Vector3f GetPrimaryRay(
+	const Params& params,
+	const Sampler& sampler,
+	const int w,
+	const int h,
+	const int sample);
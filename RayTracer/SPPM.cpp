@@ -0,0 +1,456 @@
+#include "SPPM.h"
+#include "PhotonMap.h"
+#include "Sampler.h"
+#include "Scheduler.h"
+#include "Stats.h"
+#include "Denoise.h"
+#include <algorithm>
+#include <iostream>
+#include <chrono>
+#include <cmath>
+
+using namespace Eigen;
+using namespace std;
+
+#define PI_F 3.14159265f
+
+// Rows of the image per camera pass job
+#define SPPM_CAMERA_ROWS 16
+// Photon gathering jobs per thread, and fewest photon tests in one
+#define SPPM_GATHER_JOBS_PER_THREAD 8
+#define SPPM_GATHER_TESTS 65536
+// Fewest pixels per job adding up what the grid gathered
+#define SPPM_GATHER_PIXELS 1024
+
+//-----------------------------------------------------------
+SPPMIntegrator::SPPMIntegrator(const CompiledScene& scene, const Params& params, WorkStealingPool& pool) :
+	scene(scene),
+	params(params),
+	pool(pool)
+{
+	const size_t numPixels = (size_t)params.width * params.height;
+	direct.assign(numPixels, Vector3f::Zero());
+	radiusSq.assign(numPixels, params.photonRadius * params.photonRadius);
+	photonCount.assign(numPixels, 0.f);
+	flux.assign(numPixels, Vector3f::Zero());
+
+	pointPosition.resize(numPixels);
+	pointNormal.resize(numPixels);
+	pointFilter.resize(numPixels);
+	// One bucket per pixel, and at most eight cells per visible point
+	cellStart.resize(numPixels + 1);
+	cellEntries.reserve(numPixels * 8);
+	pixelStart.resize(numPixels + 1);
+	bucketNext.resize(numPixels);
+	photonStart.resize(numPixels + 1);
+}
+
+int SPPMIntegrator::RunPass()
+{
+	const int numPhotons = params.numPhotons > 0 ? params.numPhotons : SPPM_DEFAULT_PHOTONS;
+	TraceCameraPaths();
+	BuildGrid();
+	TracePhotons(numPhotons);
+	SortPhotons();
+	GatherPhotons();
+	++numPasses;
+	return numPhotons;
+}
+
+void SPPMIntegrator::GetImage(FrameBuffer& frameBuffer) const
+{
+	frameBuffer.Resize(params.width, params.height);
+	const float passes = (float)max(numPasses, 1);
+	for (size_t i = 0; i < direct.size(); ++i)
+	{
+		frameBuffer.Set(i, (direct[i] + flux[i] / (PI_F * radiusSq[i])) / passes);
+	}
+}
+
+size_t SPPMIntegrator::GetMemoryUsed() const
+{
+	size_t bytes = 0;
+	bytes += (direct.capacity() + flux.capacity() + entryFlux.capacity()) * sizeof(Vector3f);
+	bytes += (pointPosition.capacity() + pointNormal.capacity() + pointFilter.capacity()) * sizeof(Vector3f);
+	bytes += (radiusSq.capacity() + photonCount.capacity()) * sizeof(float);
+	bytes += (cellStart.capacity() + cellEntries.capacity() + pixelStart.capacity() + pixelEntries.capacity()) * sizeof(int);
+	bytes += (bucketNext.capacity() + entryPhotons.capacity() + photonStart.capacity()) * sizeof(int);
+	for (const vector<SPPMPhoton>& photons : jobPhotons)
+	{
+		bytes += photons.capacity() * sizeof(SPPMPhoton);
+	}
+	bytes += sortedPhotons.capacity() * sizeof(SPPMPhoton);
+	return bytes;
+}
+
+//-----------------------------------------------------------
+/*
+	Follow each pixel's path down its mirror bounces, as CastRay does,
+	adding up the direct light. Each diffuse hit is a candidate for the
+	visible point, weighted by how much of it reaches the pixel.
+
+	The pick is made as the path goes, with a single random number:
+	each candidate takes over with its share of the weight so far, and
+	the number is stretched back out to [0, 1) after every choice, so
+	it can make the next one too. The point ends up weighted by the
+	total over its own share, which makes the estimate come out right.
+*/
+void SPPMIntegrator::TraceCameraPaths()
+{
+	const unique_ptr<Sampler> sampler = MakeSampler(params.samplerType, params.seed);
+	const int numBands = (params.height + SPPM_CAMERA_ROWS - 1) / SPPM_CAMERA_ROWS;
+	pool.Run(numBands, [&](int band, int)
+	{
+		const int endRow = min((band + 1) * SPPM_CAMERA_ROWS, params.height);
+		for (int h = band * SPPM_CAMERA_ROWS; h < endRow; ++h)
+		{
+			for (int w = 0; w < params.width; ++w)
+			{
+				const int pixel = h * params.width + w;
+				float u = sampler->Get2D(w, h, numPasses, SAMPLE_DIM_VISIBLE_POINT)[0];
+
+				Vector3f origin = Vector3f::Zero();
+				Vector3f ray = GetPrimaryRay(params, *sampler, w, h, numPasses);
+				Vector3f colour = Vector3f::Zero();
+				float weight = 1.f;
+				float totalWeight = 0.f;
+				pointFilter[pixel] = Vector3f::Zero();
+
+				for (int bounce = 0; bounce <= params.numBouncesPerRay; ++bounce)
+				{
+					float closestDist = MAX_SCENE_DEPTH;
+					HitRecord hit;
+					if (!scene.Intersect(origin, ray, closestDist, hit))
+					{
+						colour += weight * scene.GetBackground();
+						STAT_SAMPLE(STAT_HIST_BOUNCES_LEFT, params.numBouncesPerRay - bounce);
+						break;
+					}
+					colour += weight * DirectLighting(hit, scene);
+
+					if (hit.diffusionFactor > 0.f)
+					{
+						totalWeight += weight;
+						const float share = weight / totalWeight;
+						if (u < share)
+						{
+							u /= share;
+							pointPosition[pixel] = hit.point;
+							pointNormal[pixel] = hit.normal.dot(ray) < 0.f ? hit.normal : Vector3f(-hit.normal);
+							pointFilter[pixel] = hit.diffusionFactor * hit.colour;
+						}
+						else
+						{
+							u = (u - share) / (1.f - share);
+						}
+					}
+
+					if (bounce == params.numBouncesPerRay)
+					{
+						STAT_ADD(STAT_BOUNCE_LIMIT_REACHED, 1);
+						STAT_SAMPLE(STAT_HIST_BOUNCES_LEFT, 0);
+						break;
+					}
+					STAT_ADD(STAT_REFLECTION_RAYS, 1);
+					origin = hit.point;
+					ray = ReflectRay(ray, hit.normal);
+					weight *= REFLECTANCE;
+				}
+
+				pointFilter[pixel] *= totalWeight;
+				direct[pixel] += colour;
+			}
+		}
+	});
+}
+
+uint32_t SPPMIntegrator::HashCell(const int x, const int y, const int z) const
+{
+	// Teschner et al., "Optimized Spatial Hashing for Collision Detection of Deformable Objects"
+	const uint32_t hash = ((uint32_t)x * 73856093u) ^ ((uint32_t)y * 19349663u) ^ ((uint32_t)z * 83492791u);
+	return hash % (uint32_t)(cellStart.size() - 1);
+}
+
+/*
+	Bucket every visible point into each cell its sphere overlaps, with
+	a counting sort. Cells are twice the widest radius across, so that's
+	at most two cells along each axis. Different cells can share a
+	bucket, but a point only goes into each bucket once. Each pixel
+	also keeps where its entries went, in the order of its buckets.
+
+	This is one pass over the pixels, so it's left on one thread,
+	which keeps the order of each bucket fixed.
+*/
+void SPPMIntegrator::BuildGrid()
+{
+	const int numPixels = (int)pointFilter.size();
+	AlignedBox3f bounds;
+	float maxRadiusSq = 0.f;
+	for (int i = 0; i < numPixels; ++i)
+	{
+		if (!pointFilter[i].isZero())
+		{
+			bounds.extend(pointPosition[i]);
+			maxRadiusSq = max(maxRadiusSq, radiusSq[i]);
+		}
+	}
+	gridLower = bounds.isEmpty() ? Vector3f::Zero() : bounds.min();
+	cellSize = max(2.f * sqrt(maxRadiusSq), 1e-6f);
+
+	// Gives the buckets of each cell the point's sphere overlaps, none repeated
+	auto forEachBucket = [this](const int i, uint32_t buckets[8]) -> int
+	{
+		const float radius = sqrt(radiusSq[i]);
+		const Vector3f lower = (pointPosition[i] - gridLower - Vector3f::Constant(radius)) / cellSize;
+		const Vector3f upper = (pointPosition[i] - gridLower + Vector3f::Constant(radius)) / cellSize;
+		int count = 0;
+		for (int z = (int)floor(lower[2]); z <= (int)floor(upper[2]); ++z)
+		{
+			for (int y = (int)floor(lower[1]); y <= (int)floor(upper[1]); ++y)
+			{
+				for (int x = (int)floor(lower[0]); x <= (int)floor(upper[0]); ++x)
+				{
+					const uint32_t bucket = HashCell(x, y, z);
+					if (count < 8 && find(buckets, buckets + count, bucket) == buckets + count)
+					{
+						buckets[count++] = bucket;
+					}
+				}
+			}
+		}
+		return count;
+	};
+
+	fill(cellStart.begin(), cellStart.end(), 0);
+	uint32_t buckets[8];
+	for (int i = 0; i < numPixels; ++i)
+	{
+		if (!pointFilter[i].isZero())
+		{
+			const int count = forEachBucket(i, buckets);
+			for (int b = 0; b < count; ++b)
+			{
+				++cellStart[buckets[b] + 1];
+			}
+		}
+	}
+	for (size_t b = 1; b < cellStart.size(); ++b)
+	{
+		cellStart[b] += cellStart[b - 1];
+	}
+
+	cellEntries.resize(cellStart.back());
+	pixelEntries.resize(cellStart.back());
+	copy(cellStart.begin(), cellStart.end() - 1, bucketNext.begin());
+	int numEntries = 0;
+	for (int i = 0; i < numPixels; ++i)
+	{
+		pixelStart[i] = numEntries;
+		if (!pointFilter[i].isZero())
+		{
+			const int count = forEachBucket(i, buckets);
+			for (int b = 0; b < count; ++b)
+			{
+				const int entry = bucketNext[buckets[b]]++;
+				cellEntries[entry] = i;
+				pixelEntries[numEntries++] = entry;
+			}
+		}
+	}
+	pixelStart[numPixels] = numEntries;
+}
+
+/*
+	Trace a pass of photons, keeping every diffuse hit that lands in a
+	bucket with any visible points in it. Each job keeps its own list.
+*/
+void SPPMIntegrator::TracePhotons(const int numPhotons)
+{
+	const vector<PhotonJob> jobs = PlanPhotonJobs(scene, numPhotons, numPasses);
+	jobPhotons.resize(jobs.size());
+
+	const SobolSampler sampler(params.seed);
+	pool.Run((int)jobs.size(), [&](int j, int)
+	{
+		vector<SPPMPhoton>& photons = jobPhotons[j];
+		photons.clear();
+		const function<void(const PhotonHit&)> store = [this, &photons](const PhotonHit& hit)
+		{
+			const Vector3f cell = (hit.position - gridLower) / cellSize;
+			const uint32_t bucket = HashCell((int)floor(cell[0]), (int)floor(cell[1]), (int)floor(cell[2]));
+			if (cellStart[bucket + 1] > cellStart[bucket])
+			{
+				photons.push_back({ hit.position, hit.direction, hit.power, bucket });
+			}
+		};
+		for (int p = 0; p < jobs[j].count; ++p)
+		{
+			TracePhoton(scene, sampler, jobs[j], jobs[j].first + p, store);
+		}
+	});
+}
+
+/*
+	Counting sort this pass's photons by bucket, once, keeping them in
+	the order they were sent out within each bucket. Working out the
+	buckets was done as they were traced, so this is just a count and
+	a copy.
+*/
+void SPPMIntegrator::SortPhotons()
+{
+	fill(photonStart.begin(), photonStart.end(), 0);
+	for (const vector<SPPMPhoton>& photons : jobPhotons)
+	{
+		for (const SPPMPhoton& photon : photons)
+		{
+			++photonStart[photon.bucket + 1];
+		}
+	}
+	for (size_t b = 1; b < photonStart.size(); ++b)
+	{
+		photonStart[b] += photonStart[b - 1];
+	}
+
+	sortedPhotons.resize(photonStart.back());
+	copy(photonStart.begin(), photonStart.end() - 1, bucketNext.begin());
+	for (const vector<SPPMPhoton>& photons : jobPhotons)
+	{
+		for (const SPPMPhoton& photon : photons)
+		{
+			sortedPhotons[bucketNext[photon.bucket]++] = photon;
+		}
+	}
+}
+
+/*
+	Add each photon to every visible point it landed close enough to,
+	on the side it faces, then shrink the radius of every pixel that
+	caught some, keeping SPPM_ALPHA of the new ones, and scale the flux
+	down with the area. Pixels that caught nothing are left alone.
+
+	First, jobs take ranges of the grid's entries, and check each
+	entry's visible point against the photons in its bucket, in order,
+	adding up what it caught. No two jobs share an entry. A few buckets
+	can hold most of the points, so the ranges are cut to make each
+	job do about as many tests as the others, splitting big buckets
+	between jobs.
+
+	Then jobs take bands of pixels, and each pixel adds up its own
+	entries, in the order of its buckets. Every sum is done in the
+	same order whatever the thread count.
+*/
+void SPPMIntegrator::GatherPhotons()
+{
+	const int numEntries = (int)cellEntries.size();
+	entryPhotons.assign(numEntries, 0);
+	entryFlux.assign(numEntries, Vector3f::Zero());
+
+	// Every entry costs a test per photon in its bucket
+	const int numBuckets = (int)cellStart.size() - 1;
+	long long totalTests = 0;
+	for (int b = 0; b < numBuckets; ++b)
+	{
+		totalTests += (long long)(photonStart[b + 1] - photonStart[b]) * (cellStart[b + 1] - cellStart[b]);
+	}
+	const long long jobTests = max(totalTests / (pool.GetNumThreads() * SPPM_GATHER_JOBS_PER_THREAD), (long long)SPPM_GATHER_TESTS);
+	vector<int> cuts = { 0 };
+	long long tests = 0;
+	for (int b = 0; b < numBuckets; ++b)
+	{
+		const long long photons = photonStart[b + 1] - photonStart[b];
+		for (int e = cellStart[b]; photons > 0 && e < cellStart[b + 1];)
+		{
+			const long long wanted = max((jobTests - tests + photons - 1) / photons, 1LL);
+			const int take = (int)min((long long)(cellStart[b + 1] - e), wanted);
+			e += take;
+			tests += take * photons;
+			if (tests >= jobTests)
+			{
+				cuts.push_back(e);
+				tests = 0;
+			}
+		}
+	}
+	if (cuts.back() < numEntries)
+	{
+		cuts.push_back(numEntries);
+	}
+
+	pool.Run((int)cuts.size() - 1, [&](int job, int)
+	{
+		for (int first = cuts[job]; first < cuts[job + 1];)
+		{
+			// The bucket entry first is in, and as much of it as this job has
+			const int b = (int)(upper_bound(cellStart.begin(), cellStart.end(), first) - cellStart.begin()) - 1;
+			const int last = min(cuts[job + 1], cellStart[b + 1]);
+			for (int p = photonStart[b]; p < photonStart[b + 1]; ++p)
+			{
+				const SPPMPhoton& photon = sortedPhotons[p];
+				for (int e = first; e < last; ++e)
+				{
+					const int i = cellEntries[e];
+					if ((photon.position - pointPosition[i]).squaredNorm() < radiusSq[i] &&
+						photon.direction.dot(pointNormal[i]) < 0.f)
+					{
+						++entryPhotons[e];
+						entryFlux[e] += pointFilter[i].cwiseProduct(photon.power);
+					}
+				}
+			}
+			first = last;
+		}
+	});
+
+	const int numPixels = (int)pointFilter.size();
+	const int numBands = max(1, numPixels / SPPM_GATHER_PIXELS);
+	pool.Run(numBands, [&](int band, int)
+	{
+		const int first = (int)((long long)numPixels * band / numBands);
+		const int last = (int)((long long)numPixels * (band + 1) / numBands);
+		for (int i = first; i < last; ++i)
+		{
+			int newPhotons = 0;
+			Vector3f newFlux = Vector3f::Zero();
+			for (int e = pixelStart[i]; e < pixelStart[i + 1]; ++e)
+			{
+				newPhotons += entryPhotons[pixelEntries[e]];
+				newFlux += entryFlux[pixelEntries[e]];
+			}
+			if (newPhotons > 0)
+			{
+				const float count = photonCount[i] + SPPM_ALPHA * newPhotons;
+				const float ratio = count / (photonCount[i] + newPhotons);
+				radiusSq[i] *= ratio;
+				flux[i] = (flux[i] + newFlux) * ratio;
+				photonCount[i] = count;
+			}
+		}
+	});
+}
+
+//-----------------------------------------------------------
+bool RenderSPPM(const CompiledScene& scene, const Params& params, WorkStealingPool& pool)
+{
+	SPPMIntegrator integrator(scene, params, pool);
+	cout << "Rendering " << params.sppmPasses << " SPPM passes on " << pool.GetNumThreads() << " threads" << endl;
+
+	{
+		StatTimer timer(STAT_TIME_RENDER);
+		for (int pass = 0; pass < params.sppmPasses; ++pass)
+		{
+			const auto start = chrono::steady_clock::now();
+			const int numPhotons = integrator.RunPass();
+			const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+			cout << "  pass " << pass + 1 << ": " << numPhotons << " photons in " << seconds << "s ("
+				<< numPhotons / seconds << " photons/sec), " << integrator.GetMemoryUsed() / (1024. * 1024.) << " MB" << endl;
+		}
+	}
+
+	FrameBuffer frameBuffer;
+	integrator.GetImage(frameBuffer);
+	if (params.denoise && !DenoiseFrame(scene, params, pool, nullptr, frameBuffer))
+	{
+		return false;
+	}
+	return WriteImageToFile(frameBuffer, params, params.outputFile);
+}
@@ -0,0 +1,141 @@
+#pragma once
+#include <eigen3/Eigen/Dense>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "CompiledScene.h"
+#include "Render.h"
+
+class WorkStealingPool;
+
+// Photons per pass when Params doesn't say
+#define SPPM_DEFAULT_PHOTONS 100000
+// How much of each pass's photons a pixel keeps, Hachisuka and Jensen's alpha
+#define SPPM_ALPHA 0.7f
+
+/**********************************************/
+/*############### SPPM CLASSES ###############*/
+/**********************************************/
+
+/*
+	Stochastic progressive photon mapping, after Hachisuka and Jensen,
+	"Stochastic Progressive Photon Mapping" (SIGGRAPH Asia 2009).
+
+	Rather than trace one big photon map and keep it, SPPM alternates
+	two passes, as many times as it's asked to:
+
+		camera pass: trace a jittered path for every pixel, gathering
+		direct light along it, and leave one visible point on a
+		diffuse surface it hit
+		photon pass: trace a batch of photons, and add each one that
+		lands within a visible point's radius to that point's pixel
+
+	After every pass, each pixel that caught photons shrinks its radius
+	and scales the flux it has gathered to suit, keeping SPPM_ALPHA of
+	the new photons. So the estimate sharpens as passes go by, and
+	converges on the right answer, while the only things kept between
+	passes are a handful of numbers per pixel.
+
+	The camera path follows mirrors, like CastRay. Every diffuse hit
+	along it could take the visible point; one is picked at random, in
+	proportion to how much it counts towards the pixel, and weighted
+	so the sum comes out right on average.
+
+	Visible points go in a hash grid with cells twice the widest radius
+	across, rebuilt each pass, so a photon only has to look in the one
+	cell it lands in. Memory then depends on the image size and the
+	photons per pass, never on how many passes there have been.
+
+	Photons are kept for the length of a pass, sorted by the bucket they
+	land in. Each bucket adds up its photons in the order they were sent
+	out, and each pixel adds up its buckets in a fixed order, so the
+	image is the same whatever the thread count.
+*/
+// A photon on a diffuse surface, kept until the end of its pass
+struct SPPMPhoton
+{
+	Eigen::Vector3f position;
+	Eigen::Vector3f direction;
+	Eigen::Vector3f power;
+	// The bucket of the grid the cell it landed in goes in
+	uint32_t bucket;
+};
+
+class SPPMIntegrator
+{
+public:
+	SPPMIntegrator(const CompiledScene& scene, const Params& params, WorkStealingPool& pool);
+	~SPPMIntegrator() {};
+
+	// Run one camera pass and one photon pass, then update every pixel.
+	// Gives back the number of photons traced.
+	int RunPass();
+
+	// The image so far, one colour per pixel
+	void GetImage(FrameBuffer& frameBuffer) const;
+
+	int GetNumPasses() const { return numPasses; };
+	size_t GetMemoryUsed() const;
+
+	// Gathering radius of every pixel, squared
+	const std::vector<float>& GetRadiiSquared() const { return radiusSq; };
+
+private:
+	void TraceCameraPaths();
+	void BuildGrid();
+	void TracePhotons(const int numPhotons);
+	void SortPhotons();
+	void GatherPhotons();
+
+	// Which bucket of the grid a cell goes in
+	uint32_t HashCell(const int x, const int y, const int z) const;
+
+	const CompiledScene& scene;
+	const Params& params;
+	WorkStealingPool& pool;
+
+	int numPasses = 0;
+
+	// What's kept between passes, per pixel: direct light summed over
+	// every pass, and the gathering radius, photon count and flux
+	std::vector<Eigen::Vector3f> direct;
+	std::vector<float> radiusSq;
+	std::vector<float> photonCount;
+	std::vector<Eigen::Vector3f> flux;
+
+	// This pass's visible point for each pixel. filter is what light
+	// arriving there is multiplied by on its way to the pixel; a pixel
+	// whose path didn't end up anywhere diffuse has a filter of zero.
+	std::vector<Eigen::Vector3f> pointPosition;
+	std::vector<Eigen::Vector3f> pointNormal;
+	std::vector<Eigen::Vector3f> pointFilter;
+
+	// The grid: pixels of bucket b are cellEntries[cellStart[b], cellStart[b + 1]),
+	// and the entries pixel i has are pixelEntries[pixelStart[i], pixelStart[i + 1])
+	Eigen::Vector3f gridLower;
+	float cellSize = 1.f;
+	std::vector<int> cellStart;
+	std::vector<int> cellEntries;
+	std::vector<int> pixelStart;
+	std::vector<int> pixelEntries;
+
+	// Where each bucket is up to while things are sorted into it
+	std::vector<int> bucketNext;
+
+	// Photons caught this pass by each entry of the grid
+	std::vector<int> entryPhotons;
+	std::vector<Eigen::Vector3f> entryFlux;
+
+	// Where each photon job's photons landed this pass, then all of them
+	// sorted by bucket: bucket b's are sortedPhotons[photonStart[b], photonStart[b + 1])
+	std::vector<std::vector<SPPMPhoton>> jobPhotons;
+	std::vector<SPPMPhoton> sortedPhotons;
+	std::vector<int> photonStart;
+};
+
+/*
+	Render params.sppmPasses passes of SPPM and write the image out,
+	reporting the memory used and photons traced per second as it goes.
+*/
+bool RenderSPPM(const CompiledScene& scene, const Params& params, WorkStealingPool& pool);
@@ -0,0 +1,287 @@
+#include "Sampler.h"
+#include <random>
+#include <cmath>
+
+using namespace Eigen;
+using namespace std;
+
+//-----------------------------------------------------------
+/*
+	Integer hashing, which everything here is built on.
+	This is Chris Wellons' lowbias32: every input bit affects every
+	output bit, and it's cheap.
+*/
+static uint32_t Hash(uint32_t x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+static uint32_t HashCombine(const uint32_t seed, const uint32_t value)
+{
+	return Hash(seed ^ (value + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+static uint32_t HashSample(const uint32_t seed, const int x, const int y, const int sample, const int dimension)
+{
+	uint32_t h = HashCombine(seed, (uint32_t)x);
+	h = HashCombine(h, (uint32_t)y);
+	h = HashCombine(h, (uint32_t)sample);
+	return HashCombine(h, (uint32_t)dimension);
+}
+
+// The top 24 bits as a float in [0, 1). All 24 fit in a float exactly,
+// so this can never round up to 1.
+static float ToUnitFloat(const uint32_t x)
+{
+	return (float)(x >> 8) * (1.f / 16777216.f);
+}
+
+//-----------------------------------------------------------
+Vector2f RandomSampler::Get2D(const int x, const int y, const int sample, const int dimension) const
+{
+	const uint32_t h = HashSample(seed, x, y, sample, dimension);
+	return Vector2f(ToUnitFloat(h), ToUnitFloat(Hash(h ^ 0x5bd1e995u)));
+}
+
+//-----------------------------------------------------------
+/*
+	Owen scrambled Sobol, following Burley, "Practical Hash-based
+	Owen Scrambling" (JCGT 2020).
+
+	Owen scrambling randomly flips each bit of a point, where the flip
+	depends only on the bits above it. That keeps the points spread
+	evenly (it maps a net to a net), but gets rid of the regular patterns
+	plain Sobol points make. The Laine-Karras hash does this cheaply
+	working from the low bits up, so the bits are reversed either side.
+
+	The sample index is shuffled the same way first, so pixels don't
+	all take the same points in the same order.
+*/
+static uint32_t ReverseBits(uint32_t x)
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+	x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+static uint32_t LaineKarrasPermutation(uint32_t x, const uint32_t seed)
+{
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+static uint32_t NestedUniformScramble(uint32_t x, const uint32_t seed)
+{
+	x = ReverseBits(x);
+	x = LaineKarrasPermutation(x, seed);
+	return ReverseBits(x);
+}
+
+// The first two Sobol dimensions. The first is just the index with its
+// bits reversed; the second uses the direction numbers for x + 1.
+static uint32_t Sobol0(const uint32_t index)
+{
+	return ReverseBits(index);
+}
+
+static uint32_t Sobol1(uint32_t index)
+{
+	uint32_t result = 0;
+	for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+	{
+		if (index & 1)
+		{
+			result ^= v;
+		}
+	}
+	return result;
+}
+
+Vector2f SobolSampler::Get2D(const int x, const int y, const int sample, const int dimension) const
+{
+	const uint32_t pixelSeed = HashSample(seed, x, y, 0, dimension);
+	const uint32_t index = NestedUniformScramble((uint32_t)sample, pixelSeed);
+	return Vector2f(
+		ToUnitFloat(NestedUniformScramble(Sobol0(index), HashCombine(pixelSeed, 0))),
+		ToUnitFloat(NestedUniformScramble(Sobol1(index), HashCombine(pixelSeed, 1))));
+}
+
+//-----------------------------------------------------------
+/*
+	Make a tile of blue noise with Ulichney's void and cluster method.
+
+	"Energy" at a pixel is the sum of a gaussian centred on every
+	pixel that's switched on, wrapping round the tile's edges. The
+	tightest cluster is the on pixel with the most energy; the largest
+	void is the off pixel with the least.
+
+	Start from a few random pixels, and shuffle them about until moving
+	the tightest cluster into the largest void puts it straight back.
+	Then rank every pixel: the starting pixels by taking the clusters
+	away one at a time, the rest by filling in the voids one at a time.
+	The rank, over the pixel count, is the noise value.
+
+	This only depends on the size, so it's made once and shared.
+*/
+static vector<float> MakeBlueNoiseTile()
+{
+	const int n = BLUE_NOISE_SIZE;
+	const int count = n * n;
+	const float sigma = 1.5f;
+
+	// The gaussian for each offset, already wrapped round
+	vector<float> kernel(count);
+	for (int dy = 0; dy < n; ++dy)
+	{
+		for (int dx = 0; dx < n; ++dx)
+		{
+			const float wx = (float)min(dx, n - dx);
+			const float wy = (float)min(dy, n - dy);
+			kernel[dy * n + dx] = exp(-(wx * wx + wy * wy) / (2.f * sigma * sigma));
+		}
+	}
+
+	vector<char> on(count, 0);
+	vector<float> energy(count, 0.f);
+	auto toggle = [&](const int p, const bool value)
+	{
+		on[p] = value;
+		const float sign = value ? 1.f : -1.f;
+		const int px = p % n, py = p / n;
+		for (int y = 0; y < n; ++y)
+		{
+			const int dy = (y - py + n) % n;
+			for (int x = 0; x < n; ++x)
+			{
+				energy[y * n + x] += sign * kernel[dy * n + (x - px + n) % n];
+			}
+		}
+	};
+	auto tightestCluster = [&]()
+	{
+		int best = -1;
+		for (int p = 0; p < count; ++p)
+		{
+			if (on[p] && (best < 0 || energy[p] > energy[best]))
+			{
+				best = p;
+			}
+		}
+		return best;
+	};
+	auto largestVoid = [&]()
+	{
+		int best = -1;
+		for (int p = 0; p < count; ++p)
+		{
+			if (!on[p] && (best < 0 || energy[p] < energy[best]))
+			{
+				best = p;
+			}
+		}
+		return best;
+	};
+
+	// Starting pattern: a tenth of the pixels, at random
+	mt19937 generator(1);
+	const int numInitial = count / 10;
+	for (int placed = 0; placed < numInitial;)
+	{
+		const int p = (int)(generator() % count);
+		if (!on[p])
+		{
+			toggle(p, true);
+			++placed;
+		}
+	}
+	for (;;)
+	{
+		const int cluster = tightestCluster();
+		toggle(cluster, false);
+		const int hole = largestVoid();
+		if (hole == cluster)
+		{
+			toggle(cluster, true);
+			break;
+		}
+		toggle(hole, true);
+	}
+
+	vector<int> rank(count, 0);
+	const vector<char> initialOn = on;
+	const vector<float> initialEnergy = energy;
+	for (int ones = numInitial; ones > 0; --ones)
+	{
+		const int cluster = tightestCluster();
+		toggle(cluster, false);
+		rank[cluster] = ones - 1;
+	}
+
+	// Filling voids all the way up is the same as Ulichney's third phase,
+	// since the least energy from the on pixels is the most from the off ones
+	on = initialOn;
+	energy = initialEnergy;
+	for (int ones = numInitial; ones < count; ++ones)
+	{
+		const int hole = largestVoid();
+		toggle(hole, true);
+		rank[hole] = ones;
+	}
+
+	vector<float> tile(count);
+	for (int p = 0; p < count; ++p)
+	{
+		tile[p] = (float)rank[p] / (float)count;
+	}
+	return tile;
+}
+
+BlueNoiseSampler::BlueNoiseSampler(const uint32_t seed)
+	: Sampler(seed)
+{
+	static const vector<float> sharedTile = MakeBlueNoiseTile();
+	tile = sharedTile;
+}
+
+Vector2f BlueNoiseSampler::Get2D(const int x, const int y, const int sample, const int dimension) const
+{
+	// The R2 sequence's steps: the plastic number's equivalents of the golden ratio
+	const double step[2] = { 0.7548776662466927, 0.5698402909980532 };
+
+	Vector2f result;
+	for (int k = 0; k < 2; ++k)
+	{
+		const uint32_t shift = HashCombine(seed, (uint32_t)(2 * dimension + k));
+		const int tx = (int)(((uint32_t)x + shift) % BLUE_NOISE_SIZE);
+		const int ty = (int)(((uint32_t)y + (shift >> 16)) % BLUE_NOISE_SIZE);
+		const double value = tile[ty * BLUE_NOISE_SIZE + tx] + sample * step[k];
+		result[k] = min((float)(value - floor(value)), 0x1.fffffep-1f);
+	}
+	return result;
+}
+
+//-----------------------------------------------------------
+unique_ptr<Sampler> MakeSampler(const SamplerType type, const uint32_t seed)
+{
+	switch (type)
+	{
+	case SAMPLER_RANDOM:
+		return unique_ptr<Sampler>(new RandomSampler(seed));
+	case SAMPLER_BLUE_NOISE:
+		return unique_ptr<Sampler>(new BlueNoiseSampler(seed));
+	case SAMPLER_SOBOL:
+	default:
+		return unique_ptr<Sampler>(new SobolSampler(seed));
+	}
+}
@@ -0,0 +1,105 @@
+#pragma once
+#include <eigen3/Eigen/Dense>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+// Which pair of dimensions each use of random numbers takes, so they
+// never share values. Anything new should take the next free pair.
+#define SAMPLE_DIM_PIXEL 0
+// Photons take this one for leaving the light, then two more per bounce
+#define SAMPLE_DIM_PHOTON 1
+// SPPM picks which hit along a camera path gets the visible point with
+// this one, well clear of the photons' dimensions
+#define SAMPLE_DIM_VISIBLE_POINT 64
+
+// Side length of the blue noise tile
+#define BLUE_NOISE_SIZE 64
+
+/**********************************************/
+/*############# SAMPLER CLASSES ##############*/
+/**********************************************/
+
+enum SamplerType
+{
+	SAMPLER_RANDOM,
+	SAMPLER_SOBOL,
+	SAMPLER_BLUE_NOISE
+};
+
+/*
+	Where the random numbers for rendering come from.
+
+	A sampler has no state that changes. Every value is worked out
+	from the pixel, the sample number and the dimension, so any thread
+	can ask for any sample in any order and gets the same answer.
+	The image then doesn't depend on how many threads there are, or
+	which thread rendered what.
+
+	Values are in [0, 1).
+*/
+class Sampler
+{
+public:
+	Sampler(const uint32_t seed) : seed(seed) {};
+	virtual ~Sampler() {};
+
+	// A 2D point for sample number `sample` of pixel (x, y).
+	// dimension picks an independent pair of values, like SAMPLE_DIM_PIXEL.
+	virtual Eigen::Vector2f Get2D(
+		const int x,
+		const int y,
+		const int sample,
+		const int dimension) const = 0;
+
+	virtual const char* GetName() const = 0;
+
+protected:
+	uint32_t seed;
+};
+
+// A counter based generator: every value is a hash of its inputs.
+// Plain white noise, but cheap and with no state at all.
+class RandomSampler : public Sampler
+{
+public:
+	RandomSampler(const uint32_t seed) : Sampler(seed) {};
+
+	Eigen::Vector2f Get2D(const int x, const int y, const int sample, const int dimension) const override;
+	const char* GetName() const override { return "random"; };
+};
+
+// The 2D Sobol sequence, Owen scrambled with a different scramble for
+// every pixel and dimension. Any power of two samples of a pixel are
+// spread evenly over it, so noise falls faster than with random samples.
+class SobolSampler : public Sampler
+{
+public:
+	SobolSampler(const uint32_t seed) : Sampler(seed) {};
+
+	Eigen::Vector2f Get2D(const int x, const int y, const int sample, const int dimension) const override;
+	const char* GetName() const override { return "sobol"; };
+};
+
+// A tile of blue noise, repeated over the image, so neighbouring pixels
+// get very different values and what noise is left is high frequency.
+// Each sample steps every pixel along by the R2 sequence's steps, from
+// the plastic number, a different one for x and y, and each dimension
+// uses the tile shifted by a different amount.
+class BlueNoiseSampler : public Sampler
+{
+public:
+	BlueNoiseSampler(const uint32_t seed);
+
+	Eigen::Vector2f Get2D(const int x, const int y, const int sample, const int dimension) const override;
+	const char* GetName() const override { return "bluenoise"; };
+
+	// The tile itself, BLUE_NOISE_SIZE squared values, each a different
+	// multiple of 1 / BLUE_NOISE_SIZE^2
+	const std::vector<float>& GetTile() const { return tile; };
+
+private:
+	std::vector<float> tile;
+};
+
+std::unique_ptr<Sampler> MakeSampler(const SamplerType type, const uint32_t seed);
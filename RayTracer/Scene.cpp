@@ -1,6 +1,8 @@
 #include "Scene.h"
 #include <string>
 #include <fstream>
+#include <cstring>
+#include <filesystem>
 
 using namespace Eigen;
 using namespace std;
@@ -14,14 +16,48 @@ using namespace std;
 	"no colour" - that is, it does not influence the colour
 	of objects beyond shadowing, etc
 */
+Scene::~Scene()
+{
+}
+
+Sphere* Scene::AddSphere()
+{
+	return spheres.Add();
+}
+
+Plane* Scene::AddPlane()
+{
+	return planes.Add();
+}
+
+TriangleMesh* Scene::AddMesh()
+{
+	return meshes.Add();
+}
+
+PointLight* Scene::AddPointLight()
+{
+	return pointLights.Add();
+}
+
 void Scene::AddShape(Shape* shape)
 {
-	shapes.push_back(shape);
+	otherShapes.emplace_back(shape);
 }
 
 void Scene::AddLight(Light* light)
 {
-	lights.push_back(light);
+	otherLights.emplace_back(light);
+}
+
+size_t Scene::GetNumShapes() const
+{
+	return spheres.size() + planes.size() + meshes.size() + otherShapes.size();
+}
+
+size_t Scene::GetNumLights() const
+{
+	return pointLights.size() + otherLights.size();
 }
 
 void Scene::SetBackground(Eigen::Vector3f& colour)
@@ -39,11 +75,12 @@ Eigen::Vector3f Scene::GetBackground()
 */
 std::ostream& operator << (std::ostream& os, const Scene& s)
 {
-	os << s.shapes.size() << " " << s.lights.size() << endl;
-	for (int i = 0; i < s.shapes.size(); ++i)
-		os << s.shapes[i] << endl;
-	for (int i = 0; i < s.lights.size(); ++i)
-		os << s.lights[i] << endl;
+	// Shapes and lights of other kinds have no text form, so only the built in ones go
+	os << s.spheres.size() + s.planes.size() + s.meshes.size() << " " << s.pointLights.size() << endl;
+	s.spheres.ForEach([&os](const Sphere& sphere) { os << sphere << endl; });
+	s.planes.ForEach([&os](const Plane& plane) { os << plane << endl; });
+	s.meshes.ForEach([&os](const TriangleMesh& mesh) { os << mesh << endl; });
+	s.pointLights.ForEach([&os](const PointLight& light) { os << light << endl; });
 	os << s.backgroundColour[0] << " " << s.backgroundColour[1] << " " << s.backgroundColour[2] << endl;
 	return os;
 }
@@ -60,15 +97,25 @@ std::istream & operator >> (std::istream & is, Scene& scene)
 		is >> shapeType;
 		if (strcmp(shapeType.c_str(), "SPHERE") == 0)
 		{
-			Sphere* s = new Sphere();
-			is >> *s;
-			scene.AddShape(s);
+			is >> *scene.AddSphere();
 		}
 		else if (strcmp(shapeType.c_str(), "PLANE") == 0)
 		{
-			Plane* p = new Plane();
-			is >> *p;
-			scene.AddShape(p);
+			is >> *scene.AddPlane();
+		}
+		else if (strcmp(shapeType.c_str(), "MESH") == 0)
+		{
+			TriangleMesh* mesh = scene.AddMesh();
+			is >> *mesh;
+			filesystem::path meshFile = mesh->GetFileName();
+			if (meshFile.is_relative() && !scene.loadDirectory.empty())
+			{
+				meshFile = filesystem::path(scene.loadDirectory) / meshFile;
+			}
+			if (!mesh->Load(meshFile.string(), scene.loadThreads))
+			{
+				scene.loadFailed = true;
+			}
 		}
 	}
 	for (int i = 0; i < numLights; ++i)
@@ -77,9 +124,7 @@ std::istream & operator >> (std::istream & is, Scene& scene)
 		is >> lightType;
 		if (strcmp(lightType.c_str(), "POINTLIGHT") == 0)
 		{
-			PointLight* pl = new PointLight();
-			is >> *pl;
-			scene.AddLight(pl);
+			is >> *scene.AddPointLight();
 		}
 	}
 
@@ -94,8 +139,11 @@ std::istream & operator >> (std::istream & is, Scene& scene)
 */
 bool ReadScene(
 	const string& sceneFile,
-	Scene& scene)
+	Scene& scene,
+	const int numThreads)
 {
+	scene.SetLoadThreads(numThreads);
+	scene.SetLoadDirectory(filesystem::path(sceneFile).parent_path().string());
 	ifstream file;
 	file.open(sceneFile);
 	if (file.is_open())
@@ -105,7 +153,7 @@ bool ReadScene(
 			file >> scene;
 		}
 		file.close();
-		return true;
+		return !scene.HasLoadFailed();
 	}
 
 	return false;
@@ -2,11 +2,125 @@
 #include <eigen3/Eigen/Dense>
 #include <iostream>
 #include <vector>
+#include <memory>
+#include <string>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <cstdint>
 
 #define EPSILON 0.01
 
 #define MAX_NUM_BOUNCES_PER_RAY 10
 
+// Objects in the first block of an ObjectPool. Every block after is twice the last.
+#define OBJECT_POOL_FIRST_BLOCK 64
+
+/*
+	Objects of one type, kept together in blocks that are never moved,
+	so pointers to them stay good as more are added. Each block is twice
+	the size of the one before, so there are only ever a few of them.
+
+	A T that declares static constexpr bool ownsNothing = true promises
+	that destroying one does nothing that matters. Then the blocks are
+	just freed, without going through the objects in them, so throwing
+	away millions of them is a handful of frees. Otherwise each one is
+	destroyed as usual.
+*/
+template <class T, class = void>
+struct OwnsNothing : std::false_type {};
+
+template <class T>
+struct OwnsNothing<T, std::void_t<decltype(T::ownsNothing)>> : std::bool_constant<T::ownsNothing> {};
+
+template <class T>
+class ObjectPool
+{
+public:
+	ObjectPool() {};
+	ObjectPool(const ObjectPool&) = delete;
+	ObjectPool& operator=(const ObjectPool&) = delete;
+	~ObjectPool() { Clear(); };
+
+	template <class... Args>
+	T* Add(Args&&... args)
+	{
+		// The promise is about T's own members, so a subclass mustn't
+		// inherit it and then add members that own something
+		static_assert(!OwnsNothing<T>::value || std::is_final<T>::value,
+			"Only final classes can promise ownsNothing");
+
+		if (blocks.empty() || blocks.back().used == blocks.back().capacity)
+		{
+			const size_t capacity = blocks.empty() ? OBJECT_POOL_FIRST_BLOCK : blocks.back().capacity * 2;
+			Block block;
+			block.objects = (T*)::operator new(capacity * sizeof(T), std::align_val_t(alignof(T)));
+			block.capacity = capacity;
+			block.used = 0;
+			blocks.push_back(block);
+		}
+		Block& block = blocks.back();
+		T* object = new (block.objects + block.used) T(std::forward<Args>(args)...);
+		++block.used;
+		++count;
+		return object;
+	};
+
+	size_t size() const { return count; };
+
+	// Call f on every object, in the order they were added
+	template <class F>
+	void ForEach(F f)
+	{
+		for (const Block& block : blocks)
+		{
+			for (size_t i = 0; i < block.used; ++i)
+			{
+				f(block.objects[i]);
+			}
+		}
+	};
+	template <class F>
+	void ForEach(F f) const
+	{
+		for (const Block& block : blocks)
+		{
+			for (size_t i = 0; i < block.used; ++i)
+			{
+				f((const T&)block.objects[i]);
+			}
+		}
+	};
+
+	void Clear()
+	{
+		for (const Block& block : blocks)
+		{
+			if (!OwnsNothing<T>::value)
+			{
+				for (size_t i = 0; i < block.used; ++i)
+				{
+					block.objects[i].~T();
+				}
+			}
+			::operator delete(block.objects, std::align_val_t(alignof(T)));
+		}
+		blocks.clear();
+		count = 0;
+	};
+
+private:
+	struct Block
+	{
+		T* objects;
+		size_t capacity;
+		size_t used;
+	};
+
+	std::vector<Block> blocks;
+	size_t count = 0;
+};
+
 /**********************************************/
 /*############# SCENE CLASSES ################*/
 /**********************************************/
@@ -28,6 +142,11 @@ protected:
 };
 
 class Material;
+class CompiledScene;
+class PointLight;
+class Sphere;
+class Plane;
+class TriangleMesh;
 
 // This struct stores the collision of light with a shape.
 // It contains the point where the light hit,
@@ -85,10 +204,20 @@ public:
 	// a property of the material itself
 	virtual float GetDiffusionFactor() = 0;
 
+	// Write a flattened copy of this shape into the compiled scene
+	virtual void Compile(CompiledScene& compiled) = 0;
+
 protected:
 };
 
 
+/*
+	The scene owns everything in it. The shapes and lights built in
+	live in pools of their own type, so each type is all together in
+	memory, gets compiled a pool at a time without virtual calls, and
+	goes in a few frees when the scene does. Any other kind of Shape
+	or Light can still be added, and compiles itself as before.
+*/
 class Scene
 {
 public:
@@ -96,20 +225,47 @@ public:
 	{
 		backgroundColour = Eigen::Vector3f(0.1f, 0.1f, 0.1f);
 	};
-	~Scene() {};
+	~Scene();
 
 	// other constructors
 
+	// A new default shape or light in its pool, to be set up through
+	// the pointer, which stays good as long as the scene does
+	Sphere* AddSphere();
+	Plane* AddPlane();
+	TriangleMesh* AddMesh();
+	PointLight* AddPointLight();
+
+	// Anything else, made with new. The scene deletes it.
 	void AddShape(Shape* shape);
 	void AddLight(Light* light);
 
-	std::vector<Shape*> GetShapes() { return shapes; };
-	std::vector<Light*> GetLights() { return lights; };
+	ObjectPool<Sphere>& GetSpheres() { return spheres; };
+	ObjectPool<Plane>& GetPlanes() { return planes; };
+	ObjectPool<TriangleMesh>& GetMeshes() { return meshes; };
+	ObjectPool<PointLight>& GetPointLights() { return pointLights; };
+	const std::vector<std::unique_ptr<Shape>>& GetOtherShapes() const { return otherShapes; };
+	const std::vector<std::unique_ptr<Light>>& GetOtherLights() const { return otherLights; };
+
+	size_t GetNumShapes() const;
+	size_t GetNumLights() const;
 
 	// Currently backgrounds are just colours, nothing fancier
 	void SetBackground(Eigen::Vector3f& colour);
 	Eigen::Vector3f GetBackground();
 
+	// Threads used to load meshes while the scene is read in. 0 means
+	// every hardware thread.
+	void SetLoadThreads(const int numThreads) { loadThreads = numThreads; };
+
+	// Where relative mesh file names are found from: the directory of
+	// the scene file being read. Empty means the working directory.
+	void SetLoadDirectory(const std::string& directory) { loadDirectory = directory; };
+
+	// Whether something the scene was read from refers to, like a
+	// mesh's OBJ file, couldn't be loaded
+	bool HasLoadFailed() const { return loadFailed; };
+
 	// What else does a scene have? Objects and lighting, really
 
 	// IO overloads
@@ -117,16 +273,25 @@ public:
 	friend std::istream& operator >> (std::istream& is, Scene& s);
 
 private:
-	std::vector<Shape*> shapes;
-	std::vector<Light*> lights;
+	// Spheres, planes and lights own nothing, so their blocks are just freed
+	ObjectPool<Sphere> spheres;
+	ObjectPool<Plane> planes;
+	ObjectPool<TriangleMesh> meshes;
+	ObjectPool<PointLight> pointLights;
+	std::vector<std::unique_ptr<Shape>> otherShapes;
+	std::vector<std::unique_ptr<Light>> otherLights;
 
 	Eigen::Vector3f backgroundColour;
+
+	int loadThreads = 0;
+	std::string loadDirectory;
+	bool loadFailed = false;
 };
 
 /**********************************************/
 /*############# Light CLASSES ################*/
 /**********************************************/
-class PointLight : public Light
+class PointLight final : public Light
 {
 public:
 	PointLight();
@@ -148,6 +313,10 @@ public:
 	friend std::ostream& operator << (std::ostream& os, const PointLight& pl);
 	friend std::istream& operator >> (std::istream& is, PointLight& pl);
 
+	// Scene pools skip this destructor. Only keep this true while every
+	// member below is plain data that owns no memory.
+	static constexpr bool ownsNothing = true;
+
 private:
 	Eigen::Vector3f position;
 	float intensity;
@@ -161,7 +330,7 @@ private:
 /**********************************************/
 /*############# SHAPE CLASSES ################*/
 /**********************************************/
-class Sphere : public Shape
+class Sphere final : public Shape
 {
 public:
 	Sphere();
@@ -178,6 +347,8 @@ public:
 	Eigen::Vector3f GetSurfaceNormalAtPoint(
 		Eigen::Vector3f& point) override;
 
+	void Compile(CompiledScene& compiled) override;
+
 	void SetSphere(const Eigen::Vector3f& centre,
 		const Eigen::Vector3f& colour,
 		const float r);
@@ -190,6 +361,10 @@ public:
 	friend std::ostream& operator << (std::ostream& os, const Sphere& s);
 	friend std::istream& operator >> (std::istream& is, Sphere& s);
 
+	// Scene pools skip this destructor. Only keep this true while every
+	// member below is plain data that owns no memory.
+	static constexpr bool ownsNothing = true;
+
 private:
 	float radius;
 	Eigen::Vector3f centre;
@@ -202,7 +377,7 @@ private:
 	static const int BAD_RADIUS = -1;
 };
 
-class Plane : public Shape
+class Plane final : public Shape
 {
 public:
 	Plane();
@@ -219,6 +394,8 @@ public:
 	Eigen::Vector3f GetSurfaceNormalAtPoint(
 		Eigen::Vector3f& point) override;
 
+	void Compile(CompiledScene& compiled) override;
+
 	void SetPlane(const Eigen::Vector3f& normal,
 		const float& offset,
 		const Eigen::Vector3f& colour);
@@ -227,6 +404,9 @@ public:
 	friend std::ostream& operator << (std::ostream& os, const Plane& s);
 	friend std::istream& operator >> (std::istream& is, Plane& s);
 
+	// Scene pools skip this destructor. Only keep this true while every
+	// member below is plain data that owns no memory.
+	static constexpr bool ownsNothing = true;
 
 private:
 	Eigen::Vector3f normal;
@@ -238,6 +418,65 @@ private:
 	float diffusionFactor;
 };
 
+/*
+	A mesh of triangles sharing their vertices, like one from an OBJ file.
+
+	This is kept the way the file has it: one array of vertices, and
+	three indices into it per triangle, rather than a Shape for every
+	triangle. Meshes of tens of millions of triangles are the norm.
+*/
+class TriangleMesh final : public Shape
+{
+public:
+	TriangleMesh();
+	TriangleMesh(
+		const std::vector<Eigen::Vector3f>& vertices,
+		const std::vector<uint32_t>& indices,
+		const Eigen::Vector3f& colour);
+	~TriangleMesh() {};
+
+	bool DoesRayIntersect(
+		Eigen::Vector3f ray,
+		float& distance,
+		LightCollision& collision) override;
+
+	float GetDiffusionFactor() override;
+
+	Eigen::Vector3f GetSurfaceNormalAtPoint(
+		Eigen::Vector3f& point) override;
+
+	void Compile(CompiledScene& compiled) override;
+
+	// Replace the triangles with the ones in an OBJ file. numThreads < 1
+	// means use every hardware thread.
+	bool Load(
+		const std::string& fileName,
+		const int numThreads = 0);
+
+	const std::string& GetFileName() const { return fileName; };
+
+	size_t GetNumTriangles() const { return indices.size() / 3; };
+	const std::vector<Eigen::Vector3f>& GetVertices() const { return vertices; };
+	const std::vector<uint32_t>& GetIndices() const { return indices; };
+
+	// IO overloads
+	friend std::ostream& operator << (std::ostream& os, const TriangleMesh& m);
+	friend std::istream& operator >> (std::istream& is, TriangleMesh& m);
+
+private:
+	// Unit normal of triangle i, facing whichever way its winding says
+	Eigen::Vector3f GetTriangleNormal(const size_t i) const;
+
+	std::string fileName;
+	std::vector<Eigen::Vector3f> vertices;
+	std::vector<uint32_t> indices;
+	Eigen::Vector3f colour;
+
+	Material material;
+
+	float diffusionFactor;
+};
+
 /**********************************************/
 /*############ MATERIAL CLASSES ##############*/
 /**********************************************/
@@ -263,6 +502,10 @@ private:
 // --------------------------------- //
 // Some general scene functions
 
+// Fails if the file can't be opened, or a mesh in it can't be loaded.
+// Relative mesh file names are from the scene file's directory, and
+// numThreads is for loading them, as with Scene::SetLoadThreads.
 bool ReadScene(
 	const std::string& sceneFile,
-	Scene& scene);
\ No newline at end of file
+	Scene& scene,
+	const int numThreads = 0);
\ No newline at end of file
@@ -0,0 +1,296 @@
+#include "SceneFile.h"
+#include "Scene.h"
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <cstring>
+
+using namespace Eigen;
+using namespace std;
+
+//-----------------------------------------------------------
+static uint64_t AlignOffset(const uint64_t offset)
+{
+	return (offset + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+}
+
+bool IsSceneFile(const string& fileName)
+{
+	ifstream file(fileName, ifstream::in | ifstream::binary);
+	char magic[8] = {};
+	file.read(magic, sizeof(magic));
+	return file.good() && memcmp(magic, SCENE_FILE_MAGIC, sizeof(magic)) == 0;
+}
+
+/*
+	The file is put together in memory, so it goes out in a single write.
+	The gaps between sections are zeroed, so the same scene always gives
+	the same bytes.
+*/
+bool WriteSceneFile(const string& fileName, const CompiledScene& scene)
+{
+	const ArrayView<SphereData> spheres = scene.GetSpheres();
+	const ArrayView<PlaneData> planes = scene.GetPlanes();
+	const ArrayView<LightData> lights = scene.GetLights();
+	const ArrayView<BVHNode> nodes = scene.GetBVH().GetNodes();
+	const ArrayView<int> indices = scene.GetBVH().GetPrimitiveIndices();
+	const ArrayView<Vector3f> vertices = scene.GetVertices();
+	const ArrayView<TriangleData> triangles = scene.GetTriangles();
+	const ArrayView<MeshData> meshes = scene.GetMeshes();
+	const ArrayView<BVHNode> triangleNodes = scene.GetTriangleBVH().GetNodes();
+	const ArrayView<int> triangleIndices = scene.GetTriangleBVH().GetPrimitiveIndices();
+
+	SceneFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic));
+	header.version = SCENE_FILE_VERSION;
+	header.endianCheck = SCENE_FILE_ENDIAN_CHECK;
+	header.sphereSize = sizeof(SphereData);
+	header.planeSize = sizeof(PlaneData);
+	header.lightSize = sizeof(LightData);
+	header.nodeSize = sizeof(BVHNode);
+	header.vertexSize = sizeof(Vector3f);
+	header.triangleSize = sizeof(TriangleData);
+	header.meshSize = sizeof(MeshData);
+	header.triangleBvhDepth = scene.GetTriangleBVH().GetDepth();
+	for (int c = 0; c < 3; ++c)
+	{
+		header.background[c] = scene.GetBackground()[c];
+	}
+	header.bvhDepth = scene.GetBVH().GetDepth();
+
+	uint64_t end = sizeof(header);
+	auto place = [&end](SceneFileSection& section, const size_t count, const size_t recordSize)
+	{
+		section.offset = AlignOffset(end);
+		section.count = count;
+		end = section.offset + count * recordSize;
+	};
+	place(header.spheres, spheres.size(), sizeof(SphereData));
+	place(header.planes, planes.size(), sizeof(PlaneData));
+	place(header.lights, lights.size(), sizeof(LightData));
+	place(header.bvhNodes, nodes.size(), sizeof(BVHNode));
+	place(header.bvhIndices, indices.size(), sizeof(int32_t));
+	place(header.vertices, vertices.size(), sizeof(Vector3f));
+	place(header.triangles, triangles.size(), sizeof(TriangleData));
+	place(header.meshes, meshes.size(), sizeof(MeshData));
+	place(header.triangleBvhNodes, triangleNodes.size(), sizeof(BVHNode));
+	place(header.triangleBvhIndices, triangleIndices.size(), sizeof(int32_t));
+
+	vector<char> bytes(end, 0);
+	memcpy(bytes.data(), &header, sizeof(header));
+	auto copy = [&bytes](const SceneFileSection& section, const void* from, const size_t recordSize)
+	{
+		if (section.count > 0)
+		{
+			memcpy(bytes.data() + section.offset, from, section.count * recordSize);
+		}
+	};
+	copy(header.spheres, spheres.data(), sizeof(SphereData));
+	copy(header.planes, planes.data(), sizeof(PlaneData));
+	copy(header.lights, lights.data(), sizeof(LightData));
+	copy(header.bvhNodes, nodes.data(), sizeof(BVHNode));
+	copy(header.bvhIndices, indices.data(), sizeof(int32_t));
+	copy(header.vertices, vertices.data(), sizeof(Vector3f));
+	copy(header.triangles, triangles.data(), sizeof(TriangleData));
+	copy(header.meshes, meshes.data(), sizeof(MeshData));
+	copy(header.triangleBvhNodes, triangleNodes.data(), sizeof(BVHNode));
+	copy(header.triangleBvhIndices, triangleIndices.data(), sizeof(int32_t));
+
+	ofstream file(fileName, ofstream::out | ofstream::binary | ofstream::trunc);
+	file.write(bytes.data(), bytes.size());
+	file.close();
+	if (!file.good())
+	{
+		cout << "ERROR: scene could not be written to " << fileName << endl;
+		return false;
+	}
+	return true;
+}
+
+//-----------------------------------------------------------
+static bool IsSectionInFile(const SceneFileSection& section, const size_t recordSize, const size_t fileSize)
+{
+	if (section.offset % SCENE_FILE_ALIGNMENT != 0 || section.offset > fileSize)
+	{
+		return false;
+	}
+	// Written so a huge count can't overflow its way past the check
+	return section.count <= (fileSize - section.offset) / recordSize;
+}
+
+/*
+	Walk the tree's nodes in order, checking every interior node points
+	at a pair of children inside the array, and every leaf at indices
+	inside the array, that are in turn real primitives.
+
+	The builder always puts children after their parent, and files are
+	held to that too. It means the walk can't loop, and depths can be
+	worked out in one pass, to make sure traversal's stack is big enough.
+*/
+static bool IsBVHValid(
+	const ArrayView<BVHNode>& nodes,
+	const ArrayView<int>& indices,
+	const size_t numPrimitives,
+	const int depth)
+{
+	if (nodes.empty())
+	{
+		return indices.empty() && depth == 0;
+	}
+	if (depth < 1 || depth > BVH_MAX_DEPTH)
+	{
+		return false;
+	}
+
+	vector<uint8_t> nodeDepth(nodes.size(), 0);
+	nodeDepth[0] = 1;
+	for (size_t i = 0; i < nodes.size(); ++i)
+	{
+		const BVHNode& node = nodes[i];
+		if (nodeDepth[i] == 0 || node.first < 0 || node.count < 0)
+		{
+			return false;
+		}
+		if (node.IsLeaf())
+		{
+			if ((size_t)node.first + (size_t)node.count > indices.size())
+			{
+				return false;
+			}
+			continue;
+		}
+
+		const size_t child = (size_t)node.first;
+		if (child <= i || child + 1 >= nodes.size() || nodeDepth[i] >= depth)
+		{
+			return false;
+		}
+		nodeDepth[child] = nodeDepth[i] + 1;
+		nodeDepth[child + 1] = nodeDepth[i] + 1;
+	}
+
+	for (const int index : indices)
+	{
+		if (index < 0 || (size_t)index >= numPrimitives)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+bool LoadSceneFile(const string& fileName, CompiledScene& scene)
+{
+	shared_ptr<MappedFile> file = make_shared<MappedFile>();
+	if (!file->Open(fileName))
+	{
+		cout << "ERROR: could not open scene file " << fileName << endl;
+		return false;
+	}
+
+	auto fail = [&fileName](const char* reason)
+	{
+		cout << "ERROR: " << fileName << " is not a usable scene file: " << reason << endl;
+		return false;
+	};
+
+	if (file->GetSize() < sizeof(SceneFileHeader))
+	{
+		return fail("too short");
+	}
+	SceneFileHeader header;
+	memcpy(&header, file->GetData(), sizeof(header));
+	if (memcmp(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic)) != 0)
+	{
+		return fail("not a scene file");
+	}
+	if (header.version != SCENE_FILE_VERSION)
+	{
+		return fail("written by a different version");
+	}
+	if (header.endianCheck != SCENE_FILE_ENDIAN_CHECK)
+	{
+		return fail("written on a machine with the other byte order");
+	}
+	if (header.sphereSize != sizeof(SphereData) ||
+		header.planeSize != sizeof(PlaneData) ||
+		header.lightSize != sizeof(LightData) ||
+		header.nodeSize != sizeof(BVHNode) ||
+		header.vertexSize != sizeof(Vector3f) ||
+		header.triangleSize != sizeof(TriangleData) ||
+		header.meshSize != sizeof(MeshData))
+	{
+		return fail("written by a build with different record layouts");
+	}
+
+	const size_t size = file->GetSize();
+	if (!IsSectionInFile(header.spheres, sizeof(SphereData), size) ||
+		!IsSectionInFile(header.planes, sizeof(PlaneData), size) ||
+		!IsSectionInFile(header.lights, sizeof(LightData), size) ||
+		!IsSectionInFile(header.bvhNodes, sizeof(BVHNode), size) ||
+		!IsSectionInFile(header.bvhIndices, sizeof(int32_t), size) ||
+		!IsSectionInFile(header.vertices, sizeof(Vector3f), size) ||
+		!IsSectionInFile(header.triangles, sizeof(TriangleData), size) ||
+		!IsSectionInFile(header.meshes, sizeof(MeshData), size) ||
+		!IsSectionInFile(header.triangleBvhNodes, sizeof(BVHNode), size) ||
+		!IsSectionInFile(header.triangleBvhIndices, sizeof(int32_t), size))
+	{
+		return fail("a section runs off the end of the file");
+	}
+	if (header.spheres.count >= MAX_PRIMITIVES_PER_TYPE ||
+		header.planes.count >= MAX_PRIMITIVES_PER_TYPE ||
+		header.triangles.count >= MAX_PRIMITIVES_PER_TYPE)
+	{
+		return fail("too many primitives for a primitive key");
+	}
+
+	// The mapping is page aligned, and so the sections are aligned too
+	const char* base = file->GetData();
+	const ArrayView<SphereData> spheres((const SphereData*)(base + header.spheres.offset), header.spheres.count);
+	const ArrayView<PlaneData> planes((const PlaneData*)(base + header.planes.offset), header.planes.count);
+	const ArrayView<LightData> lights((const LightData*)(base + header.lights.offset), header.lights.count);
+	const ArrayView<BVHNode> nodes((const BVHNode*)(base + header.bvhNodes.offset), header.bvhNodes.count);
+	const ArrayView<int> indices((const int*)(base + header.bvhIndices.offset), header.bvhIndices.count);
+	const ArrayView<Vector3f> vertices((const Vector3f*)(base + header.vertices.offset), header.vertices.count);
+	const ArrayView<TriangleData> triangles((const TriangleData*)(base + header.triangles.offset), header.triangles.count);
+	const ArrayView<MeshData> meshes((const MeshData*)(base + header.meshes.offset), header.meshes.count);
+	const ArrayView<BVHNode> triangleNodes((const BVHNode*)(base + header.triangleBvhNodes.offset), header.triangleBvhNodes.count);
+	const ArrayView<int> triangleIndices((const int*)(base + header.triangleBvhIndices.offset), header.triangleBvhIndices.count);
+
+	if (!IsBVHValid(nodes, indices, spheres.size(), header.bvhDepth) ||
+		!IsBVHValid(triangleNodes, triangleIndices, triangles.size(), header.triangleBvhDepth))
+	{
+		return fail("a BVH is broken");
+	}
+	for (const TriangleData& t : triangles)
+	{
+		if (t.v[0] >= vertices.size() || t.v[1] >= vertices.size() || t.v[2] >= vertices.size() || t.mesh >= meshes.size())
+		{
+			return fail("a triangle refers to a vertex or mesh that isn't there");
+		}
+	}
+
+	scene.Borrow(spheres, planes, lights, nodes, indices, header.bvhDepth, file);
+	scene.BorrowTriangles(vertices, triangles, meshes, triangleNodes, triangleIndices, header.triangleBvhDepth);
+	scene.SetBackground(Vector3f(header.background[0], header.background[1], header.background[2]));
+	return true;
+}
+
+//-----------------------------------------------------------
+bool LoadScene(const string& fileName, CompiledScene& scene, const int numThreads)
+{
+	if (IsSceneFile(fileName))
+	{
+		return LoadSceneFile(fileName, scene);
+	}
+
+	Scene textScene;
+	if (!ReadScene(fileName, textScene, numThreads))
+	{
+		cout << "ERROR: could not read scene file " << fileName << endl;
+		return false;
+	}
+	scene.Compile(textScene);
+	return true;
+}
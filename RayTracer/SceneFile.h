@@ -0,0 +1,108 @@
+#pragma once
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+#include "CompiledScene.h"
+#include "MappedFile.h"
+
+// First 8 bytes of every binary scene file
+#define SCENE_FILE_MAGIC "RTSCENE"
+// Bump this whenever the layout of anything in the file changes
+#define SCENE_FILE_VERSION 2
+// Written as a number, so a file from a machine with the other byte order is spotted
+#define SCENE_FILE_ENDIAN_CHECK 0x01020304u
+// Every section starts on a cache line, which covers the alignment of every record
+#define SCENE_FILE_ALIGNMENT 64
+
+/**********************************************/
+/*############ SCENE FILE CLASSES ############*/
+/**********************************************/
+
+/*
+	Binary scene files
+
+	A compiled scene, BVH and all, written out exactly as it sits in
+	memory. Loading one is a matter of mapping the file and pointing
+	a CompiledScene at it: nothing is parsed, nothing is copied and
+	the BVH isn't rebuilt. Pages are only read in when rays touch them.
+
+	The layout is a fixed size header, then one section per array:
+
+		spheres               SphereData[]
+		planes                PlaneData[]
+		lights                LightData[]
+		bvh nodes             BVHNode[]
+		bvh indices           int32[]
+		vertices              float[3][]
+		triangles             TriangleData[]
+		meshes                MeshData[]
+		triangle bvh nodes    BVHNode[]
+		triangle bvh indices  int32[]
+
+	The header records the size of each record, so a file written by a
+	build with a different layout is turned away rather than misread.
+	Files are only meant to be read on machines like the one that wrote
+	them; there's no byte swapping.
+*/
+struct SceneFileSection
+{
+	uint64_t offset;	// from the start of the file
+	uint64_t count;		// in records, not bytes
+};
+
+struct SceneFileHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t endianCheck;
+
+	uint32_t sphereSize;
+	uint32_t planeSize;
+	uint32_t lightSize;
+	uint32_t nodeSize;
+	uint32_t vertexSize;
+	uint32_t triangleSize;
+	uint32_t meshSize;
+	int32_t triangleBvhDepth;
+
+	float background[3];
+	int32_t bvhDepth;
+
+	SceneFileSection spheres;
+	SceneFileSection planes;
+	SceneFileSection lights;
+	SceneFileSection bvhNodes;
+	SceneFileSection bvhIndices;
+	SceneFileSection vertices;
+	SceneFileSection triangles;
+	SceneFileSection meshes;
+	SceneFileSection triangleBvhNodes;
+	SceneFileSection triangleBvhIndices;
+};
+
+static_assert(sizeof(SceneFileHeader) == 224, "The scene file header is part of the file format");
+
+// Does the file start like a binary scene file?
+bool IsSceneFile(const std::string& fileName);
+
+// Write out a scene that has already been compiled
+bool WriteSceneFile(const std::string& fileName, const CompiledScene& scene);
+
+/*
+	Map a binary scene file and point scene at it.
+
+	Everything that could send a ray off the end of an array is checked
+	first: the header, that every section is inside the file, that
+	triangles only use vertices and meshes that exist, and that the
+	BVHs only refer to nodes and primitives that exist. A file that
+	fails any of it is rejected, and scene is left alone.
+*/
+bool LoadSceneFile(const std::string& fileName, CompiledScene& scene);
+
+/*
+	Load either kind of scene: binary scene files are mapped in as
+	above, and text ones are read and compiled. numThreads is for
+	loading the meshes a text scene refers to.
+*/
+bool LoadScene(const std::string& fileName, CompiledScene& scene, const int numThreads = 0);
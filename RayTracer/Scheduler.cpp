@@ -0,0 +1,160 @@
+#include "Scheduler.h"
+#include <algorithm>
+
+using namespace std;
+
+//-----------------------------------------------------------
+/*
+	The work stealing pool
+
+	Threads are started once and live as long as the pool does,
+	so that rendering lots of small batches doesn't pay for thread
+	creation every time.
+*/
+WorkStealingPool::WorkStealingPool(int numThreads)
+{
+	if (numThreads < 1)
+	{
+		numThreads = max(1, (int)thread::hardware_concurrency());
+	}
+
+	for (int i = 0; i < numThreads; ++i)
+	{
+		queues.push_back(make_unique<WorkQueue>());
+	}
+	jobCounts.resize(numThreads, 0);
+	stealCounts.resize(numThreads, 0);
+
+	for (int i = 0; i < numThreads; ++i)
+	{
+		workers.emplace_back(&WorkStealingPool::WorkerLoop, this, i);
+	}
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+	{
+		lock_guard<mutex> guard(batchLock);
+		shuttingDown = true;
+	}
+	batchStarted.notify_all();
+	for (auto& w : workers)
+	{
+		w.join();
+	}
+}
+
+/*
+	Deal the jobs out to the workers in contiguous blocks, so that each
+	thread starts on a neighbouring run of tiles, then wake everyone up
+	and wait for them to drain all the queues.
+*/
+void WorkStealingPool::Run(int numJobs, const function<void(int job, int thread)>& job)
+{
+	const int numThreads = GetNumThreads();
+	for (int t = 0; t < numThreads; ++t)
+	{
+		const int first = (int)((long long)numJobs * t / numThreads);
+		const int last = (int)((long long)numJobs * (t + 1) / numThreads);
+
+		lock_guard<mutex> guard(queues[t]->lock);
+		for (int j = first; j < last; ++j)
+		{
+			queues[t]->jobs.push_back(j);
+		}
+		jobCounts[t] = 0;
+		stealCounts[t] = 0;
+	}
+
+	unique_lock<mutex> guard(batchLock);
+	currentJob = &job;
+	busyWorkers = numThreads;
+	++batch;
+	batchStarted.notify_all();
+	batchFinished.wait(guard, [this] { return busyWorkers == 0; });
+	currentJob = nullptr;
+}
+
+/*
+	Own jobs come off the back of the deque, stolen jobs off the front.
+	Since blocks are dealt out in order, the front of a victim's queue is
+	the work furthest from what it is currently doing.
+*/
+bool WorkStealingPool::PopJob(int thread, int& job)
+{
+	lock_guard<mutex> guard(queues[thread]->lock);
+	if (queues[thread]->jobs.empty())
+	{
+		return false;
+	}
+	job = queues[thread]->jobs.back();
+	queues[thread]->jobs.pop_back();
+	return true;
+}
+
+bool WorkStealingPool::StealJob(int thread, int& job)
+{
+	const int numThreads = GetNumThreads();
+	for (int i = 1; i < numThreads; ++i)
+	{
+		const int victim = (thread + i) % numThreads;
+		lock_guard<mutex> guard(queues[victim]->lock);
+		if (!queues[victim]->jobs.empty())
+		{
+			job = queues[victim]->jobs.front();
+			queues[victim]->jobs.pop_front();
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+	Each worker sleeps until a new batch starts, then runs jobs until
+	there is nothing left to take or steal. No jobs are added during a
+	batch, so once every queue is empty this worker is done.
+*/
+void WorkStealingPool::WorkerLoop(int thread)
+{
+	int lastBatch = 0;
+	while (true)
+	{
+		const function<void(int, int)>* job = nullptr;
+		{
+			unique_lock<mutex> guard(batchLock);
+			batchStarted.wait(guard, [&] { return shuttingDown || batch != lastBatch; });
+			if (shuttingDown)
+			{
+				return;
+			}
+			lastBatch = batch;
+			job = currentJob;
+		}
+
+		int j = 0;
+		while (true)
+		{
+			if (PopJob(thread, j))
+			{
+				(*job)(j, thread);
+				++jobCounts[thread];
+			}
+			else if (StealJob(thread, j))
+			{
+				(*job)(j, thread);
+				++jobCounts[thread];
+				++stealCounts[thread];
+			}
+			else
+			{
+				break;
+			}
+		}
+
+		{
+			lock_guard<mutex> guard(batchLock);
+			--busyWorkers;
+		}
+		batchFinished.notify_all();
+	}
+}
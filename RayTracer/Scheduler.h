@@ -0,0 +1,66 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+/**********************************************/
+/*############ SCHEDULER CLASSES #############*/
+/**********************************************/
+
+// A pool of worker threads that run batches of jobs.
+// Jobs are just indices; the caller decides what an index means
+// (a tile of the image, a batch of photons, etc).
+//
+// Each worker owns a deque of jobs. A worker pops from the back of its
+// own deque, and when that runs dry it steals from the front of someone
+// else's. So if one worker gets a run of expensive jobs, the others
+// take the rest of its work instead of sitting idle.
+class WorkStealingPool
+{
+public:
+	// numThreads < 1 means use every hardware thread
+	WorkStealingPool(int numThreads);
+	~WorkStealingPool();
+
+	int GetNumThreads() const { return (int)queues.size(); };
+
+	// Run jobs [0, numJobs) across the pool, and block until they're all done.
+	// The job function is given the job index and the index of the thread running it.
+	void Run(int numJobs, const std::function<void(int job, int thread)>& job);
+
+	// How many jobs each thread ran in the most recent call to Run,
+	// and how many of those it stole from another thread
+	const std::vector<int>& GetJobCounts() const { return jobCounts; };
+	const std::vector<int>& GetStealCounts() const { return stealCounts; };
+
+private:
+	struct WorkQueue
+	{
+		std::mutex lock;
+		std::deque<int> jobs;
+	};
+
+	void WorkerLoop(int thread);
+	bool PopJob(int thread, int& job);
+	bool StealJob(int thread, int& job);
+
+	std::vector<std::thread> workers;
+	std::vector<std::unique_ptr<WorkQueue>> queues;
+
+	std::vector<int> jobCounts;
+	std::vector<int> stealCounts;
+
+	// The current batch. Workers sleep until the batch number changes.
+	const std::function<void(int, int)>* currentJob = nullptr;
+	int batch = 0;
+	int busyWorkers = 0;
+	bool shuttingDown = false;
+
+	std::mutex batchLock;
+	std::condition_variable batchStarted;
+	std::condition_variable batchFinished;
+};
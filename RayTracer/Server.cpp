@@ -0,0 +1,365 @@
+#include "Server.h"
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <exception>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "CompiledScene.h"
+#include "SceneFile.h"
+#include "PhotonMap.h"
+#include "IlluminationMap.h"
+#include "Stats.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// Not every platform can turn off SIGPIPE per send
+#if !defined(_WIN32) && !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+//-----------------------------------------------------------
+CompiledScene* SceneCache::Get(const string& fileName, const int numThreads, bool& loaded)
+{
+	loaded = false;
+	error_code error;
+	const fs::path path = fs::absolute(fileName, error);
+	const fs::file_time_type modified = fs::last_write_time(path, error);
+	if (error)
+	{
+		cout << "ERROR: could not read scene file " << fileName << endl;
+		return nullptr;
+	}
+	const uintmax_t bytes = fs::file_size(path, error);
+
+	for (auto entry = entries.begin(); entry != entries.end(); ++entry)
+	{
+		if (entry->path != path.string())
+		{
+			continue;
+		}
+		if (entry->modified == modified && entry->bytes == bytes)
+		{
+			entries.splice(entries.begin(), entries, entry);
+			return entries.front().scene.get();
+		}
+		// The file has changed since, so what's cached is out of date
+		entries.erase(entry);
+		break;
+	}
+
+	Entry entry;
+	entry.path = path.string();
+	entry.modified = modified;
+	entry.bytes = bytes;
+	entry.scene.reset(new CompiledScene());
+	if (!LoadScene(fileName, *entry.scene, numThreads))
+	{
+		return nullptr;
+	}
+	loaded = true;
+
+	entries.push_front(move(entry));
+	while (entries.size() > SERVER_MAX_CACHED_SCENES)
+	{
+		entries.pop_back();
+	}
+	return entries.front().scene.get();
+}
+
+//-----------------------------------------------------------
+RenderServer::RenderServer(const Params& defaults, ArgumentParser parser)
+	: defaults(defaults), parser(parser), pool(defaults.numThreads)
+{
+	this->defaults.serverAddress.clear();
+}
+
+string RenderServer::RunJob(const string& line, bool& quit)
+{
+	quit = false;
+	vector<string> tokens;
+	{
+		istringstream stream(line);
+		string token;
+		while (stream >> token)
+		{
+			tokens.push_back(token);
+		}
+	}
+	if (tokens.empty())
+	{
+		return "";
+	}
+	if (tokens.size() == 1 && tokens[0] == "quit")
+	{
+		quit = true;
+		return "OK quit";
+	}
+
+	try
+	{
+		return RenderJob(tokens);
+	}
+	catch (const exception& e)
+	{
+		return string("ERROR ") + e.what();
+	}
+}
+
+string RenderServer::RenderJob(vector<string>& tokens)
+{
+	// The parser wants a command line, program name and all, ending
+	// in a null like main's does
+	vector<char*> argv;
+	char programName[] = "raytracer";
+	argv.push_back(programName);
+	for (string& token : tokens)
+	{
+		argv.push_back(&token[0]);
+	}
+	argv.push_back(nullptr);
+	Params job = defaults;
+	if (!parser((int)argv.size() - 1, argv.data(), job))
+	{
+		return "ERROR bad arguments";
+	}
+	if (job.runUnitTests || !job.convertFile.empty() || !job.animationFile.empty() || !job.serverAddress.empty())
+	{
+		return "ERROR -u, -convert, -anim and -serve can't be given to a server job";
+	}
+	if (job.sceneFile.empty() || job.outputFile.empty())
+	{
+		return "ERROR a job needs -i and -o";
+	}
+	job.numThreads = pool.GetNumThreads();
+
+	// Each job's stats are its own
+	ResetStats();
+	ResetPeakImageMemoryUsed();
+	const auto start = chrono::steady_clock::now();
+
+	StatTimer loadTimer(STAT_TIME_LOAD);
+	bool loaded = false;
+	CompiledScene* scene = cache.Get(job.sceneFile, pool.GetNumThreads(), loaded);
+	if (!scene)
+	{
+		return "ERROR could not load " + job.sceneFile;
+	}
+	loadTimer.Stop();
+
+	PhotonMaps photonMaps;
+	IlluminationMaps illuminationMaps;
+	const bool rendered = PrepareIndirectLighting(*scene, job, pool, photonMaps, illuminationMaps) && RenderScene(*scene, job, pool);
+	// The maps go with this job, but the scene stays for the next
+	scene->SetPhotonMaps(nullptr);
+	scene->SetIlluminationMaps(nullptr);
+	if (!rendered)
+	{
+		return "ERROR could not render " + job.outputFile;
+	}
+
+	if (!job.statsFile.empty() && !WriteStatsFile(job.statsFile, MergeStats(), job.numBouncesPerRay, (size_t)job.width * job.height))
+	{
+		return "ERROR could not write " + job.statsFile;
+	}
+
+	const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	ostringstream reply;
+	reply << "OK " << job.outputFile << " " << seconds << "s scene " << (loaded ? "loaded" : "cached");
+	return reply.str();
+}
+
+//-----------------------------------------------------------
+static bool ServeStdio(RenderServer& server)
+{
+	// Replies have stdout to themselves, and everything else goes to stderr
+	streambuf* stdoutBuffer = cout.rdbuf(cerr.rdbuf());
+	ostream replies(stdoutBuffer);
+
+	string line;
+	bool quit = false;
+	while (!quit && getline(cin, line))
+	{
+		const string reply = server.RunJob(line, quit);
+		if (!reply.empty())
+		{
+			replies << reply << endl;
+		}
+	}
+
+	cout.rdbuf(stdoutBuffer);
+	return true;
+}
+
+#ifdef _WIN32
+
+static bool ServeSocket(RenderServer&, const string& path)
+{
+	cout << "ERROR: can't listen on " << path << ": unix domain sockets aren't supported on Windows, use -serve " << SERVER_STDIO << endl;
+	return false;
+}
+
+#else
+
+static bool SendLine(const int connection, const string& line)
+{
+	const string message = line + "\n";
+	size_t sent = 0;
+	while (sent < message.size())
+	{
+		const ssize_t n = send(connection, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			return false;
+		}
+		sent += (size_t)n;
+	}
+	return true;
+}
+
+// Run jobs from one client until it hangs up or asks the server to quit.
+// Says whether it asked to quit.
+static bool ServeConnection(RenderServer& server, const int connection)
+{
+	string pending;
+	char buffer[4096];
+	while (true)
+	{
+		const ssize_t n = recv(connection, buffer, sizeof(buffer), 0);
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n <= 0)
+		{
+			return false;
+		}
+		pending.append(buffer, (size_t)n);
+
+		size_t end;
+		while ((end = pending.find('\n')) != string::npos)
+		{
+			const string line = pending.substr(0, end);
+			pending.erase(0, end + 1);
+
+			bool quit = false;
+			const string reply = server.RunJob(line, quit);
+			if (!reply.empty() && !SendLine(connection, reply))
+			{
+				// The client has gone, so there's no one to send the rest to
+				return false;
+			}
+			if (quit)
+			{
+				return true;
+			}
+		}
+
+		// What's left has no end to it yet. Past this long it's never
+		// going to be a job, so don't keep holding on to it.
+		if (pending.size() > SERVER_MAX_LINE)
+		{
+			SendLine(connection, "ERROR line too long");
+			return false;
+		}
+	}
+}
+
+static bool ServeSocket(RenderServer& server, const string& path)
+{
+	sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path))
+	{
+		cout << "ERROR: socket path " << path << " is too long" << endl;
+		return false;
+	}
+	strcpy(address.sun_path, path.c_str());
+
+	// A server that didn't quit cleanly leaves its socket behind. Anything
+	// else there is left alone.
+	struct stat status;
+	if (stat(path.c_str(), &status) == 0)
+	{
+		if (!S_ISSOCK(status.st_mode))
+		{
+			cout << "ERROR: " << path << " already exists, and isn't a socket" << endl;
+			return false;
+		}
+		unlink(path.c_str());
+	}
+
+	const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0)
+	{
+		cout << "ERROR: could not make a socket: " << strerror(errno) << endl;
+		return false;
+	}
+	if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 4) != 0)
+	{
+		cout << "ERROR: could not listen on " << path << ": " << strerror(errno) << endl;
+		close(listener);
+		return false;
+	}
+	cout << "Listening on " << path << " with " << server.GetPool().GetNumThreads() << " threads" << endl;
+
+	bool quit = false;
+	while (!quit)
+	{
+		const int connection = accept(listener, nullptr, nullptr);
+		if (connection < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			cout << "ERROR: could not accept a connection: " << strerror(errno) << endl;
+			break;
+		}
+		quit = ServeConnection(server, connection);
+		close(connection);
+	}
+
+	close(listener);
+	unlink(path.c_str());
+	return quit;
+}
+
+#endif
+
+//-----------------------------------------------------------
+bool RunServer(const Params& params, ArgumentParser parser)
+{
+	RenderServer server(params, parser);
+
+	// A scene given when the server starts is loaded before the first job
+	// asks for it
+	if (!params.sceneFile.empty())
+	{
+		bool loaded = false;
+		if (!server.GetCache().Get(params.sceneFile, params.numThreads, loaded))
+		{
+			return false;
+		}
+	}
+
+	if (params.serverAddress == SERVER_STDIO)
+	{
+		return ServeStdio(server);
+	}
+	return ServeSocket(server, params.serverAddress);
+}
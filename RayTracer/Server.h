@@ -0,0 +1,115 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <filesystem>
+#include <cstdint>
+
+#include "Render.h"
+#include "Scheduler.h"
+
+// Most compiled scenes a server keeps loaded. The one used longest ago
+// goes first.
+#define SERVER_MAX_CACHED_SCENES 8
+
+// What the reply stream of "-serve stdio" is called
+#define SERVER_STDIO "stdio"
+
+// Turns a job's arguments into Params, as main does with the command line
+typedef bool (*ArgumentParser)(const int argc, char** argv, Params& params);
+
+// The one main uses, defined next to it in RayTracer.cpp. It rejects
+// missing and malformed values rather than throwing.
+bool ParseArgs(const int argc, char** argv, Params& params);
+
+// Longest job line a socket client can send, in bytes
+#define SERVER_MAX_LINE (64 * 1024)
+
+/**********************************************/
+/*############### SERVER CLASSES #############*/
+/**********************************************/
+
+/*
+	Compiled scenes, kept loaded between jobs.
+
+	A scene is known by the absolute path of its file. It's loaded again
+	if the file's modification time or size has changed since, so an
+	edited scene is never rendered stale. OBJ files a text scene reads
+	meshes from aren't watched, only the scene file itself.
+*/
+class SceneCache
+{
+public:
+	SceneCache() {};
+
+	// The compiled scene in fileName, loaded if it isn't cached or the
+	// file has changed. loaded says which. nullptr if it can't be loaded.
+	// Meshes are loaded with numThreads threads.
+	CompiledScene* Get(const std::string& fileName, const int numThreads, bool& loaded);
+
+	size_t size() const { return entries.size(); };
+	void Clear() { entries.clear(); };
+
+private:
+	struct Entry
+	{
+		std::string path;
+		std::filesystem::file_time_type modified;
+		uintmax_t bytes = 0;
+		std::unique_ptr<CompiledScene> scene;
+	};
+
+	// Most recently used first
+	std::list<Entry> entries;
+};
+
+/*
+	Renders jobs one at a time, each a line of the same arguments the
+	command line takes, such as "-i scene.txt -o out.ppm -s 16".
+
+	Arguments a job doesn't give are taken from the ones the server was
+	started with. Every job renders on the same pool of threads, started
+	once with the server, so -t is ignored in jobs, and -u, -convert,
+	-anim and -serve can't be given to one.
+
+	Photon and illumination maps belong to the job that asked for them,
+	and are dropped from the cached scene once it's done.
+*/
+class RenderServer
+{
+public:
+	RenderServer(const Params& defaults, ArgumentParser parser);
+
+	/*
+		Run one line of input and return the reply, which is either
+		"OK <output file> <seconds>s scene cached|loaded" or "ERROR <why>".
+		A line of "quit" sets quit and replies "OK quit". Blank lines get
+		an empty reply, which isn't sent. Nothing a line says can take
+		the server down: anything thrown is an ERROR reply too.
+	*/
+	std::string RunJob(const std::string& line, bool& quit);
+
+	SceneCache& GetCache() { return cache; };
+	WorkStealingPool& GetPool() { return pool; };
+
+private:
+	// Parse and render one job, given as its arguments
+	std::string RenderJob(std::vector<std::string>& tokens);
+
+	Params defaults;
+	ArgumentParser parser;
+	SceneCache cache;
+	WorkStealingPool pool;
+};
+
+/*
+	Serve jobs until "quit", from params.serverAddress: either "stdio",
+	reading jobs from stdin and replying on stdout, or the path of a
+	unix domain socket to listen on. Clients connect one at a time and
+	send jobs a line at a time, and get a line back for each.
+
+	With stdio, everything the renderer prints goes to stderr instead,
+	so stdout only has replies on it.
+*/
+bool RunServer(const Params& params, ArgumentParser parser);
@@ -1,8 +1,13 @@
 #include "Scene.h"
+#include "CompiledScene.h"
 #include <string>
 #include <fstream>
 #include <iostream>
 #include <assert.h>
+#include <chrono>
+#include <limits>
+
+#include "ObjLoader.h"
 
 using namespace Eigen;
 using namespace std;
@@ -36,6 +41,9 @@ Sphere::Sphere(
 	this->radius = r;
 
 	this->material = m;
+
+	// default for now
+	diffusionFactor = 0.5f;
 }
 
 Sphere::~Sphere()
@@ -80,7 +88,10 @@ bool Sphere::DoesRayIntersect(
 
 	// Project centre of sphere on to ray:
 	ray.normalize();
-	Vector3f proj = (centre.dot(ray)) * ray;
+	// Keep the sign of the projection, so that spheres behind the
+	// ray origin give a negative distance and get rejected
+	float projLength = centre.dot(ray);
+	Vector3f proj = projLength * ray;
 	Vector3f dist = centre - proj;
 
 	float distToCentre = dist.norm();
@@ -89,7 +100,7 @@ bool Sphere::DoesRayIntersect(
 		if (distToCentre > radius - EPSILON)
 		{
 			// ray hits at radius, perfect tangent intersection
-			distance = proj.norm();
+			distance = projLength;
 		}
 		else
 		{
@@ -98,7 +109,7 @@ bool Sphere::DoesRayIntersect(
 			// But for now I'm ignoring this case, since I'm just not going to
 			// make scenes that create this case
 			// TODO: verify that the first term in the following line is correct ... 
-			distance = proj.norm() - sqrt(radius * radius - distToCentre * distToCentre);
+			distance = projLength - sqrt(radius * radius - distToCentre * distToCentre);
 
 			// intersection = p + d*di1
 			// di1 = |pc - p| - dist
@@ -159,6 +170,22 @@ Eigen::Vector3f Sphere::GetSurfaceNormalAtPoint(
 	return surfaceNormal;
 }
 
+void Sphere::Compile(CompiledScene& compiled)
+{
+	// A bad sphere can never be hit, so leave it out
+	if (radius == BAD_RADIUS)
+	{
+		return;
+	}
+
+	SphereData s;
+	s.centre = centre;
+	s.radius = radius;
+	s.colour = colour;
+	s.diffusionFactor = diffusionFactor;
+	compiled.AddSphere(s);
+}
+
 /*
 	I/O overloads
 */
@@ -205,6 +232,9 @@ Plane::Plane(
 	this->normal = normal;
 	this->offset = offset;
 	this->colour = colour;
+
+	// default for now
+	diffusionFactor = 0.5f;
 }
 
 void Plane::SetPlane(
@@ -287,6 +317,27 @@ Eigen::Vector3f Plane::GetSurfaceNormalAtPoint([[maybe_unused]]Eigen::Vector3f&
 	return this->normal;
 }
 
+/*
+	The normal doesn't have to be unit length in the scene file.
+	The compiled plane gets a unit normal, and the offset is scaled
+	by the same amount so that it's still the same plane.
+*/
+void Plane::Compile(CompiledScene& compiled)
+{
+	const float length = normal.norm();
+	if (length == 0)
+	{
+		return;
+	}
+
+	PlaneData p;
+	p.normal = normal / length;
+	p.offset = offset / length;
+	p.colour = colour;
+	p.diffusionFactor = diffusionFactor;
+	compiled.AddPlane(p);
+}
+
 std::ostream& operator << (std::ostream& os, const Plane& p)
 {
 	os << "PLANE ";
@@ -307,4 +358,175 @@ std::istream & operator >> (std::istream & is, Plane& p)
 	is >> offset;
 	p.SetPlane(normal, offset, colour);
 	return is;
-}
\ No newline at end of file
+}
+
+//-----------------------------------------------------------
+/*
+	The TriangleMesh class
+*/
+TriangleMesh::TriangleMesh()
+{
+	colour = Vector3f(0.5f, 0.5f, 0.5f);
+
+	// default for now
+	diffusionFactor = 0.5f;
+}
+
+TriangleMesh::TriangleMesh(
+	const std::vector<Eigen::Vector3f>& vertices,
+	const std::vector<uint32_t>& indices,
+	const Eigen::Vector3f& colour)
+{
+	this->vertices = vertices;
+	this->indices = indices;
+	this->colour = colour;
+
+	// default for now
+	diffusionFactor = 0.5f;
+}
+
+float TriangleMesh::GetDiffusionFactor()
+{
+	return diffusionFactor;
+}
+
+Eigen::Vector3f TriangleMesh::GetTriangleNormal(const size_t i) const
+{
+	const Vector3f& v0 = vertices[indices[3 * i]];
+	const Vector3f& v1 = vertices[indices[3 * i + 1]];
+	const Vector3f& v2 = vertices[indices[3 * i + 2]];
+	return (v1 - v0).cross(v2 - v0).normalized();
+}
+
+/*
+	Like the other shapes, rays here start at the camera. Every triangle
+	is tried, so this is only good for small meshes; rendering goes
+	through the compiled scene's BVH instead.
+*/
+bool TriangleMesh::DoesRayIntersect(
+	Eigen::Vector3f ray,
+	float& distance,
+	LightCollision& collision)
+{
+	ray.normalize();
+	const TriangleRay triangleRay = MakeTriangleRay(Vector3f::Zero(), ray);
+	float closest = std::numeric_limits<float>::max();
+	size_t closestTriangle = GetNumTriangles();
+	for (size_t i = 0; i < GetNumTriangles(); ++i)
+	{
+		float d = 0.f;
+		if (IntersectTriangle(triangleRay, vertices[indices[3 * i]], vertices[indices[3 * i + 1]], vertices[indices[3 * i + 2]], closest, d))
+		{
+			closest = d;
+			closestTriangle = i;
+		}
+	}
+	if (closestTriangle == GetNumTriangles())
+	{
+		return false;
+	}
+
+	distance = closest;
+	collision.point = ray * distance;
+	collision.surfaceNormal = GetTriangleNormal(closestTriangle);
+	collision.frontFace = collision.surfaceNormal.dot(ray) < 0.0;
+
+	// Reflect about the normal on the side the ray came from
+	const Vector3f normal = collision.frontFace ? collision.surfaceNormal : Vector3f(-collision.surfaceNormal);
+	collision.reflectedRay = ray - 2 * ray.dot(normal) * normal;
+	collision.reflectedRay.normalize();
+	collision.colour = this->colour;
+	return true;
+}
+
+/*
+	A mesh has no one normal, so this finds the triangle the point is
+	on: the one it's closest to the plane of, out of those it lies
+	inside when dropped onto their plane.
+*/
+Eigen::Vector3f TriangleMesh::GetSurfaceNormalAtPoint(
+	Eigen::Vector3f& point)
+{
+	float closest = std::numeric_limits<float>::max();
+	Vector3f surfaceNormal = Vector3f::Zero();
+	for (size_t i = 0; i < GetNumTriangles(); ++i)
+	{
+		const Vector3f& v0 = vertices[indices[3 * i]];
+		const Vector3f& v1 = vertices[indices[3 * i + 1]];
+		const Vector3f& v2 = vertices[indices[3 * i + 2]];
+		const Vector3f normal = GetTriangleNormal(i);
+		const float height = std::abs((point - v0).dot(normal));
+		if (!(height < closest))
+		{
+			continue;
+		}
+
+		// Inside if it's on the same side of each edge as the normal says
+		const float tolerance = -1e-4f;
+		if ((v1 - v0).cross(point - v0).dot(normal) >= tolerance &&
+			(v2 - v1).cross(point - v1).dot(normal) >= tolerance &&
+			(v0 - v2).cross(point - v2).dot(normal) >= tolerance)
+		{
+			closest = height;
+			surfaceNormal = normal;
+		}
+	}
+	return surfaceNormal;
+}
+
+void TriangleMesh::Compile(CompiledScene& compiled)
+{
+	if (indices.empty())
+	{
+		return;
+	}
+
+	MeshData m;
+	m.colour = colour;
+	m.diffusionFactor = diffusionFactor;
+	compiled.AddMesh(vertices, indices, m);
+}
+
+/*
+	Report how long it took, and how much the mesh takes up per
+	triangle, since that's what decides whether a big asset fits
+*/
+bool TriangleMesh::Load(
+	const std::string& fileName,
+	const int numThreads)
+{
+	const auto start = std::chrono::steady_clock::now();
+	if (!LoadObj(fileName, vertices, indices, numThreads))
+	{
+		return false;
+	}
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	this->fileName = fileName;
+
+	const size_t bytes = vertices.size() * sizeof(Vector3f) + indices.size() * sizeof(uint32_t);
+	cout << "Loaded " << fileName << ": " << vertices.size() << " vertices, "
+		<< GetNumTriangles() << " triangles in " << seconds << "s, "
+		<< (GetNumTriangles() ? (double)bytes / GetNumTriangles() : 0.0) << " bytes per triangle" << endl;
+	return true;
+}
+
+/*
+	In a scene file a mesh is the OBJ file's name, then its colour.
+	The name can't have spaces in it. Reading one only reads the name;
+	the scene loads the triangles, so it can tell when that fails.
+*/
+std::ostream& operator << (std::ostream& os, const TriangleMesh& m)
+{
+	os << "MESH " << m.fileName << " ";
+	for (int i = 0; i < 3; ++i)
+		os << m.colour[i] << " ";
+	return os;
+}
+std::istream & operator >> (std::istream & is, TriangleMesh& m)
+{
+	std::string fileName;
+	is >> fileName;
+	is >> m.colour[0] >> m.colour[1] >> m.colour[2];
+	m.fileName = fileName;
+	return is;
+}
@@ -0,0 +1,195 @@
+#include "Stats.h"
+#include <fstream>
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "FrameBuffer.h"
+
+using namespace std;
+
+// What each counter is called in the report, in the order of StatCounter
+static const char* statCounterNames[] =
+{
+	"camera_rays",
+	"reflection_rays",
+	"shadow_rays",
+	"photon_rays",
+	"closest_hit_queries",
+	"closest_hits",
+	"closest_misses",
+	"shadow_occluded",
+	"sphere_tests",
+	"plane_tests",
+	"triangle_tests",
+	"bvh_nodes",
+	"bounce_limit_reached",
+	"time_load",
+	"time_photons",
+	"time_render",
+	"time_denoise",
+	"time_write_image"
+};
+
+static_assert(sizeof(statCounterNames) / sizeof(statCounterNames[0]) == NUM_STAT_COUNTERS, "Every counter needs a name");
+
+//-----------------------------------------------------------
+void ThreadStats::Add(const ThreadStats& other)
+{
+	for (int c = 0; c < NUM_STAT_COUNTERS; ++c)
+	{
+		counters[c] += other.counters[c];
+	}
+	for (int h = 0; h < NUM_STAT_HISTOGRAMS; ++h)
+	{
+		for (int b = 0; b < STATS_HISTOGRAM_BINS; ++b)
+		{
+			histograms[h][b] += other.histograms[h][b];
+		}
+	}
+}
+
+/*
+	The blocks of the threads still running, and what the ones that have
+	exited counted, so a pool that's been shut down still gets merged but
+	doesn't keep its blocks. A server starts threads for as long as it
+	runs, for every mesh it loads and every frame it writes.
+*/
+static mutex registryLock;
+static vector<ThreadStats*> registry;
+static ThreadStats retired;
+
+#ifdef RT_STATS
+// Hands a thread's block back when the thread exits
+struct ThreadStatsOwner
+{
+	unique_ptr<ThreadStats> stats = make_unique<ThreadStats>();
+
+	ThreadStatsOwner()
+	{
+		lock_guard<mutex> guard(registryLock);
+		registry.push_back(stats.get());
+	}
+
+	~ThreadStatsOwner()
+	{
+		lock_guard<mutex> guard(registryLock);
+		retired.Add(*stats);
+		registry.erase(find(registry.begin(), registry.end(), stats.get()));
+		currentThreadStats = nullptr;
+	}
+};
+
+ThreadStats* RegisterThreadStats()
+{
+	thread_local ThreadStatsOwner owner;
+	return owner.stats.get();
+}
+#endif
+
+size_t GetNumThreadStats()
+{
+	lock_guard<mutex> guard(registryLock);
+	return registry.size();
+}
+
+bool AreStatsEnabled()
+{
+#ifdef RT_STATS
+	return true;
+#else
+	return false;
+#endif
+}
+
+ThreadStats MergeStats()
+{
+	lock_guard<mutex> guard(registryLock);
+	ThreadStats totals = retired;
+	for (const ThreadStats* stats : registry)
+	{
+		totals.Add(*stats);
+	}
+	return totals;
+}
+
+void ResetStats()
+{
+	lock_guard<mutex> guard(registryLock);
+	retired = ThreadStats();
+	for (ThreadStats* stats : registry)
+	{
+		*stats = ThreadStats();
+	}
+}
+
+//-----------------------------------------------------------
+static double ToSeconds(const uint64_t nanoseconds)
+{
+	return (double)nanoseconds * 1e-9;
+}
+
+bool WriteStatsFile(const string& fileName, const ThreadStats& totals, const int maxBounces, const size_t numPixels)
+{
+	ofstream ofs(fileName);
+	if (!ofs.is_open())
+	{
+		cout << "ERROR: stats could not be written to " << fileName << endl;
+		return false;
+	}
+
+	const uint64_t* counters = totals.counters;
+	ofs << "{" << endl;
+	ofs << "  \"stats_enabled\": " << (AreStatsEnabled() ? "true" : "false") << "," << endl;
+
+	ofs << "  \"counters\": {" << endl;
+	for (int c = 0; c < STAT_TIME_LOAD; ++c)
+	{
+		ofs << "    \"" << statCounterNames[c] << "\": " << counters[c] << (c + 1 < STAT_TIME_LOAD ? "," : "") << endl;
+	}
+	ofs << "  }," << endl;
+
+	ofs << "  \"phases_sec\": {" << endl;
+	for (int c = STAT_TIME_LOAD; c < NUM_STAT_COUNTERS; ++c)
+	{
+		// Drop the "time_" from the name
+		ofs << "    \"" << statCounterNames[c] + 5 << "\": " << ToSeconds(counters[c]) << (c + 1 < NUM_STAT_COUNTERS ? "," : "") << endl;
+	}
+	ofs << "  }," << endl;
+
+	// Paths that ended with b bounces left reached depth maxBounces - b
+	const int lastDepth = min(maxBounces, STATS_HISTOGRAM_BINS - 1);
+	ofs << "  \"histograms\": {" << endl;
+	ofs << "    \"bounce_depth\": { \"num_bounces_per_ray\": " << maxBounces << ", \"counts\": [";
+	for (int depth = 0; depth <= lastDepth; ++depth)
+	{
+		ofs << totals.histograms[STAT_HIST_BOUNCES_LEFT][lastDepth - depth] << (depth < lastDepth ? ", " : "");
+	}
+	ofs << "] }" << endl;
+	ofs << "  }," << endl;
+
+	// Image buffers are counted whether stats are compiled in or not
+	const size_t peakImageBytes = GetPeakImageMemoryUsed();
+	ofs << "  \"memory\": {" << endl;
+	ofs << "    \"peak_image_bytes\": " << peakImageBytes << "," << endl;
+	ofs << "    \"image_bytes_per_megapixel\": " << (numPixels > 0 ? (double)peakImageBytes / numPixels * 1e6 : 0.) << endl;
+	ofs << "  }," << endl;
+
+	// Every ray traced while rendering, whatever it was for
+	const double renderSeconds = ToSeconds(counters[STAT_TIME_RENDER]);
+	const double photonSeconds = ToSeconds(counters[STAT_TIME_PHOTONS]);
+	const uint64_t renderRays = counters[STAT_CAMERA_RAYS] + counters[STAT_REFLECTION_RAYS] + counters[STAT_SHADOW_RAYS];
+	ofs << "  \"mrays_per_sec\": " << (renderSeconds > 0. ? renderRays / renderSeconds * 1e-6 : 0.) << "," << endl;
+	ofs << "  \"photon_mrays_per_sec\": " << (photonSeconds > 0. ? counters[STAT_PHOTON_RAYS] / photonSeconds * 1e-6 : 0.) << endl;
+	ofs << "}" << endl;
+
+	ofs.close();
+	if (!ofs.good())
+	{
+		cout << "ERROR: stats could not be written to " << fileName << endl;
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,179 @@
+#pragma once
+#include <string>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+
+// Bins in each histogram. Values past the last bin go in the last bin.
+#define STATS_HISTOGRAM_BINS 64
+
+/**********************************************/
+/*############### STATS CLASSES ##############*/
+/**********************************************/
+
+/*
+	Counts of what the renderer did, for working out where the time goes.
+
+	Every thread keeps its own counts, in a block of its own that no
+	other thread writes, so counting costs an add and no atomics or
+	shared cache lines. The blocks are only added up at the end, by
+	MergeStats, once the threads are done with them.
+
+	Hot loops count into a LocalStat, which holds its count in a local
+	and only adds it to the thread's block once, when it goes out of scope.
+
+	All of it is compiled out unless RT_STATS is defined (the
+	RAYTRACER_STATS CMake option), leaving no trace in the hot paths.
+
+	The SIMD packet kernels aren't counted inside, just the rays they trace.
+*/
+enum StatCounter
+{
+	STAT_CAMERA_RAYS,
+	STAT_REFLECTION_RAYS,
+	STAT_SHADOW_RAYS,
+	STAT_PHOTON_RAYS,
+
+	// Closest hit searches, and how many of them found something
+	STAT_CLOSEST_HIT_QUERIES,
+	STAT_CLOSEST_HITS,
+	STAT_CLOSEST_MISSES,
+	// Shadow rays that found something in the way
+	STAT_SHADOW_OCCLUDED,
+
+	// Ray - primitive tests, and BVH nodes opened
+	STAT_SPHERE_TESTS,
+	STAT_PLANE_TESTS,
+	STAT_TRIANGLE_TESTS,
+	STAT_BVH_NODES,
+
+	// Camera paths cut off by numBouncesPerRay, rather than missing
+	STAT_BOUNCE_LIMIT_REACHED,
+
+	// Nanoseconds spent in each phase of a render
+	STAT_TIME_LOAD,
+	STAT_TIME_PHOTONS,
+	STAT_TIME_RENDER,
+	STAT_TIME_DENOISE,
+	STAT_TIME_WRITE_IMAGE,
+
+	NUM_STAT_COUNTERS
+};
+
+enum StatHistogram
+{
+	// How many bounces each camera path had left when it ended. Kept
+	// this way round because the renderer counts bounces down; the
+	// report turns it into the depth each path reached.
+	STAT_HIST_BOUNCES_LEFT,
+
+	NUM_STAT_HISTOGRAMS
+};
+
+// Starts on a cache line of its own, so two threads' blocks never share one
+struct alignas(64) ThreadStats
+{
+	uint64_t counters[NUM_STAT_COUNTERS] = {};
+	uint64_t histograms[NUM_STAT_HISTOGRAMS][STATS_HISTOGRAM_BINS] = {};
+
+	void Add(const ThreadStats& other);
+};
+
+// Is counting compiled in?
+bool AreStatsEnabled();
+
+// Every thread's counts added up. Only call when no thread is counting.
+ThreadStats MergeStats();
+
+// Zero every thread's counts. Only call when no thread is counting.
+void ResetStats();
+
+// How many running threads have counted anything. A thread's block is
+// freed when it exits, and its counts kept for MergeStats.
+size_t GetNumThreadStats();
+
+/*
+	Write totals out as JSON: every counter, the histograms, the time
+	spent in each phase and how many million rays a second were traced
+	while rendering. maxBounces is numBouncesPerRay, to turn bounces
+	left into depths. The most memory the image buffers took at once is
+	in there too, alone and per megapixel of the numPixels rendered.
+*/
+bool WriteStatsFile(const std::string& fileName, const ThreadStats& totals, const int maxBounces, const size_t numPixels);
+
+#ifdef RT_STATS
+
+// This thread's counts, made the first time the thread counts anything
+// and freed when the thread exits
+ThreadStats* RegisterThreadStats();
+
+inline thread_local ThreadStats* currentThreadStats = nullptr;
+
+inline ThreadStats& GetThreadStats()
+{
+	if (!currentThreadStats)
+	{
+		currentThreadStats = RegisterThreadStats();
+	}
+	return *currentThreadStats;
+}
+
+#define STAT_ADD(counter, n) (GetThreadStats().counters[(counter)] += (uint64_t)(n))
+#define STAT_SAMPLE(histogram, value) (GetThreadStats().histograms[(histogram)][std::min((int)(value), STATS_HISTOGRAM_BINS - 1)] += 1)
+
+class LocalStat
+{
+public:
+	explicit LocalStat(const StatCounter counter) : counter(counter) {};
+	~LocalStat() { STAT_ADD(counter, count); };
+
+	void Add(const uint64_t n = 1) { count += n; };
+
+private:
+	StatCounter counter;
+	uint64_t count = 0;
+};
+
+// Adds the time from here to the end of the scope to a STAT_TIME_ counter
+class StatTimer
+{
+public:
+	explicit StatTimer(const StatCounter counter) : counter(counter), start(std::chrono::steady_clock::now()) {};
+	~StatTimer() { Stop(); };
+
+	// Stop early. Only the first stop counts.
+	void Stop()
+	{
+		if (running)
+		{
+			STAT_ADD(counter, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+			running = false;
+		}
+	};
+
+private:
+	StatCounter counter;
+	std::chrono::steady_clock::time_point start;
+	bool running = true;
+};
+
+#else
+
+#define STAT_ADD(counter, n) ((void)0)
+#define STAT_SAMPLE(histogram, value) ((void)0)
+
+class LocalStat
+{
+public:
+	explicit LocalStat(const StatCounter) {};
+	void Add(const uint64_t = 1) {};
+};
+
+class StatTimer
+{
+public:
+	explicit StatTimer(const StatCounter) {};
+	void Stop() {};
+};
+
+#endif
@@ -1,11 +1,43 @@
 #include <stdlib.h>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <assert.h>
+#include <random>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <iterator>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <filesystem>
+#endif
 
 #include "UnitTests.h"
 #include "Scene.h"
+#include "CompiledScene.h"
+#include "Packet.h"
+#include "Sampler.h"
+#include "Render.h"
+#include "Scheduler.h"
+#include "ImageOutput.h"
+#include "SceneFile.h"
+#include "ObjLoader.h"
+#include "PhotonMap.h"
+#include "SPPM.h"
+#include "IlluminationMap.h"
+#include "Stats.h"
+#include "Denoise.h"
+#include "Animation.h"
+#include "Server.h"
+#include "Distributed.h"
+#include "Checkpoint.h"
+#include "Integrator.h"
 
 /*
     Global unit test function. Runs all decided unit tests
@@ -24,6 +56,138 @@ bool RunUnitTests()
         return false;
     }
 
+    if (!BVHTest())
+    {
+        std::cerr << "BVH test failed!" << std::endl;
+        return false;
+    }
+
+    if (!PacketTest())
+    {
+        std::cerr << "Packet test failed!" << std::endl;
+        return false;
+    }
+
+    if (!SamplerTest())
+    {
+        std::cerr << "Sampler test failed!" << std::endl;
+        return false;
+    }
+
+    if (!RenderReproducibilityTest())
+    {
+        std::cerr << "Render reproducibility test failed!" << std::endl;
+        return false;
+    }
+
+    if (!AdaptiveSamplingTest())
+    {
+        std::cerr << "Adaptive sampling test failed!" << std::endl;
+        return false;
+    }
+
+    if (!ImageOutputTest())
+    {
+        std::cerr << "Image output test failed!" << std::endl;
+        return false;
+    }
+
+    if (!SceneFileTest())
+    {
+        std::cerr << "Scene file test failed!" << std::endl;
+        return false;
+    }
+
+    if (!TriangleMeshTest())
+    {
+        std::cerr << "Triangle mesh test failed!" << std::endl;
+        return false;
+    }
+
+    if (!OcclusionTest())
+    {
+        std::cerr << "Occlusion test failed!" << std::endl;
+        return false;
+    }
+
+    if (!PhotonMapTest())
+    {
+        std::cerr << "PhotonMap test failed!" << std::endl;
+        return false;
+    }
+
+    if (!SPPMTest())
+    {
+        std::cerr << "SPPM test failed!" << std::endl;
+        return false;
+    }
+
+    if (!IlluminationMapTest())
+    {
+        std::cerr << "Illumination map test failed!" << std::endl;
+        return false;
+    }
+
+    if (!StatsTest())
+    {
+        std::cerr << "Stats test failed!" << std::endl;
+        return false;
+    }
+
+    if (!CostMapTest())
+    {
+        std::cerr << "Cost map test failed!" << std::endl;
+        return false;
+    }
+
+    if (!DenoiseTest())
+    {
+        std::cerr << "Denoise test failed!" << std::endl;
+        return false;
+    }
+
+    if (!AnimationTest())
+    {
+        std::cerr << "Animation test failed!" << std::endl;
+        return false;
+    }
+
+    if (!ServerTest())
+    {
+        std::cerr << "Server test failed!" << std::endl;
+        return false;
+    }
+
+    if (!DistributedTest())
+    {
+        std::cerr << "Distributed test failed!" << std::endl;
+        return false;
+    }
+
+    if (!CheckpointTest())
+    {
+        std::cerr << "Checkpoint test failed!" << std::endl;
+        return false;
+    }
+
+    if (!FrameBufferTest())
+    {
+        std::cerr << "Frame buffer test failed!" << std::endl;
+        return false;
+    }
+
+    if (!ScenePoolTest())
+    {
+        std::cerr << "Scene pool test failed!" << std::endl;
+        return false;
+    }
+
+    if (!IntegratorTest())
+    {
+        std::cerr << "Integrator test failed!" << std::endl;
+        return false;
+    }
+
 
     return true;
 }
@@ -76,4 +240,1974 @@ bool ReflectionTest()
     assert(collision.reflectedRay(2) < 1e-1);
 
     return true;
-}
\ No newline at end of file
+}
+
+/*
+    Test the BVH finds the same closest hit as checking every shape
+
+    A few hundred random spheres and a plane, hit with rays across a
+    90 degree field of view, from the camera and from a point off to
+    the side. The compiled scene's answer is checked against running
+    the same kernels over every primitive.
+*/
+bool BVHTest()
+{
+    Scene scene;
+    std::mt19937 generator(7);
+    std::uniform_real_distribution<float> position(-4.f, 4.f);
+    std::uniform_real_distribution<float> radius(0.05f, 0.5f);
+    for (int i = 0; i < 300; ++i)
+    {
+        Sphere* s = new Sphere();
+        Eigen::Vector3f centre(position(generator), position(generator), 5.f + position(generator));
+        s->SetSphere(centre, Eigen::Vector3f(1, 0, 0), radius(generator));
+        scene.AddShape(s);
+    }
+    scene.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), -3.f, Eigen::Vector3f(0, 1, 0)));
+    const CompiledScene compiled(scene);
+
+    const Eigen::Vector3f origins[2] = { Eigen::Vector3f(0, 0, 0), Eigen::Vector3f(2, 1, 3) };
+    for (const auto& origin : origins)
+    {
+        for (int y = 0; y < 40; ++y)
+        {
+            for (int x = 0; x < 40; ++x)
+            {
+                Eigen::Vector3f ray(x / 20.f - 1.f, y / 20.f - 1.f, 1.f);
+                ray.normalize();
+
+                float linearDist = 10.f;
+                int linearKey = NO_PRIMITIVE_KEY;
+                float distance = 0.f;
+                const auto& spheres = compiled.GetSpheres();
+                const auto& planes = compiled.GetPlanes();
+                for (int i = 0; i < (int)spheres.size(); ++i)
+                {
+                    const int key = PrimitiveKey(PRIMITIVE_SPHERE, i);
+                    if (IntersectSphere(spheres[i], origin, ray, linearDist, distance) &&
+                        IsCloserHit(distance, key, linearDist, linearKey))
+                    {
+                        linearDist = distance;
+                        linearKey = key;
+                    }
+                }
+                for (int i = 0; i < (int)planes.size(); ++i)
+                {
+                    const int key = PrimitiveKey(PRIMITIVE_PLANE, i);
+                    if (IntersectPlane(planes[i], origin, ray, linearDist, distance) &&
+                        IsCloserHit(distance, key, linearDist, linearKey))
+                    {
+                        linearDist = distance;
+                        linearKey = key;
+                    }
+                }
+                const int linearType = KeyType(linearKey);
+                const int linearIndex = KeyIndex(linearKey);
+
+                float bvhDist = 10.f;
+                HitRecord hit;
+                bool bvhHit = compiled.Intersect(origin, ray, bvhDist, hit);
+
+                assert(bvhHit == (linearType != PRIMITIVE_NONE));
+                assert(hit.type == linearType);
+                assert(hit.index == linearIndex);
+                assert(bvhDist == linearDist);
+                if (hit.type != linearType || hit.index != linearIndex)
+                {
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+/*
+    A bumpy n by n grid of quads, two triangles each, facing the camera
+    from about z = 5. Used wherever a test wants a mesh.
+*/
+static TriangleMesh* MakeGridMesh(const int n, const float size)
+{
+    std::vector<Eigen::Vector3f> vertices;
+    std::vector<uint32_t> indices;
+    for (int j = 0; j <= n; ++j)
+    {
+        for (int i = 0; i <= n; ++i)
+        {
+            const float x = size * (2.f * i / n - 1.f);
+            const float y = size * (2.f * j / n - 1.f);
+            vertices.push_back(Eigen::Vector3f(x, y, 5.f + 0.3f * std::sin(3.f * x) * std::cos(2.f * y)));
+        }
+    }
+    for (int j = 0; j < n; ++j)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            const uint32_t corner = j * (n + 1) + i;
+            const uint32_t quad[6] = { corner, corner + 1, corner + n + 2, corner, corner + n + 2, corner + n + 1 };
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+    return new TriangleMesh(vertices, indices, Eigen::Vector3f(1, 0, 1));
+}
+
+/*
+    Test the packet kernels give exactly the same hits as tracing
+    one ray at a time
+
+    Every kernel width the CPU can run is checked, on full and partial
+    packets. Two of the spheres are in exactly the same place, so the
+    tie breaking between equally close hits gets checked too.
+*/
+bool PacketTest()
+{
+    Scene scene;
+    std::mt19937 generator(11);
+    std::uniform_real_distribution<float> position(-3.f, 3.f);
+    std::uniform_real_distribution<float> radius(0.05f, 0.6f);
+    for (int i = 0; i < 200; ++i)
+    {
+        Sphere* s = new Sphere();
+        Eigen::Vector3f centre(position(generator), position(generator), 5.f + position(generator));
+        s->SetSphere(centre, Eigen::Vector3f(0, 0, 1), radius(generator));
+        scene.AddShape(s);
+    }
+    for (int i = 0; i < 2; ++i)
+    {
+        Sphere* s = new Sphere();
+        s->SetSphere(Eigen::Vector3f(0.5f, 0.25f, 2.f), Eigen::Vector3f(0, 1, 0), 0.5f);
+        scene.AddShape(s);
+    }
+    scene.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), -2.f, Eigen::Vector3f(0, 1, 0)));
+    scene.AddShape(new Plane(Eigen::Vector3f(0, 0, 2), 18.f, Eigen::Vector3f(1, 1, 0)));
+    scene.AddShape(MakeGridMesh(12, 1.5f));
+    const CompiledScene compiled(scene);
+
+    const int widths[3] = { 4, 8, 16 };
+    for (int width : widths)
+    {
+        if (width > GetNativePacketWidth())
+        {
+            continue;
+        }
+        const PacketKernel kernel = GetPacketKernel(width);
+
+        for (int row = 0; row < 64; ++row)
+        {
+            for (int start = 0; start < 64; start += PACKET_SIZE)
+            {
+                RayPacket packet;
+                packet.origin[0] = row % 2 == 0 ? 0.f : 0.3f;
+                packet.origin[1] = 0.f;
+                packet.origin[2] = 0.f;
+                // Every third packet is cut short
+                packet.count = row % 3 == 0 ? 5 : PACKET_SIZE;
+                for (int i = 0; i < PACKET_SIZE; ++i)
+                {
+                    Eigen::Vector3f ray((start + i) / 32.f - 1.f, row / 32.f - 1.f, 1.f);
+                    ray.normalize();
+                    packet.dx[i] = ray[0];
+                    packet.dy[i] = ray[1];
+                    packet.dz[i] = ray[2];
+                }
+
+                PacketHits expected, actual;
+                TracePacketScalar(compiled, packet, 10.f, expected);
+                kernel(compiled, packet, 10.f, actual);
+                for (int i = 0; i < packet.count; ++i)
+                {
+                    assert(expected.type[i] == actual.type[i]);
+                    assert(expected.index[i] == actual.index[i]);
+                    assert(expected.distance[i] == actual.distance[i]);
+                    if (expected.type[i] != actual.type[i] ||
+                        expected.index[i] != actual.index[i] ||
+                        expected.distance[i] != actual.distance[i])
+                    {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+/*
+    Test the samplers
+
+    Every sampler must stay in [0, 1) and give the same value every time
+    it's asked for the same sample. The first 16 Sobol samples of a pixel
+    must land one in each cell of a 4x4 grid, and also one in each of
+    16 columns and 16 rows. The blue noise tile must use every value once.
+*/
+bool SamplerTest()
+{
+    const SamplerType types[3] = { SAMPLER_RANDOM, SAMPLER_SOBOL, SAMPLER_BLUE_NOISE };
+    for (const auto type : types)
+    {
+        const auto sampler = MakeSampler(type, 5);
+        for (int sample = 0; sample < 64; ++sample)
+        {
+            for (int dimension = 0; dimension < 3; ++dimension)
+            {
+                const Eigen::Vector2f a = sampler->Get2D(13, 7, sample, dimension);
+                const Eigen::Vector2f b = sampler->Get2D(13, 7, sample, dimension);
+                assert(a == b);
+                assert(a[0] >= 0.f && a[0] < 1.f && a[1] >= 0.f && a[1] < 1.f);
+                if (a != b || a[0] < 0.f || a[0] >= 1.f || a[1] < 0.f || a[1] >= 1.f)
+                {
+                    return false;
+                }
+            }
+        }
+    }
+
+    SobolSampler sobol(5);
+    for (int pixel = 0; pixel < 4; ++pixel)
+    {
+        int square[16] = {}, columns[16] = {}, rows[16] = {};
+        for (int sample = 0; sample < 16; ++sample)
+        {
+            const Eigen::Vector2f p = sobol.Get2D(pixel, 3, sample, SAMPLE_DIM_PIXEL);
+            ++square[(int)(p[0] * 4) + 4 * (int)(p[1] * 4)];
+            ++columns[(int)(p[0] * 16)];
+            ++rows[(int)(p[1] * 16)];
+        }
+        for (int i = 0; i < 16; ++i)
+        {
+            assert(square[i] == 1 && columns[i] == 1 && rows[i] == 1);
+            if (square[i] != 1 || columns[i] != 1 || rows[i] != 1)
+            {
+                return false;
+            }
+        }
+    }
+
+    BlueNoiseSampler blueNoise(5);
+    std::vector<float> values = blueNoise.GetTile();
+    std::sort(values.begin(), values.end());
+    for (int i = 0; i < (int)values.size(); ++i)
+    {
+        assert(values[i] == (float)i / (float)values.size());
+        if (values[i] != (float)i / (float)values.size())
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+    Test a frame comes out the same however it's rendered
+
+    The same seed must give exactly the same image on one thread or
+    several, with or without packets. The wavefront integrator adds up
+    bounces in a different order, so it only has to be very close.
+*/
+bool RenderReproducibilityTest()
+{
+    Scene scene;
+    std::mt19937 generator(3);
+    std::uniform_real_distribution<float> position(-3.f, 3.f);
+    for (int i = 0; i < 50; ++i)
+    {
+        Sphere* s = new Sphere();
+        Eigen::Vector3f centre(position(generator), position(generator), 6.f + position(generator));
+        s->SetSphere(centre, Eigen::Vector3f(1, 0.5f, 0), 0.6f);
+        scene.AddShape(s);
+    }
+    scene.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), -3.f, Eigen::Vector3f(0, 1, 0)));
+    scene.AddLight(new PointLight(Eigen::Vector3f(0, 4, 2), Eigen::Vector3f(1, 1, 1), 1.f));
+    const CompiledScene compiled(scene);
+
+    Params params;
+    params.width = 48;
+    params.height = 40;
+    params.samplesPerPixel = 4;
+    params.numBouncesPerRay = 3;
+
+    FrameBuffer reference(params.width, params.height);
+    WorkStealingPool onePool(1);
+    RenderFrame(compiled, params, onePool, reference);
+
+    WorkStealingPool threePool(3);
+    const bool packets[2] = { false, true };
+    for (const bool usePackets : packets)
+    {
+        params.usePackets = usePackets;
+        FrameBuffer frame(params.width, params.height);
+        RenderFrame(compiled, params, threePool, frame);
+        assert(frame == reference);
+        if (frame != reference)
+        {
+            return false;
+        }
+    }
+
+    params.usePackets = false;
+    params.useWavefront = true;
+    FrameBuffer frame(params.width, params.height);
+    RenderFrame(compiled, params, threePool, frame);
+    for (size_t i = 0; i < frame.GetNumPixels(); ++i)
+    {
+        assert((frame.Get(i) - reference.Get(i)).norm() < 1e-4f);
+        if ((frame.Get(i) - reference.Get(i)).norm() >= 1e-4f)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+    Test adaptive sampling
+
+    The top of the frame is empty background, which never varies, so
+    those pixels must stop at the minimum. Lower down, a sphere's edge
+    cuts across pixels, where jitter makes them noisy, so some pixels
+    must take more. Packets must take exactly the same
+    samples as the scalar tiles, and the wavefront integrator must
+    stay within the limits.
+*/
+bool AdaptiveSamplingTest()
+{
+    Scene scene;
+    Sphere* s = new Sphere();
+    s->SetSphere(Eigen::Vector3f(0, -1, 4), Eigen::Vector3f(1, 1, 1), 1.f);
+    scene.AddShape(s);
+    scene.AddLight(new PointLight(Eigen::Vector3f(0, 4, 0), Eigen::Vector3f(1, 1, 1), 1.f));
+    const CompiledScene compiled(scene);
+
+    Params params;
+    params.width = 32;
+    params.height = 32;
+    params.numBouncesPerRay = 1;
+    params.adaptive = true;
+    params.minSamples = 4;
+    params.maxSamples = 32;
+    params.noiseThreshold = 0.02f;
+
+    WorkStealingPool pool(2);
+    FrameBuffer frame(params.width, params.height);
+    std::vector<int> counts(params.width * params.height);
+    RenderFrame(compiled, params, pool, frame, &counts);
+
+    bool anyMore = false;
+    for (int h = 0; h < params.height; ++h)
+    {
+        for (int w = 0; w < params.width; ++w)
+        {
+            const int count = counts[w + h * params.width];
+            assert(count >= params.minSamples && count <= params.maxSamples);
+            if (h < params.height / 4)
+            {
+                assert(count == params.minSamples);
+            }
+            anyMore = anyMore || count > params.minSamples;
+        }
+    }
+    assert(anyMore);
+
+    params.usePackets = true;
+    FrameBuffer packetFrame(params.width, params.height);
+    std::vector<int> packetCounts(params.width * params.height);
+    RenderFrame(compiled, params, pool, packetFrame, &packetCounts);
+    assert(packetFrame == frame);
+    assert(packetCounts == counts);
+
+    params.usePackets = false;
+    params.useWavefront = true;
+    FrameBuffer waveFrame(params.width, params.height);
+    std::vector<int> waveCounts(params.width * params.height);
+    RenderFrame(compiled, params, pool, waveFrame, &waveCounts);
+    for (size_t i = 0; i < waveCounts.size(); ++i)
+    {
+        assert(waveCounts[i] >= params.minSamples && waveCounts[i] <= params.maxSamples);
+    }
+
+    return anyMore && packetFrame == frame && packetCounts == counts;
+}
+
+/*
+    Test image output
+
+    The SIMD quantizer must give the same bytes as the plain clamp and
+    truncate it replaced, including for values out of range and NaNs.
+    Streaming rows to a file in a jumbled order must give exactly the
+    same file as encoding the whole image at once, in every format.
+*/
+bool ImageOutputTest()
+{
+    std::vector<float> values;
+    for (int i = -200; i < 1400; ++i)
+    {
+        values.push_back(i / 1000.f);
+    }
+    values.push_back(std::numeric_limits<float>::quiet_NaN());
+    values.push_back(std::numeric_limits<float>::infinity());
+    values.push_back(-std::numeric_limits<float>::infinity());
+
+    const Quantizer linear(1.f);
+    std::vector<uint8_t> bytes(values.size());
+    linear.Quantize(values.data(), (int)values.size(), bytes.data());
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        const uint8_t expected = (uint8_t)(255 * std::max(0.f, std::min(1.f, values[i])));
+        assert(bytes[i] == expected);
+        if (bytes[i] != expected)
+        {
+            return false;
+        }
+    }
+
+    const Quantizer gamma(2.2f);
+    gamma.Quantize(values.data(), (int)values.size(), bytes.data());
+    for (size_t i = 1; i + 3 < values.size(); ++i)
+    {
+        assert(bytes[i] >= bytes[i - 1]);
+    }
+    assert(bytes[200] == 0 && bytes[1200] == 255);
+
+    const int width = 37, height = 23;
+    FrameBuffer image(width, height);
+    std::mt19937 generator(9);
+    std::uniform_real_distribution<float> value(-0.5f, 2.f);
+    for (size_t i = 0; i < image.GetNumPixels(); ++i)
+    {
+        image.Set(i, Eigen::Vector3f(value(generator), value(generator), value(generator)));
+    }
+
+    const char* fileNames[3] = { "image_output_test.ppm", "image_output_test.pfm", "image_output_test.exr" };
+    for (const char* fileName : fileNames)
+    {
+        std::vector<char> expected;
+        EncodeImage(image, GetImageFormat(fileName), 1.f, expected);
+
+        {
+            ImageWriter writer(fileName, width, height, 1.f);
+            assert(writer.IsOpen());
+            writer.WriteRows(image, 16, height);
+            writer.WriteRows(image, 0, 5);
+            writer.WriteRows(image, 5, 16);
+            writer.Close();
+        }
+
+        std::ifstream file(fileName, std::ifstream::binary);
+        const std::vector<char> written((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        file.close();
+        std::remove(fileName);
+        assert(written == expected);
+        if (written != expected)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+    Test binary scene files:
+
+    A scene written out and mapped back in has to give exactly the
+    same hits as the one it came from, without rebuilding the BVH.
+    A file whose BVH points past the end of its spheres, and one
+    that has been cut short, have to be turned away.
+*/
+bool SceneFileTest()
+{
+    Scene scene;
+    std::mt19937 generator(11);
+    std::uniform_real_distribution<float> position(-4.f, 4.f);
+    std::uniform_real_distribution<float> radius(0.05f, 0.5f);
+    for (int i = 0; i < 200; ++i)
+    {
+        Sphere* s = new Sphere();
+        Eigen::Vector3f centre(position(generator), position(generator), 5.f + position(generator));
+        s->SetSphere(centre, Eigen::Vector3f(0, 0, 1), radius(generator));
+        scene.AddShape(s);
+    }
+    scene.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), -3.f, Eigen::Vector3f(0, 1, 0)));
+    scene.AddShape(MakeGridMesh(10, 2.f));
+    scene.AddLight(new PointLight(Eigen::Vector3f(1, 4, 2), Eigen::Vector3f(1, 1, 1), 0.8f));
+    const CompiledScene compiled(scene);
+
+    const char* fileName = "scene_file_test.rtscene";
+    bool written = WriteSceneFile(fileName, compiled);
+    assert(written);
+    assert(IsSceneFile(fileName));
+
+    CompiledScene loaded;
+    bool read = LoadSceneFile(fileName, loaded);
+    assert(read);
+    if (!written || !read)
+    {
+        std::remove(fileName);
+        return false;
+    }
+    assert(loaded.GetSpheres().size() == compiled.GetSpheres().size());
+    assert(loaded.GetPlanes().size() == compiled.GetPlanes().size());
+    assert(loaded.GetLights().size() == compiled.GetLights().size());
+    assert(loaded.GetBVH().GetNumNodes() == compiled.GetBVH().GetNumNodes());
+    assert(loaded.GetTriangles().size() == compiled.GetTriangles().size());
+    assert(loaded.GetTriangleBVH().GetNumNodes() == compiled.GetTriangleBVH().GetNumNodes());
+    assert(loaded.GetBackground() == compiled.GetBackground());
+
+    for (int y = 0; y < 40; ++y)
+    {
+        for (int x = 0; x < 40; ++x)
+        {
+            Eigen::Vector3f ray(x / 20.f - 1.f, y / 20.f - 1.f, 1.f);
+            ray.normalize();
+
+            float expectedDist = 10.f;
+            HitRecord expected;
+            const bool expectedHit = compiled.Intersect(Eigen::Vector3f::Zero(), ray, expectedDist, expected);
+            float loadedDist = 10.f;
+            HitRecord hit;
+            const bool loadedHit = loaded.Intersect(Eigen::Vector3f::Zero(), ray, loadedDist, hit);
+
+            assert(loadedHit == expectedHit);
+            assert(hit.type == expected.type && hit.index == expected.index);
+            assert(loadedDist == expectedDist);
+            if (loadedHit != expectedHit || hit.type != expected.type || hit.index != expected.index)
+            {
+                std::remove(fileName);
+                return false;
+            }
+        }
+    }
+
+    // Break the file: point the first leaf at an index that isn't a sphere
+    std::vector<char> bytes;
+    {
+        std::ifstream file(fileName, std::ifstream::binary);
+        bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    SceneFileHeader header;
+    memcpy(&header, bytes.data(), sizeof(header));
+    const int badIndex = 100000;
+    memcpy(&bytes[header.bvhIndices.offset], &badIndex, sizeof(badIndex));
+    {
+        std::ofstream file(fileName, std::ofstream::binary | std::ofstream::trunc);
+        file.write(bytes.data(), bytes.size());
+    }
+    CompiledScene corrupt;
+    bool rejected = !LoadSceneFile(fileName, corrupt);
+    assert(rejected);
+    assert(corrupt.GetSpheres().empty());
+
+    // And cut it short, so the last section runs off the end
+    {
+        std::ofstream file(fileName, std::ofstream::binary | std::ofstream::trunc);
+        file.write(bytes.data(), bytes.size() - 4);
+    }
+    rejected = rejected && !LoadSceneFile(fileName, corrupt);
+    assert(rejected);
+
+    std::remove(fileName);
+    return rejected;
+}
+
+/*
+    Test triangle meshes:
+
+    Watertightness: rays aimed right at the shared vertices and edges
+    of a mesh are where other triangle tests let rays slip through.
+    Every one of them has to hit the mesh.
+
+    OBJ loading: a small file using most of the format, with quads,
+    slashes, relative indices and Windows line endings, has to give
+    the right triangles, and the same ones when it's cut into chunks
+    of a few bytes each. A face using a missing vertex is an error.
+*/
+bool TriangleMeshTest()
+{
+    const int n = 24;
+    Scene scene;
+    TriangleMesh* mesh = MakeGridMesh(n, 2.f);
+    scene.AddShape(mesh);
+    const CompiledScene compiled(scene);
+    assert(compiled.GetTriangles().size() == (size_t)(2 * n * n));
+
+    const std::vector<Eigen::Vector3f>& vertices = mesh->GetVertices();
+    std::vector<Eigen::Vector3f> targets;
+    for (int j = 1; j < n; ++j)
+    {
+        for (int i = 1; i < n; ++i)
+        {
+            const int v = j * (n + 1) + i;
+            targets.push_back(vertices[v]);
+            targets.push_back(0.5f * (vertices[v] + vertices[v + 1]));
+            targets.push_back(0.5f * (vertices[v] + vertices[v + n + 1]));
+            targets.push_back(0.5f * (vertices[v] + vertices[v + n + 2]));
+        }
+    }
+    int misses = 0;
+    for (const auto& target : targets)
+    {
+        float distance = 10.f;
+        HitRecord hit;
+        if (!compiled.Intersect(Eigen::Vector3f::Zero(), target.normalized(), distance, hit) ||
+            hit.type != PRIMITIVE_TRIANGLE)
+        {
+            ++misses;
+        }
+    }
+    assert(misses == 0);
+    if (misses != 0)
+    {
+        return false;
+    }
+
+    const char* fileName = "triangle_mesh_test.obj";
+    {
+        std::ofstream file(fileName, std::ofstream::binary | std::ofstream::trunc);
+        file << "# A quad and two triangles\n"
+             << "v 0 0 0\nv 1.0 0 0\nvt 0 0\nv 1 1e0 0\nvn 0 0 1\n  v 0 +1 0\n"
+             << "f 1/1/1 2/1/1 3/1/1 4/1/1\r\n"
+             << "g second\n"
+             << "v 0 0 1\nv 1 0 1\nv 1 1 1\n"
+             << "f -3 -2 -1\n"
+             << "f 5//1 6//1 7//1 # trailing comment\n"
+             << "s off";
+    }
+    const std::vector<uint32_t> expected = { 0, 1, 2, 0, 2, 3, 4, 5, 6, 4, 5, 6 };
+
+    std::vector<Eigen::Vector3f> whole, chunked;
+    std::vector<uint32_t> wholeIndices, chunkedIndices;
+    bool loaded = LoadObj(fileName, whole, wholeIndices, 1);
+    loaded = LoadObj(fileName, chunked, chunkedIndices, 3, 8) && loaded;
+    assert(loaded);
+    assert(whole.size() == 7 && whole[3] == Eigen::Vector3f(0, 1, 0));
+    assert(wholeIndices == expected);
+    assert(chunked == whole && chunkedIndices == expected);
+    const bool parsed = loaded && wholeIndices == expected && chunked == whole && chunkedIndices == expected;
+
+    {
+        std::ofstream file(fileName, std::ofstream::binary | std::ofstream::trunc);
+        file << "v 0 0 0\nv 1 0 0\nv 1 1 0\nf 1 2 9\n";
+    }
+    const bool rejected = !LoadObj(fileName, chunked, chunkedIndices);
+    assert(rejected);
+    std::remove(fileName);
+
+    // A scene whose mesh isn't there fails to read, rather than
+    // coming out without it
+    const char* sceneName = "triangle_mesh_test_scene.txt";
+    {
+        std::ofstream file(sceneName, std::ofstream::trunc);
+        file << "1 0\nMESH " << fileName << " 1 1 1\n0 0 0\n";
+    }
+    Scene missing;
+    CompiledScene missingCompiled;
+    const bool missed = !ReadScene(sceneName, missing, 1) && missing.HasLoadFailed()
+        && !LoadScene(sceneName, missingCompiled, 1);
+    assert(missed);
+    std::remove(sceneName);
+
+    // Mesh file names are relative to the scene file, not to where it's rendered from
+    const std::filesystem::path directory = "triangle_mesh_test_dir";
+    std::filesystem::create_directory(directory);
+    {
+        std::ofstream obj(directory / fileName, std::ofstream::trunc);
+        obj << "v 0 0 0\nv 1 0 0\nv 1 1 0\nf 1 2 3\n";
+        std::ofstream file(directory / sceneName, std::ofstream::trunc);
+        file << "1 0\nMESH " << fileName << " 1 1 1\n0 0 0\n";
+    }
+    Scene nearby;
+    bool found = ReadScene((directory / sceneName).string(), nearby, 1) && nearby.GetMeshes().size() == 1;
+    nearby.GetMeshes().ForEach([&](const TriangleMesh& mesh) { found = found && mesh.GetNumTriangles() == 1; });
+    assert(found);
+    std::filesystem::remove_all(directory);
+
+    return parsed && rejected && missed && found;
+}
+
+/*
+    Test occlusion queries:
+
+    IsOccluded has to agree with a closest hit search limited to the
+    same distance, for rays from all over a scene of spheres, a plane
+    and a mesh, at lots of distances. And a point on the floor right
+    under a sphere, with the light straight above, must be in shadow.
+*/
+bool OcclusionTest()
+{
+    Scene scene;
+    std::mt19937 generator(13);
+    std::uniform_real_distribution<float> position(-3.f, 3.f);
+    std::uniform_real_distribution<float> radius(0.05f, 0.4f);
+    for (int i = 0; i < 150; ++i)
+    {
+        Sphere* s = new Sphere();
+        Eigen::Vector3f centre(position(generator), position(generator), 5.f + position(generator));
+        s->SetSphere(centre, Eigen::Vector3f(1, 1, 1), radius(generator));
+        scene.AddShape(s);
+    }
+    scene.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), -3.5f, Eigen::Vector3f(0, 1, 0)));
+    scene.AddShape(MakeGridMesh(8, 1.f));
+    const CompiledScene compiled(scene);
+
+    std::uniform_real_distribution<float> direction(-1.f, 1.f);
+    std::uniform_real_distribution<float> reach(0.f, 9.f);
+    for (int i = 0; i < 4000; ++i)
+    {
+        const Eigen::Vector3f origin(position(generator), position(generator), 5.f + position(generator));
+        Eigen::Vector3f ray(direction(generator), direction(generator), direction(generator));
+        ray.normalize();
+        const float maxDist = reach(generator);
+
+        float closestDist = maxDist;
+        int closestKey = NO_PRIMITIVE_KEY;
+        const bool expected = compiled.FindClosest(origin, ray, closestDist, closestKey);
+        const bool occluded = compiled.IsOccluded(origin, ray, maxDist);
+        assert(occluded == expected);
+        if (occluded != expected)
+        {
+            return false;
+        }
+    }
+
+    Scene shadowScene;
+    Sphere* blocker = new Sphere();
+    blocker->SetSphere(Eigen::Vector3f(0, 0, 5), Eigen::Vector3f(1, 1, 1), 1.f);
+    shadowScene.AddShape(blocker);
+    shadowScene.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), -2.f, Eigen::Vector3f(1, 1, 1)));
+    shadowScene.AddLight(new PointLight(Eigen::Vector3f(0, 5, 5), Eigen::Vector3f(1, 1, 1), 1.f));
+    const CompiledScene shadowCompiled(shadowScene);
+
+    HitRecord floor;
+    floor.point = Eigen::Vector3f(0, -2, 5);
+    floor.normal = Eigen::Vector3f(0, 1, 0);
+    floor.colour = Eigen::Vector3f(1, 1, 1);
+    floor.diffusionFactor = 0.5f;
+    const bool shadowed = DirectLighting(floor, shadowCompiled).isZero();
+    floor.point = Eigen::Vector3f(3, -2, 5);
+    const bool lit = !DirectLighting(floor, shadowCompiled).isZero();
+    assert(shadowed && lit);
+
+    return shadowed && lit;
+}
+
+/*
+    Test photon maps:
+
+    Photon powers and directions have to survive being packed down.
+    The kd-tree's nearest photons have to be exactly the ones a brute
+    force search finds, for odd sized trees built on a few threads.
+    Emitting photons on one thread or three has to give the same maps.
+
+    And the caustic map has to carry the right amount of light. Between
+    two black mirrors, a floor and a ceiling, every stored photon got
+    there by mirror bounces alone, and the light on the ceiling right
+    above the lamp can be added up by hand: for m bounces, the photon
+    has been scaled up by the square of its first leg, survived
+    roulette with odds REFLECTANCE^m, and spread out over the square of
+    the unfolded distance it went.
+*/
+bool PhotonMapTest()
+{
+    std::mt19937 generator(21);
+    std::uniform_real_distribution<float> unit(0.f, 1.f);
+
+    bool packed = true;
+    for (int i = 0; i < 1000; ++i)
+    {
+        const Eigen::Vector3f power(unit(generator), unit(generator), unit(generator) * 100.f);
+        Eigen::Vector3f direction(unit(generator) - 0.5f, unit(generator) - 0.5f, unit(generator) - 0.5f);
+        direction.normalize();
+        Photon photon;
+        photon.SetPower(power);
+        photon.SetDirection(direction);
+        packed = packed && (photon.GetPower() - power).cwiseAbs().maxCoeff() <= power.maxCoeff() / 128.f;
+        packed = packed && photon.GetDirection().dot(direction) > 0.999f;
+    }
+    assert(packed);
+
+    bool nearestMatch = true;
+    WorkStealingPool pool(3);
+    for (const int count : { 1, 2, 7, 1000, 12345 })
+    {
+        std::vector<Photon> photons(count);
+        for (Photon& photon : photons)
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                photon.position[a] = unit(generator);
+            }
+            photon.SetPower(Eigen::Vector3f(1, 1, 1));
+        }
+        PhotonMap map;
+        map.Build(photons, pool);
+        nearestMatch = nearestMatch && map.size() == (size_t)count;
+
+        std::vector<const Photon*> nearest;
+        for (int q = 0; q < 50 && nearestMatch; ++q)
+        {
+            const Eigen::Vector3f point(unit(generator), unit(generator), unit(generator));
+            const int k = 1 + q % 40;
+            const float maxDistSq = q % 2 == 0 ? 0.01f : 1.f;
+
+            std::vector<float> expected;
+            for (const Photon& photon : map.GetPhotons())
+            {
+                const float distSq = (Eigen::Vector3f(photon.position[0], photon.position[1], photon.position[2]) - point).squaredNorm();
+                if (distSq < maxDistSq)
+                {
+                    expected.push_back(distSq);
+                }
+            }
+            std::sort(expected.begin(), expected.end());
+            expected.resize(std::min(expected.size(), (size_t)k));
+
+            map.FindNearest(point, k, maxDistSq, nearest);
+            std::vector<float> found;
+            for (const Photon* photon : nearest)
+            {
+                found.push_back((Eigen::Vector3f(photon->position[0], photon->position[1], photon->position[2]) - point).squaredNorm());
+            }
+            std::sort(found.begin(), found.end());
+            nearestMatch = found == expected;
+        }
+    }
+    assert(nearestMatch);
+
+    // Black mirrors at y = 0 and y = 2, with the lamp in between at y = 1
+    const float lampHeight = 1.f;
+    const float ceilingHeight = 2.f;
+    Scene mirrors;
+    mirrors.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), 0.f, Eigen::Vector3f(0, 0, 0)));
+    mirrors.AddShape(new Plane(Eigen::Vector3f(0, -1, 0), -ceilingHeight, Eigen::Vector3f(0, 0, 0)));
+    mirrors.AddLight(new PointLight(Eigen::Vector3f(0, lampHeight, 0), Eigen::Vector3f(1, 1, 1), 1.f));
+    const CompiledScene mirrorsCompiled(mirrors);
+
+    PhotonMaps mirrorMaps;
+    EmitPhotons(mirrorsCompiled, 400000, 0, pool, mirrorMaps);
+    float expected = 0.f;
+    for (int m = 1; m < 12; ++m)
+    {
+        // Odd m went down first, even m went up first
+        const float firstLeg = m % 2 == 1 ? lampHeight : ceilingHeight - lampHeight;
+        const float unfolded = firstLeg + m * ceilingHeight;
+        expected += std::pow(REFLECTANCE, (float)m) * firstLeg * firstLeg / (unfolded * unfolded);
+    }
+    const Eigen::Vector3f measured = mirrorMaps.caustic.EstimateIrradiance(
+        Eigen::Vector3f(0, ceilingHeight, 0), Eigen::Vector3f(0, -1, 0), 200, 0.5f);
+    const bool conserved = mirrorMaps.global.size() == 0 && std::fabs(measured[0] / expected - 1.f) < 0.1f;
+    assert(conserved);
+
+    // A room with some colour in it, so every map gets photons
+    Scene room;
+    room.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), -1.f, Eigen::Vector3f(0.8f, 0.8f, 0.8f)));
+    room.AddShape(new Plane(Eigen::Vector3f(0, -1, 0), -2.f, Eigen::Vector3f(0.8f, 0.8f, 0.8f)));
+    room.AddShape(new Plane(Eigen::Vector3f(1, 0, 0), -2.f, Eigen::Vector3f(0.8f, 0.1f, 0.1f)));
+    Sphere* ball = new Sphere();
+    ball->SetSphere(Eigen::Vector3f(0, 0, 3), Eigen::Vector3f(0.2f, 0.3f, 0.9f), 1.f);
+    room.AddShape(ball);
+    room.AddLight(new PointLight(Eigen::Vector3f(0, 1.5f, 2), Eigen::Vector3f(1, 1, 1), 1.f));
+    const CompiledScene roomCompiled(room);
+
+    PhotonMaps single, several;
+    WorkStealingPool onePool(1);
+    EmitPhotons(roomCompiled, 20000, 5, onePool, single);
+    EmitPhotons(roomCompiled, 20000, 5, pool, several);
+    auto same = [](const PhotonMap& a, const PhotonMap& b)
+    {
+        return a.size() == b.size() && (a.size() == 0 ||
+            std::memcmp(a.GetPhotons().data(), b.GetPhotons().data(), a.size() * sizeof(Photon)) == 0);
+    };
+    const bool repeatable = single.global.size() > 0 && single.caustic.size() > 0 && single.irradiance.size() > 0 &&
+        same(single.global, several.global) && same(single.caustic, several.caustic) && same(single.irradiance, several.irradiance);
+    assert(repeatable);
+
+    return packed && nearestMatch && conserved && repeatable;
+}
+
+/*
+    Test SPPM:
+
+    - with no indirect light to find, passes average out to the same
+      image as that many samples per pixel from the usual renderer
+    - radii only ever shrink, and memory doesn't grow between passes
+    - the image doesn't depend on the thread count
+*/
+bool SPPMTest()
+{
+    Params params;
+    params.width = 24;
+    params.height = 16;
+    params.numPhotons = 5000;
+    params.photonRadius = 0.5f;
+
+    // A lone floor: photons only ever hit it straight from the light, and those aren't stored
+    Scene floor;
+    floor.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), -1.f, Eigen::Vector3f(0.6f, 0.7f, 0.8f)));
+    floor.AddLight(new PointLight(Eigen::Vector3f(0, 2, 4), Eigen::Vector3f(1, 1, 1), 1.f));
+    const CompiledScene floorCompiled(floor);
+
+    WorkStealingPool pool(3);
+    SPPMIntegrator floorIntegrator(floorCompiled, params, pool);
+    for (int pass = 0; pass < 4; ++pass)
+    {
+        floorIntegrator.RunPass();
+    }
+    FrameBuffer progressive;
+    floorIntegrator.GetImage(progressive);
+
+    Params plainParams = params;
+    plainParams.samplesPerPixel = 4;
+    FrameBuffer plain(params.width, params.height);
+    RenderFrame(floorCompiled, plainParams, pool, plain);
+    bool matches = progressive.GetNumPixels() == plain.GetNumPixels();
+    for (size_t i = 0; i < plain.GetNumPixels() && matches; ++i)
+    {
+        matches = (progressive.Get(i) - plain.Get(i)).cwiseAbs().maxCoeff() < 1e-5f;
+    }
+    assert(matches);
+
+    // A closed box, so there's plenty of indirect light
+    Scene box;
+    box.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), -1.f, Eigen::Vector3f(0.8f, 0.8f, 0.8f)));
+    box.AddShape(new Plane(Eigen::Vector3f(0, -1, 0), -2.f, Eigen::Vector3f(0.8f, 0.8f, 0.8f)));
+    box.AddShape(new Plane(Eigen::Vector3f(1, 0, 0), -2.f, Eigen::Vector3f(0.8f, 0.1f, 0.1f)));
+    box.AddShape(new Plane(Eigen::Vector3f(-1, 0, 0), -2.f, Eigen::Vector3f(0.1f, 0.8f, 0.1f)));
+    box.AddShape(new Plane(Eigen::Vector3f(0, 0, -1), -5.f, Eigen::Vector3f(0.8f, 0.8f, 0.8f)));
+    box.AddShape(new Plane(Eigen::Vector3f(0, 0, 1), -1.f, Eigen::Vector3f(0.8f, 0.8f, 0.8f)));
+    box.AddLight(new PointLight(Eigen::Vector3f(0, 1.5f, 3), Eigen::Vector3f(1, 1, 1), 1.f));
+    const CompiledScene boxCompiled(box);
+
+    WorkStealingPool onePool(1);
+    SPPMIntegrator single(boxCompiled, params, onePool);
+    SPPMIntegrator several(boxCompiled, params, pool);
+    bool shrinks = true;
+    size_t memory = 0;
+    for (int pass = 0; pass < 5; ++pass)
+    {
+        const std::vector<float> before = several.GetRadiiSquared();
+        single.RunPass();
+        several.RunPass();
+        const std::vector<float>& after = several.GetRadiiSquared();
+        for (size_t i = 0; i < after.size(); ++i)
+        {
+            shrinks = shrinks && after[i] <= before[i];
+        }
+        shrinks = shrinks && (pass < 2 || several.GetMemoryUsed() == memory);
+        memory = several.GetMemoryUsed();
+    }
+    shrinks = shrinks && several.GetRadiiSquared() != std::vector<float>(params.width * params.height, 0.25f);
+    assert(shrinks);
+
+    FrameBuffer singleImage, severalImage;
+    single.GetImage(singleImage);
+    several.GetImage(severalImage);
+    const bool repeatable = singleImage == severalImage;
+    assert(repeatable);
+
+    return matches && shrinks && repeatable;
+}
+
+/*
+    Test illumination maps:
+
+    - texel areas add up to the whole surface
+    - mirrors either side of a lamp put the same irradiance on the
+      ceiling as the photon map test works out
+    - splatting on several threads gives exactly the same maps
+    - maps survive a trip through a file, and aren't read back for a
+      different scene
+*/
+bool IlluminationMapTest()
+{
+    const int resolution = 32;
+    SphereData sphere;
+    sphere.centre = Eigen::Vector3f(1, 2, 3);
+    sphere.radius = 1.5f;
+    PlaneData plane;
+    plane.normal = Eigen::Vector3f(0, 0, -1);
+    plane.offset = -4.f;
+    const IlluminationChart sphereChart = MakeSphereChart(sphere);
+    const IlluminationChart planeChart = MakePlaneChart(plane);
+    double sphereArea = 0.;
+    double planeArea = 0.;
+    for (int j = 0; j < resolution; ++j)
+    {
+        for (int i = 0; i < resolution; ++i)
+        {
+            sphereArea += sphereChart.GetTexelArea(i, j, resolution);
+            planeArea += planeChart.GetTexelArea(i, j, resolution);
+        }
+    }
+    const double planeSide = 2. * MAX_SCENE_DEPTH;
+    const bool areas = std::fabs(sphereArea / (4. * 3.14159265 * 1.5 * 1.5) - 1.) < 1e-4 &&
+        std::fabs(planeArea / (planeSide * planeSide) - 1.) < 1e-4;
+    assert(areas);
+
+    // Black mirrors at y = 0 and y = 2, with the lamp in between at y = 1
+    const float lampHeight = 1.f;
+    const float ceilingHeight = 2.f;
+    Scene mirrors;
+    mirrors.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), 0.f, Eigen::Vector3f(0, 0, 0)));
+    mirrors.AddShape(new Plane(Eigen::Vector3f(0, -1, 0), -ceilingHeight, Eigen::Vector3f(0, 0, 0)));
+    mirrors.AddLight(new PointLight(Eigen::Vector3f(0, lampHeight, 0), Eigen::Vector3f(1, 1, 1), 1.f));
+    const CompiledScene mirrorsCompiled(mirrors);
+
+    WorkStealingPool pool(3);
+    IlluminationMaps mirrorMaps;
+    mirrorMaps.Build(mirrorsCompiled, 400000, 0, 64, pool);
+    float expected = 0.f;
+    for (int m = 1; m < 12; ++m)
+    {
+        const float firstLeg = m % 2 == 1 ? lampHeight : ceilingHeight - lampHeight;
+        const float unfolded = firstLeg + m * ceilingHeight;
+        expected += std::pow(REFLECTANCE, (float)m) * firstLeg * firstLeg / (unfolded * unfolded);
+    }
+    HitRecord ceiling;
+    ceiling.type = PRIMITIVE_PLANE;
+    ceiling.index = 1;
+    ceiling.point = Eigen::Vector3f(0, ceilingHeight, 0);
+    const Eigen::Vector3f measured = mirrorMaps.GetIrradiance(ceiling);
+    const bool conserved = std::fabs(measured[0] / expected - 1.f) < 0.1f;
+    assert(conserved);
+
+    // A room with a ball in it, so both kinds of map get light
+    Scene room;
+    room.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), -1.f, Eigen::Vector3f(0.8f, 0.8f, 0.8f)));
+    room.AddShape(new Plane(Eigen::Vector3f(0, -1, 0), -2.f, Eigen::Vector3f(0.8f, 0.8f, 0.8f)));
+    room.AddShape(new Plane(Eigen::Vector3f(1, 0, 0), -2.f, Eigen::Vector3f(0.8f, 0.1f, 0.1f)));
+    Sphere* ball = new Sphere();
+    ball->SetSphere(Eigen::Vector3f(0, 0, 3), Eigen::Vector3f(0.2f, 0.3f, 0.9f), 1.f);
+    room.AddShape(ball);
+    room.AddLight(new PointLight(Eigen::Vector3f(0, 1.5f, 2), Eigen::Vector3f(1, 1, 1), 1.f));
+    const CompiledScene roomCompiled(room);
+
+    IlluminationMaps single, several;
+    WorkStealingPool onePool(1);
+    single.Build(roomCompiled, 20000, 5, resolution, onePool);
+    several.Build(roomCompiled, 20000, 5, resolution, pool);
+    bool lit = false;
+    for (const Eigen::Vector3f& texel : single.GetTexels())
+    {
+        lit = lit || texel.maxCoeff() > 0.f;
+    }
+    const bool repeatable = lit && single.GetTexels() == several.GetTexels();
+    assert(repeatable);
+
+    const char* fileName = "illumination_map_test.illum";
+    IlluminationMaps loaded;
+    bool saved = several.Write(fileName, roomCompiled) && IsIlluminationMapFile(fileName);
+    saved = saved && loaded.Load(fileName, roomCompiled) && loaded.GetTexels() == several.GetTexels() &&
+        loaded.GetResolution() == resolution && loaded.GetNumPhotons() == 20000;
+    saved = saved && !loaded.Load(fileName, mirrorsCompiled) && loaded.GetTexels() == several.GetTexels();
+    std::remove(fileName);
+    assert(saved);
+
+    return areas && conserved && repeatable && saved;
+}
+
+/*
+    Test render stats:
+
+    - every camera ray is counted, and every closest hit query hits or misses
+    - every camera path ends up in the bounce depth histogram
+    - the counts don't depend on how many threads rendered
+    - threads that have exited are still counted, but their blocks are freed
+*/
+bool StatsTest()
+{
+    if (!AreStatsEnabled())
+    {
+        return true;
+    }
+
+    Scene scene;
+    scene.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), -1.f, Eigen::Vector3f(0.8f, 0.8f, 0.8f)));
+    Sphere* sphere = new Sphere();
+    sphere->SetSphere(Eigen::Vector3f(0, 0, 4), Eigen::Vector3f(0.8f, 0.2f, 0.2f), 1.f);
+    scene.AddShape(sphere);
+    scene.AddLight(new PointLight(Eigen::Vector3f(0, 3, 2), Eigen::Vector3f(1, 1, 1), 1.f));
+    const CompiledScene compiled(scene);
+
+    Params params;
+    params.width = 24;
+    params.height = 16;
+    params.samplesPerPixel = 2;
+    params.numBouncesPerRay = 3;
+    FrameBuffer image(params.width, params.height);
+
+    const size_t numBlocks = GetNumThreadStats();
+    ResetStats();
+    {
+        WorkStealingPool pool(1);
+        RenderFrame(compiled, params, pool, image);
+    }
+    const ThreadStats one = MergeStats();
+
+    ResetStats();
+    {
+        WorkStealingPool pool(3);
+        RenderFrame(compiled, params, pool, image);
+    }
+    const ThreadStats three = MergeStats();
+
+    const uint64_t* counters = one.counters;
+    const uint64_t numPaths = (uint64_t)params.width * params.height * params.samplesPerPixel;
+    const bool counted = counters[STAT_CAMERA_RAYS] == numPaths
+        && counters[STAT_CLOSEST_HIT_QUERIES] == counters[STAT_CAMERA_RAYS] + counters[STAT_REFLECTION_RAYS]
+        && counters[STAT_CLOSEST_HITS] + counters[STAT_CLOSEST_MISSES] == counters[STAT_CLOSEST_HIT_QUERIES]
+        && counters[STAT_SHADOW_RAYS] > 0 && counters[STAT_SPHERE_TESTS] > 0 && counters[STAT_PLANE_TESTS] > 0;
+    assert(counted);
+
+    uint64_t numEnded = 0;
+    for (int bin = 0; bin < STATS_HISTOGRAM_BINS; ++bin)
+    {
+        numEnded += one.histograms[STAT_HIST_BOUNCES_LEFT][bin];
+    }
+    const bool ended = numEnded == numPaths
+        && counters[STAT_CLOSEST_MISSES] + counters[STAT_BOUNCE_LIMIT_REACHED] == numPaths;
+    assert(ended);
+
+    // Times aren't expected to match, but everything before them is
+    const bool repeatable = std::equal(one.counters, one.counters + STAT_TIME_LOAD, three.counters)
+        && std::equal(&one.histograms[0][0], &one.histograms[0][0] + NUM_STAT_HISTOGRAMS * STATS_HISTOGRAM_BINS, &three.histograms[0][0]);
+    assert(repeatable);
+
+    // Only this thread can have a block left, if it hadn't one already
+    const bool freed = GetNumThreadStats() <= std::max<size_t>(numBlocks, 1);
+    assert(freed);
+
+    ResetStats();
+    return counted && ended && repeatable && freed;
+}
+
+/*
+    Test per pixel cost maps:
+
+    - recording costs doesn't change the image
+    - every pixel took some time
+    - the pixels' tests and bounces add up to the totals for the frame
+    - false colour runs from blue to red, and clamps
+*/
+bool CostMapTest()
+{
+    Scene scene;
+    scene.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), -1.f, Eigen::Vector3f(0.8f, 0.8f, 0.8f)));
+    Sphere* sphere = new Sphere();
+    sphere->SetSphere(Eigen::Vector3f(0, 0, 4), Eigen::Vector3f(0.8f, 0.2f, 0.2f), 1.f);
+    scene.AddShape(sphere);
+    scene.AddLight(new PointLight(Eigen::Vector3f(0, 3, 2), Eigen::Vector3f(1, 1, 1), 1.f));
+    const CompiledScene compiled(scene);
+
+    Params params;
+    params.width = 24;
+    params.height = 16;
+    params.samplesPerPixel = 2;
+    params.numBouncesPerRay = 3;
+    const int numPixels = params.width * params.height;
+
+    WorkStealingPool pool(2);
+    FrameBuffer plain(params.width, params.height);
+    RenderFrame(compiled, params, pool, plain);
+
+    FrameBuffer costed(params.width, params.height);
+    PixelCosts costs;
+    costs.Resize(numPixels);
+    ResetStats();
+    RenderFrame(compiled, params, pool, costed, nullptr, nullptr, &costs);
+    const ThreadStats totals = MergeStats();
+
+    const bool unchanged = plain == costed;
+    assert(unchanged);
+
+    const bool timed = std::all_of(costs.nanoseconds.begin(), costs.nanoseconds.end(), [](uint64_t ns) { return ns > 0; });
+    assert(timed);
+
+    uint64_t numTests = 0;
+    uint64_t numBounces = 0;
+    for (int i = 0; i < numPixels; ++i)
+    {
+        numTests += costs.tests[i];
+        numBounces += costs.bounces[i];
+    }
+    const uint64_t* counters = totals.counters;
+    const bool addsUp = !AreStatsEnabled() || (numTests > 0
+        && numTests == counters[STAT_SPHERE_TESTS] + counters[STAT_PLANE_TESTS] + counters[STAT_TRIANGLE_TESTS] + counters[STAT_BVH_NODES]
+        && numBounces == counters[STAT_REFLECTION_RAYS]);
+    assert(addsUp);
+
+    const bool colours = FalseColour(0.f) == Eigen::Vector3f(0.f, 0.f, 0.5f)
+        && FalseColour(1.f) == Eigen::Vector3f(1.f, 0.f, 0.f)
+        && FalseColour(-2.f) == FalseColour(0.f)
+        && FalseColour(5.f) == FalseColour(1.f);
+    assert(colours);
+
+    ResetStats();
+    return unchanged && timed && addsUp && colours;
+}
+
+/*
+    Test the denoiser:
+
+    - the guides see the plane's colour, normal and distance, and the background
+    - a flat image stays flat
+    - noise on one surface is smoothed away
+    - it doesn't blur across an edge in the normals
+    - the result doesn't depend on the number of threads
+*/
+bool DenoiseTest()
+{
+    // Looking straight down a floor: the bottom half sees it, the top half sees nothing
+    Scene scene;
+    scene.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), -1.f, Eigen::Vector3f(0.6f, 0.7f, 0.8f)));
+    scene.AddLight(new PointLight(Eigen::Vector3f(0, 2, 4), Eigen::Vector3f(1, 1, 1), 1.f));
+    const CompiledScene compiled(scene);
+
+    Params params;
+    params.width = 37;
+    params.height = 20;
+    params.samplesPerPixel = 2;
+    WorkStealingPool pool(3);
+    AOVBuffers aovs;
+    RenderAOVs(compiled, params, pool, nullptr, aovs);
+    const int bottom = params.width / 2 + (params.height - 1) * params.width;
+    const bool guided = (aovs.albedo.Get(bottom) - Eigen::Vector3f(0.6f, 0.7f, 0.8f)).norm() < 1e-5f
+        && (aovs.normal.Get(bottom) - Eigen::Vector3f(0, 1, 0)).norm() < 1e-5f
+        && aovs.depth.GetValue(bottom, 0) > 1.f && aovs.depth.GetValue(bottom, 0) < MAX_SCENE_DEPTH
+        && aovs.albedo.Get(0) == compiled.GetBackground() && aovs.normal.Get(0) == Eigen::Vector3f::Zero()
+        && aovs.depth.GetValue(0, 0) == (float)MAX_SCENE_DEPTH;
+    assert(guided);
+
+    // Made up guides: two surfaces meeting down the middle, both flat on
+    const int width = 37;
+    const int height = 24;
+    const int numPixels = width * height;
+    const int edge = width / 2;
+    AOVBuffers flatAovs;
+    flatAovs.albedo.Resize(width, height);
+    flatAovs.normal.Resize(width, height);
+    flatAovs.depth.Resize(width, height, 1);
+    FrameBuffer flat(width, height);
+    for (int i = 0; i < numPixels; ++i)
+    {
+        flatAovs.albedo.Set(i, Eigen::Vector3f::Constant(0.5f));
+        flatAovs.normal.Set(i, (i % width) < edge ? Eigen::Vector3f(1, 0, 0) : Eigen::Vector3f(0, 0, 1));
+        flatAovs.depth.SetValue(i, 0, 2.f);
+        flat.Set(i, Eigen::Vector3f(0.3f, 0.4f, 0.5f));
+    }
+
+    DenoiseImage(flatAovs, pool, flat);
+    bool stillFlat = true;
+    for (int i = 0; i < numPixels; ++i)
+    {
+        stillFlat = stillFlat && (flat.Get(i) - Eigen::Vector3f(0.3f, 0.4f, 0.5f)).cwiseAbs().maxCoeff() < 1e-5f;
+    }
+    assert(stillFlat);
+
+    // Dark on the left, light on the right, with noise on both
+    std::mt19937 generator(11);
+    std::uniform_real_distribution<float> noise(-0.1f, 0.1f);
+    FrameBuffer noisy(width, height);
+    for (int i = 0; i < numPixels; ++i)
+    {
+        noisy.Set(i, Eigen::Vector3f::Constant(((i % width) < edge ? 0.2f : 0.8f) + noise(generator)));
+    }
+    FrameBuffer denoised = noisy;
+    DenoiseImage(flatAovs, pool, denoised);
+
+    const auto getError = [&](const FrameBuffer& image)
+    {
+        float error = 0.f;
+        for (int i = 0; i < numPixels; ++i)
+        {
+            error += std::abs(image.GetValue(i, 0) - ((i % width) < edge ? 0.2f : 0.8f));
+        }
+        return error / numPixels;
+    };
+    const bool smoothed = getError(denoised) < 0.25f * getError(noisy);
+    assert(smoothed);
+
+    // The columns either side of the edge keep to their own side
+    bool sharp = true;
+    for (int y = 0; y < height; ++y)
+    {
+        sharp = sharp && std::abs(denoised.GetValue(edge - 1 + y * width, 0) - 0.2f) < 0.1f
+            && std::abs(denoised.GetValue(edge + y * width, 0) - 0.8f) < 0.1f;
+    }
+    assert(sharp);
+
+    WorkStealingPool onePool(1);
+    FrameBuffer single = noisy;
+    DenoiseImage(flatAovs, onePool, single);
+    const bool repeatable = single == denoised;
+    assert(repeatable);
+
+    return guided && stillFlat && smoothed && sharp && repeatable;
+}
+
+/*
+    Test animation:
+
+    - tracks move in straight lines between keys, and hold still past the ends
+    - a refitted BVH finds the same closest hits as one built from scratch
+    - moving things far enough gets the BVH built again
+    - animation files are read, and ones that move what isn't there are rejected
+    - a rendered frame is the same image as rendering a scene built where things are then
+*/
+bool AnimationTest()
+{
+    AnimationTrack track;
+    track.keys.push_back({ 0.f, Eigen::Vector3f(0, 0, 0) });
+    track.keys.push_back({ 4.f, Eigen::Vector3f(4, 8, 0) });
+    const bool interpolated = track.GetPosition(1.f) == Eigen::Vector3f(1, 2, 0)
+        && track.GetPosition(-3.f) == Eigen::Vector3f(0, 0, 0)
+        && track.GetPosition(9.f) == Eigen::Vector3f(4, 8, 0);
+    assert(interpolated);
+
+    // Spheres jiggled a little from where the tree was built, against a tree built where they end up
+    std::mt19937 generator(5);
+    std::uniform_real_distribution<float> position(-4.f, 4.f);
+    std::uniform_real_distribution<float> jiggle(-0.3f, 0.3f);
+    Scene before;
+    Scene after;
+    std::vector<Eigen::Vector3f> moved;
+    for (int i = 0; i < 200; ++i)
+    {
+        const Eigen::Vector3f centre(position(generator), position(generator), 6.f + position(generator));
+        moved.push_back(centre + Eigen::Vector3f(jiggle(generator), jiggle(generator), jiggle(generator)));
+        Sphere* s = new Sphere();
+        s->SetSphere(centre, Eigen::Vector3f(1, 0, 0), 0.3f);
+        before.AddShape(s);
+        s = new Sphere();
+        s->SetSphere(moved.back(), Eigen::Vector3f(1, 0, 0), 0.3f);
+        after.AddShape(s);
+    }
+    CompiledScene refitted(before);
+    const CompiledScene rebuilt(after);
+    for (int i = 0; i < (int)moved.size(); ++i)
+    {
+        refitted.SetSphereCentre(i, moved[i]);
+    }
+    const bool keptTree = !refitted.RefitBVH();
+    assert(keptTree);
+
+    bool sameHits = true;
+    for (int y = 0; y < 40 && sameHits; ++y)
+    {
+        for (int x = 0; x < 40 && sameHits; ++x)
+        {
+            const Eigen::Vector3f ray = Eigen::Vector3f(x / 20.f - 1.f, y / 20.f - 1.f, 1.f).normalized();
+            float refitDist = MAX_SCENE_DEPTH;
+            float rebuiltDist = MAX_SCENE_DEPTH;
+            int refitKey = NO_PRIMITIVE_KEY;
+            int rebuiltKey = NO_PRIMITIVE_KEY;
+            refitted.FindClosest(Eigen::Vector3f::Zero(), ray, refitDist, refitKey);
+            rebuilt.FindClosest(Eigen::Vector3f::Zero(), ray, rebuiltDist, rebuiltKey);
+            sameHits = refitKey == rebuiltKey && refitDist == rebuiltDist;
+        }
+    }
+    assert(sameHits);
+
+    // Swapping spheres round scatters every leaf across the scene
+    for (int i = 0; i < (int)moved.size(); ++i)
+    {
+        refitted.SetSphereCentre(i, moved[(i * 37) % moved.size()]);
+    }
+    const bool rebuiltTree = refitted.RefitBVH() && refitted.GetBVH().GetCost() == refitted.GetBVH().GetBuildCost();
+    assert(rebuiltTree);
+
+    // One sphere in front of a floor, moving across, with the light going the other way
+    const char* animationFile = "animation_test.txt";
+    {
+        std::ofstream file(animationFile);
+        file << "2 2" << std::endl;
+        file << "SPHERE 0 2 0 -0.5 0 3 1 0.5 0 3" << std::endl;
+        file << "POINTLIGHT 0 1 1 -1 2 2" << std::endl;
+    }
+    Animation animation;
+    const bool loaded = animation.Load(animationFile) && animation.GetNumFrames() == 2
+        && animation.GetTracks().size() == 2 && animation.GetTracks()[1].type == ANIMATED_LIGHT;
+    std::remove(animationFile);
+    assert(loaded);
+
+    const auto makeScene = [](Scene& scene, const Eigen::Vector3f& centre, const Eigen::Vector3f& light)
+    {
+        scene.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), -1.f, Eigen::Vector3f(0.8f, 0.8f, 0.8f)));
+        Sphere* sphere = new Sphere();
+        sphere->SetSphere(centre, Eigen::Vector3f(0.8f, 0.2f, 0.2f), 0.5f);
+        scene.AddShape(sphere);
+        scene.AddLight(new PointLight(light, Eigen::Vector3f(1, 1, 1), 1.f));
+    };
+    Scene start;
+    makeScene(start, Eigen::Vector3f(-0.5f, 0, 3), Eigen::Vector3f(1, 2, 2));
+    CompiledScene animated(start);
+    Scene end;
+    makeScene(end, Eigen::Vector3f(0.5f, 0, 3), Eigen::Vector3f(-1, 2, 2));
+    const CompiledScene endCompiled(end);
+
+    Animation tooMany = animation;
+    AnimationTrack missing;
+    missing.index = 1;
+    missing.keys.push_back({ 0.f, Eigen::Vector3f::Zero() });
+    tooMany.AddTrack(missing);
+    const bool fits = animation.Fits(animated) && !tooMany.Fits(animated);
+    assert(fits);
+
+    Params params;
+    params.width = 24;
+    params.height = 16;
+    params.numThreads = 2;
+    params.outputFile = "animation_test.ppm";
+    WorkStealingPool pool(params.numThreads);
+    const bool rendered = RenderAnimation(animated, animation, params, pool);
+
+    FrameBuffer expected(params.width, params.height);
+    {
+        WorkStealingPool pool(1);
+        RenderFrame(endCompiled, params, pool, expected);
+    }
+    WriteImageToFile(expected, params, "animation_test_expected.ppm");
+
+    const auto readFile = [](const char* fileName)
+    {
+        std::ifstream file(fileName, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    };
+    const std::string lastFrame = readFile("animation_test_0001.ppm");
+    const bool matches = rendered && !lastFrame.empty() && lastFrame == readFile("animation_test_expected.ppm")
+        && lastFrame != readFile("animation_test_0000.ppm");
+    std::remove("animation_test_0000.ppm");
+    std::remove("animation_test_0001.ppm");
+    std::remove("animation_test_expected.ppm");
+    assert(matches);
+
+    return interpolated && keptTree && sameHits && rebuiltTree && loaded && fits && matches;
+}
+
+/*
+    Server:
+
+    Jobs run on the server's pool, and the second job for a scene uses
+    the one compiled for the first. Changing the file loads it again.
+    Jobs go through the real ParseArgs, so bad values and flags missing
+    their values get an ERROR back rather than taking the server down.
+*/
+bool ServerTest()
+{
+    const char* sceneFile = "server_test.txt";
+    const auto writeScene = [sceneFile](const int numSpheres)
+    {
+        std::ofstream file(sceneFile);
+        file << numSpheres + 1 << " 1" << std::endl;
+        file << "PLANE 0 1 0 0.9 0.9 0.9 -1" << std::endl;
+        for (int i = 0; i < numSpheres; ++i)
+        {
+            file << "SPHERE 0.5 " << i - 0.5f << " 0 3 0.8 0.2 0.2" << std::endl;
+        }
+        file << "POINTLIGHT 0 1.5 2 1 1 1 1" << std::endl;
+        file << "0 0 0" << std::endl;
+    };
+    writeScene(1);
+
+    Params defaults;
+    defaults.width = 16;
+    defaults.height = 12;
+    defaults.numThreads = 2;
+    RenderServer server(defaults, ParseArgs);
+
+    const auto endsWith = [](const std::string& reply, const std::string& end)
+    {
+        return reply.size() >= end.size() && reply.compare(reply.size() - end.size(), end.size(), end) == 0;
+    };
+    bool quit = false;
+    const std::string first = server.RunJob("-i server_test.txt -o server_test_0.ppm", quit);
+    const std::string second = server.RunJob("  -i server_test.txt   -o server_test_1.ppm", quit);
+    const bool cached = first.compare(0, 21, "OK server_test_0.ppm ") == 0 && endsWith(first, "scene loaded")
+        && endsWith(second, "scene cached") && server.GetCache().size() == 1 && !quit;
+    assert(cached);
+
+    const auto readFile = [](const char* fileName)
+    {
+        std::ifstream file(fileName, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    };
+    const std::string image = readFile("server_test_0.ppm");
+    const bool sameImage = !image.empty() && image == readFile("server_test_1.ppm");
+    assert(sameImage);
+
+    // A second sphere makes the file longer, so it can't be mistaken for the first
+    writeScene(2);
+    const std::string changed = server.RunJob("-i server_test.txt -o server_test_1.ppm", quit);
+    const bool reloaded = endsWith(changed, "scene loaded") && server.GetCache().size() == 1
+        && readFile("server_test_1.ppm") != image;
+    assert(reloaded);
+
+    const bool rejected = server.RunJob("-i server_test.txt -o server_test_1.ppm -u", quit).compare(0, 6, "ERROR ") == 0
+        && server.RunJob("-o server_test_1.ppm", quit).compare(0, 6, "ERROR ") == 0
+        && server.RunJob("-i server_test_missing.txt -o server_test_1.ppm", quit).compare(0, 6, "ERROR ") == 0
+        && server.RunJob("-bogus", quit).compare(0, 6, "ERROR ") == 0
+        && server.RunJob("-i server_test.txt -o server_test_1.ppm -s abc", quit).compare(0, 6, "ERROR ") == 0
+        && server.RunJob("-i server_test.txt -o", quit).compare(0, 6, "ERROR ") == 0
+        && server.RunJob("   ", quit).empty() && !quit;
+    assert(rejected);
+
+    const bool quits = server.RunJob("quit", quit) == "OK quit" && quit;
+    assert(quits);
+
+    std::remove(sceneFile);
+    std::remove("server_test_0.ppm");
+    std::remove("server_test_1.ppm");
+
+    return cached && sameImage && reloaded && rejected && quits;
+}
+
+/*
+    Distributed rendering:
+
+    Workers on threads here, over pipes, stand in for worker processes.
+    One of them dies after taking its first band, and the image still
+    has to come out the same as rendering it in one go.
+*/
+bool DistributedTest()
+{
+#ifdef _WIN32
+    return true;
+#else
+    Scene scene;
+    scene.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), -1.f, Eigen::Vector3f(0.8f, 0.8f, 0.8f)));
+    Sphere* sphere = new Sphere();
+    sphere->SetSphere(Eigen::Vector3f(0, 0, 3), Eigen::Vector3f(0.8f, 0.2f, 0.2f), 0.7f);
+    scene.AddShape(sphere);
+    scene.AddLight(new PointLight(Eigen::Vector3f(1, 2, 1), Eigen::Vector3f(1, 1, 1), 1.f));
+    const CompiledScene compiled(scene);
+
+    Params params;
+    params.width = 40;
+    params.height = 5 * TILE_SIZE + 3;
+    params.adaptive = true;
+    params.minSamples = 2;
+    params.maxSamples = 8;
+
+    FrameBuffer expected(params.width, params.height);
+    std::vector<int> expectedCounts(params.width * params.height, 0);
+    {
+        WorkStealingPool pool(2);
+        RenderFrame(compiled, params, pool, expected, &expectedCounts);
+    }
+
+    const int numWorkers = 3;
+    std::vector<WorkerLink> workers(numWorkers);
+    std::vector<std::thread> threads;
+    for (int w = 0; w < numWorkers; ++w)
+    {
+        int toWorker[2];
+        int fromWorker[2];
+        if (pipe(toWorker) != 0 || pipe(fromWorker) != 0)
+        {
+            return false;
+        }
+        workers[w].toWorker = toWorker[1];
+        workers[w].fromWorker = fromWorker[0];
+        workers[w].name = "worker " + std::to_string(w);
+        const int input = toWorker[0];
+        const int output = fromWorker[1];
+        threads.emplace_back([&compiled, &params, w, input, output]()
+        {
+            if (w == 0)
+            {
+                // Takes a band, then dies without sending anything back
+                int32_t band = 0;
+                [[maybe_unused]] const ssize_t n = read(input, &band, sizeof(band));
+            }
+            else
+            {
+                WorkStealingPool pool(1);
+                RunWorker(compiled, params, pool, input, output);
+            }
+            close(input);
+            close(output);
+        });
+    }
+
+    FrameBuffer frameBuffer(params.width, params.height);
+    std::vector<int> sampleCounts(params.width * params.height, 0);
+    const bool rendered = RenderBands(params, workers, frameBuffer, sampleCounts);
+    StopWorkers(workers);
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    const bool recovered = rendered && workers[0].died && workers[0].bandsRendered == 0 && !workers[1].died && !workers[2].died
+        && workers[1].bandsRendered + workers[2].bandsRendered == (params.height + TILE_SIZE - 1) / TILE_SIZE;
+    assert(recovered);
+
+    const bool merged = frameBuffer == expected && sampleCounts == expectedCounts;
+    assert(merged);
+
+    return recovered && merged;
+#endif
+}
+
+/*
+    Checkpoints:
+
+    A render stopped part way, checkpointed and picked up again comes
+    out the same as one that was never stopped. A checkpoint made with
+    other settings isn't used.
+*/
+bool CheckpointTest()
+{
+    Scene scene;
+    scene.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), -1.f, Eigen::Vector3f(0.8f, 0.8f, 0.8f)));
+    Sphere* sphere = new Sphere();
+    sphere->SetSphere(Eigen::Vector3f(0, 0, 3), Eigen::Vector3f(0.2f, 0.8f, 0.2f), 0.7f);
+    scene.AddShape(sphere);
+    scene.AddLight(new PointLight(Eigen::Vector3f(-1, 2, 1), Eigen::Vector3f(1, 1, 1), 1.f));
+    const CompiledScene compiled(scene);
+
+    Params params;
+    params.width = 3 * TILE_SIZE + 5;
+    params.height = 2 * TILE_SIZE + 7;
+    params.adaptive = true;
+    params.minSamples = 2;
+    params.maxSamples = 8;
+
+    WorkStealingPool pool(2);
+    FrameBuffer expected(params.width, params.height);
+    std::vector<int> expectedCounts(params.width * params.height, 0);
+    RenderFrame(compiled, params, pool, expected, &expectedCounts);
+
+    // Half the tiles, then killed
+    const char* checkpointFile = "checkpoint_test.bin";
+    bool written = false;
+    int numTiles = 0;
+    {
+        FrameBuffer frameBuffer(params.width, params.height);
+        std::vector<int> sampleCounts(params.width * params.height, 0);
+        Checkpoint checkpoint(compiled, params, frameBuffer, sampleCounts);
+        numTiles = checkpoint.GetNumTiles();
+        const std::unique_ptr<Sampler> sampler = MakeSampler(params.samplerType, params.seed);
+        for (int tile = 0; tile < numTiles; tile += 2)
+        {
+            RenderTile(compiled, params, *sampler, tile, frameBuffer, &sampleCounts);
+            checkpoint.TileDone(tile);
+        }
+        // The writer thread gets a go before it's stopped
+        checkpoint.StartWriting(checkpointFile, std::chrono::milliseconds(1));
+        for (int wait = 0; wait < 500 && !std::ifstream(checkpointFile).good(); ++wait)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        written = checkpoint.StopWriting() && checkpoint.GetNumTilesDone() == (numTiles + 1) / 2;
+    }
+    assert(written);
+
+    FrameBuffer frameBuffer(params.width, params.height);
+    std::vector<int> sampleCounts(params.width * params.height, 0);
+    Checkpoint resumed(compiled, params, frameBuffer, sampleCounts);
+    const bool loaded = resumed.Load(checkpointFile) && resumed.GetNumTilesDone() == (numTiles + 1) / 2;
+    assert(loaded);
+    RenderFrame(compiled, params, pool, frameBuffer, &sampleCounts, nullptr, nullptr, &resumed);
+    const bool same = resumed.GetNumTilesDone() == numTiles && frameBuffer == expected && sampleCounts == expectedCounts;
+    assert(same);
+
+    Params otherParams = params;
+    otherParams.seed = 7;
+    Checkpoint other(compiled, otherParams, frameBuffer, sampleCounts);
+    const bool rejected = !other.Load(checkpointFile) && other.GetNumTilesDone() == 0;
+    assert(rejected);
+
+    std::remove(checkpointFile);
+    return written && loaded && same && rejected;
+}
+
+/*
+    Frame buffers:
+
+    - floats go to the nearest half, ties to even, with infinities,
+      NaNs and denormals kept, and every half comes back exactly
+    - planes are aligned, whatever the width
+    - pixels, blocks and rows read back what went in, and one channel
+      images read as grey
+    - image memory is counted while buffers are alive, and given back
+*/
+bool FrameBufferTest()
+{
+    const float infinity = std::numeric_limits<float>::infinity();
+    const bool rounds = FloatToHalf(1.f) == 0x3c00 && FloatToHalf(-2.f) == 0xc000 && FloatToHalf(65504.f) == 0x7bff
+        && FloatToHalf(65519.f) == 0x7bff && FloatToHalf(65520.f) == 0x7c00 && FloatToHalf(infinity) == 0x7c00
+        && FloatToHalf(1.f + 1.f / 2048.f) == 0x3c00 && FloatToHalf(1.f + 3.f / 2048.f) == 0x3c02
+        && FloatToHalf(std::ldexp(1.f, -24)) == 0x0001 && FloatToHalf(std::ldexp(1.f, -25)) == 0x0000
+        && FloatToHalf(std::ldexp(1.5f, -25)) == 0x0001 && FloatToHalf(-0.f) == 0x8000
+        && std::isnan(HalfToFloat(FloatToHalf(std::numeric_limits<float>::quiet_NaN())));
+    assert(rounds);
+
+    std::vector<uint16_t> halves(65536);
+    std::vector<float> widened(halves.size());
+    for (size_t i = 0; i < halves.size(); ++i)
+    {
+        halves[i] = (uint16_t)i;
+    }
+    HalvesToFloats(halves.data(), (int)halves.size(), widened.data());
+    bool roundTrips = true;
+    for (size_t i = 0; i < halves.size(); ++i)
+    {
+        const float value = HalfToFloat(halves[i]);
+        const bool isNaN = std::isnan(value);
+        roundTrips = roundTrips && (isNaN || FloatToHalf(value) == halves[i])
+            && (isNaN ? std::isnan(widened[i]) : widened[i] == value);
+    }
+    assert(roundTrips);
+
+    const size_t memoryBefore = GetImageMemoryUsed();
+    bool stored = true;
+    bool aligned = true;
+    size_t memoryDuring = 0;
+    {
+        const int width = 2 * TILE_SIZE + 5;
+        const int height = TILE_SIZE + 3;
+        FrameBuffer image(width, height);
+        FrameBuffer halfImage(width, height, 3, PLANE_HALF);
+        FrameBuffer grey(width, height, 1);
+        for (int c = 0; c < 3; ++c)
+        {
+            aligned = aligned && (uintptr_t)image.GetPlane(c) % FRAMEBUFFER_ALIGNMENT == 0;
+        }
+        memoryDuring = GetImageMemoryUsed() - memoryBefore;
+
+        for (size_t i = 0; i < image.GetNumPixels(); ++i)
+        {
+            const Eigen::Vector3f colour((float)i, 0.25f * i, -1.f / (i + 1));
+            image.Set(i, colour);
+            halfImage.Set(i, colour);
+            grey.SetValue(i, 0, 0.5f);
+            stored = stored && image.Get(i) == colour && grey.Get(i) == Eigen::Vector3f::Constant(0.5f)
+                && (halfImage.Get(i) - colour).cwiseAbs().maxCoeff() <= colour.cwiseAbs().maxCoeff() / 1024.f;
+        }
+
+        std::vector<float> scratch(width);
+        for (int y = 0; y < height; ++y)
+        {
+            const float* row = halfImage.GetRow(1, y, scratch.data());
+            const float* greyRow = grey.GetRow(2, y, scratch.data() + 1);
+            stored = stored && row == scratch.data() && greyRow == grey.GetPlane(0) + y * width
+                && image.GetRow(1, y, nullptr) == image.GetPlane(1) + y * width;
+            for (int x = 0; x < width; ++x)
+            {
+                stored = stored && row[x] == halfImage.GetValue(x + y * width, 1);
+            }
+        }
+
+        FrameBuffer copy = image;
+        float block[3][TILE_SIZE * TILE_SIZE];
+        for (int c = 0; c < 3; ++c)
+        {
+            std::fill(block[c], block[c] + TILE_SIZE * TILE_SIZE, (float)c);
+        }
+        const float* const planes[3] = { block[0], block[1], block[2] };
+        copy.WriteBlock(2 * TILE_SIZE, TILE_SIZE, 5, 3, planes);
+        stored = stored && copy != image && copy.Get(2 * TILE_SIZE + TILE_SIZE * width) == Eigen::Vector3f(0, 1, 2)
+            && copy.Get(width * height - 1) == Eigen::Vector3f(0, 1, 2)
+            && copy.Get(2 * TILE_SIZE - 1 + TILE_SIZE * width) == image.Get(2 * TILE_SIZE - 1 + TILE_SIZE * width);
+    }
+    assert(aligned);
+    assert(stored);
+
+    const bool counted = memoryDuring >= (size_t)(2 * TILE_SIZE + 5) * (TILE_SIZE + 3) * (12 + 6 + 4)
+        && GetImageMemoryUsed() == memoryBefore && GetPeakImageMemoryUsed() >= memoryBefore + memoryDuring;
+    assert(counted);
+
+    return rounds && roundTrips && aligned && stored && counted;
+}
+
+/*
+    Scene pools:
+
+    - objects keep their place as the pool grows, and come back in the
+      order they went in
+    - pools destroy what they hold, unless it promises it owns nothing
+    - a scene read from text compiles to exactly what the same shapes
+      added one by one with new do, and shapes of both kinds mix
+*/
+struct PoolCounter
+{
+    static int alive;
+    int value;
+    PoolCounter(const int value) : value(value) { ++alive; };
+    ~PoolCounter() { --alive; };
+};
+int PoolCounter::alive = 0;
+
+// The same, promising its pool it owns nothing, so its destructor is skipped
+struct SkippedPoolCounter final : PoolCounter
+{
+    using PoolCounter::PoolCounter;
+    static constexpr bool ownsNothing = true;
+};
+
+bool ScenePoolTest()
+{
+    const int count = 5 * OBJECT_POOL_FIRST_BLOCK + 3;
+    bool kept = true;
+    {
+        ObjectPool<PoolCounter> pool;
+        std::vector<PoolCounter*> added;
+        for (int i = 0; i < count; ++i)
+        {
+            added.push_back(pool.Add(i));
+        }
+        for (int i = 0; i < count; ++i)
+        {
+            kept = kept && added[i]->value == i;
+        }
+        int next = 0;
+        pool.ForEach([&](const PoolCounter& c) { kept = kept && c.value == next++; });
+        kept = kept && next == count && pool.size() == (size_t)count && PoolCounter::alive == count;
+    }
+    const bool destroyed = PoolCounter::alive == 0;
+    {
+        ObjectPool<SkippedPoolCounter> pool;
+        for (int i = 0; i < count; ++i)
+        {
+            pool.Add(i);
+        }
+    }
+    const bool letGo = PoolCounter::alive == count;
+    PoolCounter::alive = 0;
+    assert(kept && destroyed && letGo);
+    static_assert(OwnsNothing<Sphere>::value && OwnsNothing<Plane>::value && OwnsNothing<PointLight>::value
+        && !OwnsNothing<TriangleMesh>::value && !OwnsNothing<PoolCounter>::value, "Wrong pools skip destructors");
+
+    const char* text = "4 2\n"
+        "SPHERE 1 0 0 5 1 0 0\n"
+        "PLANE 0 1 0 0.8 0.8 0.8 -1\n"
+        "SPHERE 0.5 1 1 4 0 1 0\n"
+        "PLANE 1 0 0 0.2 0.2 0.2 -3\n"
+        "POINTLIGHT 0 4 2 1 1 1 1\n"
+        "POINTLIGHT 2 4 0 1 1 1 0.5\n"
+        "0.1 0.2 0.3\n";
+    std::istringstream stream(text);
+    Scene pooled;
+    stream >> pooled;
+    const bool read = pooled.GetSpheres().size() == 2 && pooled.GetPlanes().size() == 2
+        && pooled.GetPointLights().size() == 2 && pooled.GetOtherShapes().empty()
+        && pooled.GetNumShapes() == 4 && pooled.GetNumLights() == 2;
+    assert(read);
+
+    Scene allocated;
+    Sphere* first = new Sphere();
+    first->SetSphere(Eigen::Vector3f(0, 0, 5), Eigen::Vector3f(1, 0, 0), 1.f);
+    allocated.AddShape(first);
+    allocated.AddShape(new Plane(Eigen::Vector3f(0, 1, 0), -1.f, Eigen::Vector3f(0.8f, 0.8f, 0.8f)));
+    Sphere* second = new Sphere();
+    second->SetSphere(Eigen::Vector3f(1, 1, 4), Eigen::Vector3f(0, 1, 0), 0.5f);
+    allocated.AddShape(second);
+    allocated.AddShape(new Plane(Eigen::Vector3f(1, 0, 0), -3.f, Eigen::Vector3f(0.2f, 0.2f, 0.2f)));
+    allocated.AddLight(new PointLight(Eigen::Vector3f(0, 4, 2), Eigen::Vector3f(1, 1, 1), 1.f));
+    allocated.AddLight(new PointLight(Eigen::Vector3f(2, 4, 0), Eigen::Vector3f(1, 1, 1), 0.5f));
+    Eigen::Vector3f background(0.1f, 0.2f, 0.3f);
+    allocated.SetBackground(background);
+
+    const CompiledScene fromPools(pooled);
+    const CompiledScene fromNew(allocated);
+    const bool same = fromPools.GetHash() == fromNew.GetHash() && fromPools.GetSpheres().size() == 2
+        && fromPools.GetPlanes().size() == 2 && fromPools.GetLights().size() == 2;
+    assert(same);
+
+    // Both kinds in one scene
+    pooled.AddShape(new Plane(Eigen::Vector3f(0, 0, -1), -9.f, Eigen::Vector3f(1, 1, 1)));
+    pooled.AddSphere()->SetSphere(Eigen::Vector3f(-1, 0, 6), Eigen::Vector3f(0, 0, 1), 0.3f);
+    const CompiledScene mixed(pooled);
+    const bool mixes = mixed.GetSpheres().size() == 3 && mixed.GetPlanes().size() == 3
+        && pooled.GetNumShapes() == 6;
+    assert(mixes);
+
+    return kept && destroyed && letGo && read && same && mixes;
+}
+
+/*
+    The integrator kernels have to give exactly what CastRay and ShadeHit
+    give, for every number of bounces, lights and kind of indirect light.
+*/
+bool IntegratorTest()
+{
+    // Part of a room with a ball in it, so rays bounce about a bit
+    Scene room;
+    room.AddPlane()->SetPlane(Eigen::Vector3f(0, 1, 0), -1.f, Eigen::Vector3f(0.8f, 0.8f, 0.8f));
+    room.AddPlane()->SetPlane(Eigen::Vector3f(0, -1, 0), -2.f, Eigen::Vector3f(0.8f, 0.8f, 0.8f));
+    room.AddPlane()->SetPlane(Eigen::Vector3f(1, 0, 0), -2.f, Eigen::Vector3f(0.8f, 0.1f, 0.1f));
+    room.AddPlane()->SetPlane(Eigen::Vector3f(0, 0, -1), -6.f, Eigen::Vector3f(0.1f, 0.8f, 0.1f));
+    room.AddSphere()->SetSphere(Eigen::Vector3f(0, 0, 3), Eigen::Vector3f(0.2f, 0.3f, 0.9f), 1.f);
+
+    std::vector<Eigen::Vector3f> rays;
+    for (int y = -8; y <= 8; ++y)
+    {
+        for (int x = -8; x <= 8; ++x)
+        {
+            rays.push_back(Eigen::Vector3f(x / 8.f, y / 8.f, 1.f).normalized());
+        }
+    }
+
+    // Every kernel gives the same colours as the generic path
+    auto matches = [&](const CompiledScene& scene)
+    {
+        bool same = true;
+        for (int numBounces = 0; numBounces <= MAX_NUM_BOUNCES_PER_RAY; ++numBounces)
+        {
+            const Integrator integrator = GetIntegrator(scene, numBounces);
+            for (const Eigen::Vector3f& ray : rays)
+            {
+                same = same && integrator.castRay(Eigen::Vector3f::Zero(), ray, scene) == CastRay(Eigen::Vector3f::Zero(), ray, scene, numBounces);
+
+                float closestDist = MAX_SCENE_DEPTH;
+                HitRecord hit;
+                if (scene.Intersect(Eigen::Vector3f::Zero(), ray, closestDist, hit))
+                {
+                    same = same && integrator.shadeHit(ray, hit, scene) == ShadeHit(ray, hit, scene, numBounces);
+                }
+            }
+        }
+        return same;
+    };
+
+    const LightCount expectedLights[] = { LIGHTS_NONE, LIGHTS_ONE, LIGHTS_MANY, LIGHTS_MANY };
+    bool lights = true;
+    for (int numLights = 0; numLights < 4; ++numLights)
+    {
+        if (numLights > 0)
+        {
+            room.AddPointLight()->SetLight(Eigen::Vector3f(numLights - 1.f, 1.5f, 2), Eigen::Vector3f(1, 1, 1), 1.f / numLights);
+        }
+        const CompiledScene compiled(room);
+        const IntegratorFeatures features = GetIntegratorFeatures(compiled, 3);
+        lights = lights && features.lights == expectedLights[numLights] && features.indirect == INDIRECT_NONE
+            && features.numBounces == 3 && matches(compiled);
+    }
+    assert(lights);
+
+    CompiledScene compiled(room);
+    WorkStealingPool pool(2);
+    IlluminationMaps illuminationMaps;
+    illuminationMaps.Build(compiled, 5000, 3, 16, pool);
+    compiled.SetIlluminationMaps(&illuminationMaps);
+    const bool illuminated = GetIntegratorFeatures(compiled, 3).indirect == INDIRECT_ILLUMINATION && matches(compiled);
+    assert(illuminated);
+
+    // Photon maps win over illumination maps, as in IndirectLighting
+    PhotonMaps photonMaps;
+    EmitPhotons(compiled, 5000, 3, pool, photonMaps);
+    compiled.SetPhotonMaps(&photonMaps);
+    const bool photons = GetIntegratorFeatures(compiled, 3).indirect == INDIRECT_PHOTONS && matches(compiled);
+    assert(photons);
+
+    // Bounce counts outside what's built are clamped
+    const bool clamped = GetIntegratorFeatures(compiled, -1).numBounces == 0
+        && GetIntegratorFeatures(compiled, MAX_NUM_BOUNCES_PER_RAY + 5).numBounces == MAX_NUM_BOUNCES_PER_RAY;
+    assert(clamped);
+
+    return lights && illuminated && photons && clamped;
+}
@@ -5,4 +5,48 @@ bool RunUnitTests();
 
 bool SurfaceNormalTest();
 
-bool ReflectionTest();
\ No newline at end of file
+bool ReflectionTest();
+
+bool BVHTest();
+
+bool PacketTest();
+
+bool SamplerTest();
+
+bool RenderReproducibilityTest();
+
+bool AdaptiveSamplingTest();
+
+bool ImageOutputTest();
+
+bool SceneFileTest();
+
+bool TriangleMeshTest();
+
+bool OcclusionTest();
+
+bool PhotonMapTest();
+
+bool SPPMTest();
+
+bool IlluminationMapTest();
+
+bool StatsTest();
+
+bool CostMapTest();
+
+bool DenoiseTest();
+
+bool AnimationTest();
+
+bool ServerTest();
+
+bool DistributedTest();
+
+bool CheckpointTest();
+
+bool FrameBufferTest();
+
+bool ScenePoolTest();
+
+bool IntegratorTest();
@@ -0,0 +1,315 @@
+#include "Wavefront.h"
+#include "Stats.h"
+
+using namespace Eigen;
+using namespace std;
+
+void PathQueue::Reserve(int capacity)
+{
+	ox.resize(capacity);
+	oy.resize(capacity);
+	oz.resize(capacity);
+	dx.resize(capacity);
+	dy.resize(capacity);
+	dz.resize(capacity);
+	weight.resize(capacity);
+	slot.resize(capacity);
+}
+
+void PathQueue::Push(
+	const Vector3f& origin,
+	const Vector3f& direction,
+	const float pathWeight,
+	const int pathSlot)
+{
+	const int i = size++;
+	ox[i] = origin[0];
+	oy[i] = origin[1];
+	oz[i] = origin[2];
+	dx[i] = direction[0];
+	dy[i] = direction[1];
+	dz[i] = direction[2];
+	weight[i] = pathWeight;
+	slot[i] = pathSlot;
+}
+
+//-----------------------------------------------------------
+/*
+	Spread the low 7 bits of x out so there are two zero bits
+	between each, ready to be interleaved into a Morton code
+*/
+static uint32_t SpreadBits(uint32_t x)
+{
+	x &= 0x7F;
+	x = (x | (x << 8)) & 0x0F00F;
+	x = (x | (x << 4)) & 0x0C30C3;
+	x = (x | (x << 2)) & 0x249249;
+	return x;
+}
+
+/*
+	A sort key that puts similar rays next to each other.
+
+	From the top bit down:
+		3 bits   which octant the direction points into
+		8 bits   the direction within that octant, 4 bits each for |x| and |y|
+		21 bits  Morton code of the origin, 7 bits an axis
+
+	So rays are grouped by direction first, since rays heading the same
+	way visit BVH nodes in the same order, then by where they start.
+*/
+static uint32_t PathSortKey(
+	const float ox, const float oy, const float oz,
+	const float dx, const float dy, const float dz,
+	const Vector3f& lower,
+	const Vector3f& scale)
+{
+	const uint32_t octant = (dx < 0.f ? 4 : 0) | (dy < 0.f ? 2 : 0) | (dz < 0.f ? 1 : 0);
+	const uint32_t cellX = min((uint32_t)(fabs(dx) * 16.f), 15u);
+	const uint32_t cellY = min((uint32_t)(fabs(dy) * 16.f), 15u);
+
+	const float x = max(0.f, min(127.f, (ox - lower[0]) * scale[0]));
+	const float y = max(0.f, min(127.f, (oy - lower[1]) * scale[1]));
+	const float z = max(0.f, min(127.f, (oz - lower[2]) * scale[2]));
+	const uint32_t morton = (SpreadBits((uint32_t)x) << 2) | (SpreadBits((uint32_t)y) << 1) | SpreadBits((uint32_t)z);
+
+	return (octant << 29) | (cellX << 25) | (cellY << 21) | morton;
+}
+
+//-----------------------------------------------------------
+WavefrontIntegrator::WavefrontIntegrator(const CompiledScene& scene, const Params& params, const Sampler& sampler)
+	: scene(scene), params(params), sampler(sampler)
+{
+	paths.Reserve(WAVEFRONT_BATCH_SIZE);
+	spawned.Reserve(WAVEFRONT_BATCH_SIZE);
+	hitDist.resize(WAVEFRONT_BATCH_SIZE);
+	hitKey.resize(WAVEFRONT_BATCH_SIZE);
+	sortKeys.resize(WAVEFRONT_BATCH_SIZE);
+	sortKeysTemp.resize(WAVEFRONT_BATCH_SIZE);
+	order.resize(WAVEFRONT_BATCH_SIZE);
+	orderTemp.resize(WAVEFRONT_BATCH_SIZE);
+	slotPixel.resize(WAVEFRONT_BATCH_SIZE);
+	slotColour.resize(WAVEFRONT_BATCH_SIZE);
+
+	// Origins outside the spheres' bounds (like points on a plane far away)
+	// are clamped to its edges, which is fine for a sort key
+	sceneLower = Vector3f::Zero();
+	sceneScale = Vector3f::Zero();
+	const auto& nodes = scene.GetBVH().GetNodes();
+	if (!nodes.empty())
+	{
+		for (int a = 0; a < 3; ++a)
+		{
+			const float extent = nodes[0].upper[a] - nodes[0].lower[a];
+			sceneLower[a] = nodes[0].lower[a];
+			sceneScale[a] = extent > 0.f ? 128.f / extent : 0.f;
+		}
+	}
+}
+
+/*
+	Render a band of rows.
+
+	Each batch takes as many samples as the pixels in the band want,
+	up to WAVEFRONT_BATCH_SIZE, and is pushed through one wave per bounce.
+	Batches carry on until every pixel in the band is done.
+*/
+void WavefrontIntegrator::RenderRows(
+	const int startRow,
+	const int endRow,
+	FrameBuffer& frameBuffer,
+	vector<int>* sampleCounts)
+{
+	const int bandPixels = (endRow - startRow) * params.width;
+	stats.assign(bandPixels, PixelStats());
+
+	for (;;)
+	{
+		const int numSlots = Generate(startRow, endRow);
+		if (numSlots == 0)
+		{
+			break;
+		}
+
+		for (int bounce = 0; bounce <= params.numBouncesPerRay && paths.size > 0; ++bounce)
+		{
+			Intersect();
+			ShadeAndSpawn(params.numBouncesPerRay - bounce);
+			SortPaths();
+		}
+
+		// Slots for a pixel are in sample order, so this adds them up in
+		// the same order as the other renderers
+		for (int i = 0; i < numSlots; ++i)
+		{
+			stats[slotPixel[i]].Add(slotColour[i]);
+		}
+	}
+
+	// Get the average pixel colour. Values are clamped when written out.
+	for (int i = 0; i < bandPixels; ++i)
+	{
+		frameBuffer.Set(startRow * params.width + i, stats[i].GetColour());
+		if (sampleCounts)
+		{
+			(*sampleCounts)[startRow * params.width + i] = stats[i].count;
+		}
+	}
+}
+
+/*
+	Fill the queue with primary rays for the pixels that aren't done yet,
+	and give back how many there are. Without adaptive sampling, each pixel
+	asks for all its samples at once. With it, pixels ask for minSamples,
+	then one more each batch until they're done. If the batch fills up,
+	the rest wait for the next one.
+*/
+int WavefrontIntegrator::Generate(const int startRow, const int endRow)
+{
+	const int bandPixels = (endRow - startRow) * params.width;
+	int numSlots = 0;
+
+	// The camera sits at the origin
+	paths.Clear();
+	for (int p = 0; p < bandPixels && numSlots < WAVEFRONT_BATCH_SIZE; ++p)
+	{
+		const PixelStats& pixel = stats[p];
+		if (pixel.IsDone(params))
+		{
+			continue;
+		}
+
+		int target = params.samplesPerPixel;
+		if (params.adaptive)
+		{
+			target = min(pixel.count < params.minSamples ? params.minSamples : pixel.count + 1, params.maxSamples);
+		}
+		const int w = p % params.width;
+		const int h = startRow + p / params.width;
+		for (int n = pixel.count; n < target && numSlots < WAVEFRONT_BATCH_SIZE; ++n)
+		{
+			slotPixel[numSlots] = p;
+			slotColour[numSlots] = Vector3f::Zero();
+			paths.Push(Vector3f::Zero(), GetPrimaryRay(params, sampler, w, h, n), 1.f, numSlots);
+			++numSlots;
+		}
+	}
+
+	return numSlots;
+}
+
+/*
+	Find the closest hit for every path in the queue. Only the key and
+	distance are kept; the rest waits for the shading stage.
+*/
+void WavefrontIntegrator::Intersect()
+{
+	for (int i = 0; i < paths.size; ++i)
+	{
+		const Vector3f origin(paths.ox[i], paths.oy[i], paths.oz[i]);
+		const Vector3f direction(paths.dx[i], paths.dy[i], paths.dz[i]);
+		float closestDist = MAX_SCENE_DEPTH;
+		int closestKey = NO_PRIMITIVE_KEY;
+		scene.FindClosest(origin, direction, closestDist, closestKey);
+		hitDist[i] = closestDist;
+		hitKey[i] = closestKey;
+	}
+}
+
+/*
+	Add each path's colour to its sample, and queue up a reflection for
+	each one that hit something, if there are bounces left.
+	The new queue only holds live paths, so it is already compacted.
+*/
+void WavefrontIntegrator::ShadeAndSpawn(const int bouncesLeft)
+{
+	spawned.Clear();
+	for (int i = 0; i < paths.size; ++i)
+	{
+		const float weight = paths.weight[i];
+		const int slot = paths.slot[i];
+		if (hitKey[i] == NO_PRIMITIVE_KEY)
+		{
+			slotColour[slot] += weight * scene.GetBackground();
+			STAT_SAMPLE(STAT_HIST_BOUNCES_LEFT, bouncesLeft);
+			continue;
+		}
+
+		const Vector3f origin(paths.ox[i], paths.oy[i], paths.oz[i]);
+		const Vector3f direction(paths.dx[i], paths.dy[i], paths.dz[i]);
+		HitRecord hit;
+		hit.type = KeyType(hitKey[i]);
+		hit.index = KeyIndex(hitKey[i]);
+		hit.distance = hitDist[i];
+		scene.CompleteHit(origin, direction, hit);
+
+		slotColour[slot] += weight * (DirectLighting(hit, scene) + IndirectLighting(hit, scene));
+
+		if (bouncesLeft > 0)
+		{
+			spawned.Push(hit.point, ReflectRay(direction, hit.normal), weight * REFLECTANCE, slot);
+		}
+		else
+		{
+			STAT_ADD(STAT_BOUNCE_LIMIT_REACHED, 1);
+			STAT_SAMPLE(STAT_HIST_BOUNCES_LEFT, 0);
+		}
+	}
+	STAT_ADD(STAT_REFLECTION_RAYS, spawned.size);
+}
+
+/*
+	Sort the spawned paths by PathSortKey and gather them into the queue
+	for the next wave.
+
+	This is an LSD radix sort, a byte at a time, carrying each path's
+	index along with its key. It's stable and costs four passes no
+	matter how the keys fall, which a comparison sort can't promise.
+*/
+void WavefrontIntegrator::SortPaths()
+{
+	const int n = spawned.size;
+	for (int i = 0; i < n; ++i)
+	{
+		sortKeys[i] = PathSortKey(
+			spawned.ox[i], spawned.oy[i], spawned.oz[i],
+			spawned.dx[i], spawned.dy[i], spawned.dz[i],
+			sceneLower, sceneScale);
+		order[i] = i;
+	}
+
+	for (int shift = 0; shift < 32; shift += 8)
+	{
+		int counts[257] = {};
+		for (int i = 0; i < n; ++i)
+		{
+			++counts[((sortKeys[i] >> shift) & 0xFF) + 1];
+		}
+		for (int b = 0; b < 256; ++b)
+		{
+			counts[b + 1] += counts[b];
+		}
+		for (int i = 0; i < n; ++i)
+		{
+			const int dest = counts[(sortKeys[i] >> shift) & 0xFF]++;
+			sortKeysTemp[dest] = sortKeys[i];
+			orderTemp[dest] = order[i];
+		}
+		swap(sortKeys, sortKeysTemp);
+		swap(order, orderTemp);
+	}
+
+	for (int i = 0; i < n; ++i)
+	{
+		const int from = order[i];
+		paths.ox[i] = spawned.ox[from];
+		paths.oy[i] = spawned.oy[from];
+		paths.oz[i] = spawned.oz[from];
+		paths.dx[i] = spawned.dx[from];
+		paths.dy[i] = spawned.dy[from];
+		paths.dz[i] = spawned.dz[from];
+		paths.weight[i] = spawned.weight[from];
+		paths.slot[i] = spawned.slot[from];
+	}
+	paths.size = n;
+}
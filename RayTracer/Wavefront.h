@@ -0,0 +1,107 @@
+#pragma once
+#include <eigen3/Eigen/Dense>
+#include <vector>
+#include <cstdint>
+
+#include "CompiledScene.h"
+#include "Render.h"
+#include "Sampler.h"
+
+// Rows of the image handed out per job in wavefront mode
+#define WAVEFRONT_ROWS 16
+// Most paths held in flight at once, per thread. Bigger batches
+// sort better, but stop fitting in cache.
+#define WAVEFRONT_BATCH_SIZE (1 << 16)
+
+/**********************************************/
+/*############ WAVEFRONT CLASSES #############*/
+/**********************************************/
+
+// Paths in flight, with one array per field rather than an array of
+// structs, so each stage only pulls in the fields it actually reads.
+struct PathQueue
+{
+	std::vector<float> ox, oy, oz;
+	std::vector<float> dx, dy, dz;
+
+	// How much this path's colour counts towards its sample
+	std::vector<float> weight;
+	// Which primary sample of the batch this path came from
+	std::vector<int> slot;
+
+	int size = 0;
+
+	void Reserve(int capacity);
+	void Clear() { size = 0; };
+	void Push(
+		const Eigen::Vector3f& origin,
+		const Eigen::Vector3f& direction,
+		const float weight,
+		const int slot);
+};
+
+/*
+	An iterative alternative to CastRay.
+
+	Instead of following one ray down through all its bounces, this keeps
+	a whole batch of paths and moves them all forward a stage at a time:
+		generate -> intersect -> shade -> spawn reflections -> sort -> intersect ...
+	Paths that miss, or run out of bounces, are dropped when the reflections
+	are spawned, so each wave is packed tight. The new wave is then sorted by
+	direction and origin, so rays that go through the same part of the BVH
+	are traced one after another.
+
+	The result is the same sum CastRay works out recursively: the colour at
+	each bounce, weighted by REFLECTANCE once per bounce before it.
+	Once a batch is done, each sample's colour goes into its pixel's
+	PixelStats, which decides whether the pixel wants more.
+
+	Each render thread owns one of these, and reuses its buffers for every job.
+*/
+class WavefrontIntegrator
+{
+public:
+	WavefrontIntegrator(const CompiledScene& scene, const Params& params, const Sampler& sampler);
+	~WavefrontIntegrator() {};
+
+	// Render every pixel in rows [startRow, endRow) into the frame buffer,
+	// and how many samples each took into sampleCounts if it's given
+	void RenderRows(
+		const int startRow,
+		const int endRow,
+		FrameBuffer& frameBuffer,
+		std::vector<int>* sampleCounts);
+
+private:
+	int Generate(const int startRow, const int endRow);
+	void Intersect();
+	void ShadeAndSpawn(const int bouncesLeft);
+	void SortPaths();
+
+	const CompiledScene& scene;
+	const Params& params;
+	const Sampler& sampler;
+
+	PathQueue paths;
+	PathQueue spawned;
+
+	// Results of the intersect stage, one per path
+	std::vector<float> hitDist;
+	std::vector<int> hitKey;
+
+	// The primary samples in this batch: their pixel within the band,
+	// and the colour gathered for them so far
+	std::vector<int> slotPixel;
+	std::vector<Eigen::Vector3f> slotColour;
+
+	// Samples taken so far for each pixel in the band
+	std::vector<PixelStats> stats;
+
+	// Scratch space for sorting
+	std::vector<uint32_t> sortKeys, sortKeysTemp;
+	std::vector<int> order, orderTemp;
+
+	// Origins are quantised relative to the scene's bounds when sorting
+	Eigen::Vector3f sceneLower;
+	Eigen::Vector3f sceneScale;
+};